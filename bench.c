@@ -0,0 +1,776 @@
+#define TINY_JIT_IMPLEMENTATION
+#include "tiny_jit.h"
+
+#include <fcntl.h>
+
+// usage: ./tiny_jit_bench [name ...], runs every benchmark without names
+
+#define BENCH_MIN_NS 20000000ull // time each case for at least 20ms
+
+typedef void (*BenchFn)(void* arg);
+
+// ns per call of fn, repeated until BENCH_MIN_NS has passed
+static double
+bench_time(BenchFn fn, void* arg)
+{
+  size_t iterations = 1;
+  for (;;) {
+    uint64_t start = jit_now_ns();
+    for (size_t i = 0; i < iterations; i++)
+      fn(arg);
+    uint64_t elapsed = jit_now_ns() - start;
+    if (elapsed >= BENCH_MIN_NS)
+      return (double)elapsed / iterations;
+    iterations *= 2;
+  }
+}
+
+static void
+bench_fill(float* values, size_t count)
+{
+  for (size_t i = 0; i < count; i++)
+    values[i] = (float)(rand() % 17 - 8) * 0.25f;
+}
+
+// |value - expected| within tolerance, relative once expected is above 1
+static bool
+bench_close(float value, float expected, float tolerance)
+{
+  float diff = value > expected ? value - expected : expected - value;
+  float scale = expected < 0 ? -expected : expected;
+  return diff <= tolerance * (scale > 1.0f ? scale : 1.0f);
+}
+
+// gemm
+
+typedef struct
+{
+  int m, n, k;
+  const float* a;
+  const float* b;
+  float* c;
+  JitGemmKernel kernel;
+} GemmCase;
+
+// multiply_matrices_2x2 from math_lib.c without the printf
+static void
+c_matrices_2x2(const float* a, const float* b, float* result)
+{
+  result[0] = a[0] * b[0] + a[1] * b[2];
+  result[1] = a[0] * b[1] + a[1] * b[3];
+  result[2] = a[2] * b[0] + a[3] * b[2];
+  result[3] = a[2] * b[1] + a[3] * b[3];
+}
+
+static void
+naive_gemm(int m, int n, int k, const float* a, const float* b, float* c)
+{
+  for (int i = 0; i < m; i++) {
+    for (int j = 0; j < n; j++) {
+      float sum = 0.0f;
+      for (int p = 0; p < k; p++)
+        sum += a[i * k + p] * b[p * n + j];
+      c[i * n + j] = sum;
+    }
+  }
+}
+
+static void
+gemm_c_2x2(void* arg)
+{
+  GemmCase* g = arg;
+  c_matrices_2x2(g->a, g->b, g->c);
+}
+
+static void
+gemm_naive(void* arg)
+{
+  GemmCase* g = arg;
+  naive_gemm(g->m, g->n, g->k, g->a, g->b, g->c);
+}
+
+static void
+gemm_jit(void* arg)
+{
+  GemmCase* g = arg;
+  g->kernel(g->a, g->b, g->c);
+}
+
+static void
+bench_gemm()
+{
+  static const int shapes[][3] = {
+    { 2, 2, 2 },    { 3, 3, 3 },    { 4, 4, 4 },       { 5, 7, 3 },
+    { 8, 8, 8 },    { 6, 20, 9 },   { 16, 16, 16 },    { 32, 32, 32 },
+    { 12, 40, 24 }, { 64, 64, 64 }, { 128, 128, 128 }, { 200, 37, 50 },
+  };
+
+  JitGemmCache* cache = jit_gemm_init();
+  if (!cache)
+    return;
+
+  printf("%-12s %10s %10s %10s %8s %8s\n",
+         "gemm m,n,k",
+         "c ns",
+         "naive ns",
+         "jit ns",
+         "GFLOP/s",
+         "speedup");
+  for (size_t i = 0; i < sizeof(shapes) / sizeof(shapes[0]); i++) {
+    int m = shapes[i][0], n = shapes[i][1], k = shapes[i][2];
+    JitGemmKernel kernel = jit_gemm_kernel(cache, m, n, k, k, n, n);
+    if (!kernel) {
+      fprintf(stderr, "gemm %dx%dx%d: no kernel\n", m, n, k);
+      continue;
+    }
+
+    float* a = malloc(sizeof(float) * m * k);
+    float* b = malloc(sizeof(float) * k * n);
+    float* c = malloc(sizeof(float) * m * n);
+    float* expected = malloc(sizeof(float) * m * n);
+    bench_fill(a, (size_t)m * k);
+    bench_fill(b, (size_t)k * n);
+
+    GemmCase g = { m, n, k, a, b, c, kernel };
+    naive_gemm(m, n, k, a, b, expected);
+    g.kernel(a, b, c);
+    for (int j = 0; j < m * n; j++) {
+      float diff = c[j] - expected[j];
+      if (diff > 1e-3f * k || diff < -1e-3f * k) {
+        fprintf(stderr, "gemm %dx%dx%d: mismatch at %d\n", m, n, k, j);
+        break;
+      }
+    }
+
+    // the C routine only exists for 2x2
+    char name[32], c_ns[16] = "-";
+    if (m == 2 && n == 2 && k == 2)
+      snprintf(c_ns, sizeof(c_ns), "%.1f", bench_time(gemm_c_2x2, &g));
+    double naive_ns = bench_time(gemm_naive, &g);
+    double jit_ns = bench_time(gemm_jit, &g);
+    snprintf(name, sizeof(name), "%d,%d,%d", m, n, k);
+    printf("%-12s %10s %10.1f %10.1f %8.2f %7.2fx\n",
+           name,
+           c_ns,
+           naive_ns,
+           jit_ns,
+           2.0 * m * n * k / jit_ns,
+           naive_ns / jit_ns);
+
+    free(a);
+    free(b);
+    free(c);
+    free(expected);
+  }
+  printf("gemm cache: %zu kernels, %zu hits, %zu misses\n\n",
+         cache->num_entries,
+         cache->hits,
+         cache->misses);
+  jit_gemm_cleanup(cache);
+}
+
+// reductions
+
+#define REDUCE_LEN (1 << 20)
+
+typedef struct
+{
+  const float* a;
+  const float* b;
+  size_t len;
+  JitReduceFloat reduce;
+  JitDotFloat dot;
+  float result;
+} ReduceCase;
+
+static void
+reduce_c_sum(void* arg)
+{
+  ReduceCase* r = arg;
+  float sum = 0.0f;
+  for (size_t i = 0; i < r->len; i++)
+    sum += r->a[i];
+  r->result = sum;
+}
+
+static void
+reduce_c_max(void* arg)
+{
+  ReduceCase* r = arg;
+  float max = r->a[0];
+  for (size_t i = 1; i < r->len; i++)
+    max = r->a[i] > max ? r->a[i] : max;
+  r->result = max;
+}
+
+static void
+reduce_c_dot(void* arg)
+{
+  ReduceCase* r = arg;
+  float sum = 0.0f;
+  for (size_t i = 0; i < r->len; i++)
+    sum += r->a[i] * r->b[i];
+  r->result = sum;
+}
+
+static void
+reduce_jit(void* arg)
+{
+  ReduceCase* r = arg;
+  r->result = r->dot ? r->dot(r->a, r->b, r->len) : r->reduce(r->a, r->len);
+}
+
+static void
+bench_reduce()
+{
+  static const struct
+  {
+    const char* name;
+    JitReduceOp op;
+    BenchFn c;
+  } ops[] = {
+    { "sum", JIT_REDUCE_SUM, reduce_c_sum },
+    { "max", JIT_REDUCE_MAX, reduce_c_max },
+    { "dot", JIT_REDUCE_DOT, reduce_c_dot },
+  };
+  static const int accumulators[] = { 1, 2, 4, 8 };
+
+  float* a = malloc(sizeof(float) * REDUCE_LEN);
+  float* b = malloc(sizeof(float) * REDUCE_LEN);
+  JITCompiler* jit = jit_init();
+  if (!a || !b || !jit)
+    goto done;
+  bench_fill(a, REDUCE_LEN);
+  bench_fill(b, REDUCE_LEN);
+
+  printf("%-10s %10s", "reduce", "c ns");
+  for (size_t j = 0; j < sizeof(accumulators) / sizeof(accumulators[0]); j++)
+    printf("     jit x%d", accumulators[j]);
+  printf("\n");
+
+  for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+    ReduceCase r = { a, b, REDUCE_LEN, NULL, NULL, 0.0f };
+    printf("%-10s %10.0f", ops[i].name, bench_time(ops[i].c, &r));
+    float expected = r.result;
+
+    for (size_t j = 0; j < sizeof(accumulators) / sizeof(accumulators[0]); j++) {
+      JitReduction reduction = { .op = ops[i].op,
+                                 .is_float = true,
+                                 .accumulators = accumulators[j] };
+      size_t func = jit_compile_reduction(jit, &reduction);
+      if (func == (size_t)-1)
+        goto done;
+      jit_finalize(jit);
+
+      r.reduce = NULL;
+      r.dot = NULL;
+      if (ops[i].op == JIT_REDUCE_DOT)
+        r.dot = (JitDotFloat)jit_function_entry(jit, func);
+      else
+        r.reduce = (JitReduceFloat)jit_function_entry(jit, func);
+      printf(" %10.0f", bench_time(reduce_jit, &r));
+
+      // the accumulators add up in a different order
+      if (!bench_close(r.result, expected, 1e-3f))
+        fprintf(stderr, "reduce %s: %f != %f\n", ops[i].name, r.result, expected);
+    }
+    printf("\n");
+  }
+  printf("\n");
+
+done:
+  jit_cleanup(jit);
+  free(a);
+  free(b);
+}
+
+// record decoding
+
+#define DECODE_RECORDS (1 << 22)
+#define DECODE_RECORD_SIZE 32
+
+// id 0, timestamp 8, price 16, quantity 20, venue 24, side 26, flags 27
+typedef struct
+{
+  const uint8_t* records;
+  size_t count;
+  float* price;
+  int64_t* quantity;
+  int32_t* side;
+  JitDecoder decoder;
+} DecodeCase;
+
+static void
+decode_c(void* arg)
+{
+  DecodeCase* d = arg;
+  for (size_t i = 0; i < d->count; i++) {
+    const uint8_t* record = d->records + i * DECODE_RECORD_SIZE;
+    int32_t quantity;
+    memcpy(&d->price[i], record + 16, sizeof(float));
+    memcpy(&quantity, record + 20, sizeof(int32_t));
+    d->quantity[i] = quantity;
+    d->side[i] = record[26];
+  }
+}
+
+static void
+decode_jit(void* arg)
+{
+  DecodeCase* d = arg;
+  void* columns[3] = { d->price, d->quantity, d->side };
+  d->decoder(d->records, d->count, columns);
+}
+
+// writes the records to a temporary file and maps it back
+static const uint8_t*
+decode_map_records(size_t size)
+{
+  char path[] = "/tmp/tiny_jit_bench_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0)
+    return NULL;
+  unlink(path);
+
+  uint8_t chunk[1 << 16];
+  bool written = true;
+  for (size_t done = 0; done < size && written; done += sizeof(chunk)) {
+    for (size_t j = 0; j < sizeof(chunk); j++)
+      chunk[j] = (uint8_t)rand();
+    written = write(fd, chunk, sizeof(chunk)) == sizeof(chunk);
+  }
+
+  void* map = written ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)
+                      : MAP_FAILED;
+  close(fd);
+  return map == MAP_FAILED ? NULL : map;
+}
+
+static void
+bench_decode()
+{
+  static const JitField fields[] = {
+    { 16, 4, false, true, 0 },  // price
+    { 20, 4, true, false, 8 },  // quantity, widened
+    { 26, 1, false, false, 4 }, // side, widened
+  };
+
+  size_t size = (size_t)DECODE_RECORDS * DECODE_RECORD_SIZE;
+  const uint8_t* records = decode_map_records(size);
+  DecodeCase c = { records,
+                   DECODE_RECORDS,
+                   malloc(sizeof(float) * DECODE_RECORDS),
+                   malloc(sizeof(int64_t) * DECODE_RECORDS),
+                   malloc(sizeof(int32_t) * DECODE_RECORDS),
+                   NULL };
+  DecodeCase expected = c;
+  expected.price = malloc(sizeof(float) * DECODE_RECORDS);
+  expected.quantity = malloc(sizeof(int64_t) * DECODE_RECORDS);
+  expected.side = malloc(sizeof(int32_t) * DECODE_RECORDS);
+  JITCompiler* jit = jit_init();
+  if (!records || !c.price || !c.quantity || !c.side || !expected.price ||
+      !expected.quantity || !expected.side || !jit)
+    goto done;
+
+  size_t func = jit_compile_decoder(
+    jit, DECODE_RECORD_SIZE, fields, sizeof(fields) / sizeof(fields[0]));
+  if (func == (size_t)-1)
+    goto done;
+  jit_finalize(jit);
+  c.decoder = (JitDecoder)jit_function_entry(jit, func);
+
+  decode_c(&expected);
+  decode_jit(&c);
+  if (memcmp(c.price, expected.price, sizeof(float) * DECODE_RECORDS) ||
+      memcmp(c.quantity, expected.quantity, sizeof(int64_t) * DECODE_RECORDS) ||
+      memcmp(c.side, expected.side, sizeof(int32_t) * DECODE_RECORDS))
+    fprintf(stderr, "decode: columns differ\n");
+
+  double c_ns = bench_time(decode_c, &c);
+  double jit_ns = bench_time(decode_jit, &c);
+  printf("%-10s %12s %12s %10s\n", "decode", "c Mrec/s", "jit Mrec/s", "speedup");
+  printf("%-10s %12.1f %12.1f %9.2fx\n\n",
+         "3 of 7",
+         DECODE_RECORDS / c_ns * 1e3,
+         DECODE_RECORDS / jit_ns * 1e3,
+         c_ns / jit_ns);
+
+done:
+  jit_cleanup(jit);
+  if (records)
+    munmap((void*)records, size);
+  free(c.price);
+  free(c.quantity);
+  free(c.side);
+  free(expected.price);
+  free(expected.quantity);
+  free(expected.side);
+}
+
+// streaming, dst[i] = src[i] * 2 over arrays larger than the last level cache
+
+#define STREAM_LEN (32u << 20) // 128MB per array
+#define STREAM_BLOCK 16        // floats per iteration, one cache line
+
+typedef void (*JitStream)(const float* src, float* dst, size_t blocks);
+
+typedef struct
+{
+  const float* src;
+  float* dst;
+  JitStream stream;
+} StreamCase;
+
+static void
+stream_c(void* arg)
+{
+  StreamCase* s = arg;
+  for (size_t i = 0; i < STREAM_LEN; i++)
+    s->dst[i] = s->src[i] * 2.0f;
+}
+
+static void
+stream_jit(void* arg)
+{
+  StreamCase* s = arg;
+  s->stream(s->src, s->dst, STREAM_LEN / STREAM_BLOCK);
+}
+
+// one 64-byte block per iteration through a JitLoop, stnp when nontemporal
+static size_t
+stream_compile(JITCompiler* jit, int prefetch, int level, bool nontemporal)
+{
+  size_t func = jit_begin_function(jit);
+  jit_load_imm64(jit, rx12, 0x40000000); // 2.0f
+  jit_vec_dup(jit, rv16, rx12, VEC_4S);
+
+  JitLoop loop = { .counter = rx2,
+                   .load = rx0,
+                   .store = rx1,
+                   .prefetch = prefetch,
+                   .prefetch_level = level };
+  if (!jit_loop_begin(jit, &loop))
+    return (size_t)-1;
+  jit_vec_load_post(jit, rv0, 4, VEC_4S, rx0);
+  for (int i = 0; i < 4; i++)
+    jit_vec_float_mul(jit, rv0 + i, rv0 + i, rv16, VEC_4S);
+  if (nontemporal) {
+    jit_vec_store_pair_nt(jit, rv0, rv1, rx1, 0);
+    jit_vec_store_pair_nt(jit, rv2, rv3, rx1, 2);
+    jit_emit(jit, arm64_add_imm(rx1, rx1, 64));
+  } else {
+    jit_vec_store_post(jit, rv0, 4, VEC_4S, rx1);
+  }
+  jit_loop_end(jit, &loop);
+
+  jit_emit(jit, arm64_ret());
+  jit_end_function(jit);
+  return func;
+}
+
+static void
+bench_stream()
+{
+  static const struct
+  {
+    const char* name;
+    int prefetch;
+    int level;
+    bool nontemporal;
+  } variants[] = {
+    { "no prefetch", 0, 1, false },   { "prefetch 256", 256, 1, false },
+    { "prefetch 1K", 1024, 1, false }, { "prefetch 4K L2", 4096, 2, false },
+    { "stnp", 0, 1, true },           { "prefetch 1K+stnp", 1024, 1, true },
+  };
+
+  float* src = malloc(sizeof(float) * STREAM_LEN);
+  float* dst = malloc(sizeof(float) * STREAM_LEN);
+  JITCompiler* jit = jit_init();
+  if (!src || !dst || !jit)
+    goto done;
+  bench_fill(src, STREAM_LEN);
+
+  // read src and write dst, the write allocate read is not counted
+  double bytes = 2.0 * sizeof(float) * STREAM_LEN;
+  StreamCase s = { src, dst, NULL };
+  printf("%-18s %10s %8s\n", "stream 128MB", "ms", "GB/s");
+  double c_ns = bench_time(stream_c, &s);
+  printf("%-18s %10.1f %8.2f\n", "c", c_ns / 1e6, bytes / c_ns);
+
+  for (size_t i = 0; i < sizeof(variants) / sizeof(variants[0]); i++) {
+    size_t func = stream_compile(jit,
+                                 variants[i].prefetch,
+                                 variants[i].level,
+                                 variants[i].nontemporal);
+    if (func == (size_t)-1)
+      goto done;
+    jit_finalize(jit);
+    s.stream = (JitStream)jit_function_entry(jit, func);
+
+    memset(dst, 0, sizeof(float) * STREAM_LEN);
+    stream_jit(&s);
+    if (dst[STREAM_LEN - 1] != src[STREAM_LEN - 1] * 2.0f)
+      fprintf(stderr, "stream %s: wrong result\n", variants[i].name);
+
+    double ns = bench_time(stream_jit, &s);
+    printf("%-18s %10.1f %8.2f\n", variants[i].name, ns / 1e6, bytes / ns);
+  }
+  printf("\n");
+
+done:
+  jit_cleanup(jit);
+  free(src);
+  free(dst);
+}
+
+// calling compiled code, a * b + 1 per call
+
+#define INVOKE_CALLS (1 << 16)
+
+typedef int64_t (*JitMulAdd)(int64_t, int64_t);
+
+typedef struct
+{
+  JITCompiler* jit;
+  size_t constant; // zero argument function for jit_execute_function
+  JitHandle handle;
+  JitValue* args;
+  JitValue* results;
+} InvokeCase;
+
+static void
+invoke_execute(void* arg)
+{
+  InvokeCase* c = arg;
+  for (size_t i = 0; i < INVOKE_CALLS; i++)
+    c->results[i] = jit_execute_function(c->jit, c->constant, JIT_TYPE_INT);
+}
+
+static void
+invoke_direct(void* arg)
+{
+  InvokeCase* c = arg;
+  JitMulAdd func = (JitMulAdd)c->handle.entry;
+  for (size_t i = 0; i < INVOKE_CALLS; i++)
+    c->results[i].l = func(c->args[i * 2].l, c->args[i * 2 + 1].l);
+}
+
+static void
+invoke_single(void* arg)
+{
+  InvokeCase* c = arg;
+  for (size_t i = 0; i < INVOKE_CALLS; i++)
+    c->results[i] = jit_invoke(&c->handle, c->args + i * 2);
+}
+
+static void
+invoke_batch(void* arg)
+{
+  InvokeCase* c = arg;
+  jit_invoke_batch(&c->handle, c->args, c->results, INVOKE_CALLS);
+}
+
+static void
+bench_invoke()
+{
+  InvokeCase c = { jit_init(),
+                   0,
+                   { 0 },
+                   malloc(sizeof(JitValue) * INVOKE_CALLS * 2),
+                   malloc(sizeof(JitValue) * INVOKE_CALLS) };
+  if (!c.jit || !c.args || !c.results)
+    goto done;
+
+  c.constant = jit_begin_function(c.jit);
+  jit_load_int(c.jit, rx0, 42);
+  jit_emit(c.jit, arm64_ret());
+  jit_end_function(c.jit);
+
+  size_t func = jit_begin_function(c.jit);
+  jit_emit(c.jit, arm64_mul(rx0, rx0, rx1));
+  jit_emit(c.jit, arm64_add_imm(rx0, rx0, 1));
+  jit_emit(c.jit, arm64_ret());
+  jit_end_function(c.jit);
+
+  JitSignature signature = { JIT_TYPE_INT64,
+                             { JIT_TYPE_INT64, JIT_TYPE_INT64 },
+                             2 };
+  if (!jit_function_handle(c.jit, func, &signature, &c.handle))
+    goto done;
+
+  for (size_t i = 0; i < INVOKE_CALLS; i++) {
+    c.args[i * 2].l = (int64_t)i;
+    c.args[i * 2 + 1].l = 3;
+  }
+  invoke_batch(&c);
+  for (size_t i = 0; i < INVOKE_CALLS; i++) {
+    if (c.results[i].l != (int64_t)i * 3 + 1) {
+      fprintf(stderr, "invoke: wrong result at %zu\n", i);
+      break;
+    }
+  }
+
+  printf("%-20s %10s\n", "invoke", "ns/call");
+  printf("%-20s %10.2f\n",
+         "jit_execute_function",
+         bench_time(invoke_execute, &c) / INVOKE_CALLS);
+  printf("%-20s %10.2f\n", "direct", bench_time(invoke_direct, &c) / INVOKE_CALLS);
+  printf("%-20s %10.2f\n", "jit_invoke", bench_time(invoke_single, &c) / INVOKE_CALLS);
+  printf("%-20s %10.2f\n\n",
+         "jit_invoke_batch",
+         bench_time(invoke_batch, &c) / INVOKE_CALLS);
+
+done:
+  jit_cleanup(c.jit);
+  free(c.args);
+  free(c.results);
+}
+
+// startup, compiling a module of many small functions vs loading it from
+// the code cache
+
+#define CACHE_FUNCTIONS 2048
+#define CACHE_TERMS 12
+
+typedef float (*JitPoly)(float x, int64_t n);
+
+// f_i(x, n) = n + horner polynomial of x with coefficients depending on i,
+// loop free but with enough constants to fill the literal pool
+static bool
+cache_compile(JITCompiler* jit)
+{
+  for (int i = 0; i < CACHE_FUNCTIONS; i++) {
+    jit_begin_function(jit);
+    JitIr* ir = jit_ir_init(jit);
+    if (!ir)
+      return false;
+
+    int x = jit_ir_arg(ir, JIT_IR_FLOAT, 0);
+    int n = jit_ir_arg(ir, JIT_IR_INT, 0); // x0, each class counts from 0
+    int acc = jit_ir_const_float(ir, 1.0f / (i + 3));
+    for (int k = 0; k < CACHE_TERMS; k++) {
+      int c = jit_ir_const_float(ir, (float)(k + 1) / (i + 7));
+      acc = jit_ir_float_add(ir, jit_ir_float_mul(ir, acc, x), c);
+    }
+    jit_ir_ret(ir, jit_ir_float_add(ir, acc, jit_ir_int_to_float(ir, n)));
+
+    bool ok = jit_ir_compile(ir);
+    jit_ir_cleanup(ir);
+    jit_end_function(jit);
+    if (!ok)
+      return false;
+  }
+  jit_finalize(jit);
+  return true;
+}
+
+typedef struct
+{
+  const char* path;
+  uint64_t key;
+} CacheCase;
+
+static void
+cache_cold(void* arg)
+{
+  (void)arg;
+  JITCompiler* jit = jit_init();
+  if (jit && !cache_compile(jit))
+    fprintf(stderr, "cache: compile failed\n");
+  jit_cleanup(jit);
+}
+
+static void
+cache_load(void* arg)
+{
+  CacheCase* c = arg;
+  JITCompiler* jit = jit_init();
+  if (jit && !jit_cache_load(jit, c->path, c->key, NULL, 0))
+    fprintf(stderr, "cache: load failed\n");
+  jit_cleanup(jit);
+}
+
+static void
+bench_cache()
+{
+  char path[] = "/tmp/tiny_jit_bench_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0)
+    return;
+  close(fd);
+
+  // the key covers everything the module is generated from
+  int source[] = { CACHE_FUNCTIONS, CACHE_TERMS };
+  CacheCase c = { path, jit_cache_hash(source, sizeof(source), 0) };
+  JITCompiler* jit = jit_init();
+  JITCompiler* loaded = jit_init();
+  if (!jit || !loaded || !cache_compile(jit) ||
+      !jit_cache_save(jit, path, c.key, NULL, 0) ||
+      !jit_cache_load(loaded, path, c.key, NULL, 0))
+    goto done;
+
+  for (int i = 0; i < CACHE_FUNCTIONS; i += 97) {
+    float expected = ((JitPoly)jit_function_entry(jit, i))(0.5f, i);
+    float result = ((JitPoly)jit_function_entry(loaded, i))(0.5f, i);
+    if (result != expected) {
+      fprintf(stderr, "cache: function %d differs\n", i);
+      break;
+    }
+  }
+
+  struct stat st;
+  stat(path, &st);
+  double cold_ns = bench_time(cache_cold, NULL);
+  double load_ns = bench_time(cache_load, &c);
+  printf("%-10s %10s %10s %10s %10s\n",
+         "cache",
+         "functions",
+         "file KB",
+         "ms",
+         "speedup");
+  printf("%-10s %10d %10lld %10.3f\n",
+         "compile",
+         CACHE_FUNCTIONS,
+         (long long)st.st_size / 1024,
+         cold_ns / 1e6);
+  printf("%-10s %10d %10lld %10.3f %9.1fx\n\n",
+         "load",
+         CACHE_FUNCTIONS,
+         (long long)st.st_size / 1024,
+         load_ns / 1e6,
+         cold_ns / load_ns);
+
+done:
+  jit_cleanup(jit);
+  jit_cleanup(loaded);
+  unlink(path);
+}
+
+typedef struct
+{
+  const char* name;
+  void (*run)();
+} Bench;
+
+static const Bench benches[] = {
+  { "gemm", bench_gemm },
+  { "reduce", bench_reduce },
+  { "decode", bench_decode },
+  { "stream", bench_stream },
+  { "invoke", bench_invoke },
+  { "cache", bench_cache },
+};
+
+int
+main(int argc, char** argv)
+{
+  size_t count = sizeof(benches) / sizeof(benches[0]);
+  for (size_t i = 0; i < count; i++) {
+    bool selected = argc < 2;
+    for (int j = 1; j < argc; j++)
+      selected |= strcmp(argv[j], benches[i].name) == 0;
+    if (selected)
+      benches[i].run();
+  }
+  return 0;
+}
@@ -47,7 +47,7 @@ string_example()
     return;
   }
 
-  jit_emit(jit, arm64_stp(29, 30, 31, -2)); // begin frame
+  jit_emit(jit, arm64_stp_pre(29, 30, 31, -2)); // begin frame
 
   jit_load_string_addr(jit, 0, str_offset);
   jit_call(jit, print_string);
@@ -55,9 +55,10 @@ string_example()
   jit_load_string_addr(jit, 0, str2_offset);
   jit_call(jit, print_string);
 
-  jit_emit(jit, arm64_ldp(29, 30, 31, 2)); // end frame
+  jit_emit(jit, arm64_ldp_post(29, 30, 31, 2)); // end frame
   jit_emit(jit, arm64_ret());
 
+  jit_finalize(jit);
   jit_execute_int(jit);
   jit_dump_code(jit);
 
@@ -71,19 +72,20 @@ dynamic_lib_example()
   if (!jit)
     return;
 
-  ExternalLibrary* lib = ext_lib_init("./libmath.so");
+  ExternalLibrary* lib = ext_lib_init_flags("./libmath.so", EXT_LIB_BIND_NOW);
   if (!lib) {
     fprintf(stderr, "Failed to load library\n");
     return;
   }
 
-  int add_func_idx = ext_lib_load_function(lib, "add_numbers");
-  int mul_func_idx = ext_lib_load_function(lib, "multiply_numbers");
-
-  if (add_func_idx < 0 || mul_func_idx < 0) {
+  const char* names[] = { "add_numbers", "multiply_numbers" };
+  int indices[2];
+  if (ext_lib_load_functions(lib, names, 2, indices) > 0) {
     ext_lib_cleanup(lib);
     return;
   }
+  int add_func_idx = indices[0];
+  int mul_func_idx = indices[1];
 
   // @add_numbers(10, 20)
   jit_load_int(jit, 0, 10); // arg 1
@@ -104,9 +106,11 @@ dynamic_lib_example()
 
   jit_end_frame(jit);
 
+  jit_finalize(jit);
   int result = jit_execute_int(jit);
   printf("Result: (add + multiply): %d\n", result);
   jit_dump_code(jit);
+  ext_lib_dump(lib);
 
   ext_lib_cleanup(lib);
   jit_cleanup(jit);
@@ -131,6 +135,7 @@ ldr_example()
   jit_emit(jit, arm64_ldrs(0, 0, 0)); // LDR s0, [x0]
   jit_emit(jit, arm64_ret());
 
+  jit_finalize(jit);
   float result = jit_execute_float(jit);
   printf("Loaded value: %.3f\n", result);
   jit_dump_code(jit);
@@ -154,6 +159,7 @@ float_example()
 
   jit_emit(jit, arm64_ret());
 
+  jit_finalize(jit);
   float result = jit_execute_float(jit);
   printf("%.3f + %.3f = %.3f\n", a, b, result);
   jit_dump_code(jit);
@@ -161,6 +167,683 @@ float_example()
   jit_cleanup(jit);
 }
 
+void
+module_example()
+{
+  JITCompiler* jit = jit_init();
+  if (!jit)
+    return;
+
+  // square is called before it is emitted, the bl gets patched on bind
+  size_t square = jit_declare_function(jit);
+
+  // int square_plus_one(int x) { return square(x) + 1; }
+  size_t square_plus_one = jit_begin_function(jit);
+  jit_call_function(jit, square);
+  jit_load_int(jit, rx1, 1);
+  jit_emit(jit, arm64_add(rx0, rx0, rx1));
+  jit_emit(jit, arm64_ret());
+  jit_end_function(jit);
+
+  // int square(int x) { return x * x; }
+  jit_bind_function(jit, square);
+  jit_emit(jit, arm64_mul(rx0, rx0, rx0));
+  jit_emit(jit, arm64_ret());
+  jit_end_function(jit);
+
+  jit_finalize(jit);
+  int (*fn)(int) = (int (*)(int))jit_function_entry(jit, square_plus_one);
+  printf("square(7) + 1 = %d\n", fn(7));
+  jit_dump_code(jit);
+
+  jit_cleanup(jit);
+}
+
+// the counter loop on virtual registers, the allocator keeps the counter
+// and the limit in callee saved registers because they live across calls
+void
+ir_example()
+{
+  JITCompiler* jit = jit_init();
+  if (!jit)
+    return;
+
+  JitIr* ir = jit_ir_init(jit);
+  if (!ir) {
+    jit_cleanup(jit);
+    return;
+  }
+
+  size_t format_str_offset = jit_add_string(jit, "IR count: %d\n");
+  int format = jit_ir_const_int(ir, (int64_t)jit_get_string(jit, format_str_offset));
+  int counter = jit_ir_const_int(ir, 0);
+  int limit = jit_ir_const_int(ir, 5);
+  int one = jit_ir_const_int(ir, 1);
+
+  size_t loop_start = jit_ir_create_label(ir);
+  size_t loop_end = jit_ir_create_label(ir);
+
+  jit_ir_bind_label(ir, loop_start);
+  int args[] = { format, counter };
+  jit_ir_call(ir, print_fmt_int, JIT_IR_INT, args, 2);
+  jit_ir_branch(ir, COND_EQ, counter, limit, loop_end);
+  jit_ir_mov(ir, counter, jit_ir_add(ir, counter, one));
+  jit_ir_jump(ir, loop_start);
+
+  jit_ir_bind_label(ir, loop_end);
+  jit_ir_ret(ir, counter);
+
+  if (jit_ir_compile(ir) && jit_finalize(jit)) {
+    jit_ir_dump(ir);
+    printf("IR result: %d\n", jit_execute_int(jit));
+  }
+
+  jit_ir_cleanup(ir);
+  jit_cleanup(jit);
+}
+
+typedef void (*AddVectors)(float* a, float* b, float* result, int size);
+
+// add_vectors from math_lib.c, 8 floats per iteration with NEON
+void
+vector_example()
+{
+  JITCompiler* jit = jit_init();
+  if (!jit)
+    return;
+
+  size_t loop = jit_create_label(jit);
+  size_t tail = jit_create_label(jit);
+  size_t done = jit_create_label(jit);
+
+  jit_emit(jit, 0x93407c63); // sxtw x3, w3
+  jit_load_int(jit, rx9, 8);
+
+jit_bind_label(jit, loop);
+  jit_compare(jit, rx3, rx9);
+  jit_jump_if_less(jit, tail);
+  jit_vec_load_post(jit, rv0, 2, VEC_4S, rx0); // ld1 {v0.4s, v1.4s}, [x0], #32
+  jit_vec_load_post(jit, rv2, 2, VEC_4S, rx1); // ld1 {v2.4s, v3.4s}, [x1], #32
+  jit_vec_float_add(jit, rv0, rv0, rv2, VEC_4S);
+  jit_vec_float_add(jit, rv1, rv1, rv3, VEC_4S);
+  jit_vec_store_post(jit, rv0, 2, VEC_4S, rx2); // st1 {v0.4s, v1.4s}, [x2], #32
+  jit_emit(jit, arm64_sub_imm(rx3, rx3, 8));
+  jit_jump(jit, loop);
+
+  // the last size % 8 elements one at a time
+jit_bind_label(jit, tail);
+  jit_compare(jit, rx3, rx31);
+  jit_jump_if_equal(jit, done);
+  jit_emit(jit, arm64_ldrs(rv0, rx0, 0));
+  jit_emit(jit, arm64_ldrs(rv1, rx1, 0));
+  jit_float_add(jit, rv0, rv0, rv1);
+  jit_emit(jit, arm64_strs(rv0, rx2, 0));
+  jit_emit(jit, arm64_add_imm(rx0, rx0, 4));
+  jit_emit(jit, arm64_add_imm(rx1, rx1, 4));
+  jit_emit(jit, arm64_add_imm(rx2, rx2, 4));
+  jit_emit(jit, arm64_sub_imm(rx3, rx3, 1));
+  jit_jump(jit, tail);
+
+jit_bind_label(jit, done);
+  jit_emit(jit, arm64_ret());
+
+  jit_dump_code(jit);
+  jit_finalize(jit);
+
+  float a[11], b[11], result[11];
+  for (int i = 0; i < 11; i++) {
+    a[i] = i;
+    b[i] = i * 0.5f;
+  }
+  AddVectors add_vectors = (AddVectors)jit_code_address(jit, 0);
+  add_vectors(a, b, result, 11);
+  printf("Vector result: %.1f %.1f ... %.1f\n", result[0], result[1], result[10]);
+
+  jit_cleanup(jit);
+}
+
+// a * b + 1 called through a typed handle, once and over a batch of tuples
+void
+handle_example()
+{
+  JITCompiler* jit = jit_init();
+  if (!jit)
+    return;
+
+  size_t func = jit_begin_function(jit);
+  jit_emit(jit, arm64_mul(rx0, rx0, rx1));
+  jit_emit(jit, arm64_add_imm(rx0, rx0, 1));
+  jit_emit(jit, arm64_ret());
+  jit_end_function(jit);
+
+  JitSignature signature = { JIT_TYPE_INT64,
+                             { JIT_TYPE_INT64, JIT_TYPE_INT64 },
+                             2 };
+  JitHandle handle;
+  if (!jit_function_handle(jit, func, &signature, &handle)) {
+    jit_cleanup(jit);
+    return;
+  }
+
+  JitValue args[8];
+  for (int i = 0; i < 4; i++) {
+    args[i * 2].l = i + 2;
+    args[i * 2 + 1].l = 10;
+  }
+  JitValue results[4];
+  jit_invoke_batch(&handle, args, results, 4);
+  printf("Handle: %lld, batch %lld %lld %lld %lld\n",
+         (long long)jit_invoke(&handle, args).l,
+         (long long)results[0].l,
+         (long long)results[1].l,
+         (long long)results[2].l,
+         (long long)results[3].l);
+
+  jit_cleanup(jit);
+}
+
+// two versions of a function swapped under a reader, the first one is freed
+// once the reader has left it
+void
+sealed_example()
+{
+  JITCompiler* jit = jit_init();
+  JitEpoch* epoch = jit_epoch_init();
+  JitEpochThread* reader = epoch ? jit_epoch_register(epoch) : NULL;
+  if (!jit || !reader)
+    goto done;
+
+  JitSealed* slot = NULL;
+  for (int version = 1; version <= 2; version++) {
+    jit_begin_function(jit);
+    jit_load_int(jit, rx0, version * 100);
+    jit_emit(jit, arm64_ret());
+    jit_end_function(jit);
+
+    JitSealed* sealed = jit_seal(jit);
+    if (!sealed)
+      goto done;
+    jit_epoch_retire(epoch, jit_sealed_exchange(&slot, sealed));
+
+    jit_epoch_enter(epoch, reader);
+    JitFunctionInt func =
+      (JitFunctionInt)jit_sealed_entry(jit_sealed_load(&slot), 0);
+    printf("Sealed: version %d returns %d\n", version, func());
+    jit_epoch_exit(reader);
+  }
+
+  size_t freed = 0;
+  for (int i = 0; i < 3; i++)
+    freed += jit_epoch_reclaim(epoch);
+  printf("Sealed: %zu retired version freed\n", freed);
+  jit_sealed_free(jit_sealed_exchange(&slot, NULL));
+
+done:
+  if (reader)
+    jit_epoch_unregister(epoch, reader);
+  jit_epoch_cleanup(epoch);
+  jit_cleanup(jit);
+}
+
+static size_t
+build_answer(JITCompiler* jit, void* arg)
+{
+  size_t func = jit_begin_function(jit);
+  jit_load_int(jit, rx0, *(int*)arg);
+  jit_emit(jit, arm64_ret());
+  jit_end_function(jit);
+  return func;
+}
+
+static int
+interpret_answer(int value)
+{
+  return value;
+}
+
+// compiled on a worker thread, the interpreter answers until it is published
+void
+compile_service_example()
+{
+  JitCompileService* service = jit_compile_init(2, 16);
+  if (!service)
+    return;
+
+  int value = 42;
+  void* slot = NULL;
+  JitCompileMetrics metrics;
+  jit_compile_submit(service, build_answer, &value, &slot, &metrics);
+
+  JitFunctionInt func = (JitFunctionInt)jit_compile_entry(&slot);
+  int answer = func ? func() : interpret_answer(value);
+
+  jit_compile_wait(service);
+  func = (JitFunctionInt)jit_compile_entry(&slot);
+  if (func)
+    answer = func();
+  printf("Compile service: %d, %zu instructions in %llu ns\n",
+         answer,
+         metrics.code_size,
+         (unsigned long long)metrics.compile_ns);
+
+  // a recompile of the slot retires the old module, so calls go through
+  // the service's epoch
+  JitEpochThread* reader = jit_epoch_register(service->epoch);
+  int tiered = 43;
+  jit_compile_submit(service, build_answer, &tiered, &slot, NULL);
+  jit_compile_wait(service);
+  if (reader) {
+    jit_epoch_enter(service->epoch, reader);
+    func = (JitFunctionInt)jit_compile_entry(&slot);
+    answer = func ? func() : interpret_answer(tiered);
+    jit_epoch_exit(reader);
+    jit_epoch_unregister(service->epoch, reader);
+    printf("Compile service: recompiled %d, %zu module(s) retired\n",
+           answer,
+           service->epoch->num_retired + service->epoch->num_reclaimed);
+  }
+
+  jit_compile_cleanup(service);
+}
+
+// the call site follows add_numbers through a reload of the library, and
+// keeps its target when branch relaxation moves the code afterwards
+void
+reload_example()
+{
+  ExternalLibrary* lib = ext_lib_init_flags("./libmath.so", EXT_LIB_BIND_NOW);
+  if (!lib)
+    return;
+  int add = ext_lib_load_function(lib, "add_numbers");
+  int sub = ext_lib_load_function(lib, "subtract_numbers");
+  JITCompiler* jit = jit_init_reserved(4 * 1024 * 1024, JIT_DATA_RESERVE_SIZE);
+  if (add < 0 || sub < 0 || !jit) {
+    jit_cleanup(jit);
+    ext_lib_cleanup(lib);
+    return;
+  }
+
+  // a branch to a label that is bound more than 1MB away later on
+  size_t far = jit_create_label(jit);
+  jit_begin_function(jit);
+  jit_compare(jit, 0, 0);
+  jit_jump_if_not_equal(jit, far);
+  jit_emit(jit, arm64_ret());
+  jit_end_function(jit);
+
+  size_t func = jit_begin_function(jit);
+  jit_begin_frame(jit);
+  jit_load_int(jit, 0, 20);
+  jit_load_int(jit, 1, 10);
+  jit_call_library(jit, lib, add);
+  jit_end_frame(jit);
+  jit_end_function(jit);
+  jit_finalize(jit);
+
+  JitFunctionInt fn = (JitFunctionInt)jit_function_entry(jit, func);
+  int before = fn();
+
+  // point the site somewhere else, then let the reload bind it back
+  jit_patch_call(&lib->sites[0], lib->functions[sub]);
+  int patched = fn();
+  ext_lib_reload(lib);
+  int reloaded = fn();
+
+  // relaxing the B.NE inserts an instruction in front of the call
+  jit_patch_call(&lib->sites[0], lib->functions[sub]);
+  uint64_t pc = lib->sites[0].pc;
+  for (int i = 0; i < 300000; i++)
+    jit_emit(jit, 0xd503201f); // nop
+  jit_bind_label(jit, far);
+  jit_emit(jit, arm64_ret());
+  jit_finalize(jit);
+
+  fn = (JitFunctionInt)jit_function_entry(jit, func);
+  const JitCallSite* site = &lib->sites[0];
+  uint32_t bl = *site->code;
+  uint64_t target = site->pc + (uint64_t)((int64_t)((int32_t)(bl << 6) >> 6) * 4);
+  if (target == site->stub)
+    target = *site->slot;
+  bool follows = site->pc == pc + 4 && (bl >> 26) == 0x25 &&
+                 target == (uint64_t)lib->functions[sub];
+
+  printf("Reload: %d, patched: %d, reloaded: %d, relaxed: %d (site %s)\n",
+         before,
+         patched,
+         reloaded,
+         fn(),
+         follows ? "moved along" : "LOST");
+
+  jit_cleanup(jit);
+  ext_lib_cleanup(lib);
+}
+
+// add_numbers(20, 10) + 12 from the data section, compiled once and then
+// loaded from the cache by a second compiler
+static void
+cache_module(JITCompiler* jit, void* add_numbers)
+{
+  size_t offset = jit_alloc_data(jit, sizeof(int32_t), sizeof(int32_t));
+  int32_t twelve = 12;
+  memcpy(jit->data + offset, &twelve, sizeof(twelve));
+
+  jit_begin_function(jit);
+  jit_begin_frame(jit);
+  jit_load_int(jit, 0, 20);
+  jit_load_int(jit, 1, 10);
+  jit_call_external(jit, add_numbers);
+  jit_load_string_addr(jit, 1, offset);
+  jit_load_mem_word(jit, 1, 1, 0);
+  jit_emit(jit, arm64_add(0, 0, 1));
+  jit_end_frame(jit);
+  jit_end_function(jit);
+}
+
+void
+cache_example()
+{
+  ExternalLibrary* lib = ext_lib_init("./libmath.so");
+  JITCompiler* jit = jit_init();
+  JITCompiler* loaded = jit_init();
+  int add = lib ? ext_lib_load_function(lib, "add_numbers") : -1;
+  if (add < 0 || !jit || !loaded)
+    goto done;
+
+  const char* source = "add_numbers(20, 10) + 12";
+  uint64_t key = jit_cache_hash(source, strlen(source), 0);
+  const char* path = "./tiny_jit.cache";
+
+  cache_module(jit, lib->functions[add]);
+  jit_finalize(jit);
+  if (!jit_cache_save(jit, path, key, &lib, 1))
+    goto done;
+  if (jit_cache_load(loaded, path, key, &lib, 1))
+    printf("Cache: compiled %d, loaded %d\n",
+           jit_execute_int(jit),
+           jit_execute_int(loaded));
+  remove(path);
+
+done:
+  jit_cleanup(loaded);
+  jit_cleanup(jit);
+  ext_lib_cleanup(lib);
+}
+
+typedef void (*ScaleInPlace)(int64_t*, size_t, int64_t);
+
+// values[i] *= factor, written back through a post-indexed store
+void
+store_example()
+{
+  JITCompiler* jit = jit_init();
+  if (!jit)
+    return;
+
+  size_t func = jit_begin_function(jit);
+  size_t loop = jit_create_label(jit);
+  size_t done = jit_create_label(jit);
+
+jit_bind_label(jit, loop);
+  jit_compare(jit, rx1, rx31);
+  jit_jump_if_equal(jit, done);
+  jit_load_mem(jit, rx3, rx0, 0);
+  jit_emit(jit, arm64_mul(rx3, rx3, rx2));
+  jit_store_mem_post(jit, rx3, rx0, 8); // str x3, [x0], #8
+  jit_emit(jit, arm64_sub_imm(rx1, rx1, 1));
+  jit_jump(jit, loop);
+
+jit_bind_label(jit, done);
+  jit_emit(jit, arm64_ret());
+  jit_end_function(jit);
+  jit_finalize(jit);
+
+  int64_t values[] = { 1, -2, 3, 40 };
+  ScaleInPlace scale = (ScaleInPlace)jit_function_entry(jit, func);
+  scale(values, 4, 3);
+  printf("Store: %lld %lld %lld %lld\n",
+         (long long)values[0],
+         (long long)values[1],
+         (long long)values[2],
+         (long long)values[3]);
+
+  jit_cleanup(jit);
+}
+
+typedef int64_t (*ClampSum)(const int64_t*, size_t);
+
+// branchless sum of clamp(values[i], -10, 10)
+void
+select_example()
+{
+  JITCompiler* jit = jit_init();
+  if (!jit)
+    return;
+
+  size_t func = jit_begin_function(jit);
+  size_t loop = jit_create_label(jit);
+  size_t done = jit_create_label(jit);
+  jit_load_int(jit, rx2, 0); // sum
+  jit_load_imm64(jit, rx4, (uint64_t)-10);
+  jit_load_int(jit, rx5, 10);
+  jit_emit(jit, arm64_lsl_imm(rx1, rx1, 3));
+  jit_emit(jit, arm64_add(rx1, rx0, rx1)); // end pointer
+
+jit_bind_label(jit, loop);
+  jit_compare(jit, rx0, rx1);
+  jit_jump_if_above_equal(jit, done);
+  jit_emit(jit, arm64_ldr(rx6, rx0, 0));
+  jit_clamp(jit, rx6, rx6, rx4, rx5);
+  jit_emit(jit, arm64_add(rx2, rx2, rx6));
+  jit_emit(jit, arm64_add_imm(rx0, rx0, 8));
+  jit_jump(jit, loop);
+
+jit_bind_label(jit, done);
+  jit_emit(jit, arm64_add(rx0, rx2, rx31));
+  jit_emit(jit, arm64_ret());
+  jit_end_function(jit);
+  jit_finalize(jit);
+
+  int64_t values[] = { -40, -3, 7, 12, 0, 25, -11, 4 };
+  ClampSum clamp_sum = (ClampSum)jit_function_entry(jit, func);
+  printf("Select: clamped sum %lld\n", (long long)clamp_sum(values, 8));
+
+  jit_cleanup(jit);
+}
+
+// sum and count of the elements above 2 in a float array
+void
+reduction_example()
+{
+  JITCompiler* jit = jit_init();
+  if (!jit)
+    return;
+
+  JitReduction sum = { .op = JIT_REDUCE_SUM, .is_float = true };
+  JitReduction above = { .op = JIT_REDUCE_COUNT_IF,
+                         .is_float = true,
+                         .cond = COND_GT,
+                         .threshold = 2.0f };
+  size_t sum_func = jit_compile_reduction(jit, &sum);
+  size_t above_func = jit_compile_reduction(jit, &above);
+  if (sum_func == (size_t)-1 || above_func == (size_t)-1) {
+    jit_cleanup(jit);
+    return;
+  }
+  jit_finalize(jit);
+
+  float values[37];
+  for (int i = 0; i < 37; i++)
+    values[i] = i * 0.125f;
+
+  JitReduceFloat sum_floats = (JitReduceFloat)jit_function_entry(jit, sum_func);
+  JitCountIf count_above = (JitCountIf)jit_function_entry(jit, above_func);
+  printf("Reduction: sum %.3f, %zu above 2\n",
+         sum_floats(values, 37),
+         count_above(values, 37));
+
+  jit_cleanup(jit);
+}
+
+// rows where a > 3 && b < c * 2
+void
+predicate_example()
+{
+  JITCompiler* jit = jit_init();
+  JitPredicate* pred = jit_pred_init();
+  if (!jit || !pred) {
+    jit_pred_cleanup(pred);
+    jit_cleanup(jit);
+    return;
+  }
+
+  int a = jit_pred_column(pred, 0, false);
+  int b = jit_pred_column(pred, 1, true);
+  int c = jit_pred_column(pred, 2, true);
+  int filter = jit_pred_and(
+    pred,
+    jit_pred_compare(pred, COND_GT, a, jit_pred_int(pred, 3)),
+    jit_pred_compare(
+      pred, COND_LT, b, jit_pred_mul(pred, c, jit_pred_float(pred, 2.0f))));
+  size_t func = jit_compile_predicate(jit, pred, filter, JIT_PRED_SELECTION);
+  if (func != (size_t)-1) {
+    jit_finalize(jit);
+
+    int32_t as[10] = { 1, 5, 7, 2, 9, 4, 8, 0, 6, 10 };
+    float bs[10] = { 1, 1, 9, 1, 3, 2, 5, 0, 1, 4 };
+    float cs[10] = { 1, 1, 2, 1, 1, 2, 3, 0, 1, 1 };
+    const void* columns[3] = { as, bs, cs };
+    uint32_t rows[10];
+
+    JitFilter select = (JitFilter)jit_function_entry(jit, func);
+    size_t count = select(columns, 10, rows);
+    printf("Predicate: %zu rows:", count);
+    for (size_t i = 0; i < count; i++)
+      printf(" %u", rows[i]);
+    printf("\n");
+  }
+
+  jit_pred_cleanup(pred);
+  jit_cleanup(jit);
+}
+
+// id and signed level out of 6-byte packed records
+void
+decoder_example()
+{
+  JITCompiler* jit = jit_init();
+  if (!jit)
+    return;
+
+  // uint32_t id at 0, int16_t level at 4
+  JitField fields[2] = {
+    { 0, 4, false, false, 8 },
+    { 4, 2, true, false, 4 },
+  };
+  size_t func = jit_compile_decoder(jit, 6, fields, 2);
+  if (func != (size_t)-1) {
+    jit_finalize(jit);
+
+    uint8_t records[5 * 6];
+    for (int i = 0; i < 5; i++) {
+      uint32_t id = 1000 + i;
+      int16_t level = (int16_t)(i * -7);
+      memcpy(records + i * 6, &id, sizeof(id));
+      memcpy(records + i * 6 + 4, &level, sizeof(level));
+    }
+
+    uint64_t ids[5];
+    int32_t levels[5];
+    void* columns[2] = { ids, levels };
+    JitDecoder decode = (JitDecoder)jit_function_entry(jit, func);
+    decode(records, 5, columns);
+    printf("Decoder: id %lu level %d ... id %lu level %d\n",
+           (unsigned long)ids[0],
+           levels[0],
+           (unsigned long)ids[4],
+           levels[4]);
+  }
+
+  jit_cleanup(jit);
+}
+
+// 3x5 = 3x2 * 2x5 through a kernel generated for that shape
+void
+gemm_example()
+{
+  JitGemmCache* cache = jit_gemm_init();
+  if (!cache)
+    return;
+
+  float a[6] = { 1, 2, 3, 4, 5, 6 };
+  float b[10] = { 1, 0, 0, 1, 2, 0, 1, 0, 1, 3 };
+  float c[15];
+
+  JitGemmKernel kernel = jit_gemm_kernel(cache, 3, 5, 2, 2, 5, 5);
+  if (kernel) {
+    kernel(a, b, c);
+    printf("GEMM result: %.0f %.0f %.0f %.0f %.0f ... %.0f\n",
+           c[0],
+           c[1],
+           c[2],
+           c[3],
+           c[4],
+           c[14]);
+  }
+
+  // the same shape again is a cache hit
+  jit_gemm_kernel(cache, 3, 5, 2, 2, 5, 5);
+  printf("GEMM cache: %zu hits, %zu misses\n", cache->hits, cache->misses);
+
+  jit_gemm_cleanup(cache);
+}
+
+// (x * 4 + 2 * 3) * (x * 4 + 6) + itof(x) * 1.0, x = 7
+void
+expr_example()
+{
+  JITCompiler* jit = jit_init();
+  if (!jit)
+    return;
+
+  JitIr* ir = jit_ir_init(jit);
+  JitExpr* expr = ir ? jit_expr_init(ir) : NULL;
+  if (!expr) {
+    jit_ir_cleanup(ir);
+    jit_cleanup(jit);
+    return;
+  }
+
+  int x = jit_expr_value(expr, jit_ir_const_int(ir, 7));
+  int four = jit_expr_const_int(expr, 4);
+  int left = jit_expr_add(
+    expr,
+    jit_expr_mul(expr, x, four),
+    jit_expr_mul(expr, jit_expr_const_int(expr, 2), jit_expr_const_int(expr, 3)));
+  int right = jit_expr_add(
+    expr, jit_expr_mul(expr, four, x), jit_expr_const_int(expr, 6));
+  int scaled = jit_expr_float_mul(
+    expr, jit_expr_int_to_float(expr, x), jit_expr_const_float(expr, 1.0f));
+  int result = jit_expr_add(expr,
+                            jit_expr_mul(expr, left, right),
+                            jit_expr_float_to_int(expr, scaled));
+
+  jit_ir_ret(ir, jit_expr_lower(expr, result));
+  printf("Expr: %zu nodes, %zu folded, %zu reused, %zu reduced\n",
+         expr->num_nodes,
+         expr->folded,
+         expr->reused,
+         expr->reduced);
+
+  if (jit_ir_compile(ir) && jit_finalize(jit)) {
+    jit_ir_dump(ir);
+    printf("Expr result: %d\n", jit_execute_int(jit));
+  }
+
+  jit_expr_cleanup(expr);
+  jit_ir_cleanup(ir);
+  jit_cleanup(jit);
+}
+
 void counter_example() {
   JITCompiler *jit = jit_init();
   if (!jit) {
@@ -196,7 +879,14 @@ jit_bind_label(jit, loop_start);
 jit_bind_label(jit, loop_end);
   jit_emit(jit, arm64_ret());
 
+  JitPeepholeStats stats = jit_peephole(jit);
+  printf("Peephole: %zu -> %zu instructions (%zu moves, %zu folds, %zu "
+         "branches, %zu dead)\n",
+         stats.before, stats.after, stats.moves, stats.folds, stats.branches,
+         stats.dead);
+
   jit_dump_code(jit);
+  jit_finalize(jit);
   jit_execute_int(jit);
 
   jit_cleanup(jit);
@@ -208,7 +898,22 @@ main()
   string_example();
   float_example();
   ldr_example();
+  module_example();
   counter_example();
+  ir_example();
+  expr_example();
+  vector_example();
+  select_example();
+  store_example();
+  handle_example();
+  sealed_example();
+  compile_service_example();
+  reload_example();
+  cache_example();
+  gemm_example();
+  reduction_example();
+  predicate_example();
+  decoder_example();
   dynamic_lib_example();
   return 0;
 }
@@ -12,12 +12,26 @@
 #define __TINY_JIT_H
 
 #include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#if defined(__APPLE__)
+#include <libkern/OSCacheControl.h>
+#endif
 
 // clang-format off
 typedef enum Cond
@@ -56,18 +70,147 @@ typedef enum {
   rv22, rv23, rv24, rv25, rv26, rv27,
   rv28, rv29, rv30, rv31,
 } JITRegister;
+
+// arrangements of a 128-bit NEON register, the value is the size field of
+// the encodings. floats use VEC_4S and doubles VEC_2D.
+typedef enum {
+  VEC_16B = 0, /* 16 x 8-bit */
+  VEC_8H  = 1, /* 8 x 16-bit */
+  VEC_4S  = 2, /* 4 x 32-bit */
+  VEC_2D  = 3, /* 2 x 64-bit */
+} JITVecArrangement;
+
+// PRFM operations: load or store, target cache level, KEEP for data that is
+// reused and STRM for data that is touched once
+typedef enum Prefetch
+{
+  PRFM_PLDL1KEEP = 0x00, PRFM_PLDL1STRM = 0x01,
+  PRFM_PLDL2KEEP = 0x02, PRFM_PLDL2STRM = 0x03,
+  PRFM_PLDL3KEEP = 0x04, PRFM_PLDL3STRM = 0x05,
+  PRFM_PSTL1KEEP = 0x10, PRFM_PSTL1STRM = 0x11,
+  PRFM_PSTL2KEEP = 0x12, PRFM_PSTL2STRM = 0x13,
+  PRFM_PSTL3KEEP = 0x14, PRFM_PSTL3STRM = 0x15,
+} Prefetch;
 // clang-format on
 
 #define MAX_CODE_MEMORY_SIZE 4096          // 4K
 #define MAX_DATA_MEMORY_SIZE (1024 * 1024) // 1MB
+#define JIT_CODE_RESERVE_SIZE (1024 * 1024)      // 1MB, code never moves
+#define JIT_DATA_RESERVE_SIZE (64 * 1024 * 1024) // 64MB, data never moves
 #define MAX_LABEL_CAPACITY 16
+#define MAX_FIXUP_CAPACITY 32
+#define MAX_FUNCTION_CAPACITY 16
+#define MAX_CONSTANT_CAPACITY 16
+#define JIT_FUNCTION_ALIGNMENT 16 // bytes, function entries are NOP padded
+#define MAX_STUB_CAPACITY 16
+#define JIT_STUB_SIZE 16 // ldr x16, #8; br x16; .quad target
+#define JIT_CALL_STUB_SIZE 32 // private stub of a call site, see jit_new_stub
+#define JIT_CALL_STUB_SLOT 24 // offset of its target
+#define MAX_EXT_FUNCTION_CAPACITY 32
+#define MAX_EXT_SYMBOL_CAPACITY 64 // power of two, kept at most half full
+#define MAX_CALL_SITE_CAPACITY 16
+#define MAX_IR_INST_CAPACITY 64
+#define MAX_IR_VALUE_CAPACITY 32
+#define MAX_IR_FRAME_SIZE 4080 // bytes, limit of a single sub sp immediate
+#define MAX_EXPR_NODE_CAPACITY 64 // power of two, the table gets twice that
+#define MAX_GEMM_CACHE_CAPACITY 16 // power of two, kept at most half full
+#define JIT_GEMM_MAX_UNROLL 1024 // vector FMLAs before a kernel loops
+#define MAX_PRED_NODE_CAPACITY 16
+#define JIT_PRED_MAX_COLUMNS 8 // column pointers live in x3-x10
+#define JIT_DECODE_MAX_FIELDS 8 // column pointers live in x3-x10
+#define JIT_DECODE_UNROLL 4 // records per iteration, a power of two
+
+#define JIT_HEAP_REGION_SIZE (128 * 1024 * 1024) // 128MB, BL reachable
+#define JIT_HEAP_MIN_CHUNK_SIZE 4096             // 4K, smallest size class
+#define JIT_HEAP_NUM_CLASSES 9                   // 4K .. 1MB
+#define JIT_HUGE_PAGE_SIZE (2 * 1024 * 1024)     // 2MB
+
+// a reservation in the code heap. rw and rx are two views of the same pages
+// (the same pointer when the platform can't dual map).
+typedef struct
+{
+  uint8_t* rw;
+  uint8_t* rx;
+  size_t size;      // reserved bytes
+  size_t committed; // bytes accessible from the start of the chunk
+  size_t committed_top; // bytes accessible at the end of the chunk
+  bool pinned;      // always fully committed (huge page or MAP_JIT region)
+} JitCodeChunk;
+
+typedef struct
+{
+  size_t reserved;   // virtual address space held by the heap
+  size_t committed;  // bytes mapped readable/writable/executable
+  size_t in_use;     // bytes handed out to compilers
+  size_t fragmented; // committed bytes sitting in free lists
+  size_t num_regions;
+  size_t num_chunks;
+} JitHeapStats;
+
+typedef enum
+{
+  JIT_FIXUP_B,          // B <label>, imm26
+  JIT_FIXUP_B_COND,     // B.cond <label>, imm19
+  JIT_FIXUP_B_COND_FAR, // B.!cond #8 followed by B <label> (relaxed B.cond,
+                        // CBZ or TBZ)
+  JIT_FIXUP_BL,         // BL <label>, calls between functions of a module
+  JIT_FIXUP_ADRP_DATA,  // ADRP to an offset in the data section
+  JIT_FIXUP_LDR_DATA,   // LDR (literal) of an offset in the data section
+  JIT_FIXUP_ADR_ABS,    // ADR of an absolute address
+  JIT_FIXUP_ADRP_ABS,   // ADRP of an absolute address
+  JIT_FIXUP_CALL,       // BL to an absolute address, through a stub if far
+  JIT_FIXUP_CB,         // CBZ/CBNZ <label>, imm19
+  JIT_FIXUP_TB          // TBZ/TBNZ <label>, imm14
+} JitFixupKind;
+
+// a PC-relative instruction that has to be (re)encoded whenever its site or
+// target moves. label branches keep their fixup after they are resolved so
+// the code buffer can be rewritten later on.
+typedef struct
+{
+  size_t offset;   // instruction index of the site
+  uint64_t target; // label index, data offset or absolute address
+  JitFixupKind kind;
+} JitFixup;
+
+// a function inside a module, its entry is a label so calls to functions
+// that are not emitted yet get patched like any forward branch.
+typedef struct
+{
+  size_t label;
+  size_t size; // instructions, known once jit_end_function is called
+} JitFunction;
+
+// a literal pool entry in the data section
+typedef struct
+{
+  uint64_t bits;
+  size_t size;
+  size_t offset;
+} JitConstant;
+
+// a patchable call emitted by jit_call_library. its address is only known
+// once branch relaxation is done, so it is handed to the library by
+// jit_finalize. the compiler keeps it afterwards for jit_cache_save.
+typedef struct
+{
+  size_t fixup; // the JIT_FIXUP_CALL of the BL
+  uint64_t stub; // private stub of the site
+  struct ExternalLibrary* lib;
+  int function;
+} JitLibraryCall;
 
 typedef struct
 {
-  // code
+  // code is written through the RW view and executed through exec, the RX
+  // view of the same chunk. capacity is the committed size in bytes.
   uint32_t* code;
+  uint32_t* exec;
   size_t code_size;
   size_t capacity;
+  JitCodeChunk code_chunk;
+  bool finalized; // icache is in sync with the code
+  bool failed;    // something couldn't be emitted, jit_finalize refuses
 
   // labels
   uint32_t** label_positions;
@@ -75,10 +218,44 @@ typedef struct
   size_t num_labels;
   size_t label_capacity;
 
-  // data
+  // fixups
+  JitFixup* fixups;
+  size_t num_fixups;
+  size_t fixup_capacity;
+  size_t* pending_fixups; // indices of fixups targeting unbound labels
+  size_t num_pending_fixups;
+
+  // functions
+  JitFunction* functions;
+  size_t num_functions;
+  size_t function_capacity;
+  size_t current_function; // (size_t)-1 outside of a function
+
+  // literal pool entries of the current function, constants are
+  // deduplicated per function and the list starts over at each entry
+  JitConstant* constants;
+  size_t num_constants;
+  size_t constant_capacity;
+
+  // call stubs, one per far target, grow down from the top of the code
+  // reservation so they stay in BL range and never move
+  uint64_t* stubs; // target address of each stub
+  size_t num_stubs;
+  size_t stub_capacity;
+  size_t stub_area; // bytes set aside for stubs at the top of code_chunk
+
+  // patchable calls, the ones from num_registered_calls on are not
+  // registered with their library yet
+  JitLibraryCall* library_calls;
+  size_t num_library_calls;
+  size_t library_call_capacity;
+  size_t num_registered_calls;
+
+  // data, data_capacity is committed and data_reserve reserved bytes
   uint8_t* data;
   size_t data_size;
   size_t data_capacity;
+  size_t data_reserve;
 } JITCompiler;
 
 uint32_t
@@ -90,6 +267,21 @@ arm64_movz(int reg, uint16_t value);
 uint32_t
 arm64_movk(int reg, uint16_t value, int shift);
 
+uint32_t
+arm64_movz_shift(int reg, uint16_t value, int shift);
+
+uint32_t
+arm64_movn(int reg, uint16_t value, int shift);
+
+bool
+arm64_logical_imm(uint64_t value, uint32_t* encoded);
+
+uint32_t
+arm64_orr_imm(int rd, int rn, uint32_t encoded);
+
+int
+arm64_imm64_sequence(int reg, uint64_t value, uint32_t* instructions);
+
 uint32_t
 arm64_adr(int rd, int32_t offset);
 
@@ -102,18 +294,92 @@ arm64_sub(int rd, int rn, int rm);
 uint32_t
 arm64_mul(int rd, int rn, int rm);
 
+uint32_t
+arm64_lsl_imm(int rd, int rn, int shift);
+
+uint32_t
+arm64_lsr_imm(int rd, int rn, int shift);
+
+// rd = rn << rm
+uint32_t
+arm64_lslv(int rd, int rn, int rm);
+
+// rd = rn | (rm << shift)
+uint32_t
+arm64_orr_lsl(int rd, int rn, int rm, int shift);
+
 uint32_t
 arm64_cmp(int rn, int rm);
 
+// SUBS xzr, rn, #imm12
+uint32_t
+arm64_cmp_imm(int rn, uint16_t imm);
+
+// rd = cond ? rn : rm
+uint32_t
+arm64_csel(int rd, int rn, int rm, int cond);
+
+// rd = cond ? rn : rm + 1
+uint32_t
+arm64_csinc(int rd, int rn, int rm, int cond);
+
+// rd = cond ? rn : ~rm
+uint32_t
+arm64_csinv(int rd, int rn, int rm, int cond);
+
+// rd = cond ? rn : -rm
+uint32_t
+arm64_csneg(int rd, int rn, int rm, int cond);
+
+// rd = cond ? 1 : 0
+uint32_t
+arm64_cset(int rd, int cond);
+
+// rd = cond ? -1 : 0
+uint32_t
+arm64_csetm(int rd, int cond);
+
+// flags = cond ? cmp(rn, rm) : nzcv
+uint32_t
+arm64_ccmp(int rn, int rm, int nzcv, int cond);
+
+// flags = cond ? cmp(rn, #imm5) : nzcv
+uint32_t
+arm64_ccmp_imm(int rn, int imm, int nzcv, int cond);
+
 uint32_t
 arm64_b(int32_t offset);
 
 uint32_t
 arm64_b_cond(int32_t offset, int cond);
 
+bool
+jit_fp_imm8(double value, uint8_t* imm8);
+
 uint32_t
 arm64_fmov_s(int rd, float value);
 
+uint32_t
+arm64_fmov_d(int rd, double value);
+
+uint32_t
+arm64_fmov_s_zero(int rd);
+
+uint32_t
+arm64_ldr_lit_s(int rt, int32_t offset);
+
+uint32_t
+arm64_ldr_lit_d(int rt, int32_t offset);
+
+uint32_t
+arm64_ldr_lit(int rt, int32_t offset);
+
+uint32_t
+arm64_br(int rn);
+
+uint32_t
+arm64_ldrd(int rt, int rn, uint16_t imm12);
+
 uint32_t
 arm64_fadd_s(int rd, int rn, int rm);
 
@@ -129,6 +395,14 @@ arm64_fdiv_s(int rd, int rn, int rm);
 uint32_t
 arm64_fcmp_s(int rn, int rm);
 
+// sd = cond ? sn : sm
+uint32_t
+arm64_fcsel_s(int rd, int rn, int rm, int cond);
+
+// flags = cond ? fcmp(sn, sm) : nzcv
+uint32_t
+arm64_fccmp_s(int rn, int rm, int nzcv, int cond);
+
 uint32_t
 arm64_scvtf_s(int rd, int rn);
 
@@ -137,6 +411,53 @@ arm64_fcvtzs_s(int rd, int rn);
 
 void
 jit_load_float(JITCompiler* jit, int reg, float value);
+void
+jit_load_double(JITCompiler* jit, int reg, double value);
+
+// loads and stores at rn + offset, offset is in units of the access size
+void
+jit_load_mem(JITCompiler* jit, int rt, int rn, uint16_t offset);
+void
+jit_load_mem_word(JITCompiler* jit, int rt, int rn, uint16_t offset);
+void
+jit_load_mem_half(JITCompiler* jit, int rt, int rn, uint16_t offset);
+void
+jit_load_mem_byte(JITCompiler* jit, int rt, int rn, uint16_t offset);
+void
+jit_load_float_mem(JITCompiler* jit, int rt, int rn, uint16_t offset);
+void
+jit_store_mem(JITCompiler* jit, int rt, int rn, uint16_t offset);
+void
+jit_store_mem_word(JITCompiler* jit, int rt, int rn, uint16_t offset);
+void
+jit_store_mem_half(JITCompiler* jit, int rt, int rn, uint16_t offset);
+void
+jit_store_mem_byte(JITCompiler* jit, int rt, int rn, uint16_t offset);
+void
+jit_store_float_mem(JITCompiler* jit, int rt, int rn, uint16_t offset);
+
+// 64-bit element rn[rm]
+void
+jit_load_mem_index(JITCompiler* jit, int rt, int rn, int rm);
+void
+jit_store_mem_index(JITCompiler* jit, int rt, int rn, int rm);
+
+// 64-bit access at rn, then rn += step bytes
+void
+jit_load_mem_post(JITCompiler* jit, int rt, int rn, int step);
+void
+jit_store_mem_post(JITCompiler* jit, int rt, int rn, int step);
+
+// ldnp/stnp x registers rt1, rt2 at rn + imm * 8
+void
+jit_load_pair_nt(JITCompiler* jit, int rt1, int rt2, int rn, int imm);
+void
+jit_store_pair_nt(JITCompiler* jit, int rt1, int rt2, int rn, int imm);
+
+// prefetch rn + offset bytes, false when no PRFM form reaches the offset
+bool
+jit_prefetch(JITCompiler* jit, int op, int rn, int offset);
+
 void
 jit_float_add(JITCompiler* jit, int rd, int rn, int rm);
 void
@@ -148,6 +469,14 @@ jit_float_div(JITCompiler* jit, int rd, int rn, int rm);
 void
 jit_float_compare(JITCompiler* jit, int rn, int rm);
 void
+jit_float_compare_if(JITCompiler* jit, int rn, int rm, int nzcv, int cond);
+void
+jit_float_select(JITCompiler* jit, int rd, int rn, int rm, int cond);
+void
+jit_float_min(JITCompiler* jit, int rd, int rn, int rm);
+void
+jit_float_max(JITCompiler* jit, int rd, int rn, int rm);
+void
 jit_int_to_float(JITCompiler* jit, int rd, int rn);
 void
 jit_float_to_int(JITCompiler* jit, int rd, int rn);
@@ -164,836 +493,9644 @@ arm64_stp(int rt1, int rt2, int rn, int imm);
 uint32_t
 arm64_ldp(int rt1, int rt2, int rn, int imm);
 
+uint32_t
+arm64_stp_pre(int rt1, int rt2, int rn, int imm);
+
+uint32_t
+arm64_ldp_post(int rt1, int rt2, int rn, int imm);
+
 uint32_t
 arm64_adrp(int rd, int64_t imm);
 
 uint32_t
 arm64_add_imm(int rd, int rn, uint16_t imm12);
 
-JITCompiler*
-jit_init();
+uint32_t
+arm64_sub_imm(int rd, int rn, uint16_t imm12);
 
-void
-jit_dump_code(JITCompiler* jit);
+uint32_t
+arm64_str(int rt, int rn, uint16_t imm12);
 
-size_t
-jit_add_string(JITCompiler* jit, const char* str);
+uint32_t
+arm64_strs(int rt, int rn, uint16_t imm12);
 
-void
-jit_load_string_addr(JITCompiler* jit, int reg, size_t offset);
+uint32_t
+arm64_strd(int rt, int rn, uint16_t imm12);
 
-const char*
-jit_get_string(JITCompiler* jit, size_t offset);
+// sized loads and stores, imm12 is scaled by the access size. LDRB/LDRH
+// zero extend, LDRSB/LDRSH/LDRSW sign extend into the 64-bit register
+uint32_t
+arm64_ldrb(int rt, int rn, uint16_t imm12);
 
-void
-jit_cleanup(JITCompiler* jit);
+uint32_t
+arm64_ldrh(int rt, int rn, uint16_t imm12);
 
-void
-jit_reset(JITCompiler* jit);
+uint32_t
+arm64_ldrsb(int rt, int rn, uint16_t imm12);
 
-void
-jit_emit(JITCompiler* jit, uint32_t instruction);
+uint32_t
+arm64_ldrsh(int rt, int rn, uint16_t imm12);
 
-size_t
-jit_create_label(JITCompiler* jit);
+uint32_t
+arm64_ldrsw(int rt, int rn, uint16_t imm12);
 
-void
-jit_bind_label(JITCompiler* jit, size_t label);
+uint32_t
+arm64_strb(int rt, int rn, uint16_t imm12);
 
-int32_t
-jit_branch_offset(JITCompiler* jit, size_t label);
+uint32_t
+arm64_strh(int rt, int rn, uint16_t imm12);
 
-void
-jit_load_int(JITCompiler* jit, int reg, int32_t value);
+uint32_t
+arm64_strw(int rt, int rn, uint16_t imm12);
 
-void
-jit_compare(JITCompiler* jit, int reg1, int reg2);
+uint32_t
+arm64_ldr(int rt, int rn, uint16_t imm12);
 
-void
-jit_jump(JITCompiler* jit, size_t label);
+uint32_t
+arm64_ldrw(int rt, int rn, uint16_t imm12);
 
-void
-jit_jump_if_equal(JITCompiler* jit, size_t label);
+uint32_t
+arm64_ldrs(int rt, int rn, uint16_t imm12);
 
-void
-jit_jump_if_not_equal(JITCompiler* jit, size_t label);
+// pre-indexed forms address rn + imm and post-indexed forms address rn, both
+// write rn + imm back to rn. imm is a byte offset in [-256, 255]
+uint32_t
+arm64_ldr_pre(int rt, int rn, int imm);
 
-void
-jit_jump_if_less(JITCompiler* jit, size_t label);
+uint32_t
+arm64_ldr_post(int rt, int rn, int imm);
 
-void
-jit_jump_if_greater(JITCompiler* jit, size_t label);
+uint32_t
+arm64_ldrw_pre(int rt, int rn, int imm);
 
-void
-jit_call(JITCompiler* jit, void* func_ptr);
+uint32_t
+arm64_ldrw_post(int rt, int rn, int imm);
 
-typedef int (*JitFunctionInt)();
-typedef float (*JitFunctionFloat)();
-typedef double (*JitFunctionDouble)();
+uint32_t
+arm64_ldrh_pre(int rt, int rn, int imm);
 
-typedef union
-{
-  int i;
-  float f;
-  double d;
-} JitValue;
+uint32_t
+arm64_ldrh_post(int rt, int rn, int imm);
 
-typedef enum
-{
-  JIT_TYPE_INT,
-  JIT_TYPE_FLOAT,
-  JIT_TYPE_DOUBLE
-} JitReturnType;
+uint32_t
+arm64_ldrb_pre(int rt, int rn, int imm);
 
-JitValue
-jit_execute_typed(JITCompiler* jit, JitReturnType return_type);
+uint32_t
+arm64_ldrb_post(int rt, int rn, int imm);
 
-int
-jit_execute_int(JITCompiler* jit);
+uint32_t
+arm64_ldrsw_pre(int rt, int rn, int imm);
 
-float
-jit_execute_float(JITCompiler* jit);
+uint32_t
+arm64_ldrsw_post(int rt, int rn, int imm);
 
-double
-jit_execute_double(JITCompiler* jit);
+uint32_t
+arm64_ldrsh_pre(int rt, int rn, int imm);
 
-typedef struct
-{
-  void* handle;        // from dlopen
-  void* functions[32]; // array of function pointers
-  int func_count;
-} ExternalLibrary;
+uint32_t
+arm64_ldrsh_post(int rt, int rn, int imm);
 
-ExternalLibrary*
-ext_lib_init(const char* library_path);
+uint32_t
+arm64_ldrsb_pre(int rt, int rn, int imm);
 
-int
-ext_lib_load_function(ExternalLibrary* lib, const char* func_name);
+uint32_t
+arm64_ldrsb_post(int rt, int rn, int imm);
 
-void
-ext_lib_cleanup(ExternalLibrary* lib);
+uint32_t
+arm64_str_pre(int rt, int rn, int imm);
 
-void
-jit_begin_frame(JITCompiler* jit);
+uint32_t
+arm64_str_post(int rt, int rn, int imm);
 
-void
-jit_end_frame(JITCompiler* jit);
+uint32_t
+arm64_strw_pre(int rt, int rn, int imm);
 
-void
-jit_call_external(JITCompiler* jit, void* func_ptr);
+uint32_t
+arm64_strw_post(int rt, int rn, int imm);
 
-#if defined(TINY_JIT_IMPLEMENTATION)
 uint32_t
-arm64_mov(int rd, int rs)
-{
-  return 0xAA0003E0 | (rs << 16) | rd;
-}
+arm64_strh_pre(int rt, int rn, int imm);
 
 uint32_t
-arm64_movz(int reg, uint16_t value)
-{
-  return 0xd2800000 | ((uint32_t)value << 5) | reg;
-}
+arm64_strh_post(int rt, int rn, int imm);
 
 uint32_t
-arm64_movk(int reg, uint16_t value, int shift)
-{
-  return 0xf2800000 | ((uint32_t)value << 5) | (shift << 21) | reg;
-}
+arm64_strb_pre(int rt, int rn, int imm);
 
 uint32_t
-arm64_adr(int rd, int32_t offset)
-{
-  return 0x10000000 | ((offset & 0x7ffff) << 5) | rd;
-}
+arm64_strb_post(int rt, int rn, int imm);
 
+// register offset forms address rn + (rm << shift), shift is 0 or the log2
+// of the access size
 uint32_t
-arm64_add(int rd, int rn, int rm)
-{
-  return 0x8b000000 | (rm << 16) | (rn << 5) | rd;
-}
+arm64_ldr_reg(int rt, int rn, int rm, int shift);
 
 uint32_t
-arm64_sub(int rd, int rn, int rm)
-{
-  return 0xcb000000 | (rm << 16) | (rn << 5) | rd;
-}
+arm64_ldrw_reg(int rt, int rn, int rm, int shift);
 
 uint32_t
-arm64_mul(int rd, int rn, int rm)
-{
-  return 0x9b007c00 | (rm << 16) | (rn << 5) | rd;
-}
+arm64_ldrh_reg(int rt, int rn, int rm, int shift);
 
 uint32_t
-arm64_cmp(int rn, int rm)
-{
-  return 0xeb000000 | (rm << 16) | (rn << 5);
-}
+arm64_ldrb_reg(int rt, int rn, int rm, int shift);
 
 uint32_t
-arm64_b(int32_t offset)
-{
-  return 0x14000000 | (offset & 0x3ffffff);
-}
+arm64_ldrsw_reg(int rt, int rn, int rm, int shift);
 
 uint32_t
-arm64_b_cond(int32_t offset, int cond)
-{
-  uint32_t imm19 = offset & 0x7ffff;
+arm64_ldrsh_reg(int rt, int rn, int rm, int shift);
+
+uint32_t
+arm64_ldrsb_reg(int rt, int rn, int rm, int shift);
+
+uint32_t
+arm64_str_reg(int rt, int rn, int rm, int shift);
+
+uint32_t
+arm64_strw_reg(int rt, int rn, int rm, int shift);
+
+uint32_t
+arm64_strh_reg(int rt, int rn, int rm, int shift);
+
+uint32_t
+arm64_strb_reg(int rt, int rn, int rm, int shift);
+
+// PRFM PLDL1KEEP, [rn, #offset], offset is a multiple of 8 below 32768
+uint32_t
+arm64_prfm(int rn, uint16_t offset);
+
+// PRFM <op>, [rn, #offset], same offsets as arm64_prfm
+uint32_t
+arm64_prfm_op(int op, int rn, uint16_t offset);
+
+// PRFUM <op>, [rn, #imm], unscaled byte offset in [-256, 255]
+uint32_t
+arm64_prfum(int op, int rn, int imm);
+
+uint32_t
+arm64_fmov_reg_s(int rd, int rn);
+
+// NEON, 128-bit registers only. LD1/ST1 take 1-4 consecutive registers,
+// the post-increment forms advance rn by the bytes transferred.
+uint32_t
+arm64_ld1(int rt, int count, int arrangement, int rn);
+
+uint32_t
+arm64_ld1_post(int rt, int count, int arrangement, int rn);
+
+uint32_t
+arm64_st1(int rt, int count, int arrangement, int rn);
+
+uint32_t
+arm64_st1_post(int rt, int count, int arrangement, int rn);
+
+// single 32-bit lane, post-increment by 4
+uint32_t
+arm64_ld1_lane_post(int rt, int index, int rn);
+
+uint32_t
+arm64_st1_lane_post(int rt, int index, int rn);
+
+// post-increment by rm instead
+uint32_t
+arm64_st1_lane_post_reg(int rt, int index, int rn, int rm);
+
+uint32_t
+arm64_ldp_q(int rt1, int rt2, int rn, int imm);
+
+uint32_t
+arm64_stp_q(int rt1, int rt2, int rn, int imm);
+
+uint32_t
+arm64_ldp_q_post(int rt1, int rt2, int rn, int imm);
+
+uint32_t
+arm64_stp_q_post(int rt1, int rt2, int rn, int imm);
+
+// non-temporal pairs, a hint that the data is not reused soon. imm is in
+// units of 16 bytes for the q forms and 8 bytes for the x forms
+uint32_t
+arm64_ldnp_q(int rt1, int rt2, int rn, int imm);
+
+uint32_t
+arm64_stnp_q(int rt1, int rt2, int rn, int imm);
+
+uint32_t
+arm64_ldnp(int rt1, int rt2, int rn, int imm);
+
+uint32_t
+arm64_stnp(int rt1, int rt2, int rn, int imm);
+
+uint32_t
+arm64_fadd_v(int rd, int rn, int rm, int arrangement);
+
+uint32_t
+arm64_fsub_v(int rd, int rn, int rm, int arrangement);
+
+uint32_t
+arm64_fmul_v(int rd, int rn, int rm, int arrangement);
+
+uint32_t
+arm64_fdiv_v(int rd, int rn, int rm, int arrangement);
+
+uint32_t
+arm64_fmla_v(int rd, int rn, int rm, int arrangement);
+
+uint32_t
+arm64_fmax_v(int rd, int rn, int rm, int arrangement);
+
+uint32_t
+arm64_fmin_v(int rd, int rn, int rm, int arrangement);
+
+uint32_t
+arm64_faddp_v(int rd, int rn, int rm, int arrangement);
+
+uint32_t
+arm64_faddp_scalar(int rd, int rn, int arrangement);
+
+uint32_t
+arm64_add_v(int rd, int rn, int rm, int arrangement);
+
+uint32_t
+arm64_sub_v(int rd, int rn, int rm, int arrangement);
+
+uint32_t
+arm64_mul_v(int rd, int rn, int rm, int arrangement);
+
+uint32_t
+arm64_cmeq_v(int rd, int rn, int rm, int arrangement);
+
+uint32_t
+arm64_cmgt_v(int rd, int rn, int rm, int arrangement);
+
+uint32_t
+arm64_cmge_v(int rd, int rn, int rm, int arrangement);
+
+uint32_t
+arm64_cmhi_v(int rd, int rn, int rm, int arrangement);
+
+uint32_t
+arm64_cmhs_v(int rd, int rn, int rm, int arrangement);
+
+uint32_t
+arm64_addv(int rd, int rn, int arrangement);
+
+uint32_t
+arm64_addp_scalar(int rd, int rn);
+
+uint32_t
+arm64_dup_v(int rd, int rn, int arrangement);
+
+uint32_t
+arm64_dup_lane(int rd, int rn, int index, int arrangement);
+
+uint32_t
+arm64_mov_v(int rd, int rn);
+
+uint32_t
+arm64_movi_zero(int rd);
+
+// vd.4s += vn.4s * vm.s[index]
+uint32_t
+arm64_fmla_lane(int rd, int rn, int rm, int index);
+
+uint32_t
+arm64_and_v(int rd, int rn, int rm);
+
+uint32_t
+arm64_orr_v(int rd, int rn, int rm);
+
+uint32_t
+arm64_not_v(int rd, int rn);
+
+uint32_t
+arm64_smax_v(int rd, int rn, int rm, int arrangement);
+
+uint32_t
+arm64_smin_v(int rd, int rn, int rm, int arrangement);
+
+uint32_t
+arm64_fcmeq_v(int rd, int rn, int rm, int arrangement);
+
+uint32_t
+arm64_fcmgt_v(int rd, int rn, int rm, int arrangement);
+
+uint32_t
+arm64_fcmge_v(int rd, int rn, int rm, int arrangement);
+
+// across the 4S lanes into the lowest one
+uint32_t
+arm64_fmaxv(int rd, int rn);
+
+uint32_t
+arm64_fminv(int rd, int rn);
+
+uint32_t
+arm64_smaxv(int rd, int rn);
+
+uint32_t
+arm64_sminv(int rd, int rn);
+
+// dd = sum of the unsigned 4S lanes of vn
+uint32_t
+arm64_uaddlv(int rd, int rn);
+
+// vd.2d += pairwise sums of the signed 4S lanes of vn
+uint32_t
+arm64_sadalp(int rd, int rn);
+
+// vd.2d += vn.2s * vm.2s (the low halves), signed, SMLAL2 takes the high
+uint32_t
+arm64_smlal(int rd, int rn, int rm);
+
+uint32_t
+arm64_smlal2(int rd, int rn, int rm);
+
+// general purpose rd = lane index of vn, zero / sign extended
+uint32_t
+arm64_umov(int rd, int rn, int index, int arrangement);
+
+uint32_t
+arm64_smov(int rd, int rn, int index, int arrangement);
+
+void
+jit_vec_load(JITCompiler* jit, int rt, int count, int arrangement, int rn);
+void
+jit_vec_load_post(JITCompiler* jit, int rt, int count, int arrangement, int rn);
+void
+jit_vec_store(JITCompiler* jit, int rt, int count, int arrangement, int rn);
+void
+jit_vec_store_post(JITCompiler* jit, int rt, int count, int arrangement, int rn);
+// ldnp/stnp q registers rt1, rt2 at rn + imm * 16
+void
+jit_vec_load_pair_nt(JITCompiler* jit, int rt1, int rt2, int rn, int imm);
+void
+jit_vec_store_pair_nt(JITCompiler* jit, int rt1, int rt2, int rn, int imm);
+void
+jit_vec_float_add(JITCompiler* jit, int rd, int rn, int rm, int arrangement);
+void
+jit_vec_float_sub(JITCompiler* jit, int rd, int rn, int rm, int arrangement);
+void
+jit_vec_float_mul(JITCompiler* jit, int rd, int rn, int rm, int arrangement);
+void
+jit_vec_float_fma(JITCompiler* jit, int rd, int rn, int rm, int arrangement);
+void
+jit_vec_float_max(JITCompiler* jit, int rd, int rn, int rm, int arrangement);
+void
+jit_vec_float_min(JITCompiler* jit, int rd, int rn, int rm, int arrangement);
+void
+jit_vec_float_sum(JITCompiler* jit, int rd, int rn, int arrangement);
+void
+jit_vec_add(JITCompiler* jit, int rd, int rn, int rm, int arrangement);
+void
+jit_vec_sub(JITCompiler* jit, int rd, int rn, int rm, int arrangement);
+void
+jit_vec_mul(JITCompiler* jit, int rd, int rn, int rm, int arrangement);
+void
+jit_vec_compare(JITCompiler* jit,
+                int rd,
+                int rn,
+                int rm,
+                int arrangement,
+                int cond);
+void
+jit_vec_float_compare(JITCompiler* jit,
+                      int rd,
+                      int rn,
+                      int rm,
+                      int arrangement,
+                      int cond);
+void
+jit_vec_sum(JITCompiler* jit, int rd, int rn, int arrangement);
+void
+jit_vec_dup(JITCompiler* jit, int rd, int rn, int arrangement);
+void
+jit_vec_zero(JITCompiler* jit, int rd);
+
+bool
+jit_heap_alloc(JitCodeChunk* chunk, size_t size, size_t commit);
+
+bool
+jit_heap_commit(JitCodeChunk* chunk, size_t commit);
+
+bool
+jit_heap_commit_top(JitCodeChunk* chunk, size_t commit);
+
+void
+jit_heap_free(JitCodeChunk* chunk);
+
+void
+jit_heap_set_huge_pages(bool enabled);
+
+void
+jit_heap_trim();
+
+JitHeapStats
+jit_heap_stats();
+
+JITCompiler*
+jit_init();
+
+JITCompiler*
+jit_init_reserved(size_t code_reserve, size_t data_reserve);
+
+void
+jit_dump_code(JITCompiler* jit);
+
+size_t
+jit_alloc_data(JITCompiler* jit, size_t size, size_t alignment);
+
+size_t
+jit_add_string(JITCompiler* jit, const char* str);
+
+// (size_t)-1 when the data section or the pool can't grow
+size_t
+jit_add_constant(JITCompiler* jit, const void* value, size_t size);
+
+// false for a (size_t)-1 offset from jit_add_constant, nothing is emitted
+bool
+jit_load_constant(JITCompiler* jit, int reg, size_t offset, size_t size);
+
+void
+jit_load_string_addr(JITCompiler* jit, int reg, size_t offset);
+
+const char*
+jit_get_string(JITCompiler* jit, size_t offset);
+
+// false when an emit failed since the last reset, the code is incomplete
+// then and stays unfinalized
+bool
+jit_finalize(JITCompiler* jit);
+
+void
+jit_cleanup(JITCompiler* jit);
+
+void
+jit_reset(JITCompiler* jit);
+
+void
+jit_emit(JITCompiler* jit, uint32_t instruction);
+
+// (size_t)-1 when the label table can't grow
+size_t
+jit_create_label(JITCompiler* jit);
+
+void
+jit_bind_label(JITCompiler* jit, size_t label);
+
+int32_t
+jit_branch_offset(JITCompiler* jit, size_t label);
+
+uint64_t
+jit_code_address(JITCompiler* jit, size_t offset);
+
+// false when the fixup table can't grow, the site is then left unpatched
+bool
+jit_add_fixup(JITCompiler* jit, JitFixupKind kind, uint64_t target);
+
+bool
+jit_apply_fixup(JITCompiler* jit, const JitFixup* fixup);
+
+// false when the code reservation is full, nothing moves then
+bool
+jit_insert_instruction(JITCompiler* jit, size_t offset, uint32_t instruction);
+
+void
+jit_load_int(JITCompiler* jit, int reg, int32_t value);
+
+void
+jit_load_imm64(JITCompiler* jit, int reg, uint64_t value);
+
+void
+jit_load_addr(JITCompiler* jit, int reg, const void* ptr);
+
+void
+jit_compare(JITCompiler* jit, int reg1, int reg2);
+
+void
+jit_jump(JITCompiler* jit, size_t label);
+
+void
+jit_jump_if_equal(JITCompiler* jit, size_t label);
+
+void
+jit_jump_if_not_equal(JITCompiler* jit, size_t label);
+
+void
+jit_jump_if_less(JITCompiler* jit, size_t label);
+
+void
+jit_jump_if_greater(JITCompiler* jit, size_t label);
+
+// branches on any Cond, relaxed like the fixed-condition variants above
+void
+jit_jump_if(JITCompiler* jit, size_t label, int cond);
+
+void
+jit_jump_if_less_equal(JITCompiler* jit, size_t label);
+
+void
+jit_jump_if_greater_equal(JITCompiler* jit, size_t label);
+
+// unsigned comparisons
+void
+jit_jump_if_below(JITCompiler* jit, size_t label);
+
+void
+jit_jump_if_below_equal(JITCompiler* jit, size_t label);
+
+void
+jit_jump_if_above(JITCompiler* jit, size_t label);
+
+void
+jit_jump_if_above_equal(JITCompiler* jit, size_t label);
+
+// branchless selects on the flags of the last compare
+void
+jit_select(JITCompiler* jit, int rd, int rn, int rm, int cond);
+
+void
+jit_select_increment(JITCompiler* jit, int rd, int rn, int rm, int cond);
+
+void
+jit_select_negate(JITCompiler* jit, int rd, int rn, int rm, int cond);
+
+void
+jit_set_if(JITCompiler* jit, int rd, int cond);
+
+void
+jit_set_mask_if(JITCompiler* jit, int rd, int cond);
+
+// chains a second compare when cond holds, otherwise sets the flags to nzcv
+void
+jit_compare_if(JITCompiler* jit, int rn, int rm, int nzcv, int cond);
+
+// rd = min/max(rn, rm), signed
+void
+jit_min(JITCompiler* jit, int rd, int rn, int rm);
+
+void
+jit_max(JITCompiler* jit, int rd, int rn, int rm);
+
+// rd = min(max(rn, lo), hi), signed; rd must not alias hi
+void
+jit_clamp(JITCompiler* jit, int rd, int rn, int lo, int hi);
+
+// counted loop: the body is emitted between jit_loop_begin and jit_loop_end
+// and runs counter times. each iteration starts with one PRFM per pointer
+// prefetch bytes ahead, so a body should consume about a cache line
+typedef struct
+{
+  int counter;        // iterations left, counted down to zero
+  int load;           // register the body loads through, -1 for none
+  int store;          // register the body stores through, -1 for none
+  int prefetch;       // bytes ahead of load/store to prefetch, 0 for none
+  int prefetch_level; // 1-3, 0 is the same as 1
+  bool prefetch_keep; // KEEP instead of STRM
+  size_t top;
+  size_t done;
+} JitLoop;
+
+bool
+jit_loop_begin(JITCompiler* jit, JitLoop* loop);
+
+void
+jit_loop_end(JITCompiler* jit, JitLoop* loop);
+
+void
+jit_call(JITCompiler* jit, void* func_ptr);
+
+// (size_t)-1 when the function table can't grow
+size_t
+jit_declare_function(JITCompiler* jit);
+
+void
+jit_bind_function(JITCompiler* jit, size_t func);
+
+size_t
+jit_begin_function(JITCompiler* jit);
+
+void
+jit_end_function(JITCompiler* jit);
+
+// address of func in the RX view. it can be taken while emitting, but the
+// function is only callable after jit_finalize, which syncs the icache (and
+// on Apple turns write protection back on for the thread)
+void*
+jit_function_entry(JITCompiler* jit, size_t func);
+
+void
+jit_call_function(JITCompiler* jit, size_t func);
+
+typedef int (*JitFunctionInt)();
+typedef float (*JitFunctionFloat)();
+typedef double (*JitFunctionDouble)();
+typedef int64_t (*JitFunctionInt64)();
+typedef void (*JitFunctionVoid)();
+
+typedef union
+{
+  int i;
+  float f;
+  double d;
+  int64_t l;
+  void* p;
+} JitValue;
+
+// return and argument types, VOID only as a return type
+typedef enum
+{
+  JIT_TYPE_INT,
+  JIT_TYPE_FLOAT,
+  JIT_TYPE_DOUBLE,
+  JIT_TYPE_INT64,
+  JIT_TYPE_POINTER,
+  JIT_TYPE_VOID
+} JitReturnType;
+
+// the code has to be finalized first. these only read the compiler, so
+// threads can run them while no one emits
+JitValue
+jit_execute_typed(JITCompiler* jit, JitReturnType return_type);
+
+JitValue
+jit_execute_function(JITCompiler* jit, size_t func, JitReturnType return_type);
+
+int
+jit_execute_int(JITCompiler* jit);
+
+float
+jit_execute_float(JITCompiler* jit);
+
+double
+jit_execute_double(JITCompiler* jit);
+
+#define JIT_MAX_ARGS 8
+
+// AAPCS64: integer and pointer arguments go in x0-x7, float and double in
+// v0-v7, each class counted separately
+typedef struct
+{
+  JitReturnType ret;
+  JitReturnType args[JIT_MAX_ARGS];
+  int num_args;
+} JitSignature;
+
+// calls entry once per tuple of num_args values, writing one result each
+typedef void (*JitInvoker)(const JitValue* args, JitValue* results, size_t count);
+
+typedef struct
+{
+  void* entry; // cast to the matching C function type for direct calls
+  JitInvoker invoke;
+  JitSignature signature;
+} JitHandle;
+
+// emits an invoker for func with the given signature and finalizes the
+// compiler. the handle stays valid until jit_reset or jit_cleanup, or after
+// jit_seal until the sealed module is freed
+bool
+jit_function_handle(JITCompiler* jit,
+                    size_t func,
+                    const JitSignature* signature,
+                    JitHandle* handle);
+
+JitValue
+jit_invoke(const JitHandle* handle, const JitValue* args);
+
+// args holds count * num_args values, results count values or NULL for void
+void
+jit_invoke_batch(const JitHandle* handle,
+                 const JitValue* args,
+                 JitValue* results,
+                 size_t count);
+
+// the code and data of a finalized compiler, detached from it. nothing but
+// ext_lib_reload retargeting its library calls writes to a sealed module
+// again, so any thread may call into it until it is freed, while the
+// compiler goes on with fresh memory. the module takes over the call sites
+// the compiler registered.
+typedef struct
+{
+  JitCodeChunk code_chunk;
+  uint8_t* data;
+  size_t data_reserve;
+  void** entries; // entry of each function, NULL if it was never emitted
+  size_t num_functions;
+} JitSealed;
+
+// finalizes the compiler and moves its code and data into a sealed module.
+// the compiler is left empty, function indices start over
+JitSealed*
+jit_seal(JITCompiler* jit);
+
+void*
+jit_sealed_entry(const JitSealed* sealed, size_t func);
+
+// frees right away, only when no thread can still be executing the code
+void
+jit_sealed_free(JitSealed* sealed);
+
+// atomically publishes sealed in slot and returns the module it replaced
+JitSealed*
+jit_sealed_exchange(JitSealed** slot, JitSealed* sealed);
+
+JitSealed*
+jit_sealed_load(JitSealed* const* slot);
+
+// epoch based reclamation of sealed modules. readers bracket every use of a
+// module with jit_epoch_enter/exit, which never block. a retired module is
+// freed by jit_epoch_reclaim once every reader that was inside when it was
+// retired has left: the global epoch only advances when all active readers
+// have seen it, and a module retired at epoch e is freed at e + 2.
+typedef struct JitEpochThread
+{
+  uint64_t state; // epoch << 1 | inside
+  struct JitEpochThread* next;
+} JitEpochThread;
+
+typedef struct JitRetired
+{
+  JitSealed* sealed;
+  uint64_t epoch;
+  struct JitRetired* next;
+} JitRetired;
+
+typedef struct
+{
+  uint64_t epoch;
+  pthread_mutex_t lock; // threads and retired, readers never take it
+  JitEpochThread* threads;
+  JitRetired* retired;
+  size_t num_retired;
+  size_t num_reclaimed;
+} JitEpoch;
+
+JitEpoch*
+jit_epoch_init();
+
+// frees every retired module, no thread may be inside
+void
+jit_epoch_cleanup(JitEpoch* epoch);
+
+// one record per reader thread
+JitEpochThread*
+jit_epoch_register(JitEpoch* epoch);
+
+void
+jit_epoch_unregister(JitEpoch* epoch, JitEpochThread* thread);
+
+void
+jit_epoch_enter(JitEpoch* epoch, JitEpochThread* thread);
+
+void
+jit_epoch_exit(JitEpochThread* thread);
+
+void
+jit_epoch_retire(JitEpoch* epoch, JitSealed* sealed);
+
+// tries to advance the epoch and frees what is safe, returns how many
+size_t
+jit_epoch_reclaim(JitEpoch* epoch);
+
+// background compilation. worker threads each own a JITCompiler, run build
+// callbacks off the caller's thread, seal the result and publish the entry
+// into a caller owned slot with a release store. until then the slot reads
+// NULL and the caller takes its interpreter or C path. a slot can be
+// submitted again, its old module is then retired through the service's
+// epoch, so callers that may still run the old entry bracket their calls
+// with jit_epoch_enter/exit on service->epoch.
+
+// emits one function into jit and returns its index, or (size_t)-1
+typedef size_t (*JitBuildFn)(JITCompiler* jit, void* arg);
+
+typedef struct
+{
+  uint64_t queued_ns;  // submit to the start of the build
+  uint64_t compile_ns; // build, seal and publish
+  size_t code_size;    // instructions of the built function
+  bool ok;
+  bool done; // set last, with a release store
+} JitCompileMetrics;
+
+typedef struct
+{
+  JitBuildFn build;
+  void* arg;
+  void** slot;
+  JitCompileMetrics* metrics; // NULL when not wanted
+  uint64_t submitted_ns;
+} JitCompileJob;
+
+typedef struct
+{
+  size_t submitted;
+  size_t completed;
+  size_t failed;
+  size_t rejected; // jit_compile_try_submit on a full queue
+  size_t max_queued;
+  uint64_t total_queued_ns;
+  uint64_t total_compile_ns;
+  uint64_t max_compile_ns;
+} JitCompileStats;
+
+// the module a slot's entry points into
+typedef struct
+{
+  void** slot;
+  JitSealed* sealed;
+} JitCompileModule;
+
+typedef struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  pthread_cond_t idle;
+
+  // ring buffer of pending jobs, bounded for backpressure
+  JitCompileJob* jobs;
+  size_t capacity;
+  size_t head;
+  size_t count;
+  size_t active; // jobs being built
+  bool stopping;
+
+  pthread_t* threads;
+  int num_threads;
+
+  // one module per published slot, freed with the service
+  JitCompileModule* modules;
+  size_t num_modules;
+  size_t module_capacity;
+  JitEpoch* epoch; // reclaims the modules replaced by a recompile
+
+  JitCompileStats stats;
+} JitCompileService;
+
+JitCompileService*
+jit_compile_init(int num_threads, size_t queue_capacity);
+
+// finishes the queued jobs, stops the workers and frees all published code.
+// no thread may be inside service->epoch anymore
+void
+jit_compile_cleanup(JitCompileService* service);
+
+// blocks while the queue is full
+bool
+jit_compile_submit(JitCompileService* service,
+                   JitBuildFn build,
+                   void* arg,
+                   void** slot,
+                   JitCompileMetrics* metrics);
+
+// returns false instead of blocking when the queue is full
+bool
+jit_compile_try_submit(JitCompileService* service,
+                       JitBuildFn build,
+                       void* arg,
+                       void** slot,
+                       JitCompileMetrics* metrics);
+
+// waits until the queue is empty and no job is being built
+void
+jit_compile_wait(JitCompileService* service);
+
+// the published entry of a slot, NULL while it is still compiling
+void*
+jit_compile_entry(void* const* slot);
+
+JitCompileStats
+jit_compile_stats(JitCompileService* service);
+
+// ext_lib_init_flags options
+#define EXT_LIB_BIND_NOW 1 // resolve every symbol at open time (RTLD_NOW)
+
+// a call that can be retargeted while other threads execute it. the site
+// is a single BL, direct when the target is in range and through the
+// private stub of the site otherwise.
+typedef struct
+{
+  uint32_t* code; // the BL, RW view
+  uint64_t pc;    // the BL, RX view
+  uint64_t stub;  // RX address of the stub
+  uint64_t* slot; // the target of the stub, RW view
+  int function;   // index into the library's functions
+  const void* owner; // the compiler or sealed module holding the code
+  size_t call; // index into the library calls of the compiler
+} JitCallSite;
+
+// an entry of the symbol cache, name is NULL for a free slot
+typedef struct
+{
+  char* name;
+  uint64_t hash;
+  int index; // into functions
+} ExtLibSymbol;
+
+typedef struct ExternalLibrary
+{
+  void* handle;     // from dlopen
+  void** functions; // array of function pointers
+  int func_count;
+  int func_capacity;
+
+  // open addressing name -> function index cache, so loading the same
+  // symbol twice doesn't go through dlsym again
+  ExtLibSymbol* symbols;
+  size_t symbol_capacity;
+
+  // call sites bound to functions of this library, rewritten on reload.
+  // a site is dropped when its owner is reset or freed, so the library
+  // never writes to code that went away.
+  JitCallSite* sites;
+  size_t num_sites;
+  size_t site_capacity;
+
+  char* path;
+  int flags;
+  uint64_t resolve_ns; // time spent in dlopen and dlsym
+  struct ExternalLibrary* next; // in the list of open libraries
+} ExternalLibrary;
+
+ExternalLibrary*
+ext_lib_init(const char* library_path);
+
+ExternalLibrary*
+ext_lib_init_flags(const char* library_path, int flags);
+
+int
+ext_lib_load_function(ExternalLibrary* lib, const char* func_name);
+
+int
+ext_lib_load_functions(ExternalLibrary* lib,
+                       const char** func_names,
+                       int count,
+                       int* indices);
+
+// reopens the library, resolves every loaded symbol again (indices stay the
+// same) and retargets every registered call site. a site whose symbol is
+// gone aborts when called. returns the number of symbols that failed or -1
+// if the library didn't open.
+//
+// the caller has to stop every thread that may run JIT code calling into
+// lib before the reload and resume them after it returns. the old image is
+// unmapped right away and nothing waits for calls in flight: a thread
+// between the load and the branch of a stub, one whose core still sees the
+// old BL, or one inside the library itself would run unmapped memory. the
+// sites are parked in their stubs while the library is closed, which only
+// holds back calls that start after that.
+int
+ext_lib_reload(ExternalLibrary* lib);
+
+void
+ext_lib_dump(ExternalLibrary* lib);
+
+void
+ext_lib_cleanup(ExternalLibrary* lib);
+
+// like jit_call_external, but the call is registered with lib and follows
+// the function through ext_lib_reload
+bool
+jit_call_library(JITCompiler* jit, ExternalLibrary* lib, int index);
+
+// atomically retargets a call site, one 4 byte BL write and an 8 byte
+// stub slot write, safe while other threads run through it. a NULL target
+// holds every caller in the stub of the site until it is patched again.
+void
+jit_patch_call(const JitCallSite* site, void* target);
+
+// on-disk code cache. a file holds the code, the data section, labels,
+// functions and every fixup, so loading it only copies the code into the
+// code heap and re-applies the fixups at the new addresses. absolute
+// targets of fixups are stored relative to the data section or the code,
+// or as a symbol of one of the libraries passed to save and load (same
+// order both times). calls made with jit_call_library stay patchable: the
+// loaded module registers them again, so the library has to be among the
+// ones passed to save and load. pointers baked into the code without a
+// fixup, like jit_load_imm64 of a host address, can't be relocated.
+#define JIT_CACHE_MAGIC 0x31454843414a4954ull // "TIJACHE1"
+#define JIT_CACHE_VERSION 2
+
+typedef enum
+{
+  JIT_RELOC_NONE,   // target is used as is (labels, data offsets)
+  JIT_RELOC_DATA,   // target is an offset into the data section
+  JIT_RELOC_CODE,   // target is a byte offset into the code
+  JIT_RELOC_SYMBOL, // target is an index into the symbols
+  JIT_RELOC_LIBRARY // same, and the BL is a jit_call_library site
+} JitRelocKind;
+
+typedef struct
+{
+  uint64_t offset;
+  uint64_t target;
+  uint32_t kind;  // JitFixupKind
+  uint32_t reloc; // JitRelocKind
+} JitCacheFixup;
+
+typedef struct
+{
+  uint32_t lib;         // index into the libraries
+  uint32_t name;        // offset into the string table
+  uint32_t page_offset; // low 12 bits of the address, ADRP + ADD keep them
+  uint32_t reserved;
+} JitCacheSymbol;
+
+// followed by code, data, label offsets, functions (label, size), fixups,
+// symbols and strings, each padded to 8 bytes
+typedef struct
+{
+  uint64_t magic;
+  uint32_t version;
+  uint32_t header_size;
+  uint64_t key;       // chosen by the caller, usually a hash of the source
+  uint64_t checksum;  // jit_cache_hash of everything after the header
+  uint64_t code_size; // instructions
+  uint64_t data_size;
+  uint64_t num_labels;
+  uint64_t num_functions;
+  uint64_t num_fixups;
+  uint64_t num_symbols;
+  uint64_t strings_size;
+} JitCacheHeader;
+
+// 64-bit hash for cache keys and the checksum, 8 bytes per step
+uint64_t
+jit_cache_hash(const void* data, size_t size, uint64_t seed);
+
+// writes every function of the compiler to path, atomically replacing it
+bool
+jit_cache_save(JITCompiler* jit,
+               const char* path,
+               uint64_t key,
+               ExternalLibrary** libs,
+               int num_libs);
+
+// replaces the code and data of the compiler with the module in path and
+// finalizes it. false when the file is missing, was written for another
+// key or doesn't fit, the caller then compiles as usual.
+bool
+jit_cache_load(JITCompiler* jit,
+               const char* path,
+               uint64_t key,
+               ExternalLibrary** libs,
+               int num_libs);
+
+void
+jit_begin_frame(JITCompiler* jit);
+
+void
+jit_end_frame(JITCompiler* jit);
+
+void
+jit_call_external(JITCompiler* jit, void* func_ptr);
+
+// what jit_peephole did, before and after are instruction counts
+typedef struct
+{
+  size_t before, after;
+  size_t moves;    // redundant moves removed or canonicalized
+  size_t folds;    // constants folded into immediates
+  size_t branches; // compare and branch pairs fused into CBZ/TBZ
+  size_t dead;     // instructions whose results were never read
+} JitPeepholeStats;
+
+// rewrites the emitted code in place. labels, fixups and function sizes are
+// kept in sync, function entries stay aligned.
+JitPeepholeStats
+jit_peephole(JITCompiler* jit);
+
+// IR with virtual registers. values are numbered as they are created, a
+// value can be written again with jit_ir_mov (loop counters). jit_ir_compile
+// computes live intervals, assigns registers by linear scan and emits a
+// complete AAPCS64 function at the current position of the compiler.
+typedef enum
+{
+  JIT_IR_INT,  // 64-bit integer or pointer, in x registers
+  JIT_IR_FLOAT // single precision, in s registers
+} JitIrType;
+
+typedef enum
+{
+  JIT_IR_ARG,   // dst = argument imm
+  JIT_IR_CONST, // dst = imm (float bits for float values)
+  JIT_IR_MOV,
+  JIT_IR_ADD,
+  JIT_IR_SUB,
+  JIT_IR_MUL,
+  JIT_IR_SHL, // dst = a << imm
+  JIT_IR_FADD,
+  JIT_IR_FSUB,
+  JIT_IR_FMUL,
+  JIT_IR_FDIV,
+  JIT_IR_INT_TO_FLOAT,
+  JIT_IR_FLOAT_TO_INT,
+  JIT_IR_LOAD,       // dst = [a + imm]
+  JIT_IR_LOAD_FLOAT, // dst = [a + imm]
+  JIT_IR_CALL,       // dst = func(args)
+  JIT_IR_LABEL,      // imm is a label of the compiler
+  JIT_IR_JUMP,
+  JIT_IR_BRANCH, // compare a and b, jump to label imm if cond holds
+  JIT_IR_RET     // returns a, or nothing when a is -1
+} JitIrOp;
+
+typedef struct
+{
+  JitIrOp op;
+  int dst;     // value written, -1 if none
+  int a, b;    // values read, -1 if unused
+  int64_t imm; // constant, offset, argument index or label
+  int cond;    // JIT_IR_BRANCH
+  void* func;  // JIT_IR_CALL
+  size_t first_arg;
+  int num_args;
+} JitIrInst;
+
+typedef struct
+{
+  JitIrType type;
+  size_t start, end; // live interval, see jit_ir_def and jit_ir_use
+  bool crosses_call;
+  int reg;  // physical register, -1 when spilled
+  int slot; // stack slot when spilled, -1 otherwise
+} JitIrValue;
+
+typedef struct
+{
+  JITCompiler* jit;
+
+  JitIrInst* insts;
+  size_t num_insts;
+  size_t inst_capacity;
+
+  JitIrValue* values;
+  size_t num_values;
+  size_t value_capacity;
+
+  int* call_args;
+  size_t num_call_args;
+  size_t call_arg_capacity;
+
+  bool failed; // a table couldn't grow, jit_ir_compile refuses the IR
+
+  // filled in by jit_ir_compile
+  size_t num_spills;
+  size_t frame_size;
+  uint32_t saved_int;   // callee saved x registers used, bit per register
+  uint32_t saved_float; // callee saved v registers used
+} JitIr;
+
+JitIr*
+jit_ir_init(JITCompiler* jit);
+
+void
+jit_ir_cleanup(JitIr* ir);
+
+int
+jit_ir_arg(JitIr* ir, JitIrType type, int index);
+
+int
+jit_ir_const_int(JitIr* ir, int64_t value);
+
+int
+jit_ir_const_float(JitIr* ir, float value);
+
+void
+jit_ir_mov(JitIr* ir, int dst, int src);
+
+int
+jit_ir_add(JitIr* ir, int a, int b);
+
+int
+jit_ir_sub(JitIr* ir, int a, int b);
+
+int
+jit_ir_mul(JitIr* ir, int a, int b);
+
+int
+jit_ir_shl(JitIr* ir, int a, int shift);
+
+int
+jit_ir_float_add(JitIr* ir, int a, int b);
+
+int
+jit_ir_float_sub(JitIr* ir, int a, int b);
+
+int
+jit_ir_float_mul(JitIr* ir, int a, int b);
+
+int
+jit_ir_float_div(JitIr* ir, int a, int b);
+
+int
+jit_ir_int_to_float(JitIr* ir, int a);
+
+int
+jit_ir_float_to_int(JitIr* ir, int a);
+
+int
+jit_ir_load(JitIr* ir, int base, int32_t offset);
+
+int
+jit_ir_load_float(JitIr* ir, int base, int32_t offset);
+
+int
+jit_ir_call(JitIr* ir,
+            void* func,
+            JitIrType return_type,
+            const int* args,
+            int num_args);
+
+size_t
+jit_ir_create_label(JitIr* ir);
+
+void
+jit_ir_bind_label(JitIr* ir, size_t label);
+
+void
+jit_ir_jump(JitIr* ir, size_t label);
+
+void
+jit_ir_branch(JitIr* ir, int cond, int a, int b, size_t label);
+
+void
+jit_ir_ret(JitIr* ir, int value);
+
+bool
+jit_ir_compile(JitIr* ir);
+
+void
+jit_ir_dump(JitIr* ir);
+
+// expression graph in front of the IR. nodes are hashed on creation, so the
+// same operation on the same operands is built once (value numbering),
+// constant operands are folded right away and multiplies by a power of two
+// become shifts. jit_expr_lower emits a node and what it depends on through
+// the IR, every node at most once: lower in code that dominates all later
+// uses, or call jit_expr_forget when starting a new block.
+typedef enum
+{
+  JIT_EXPR_CONST, // imm, float bits for float nodes
+  JIT_EXPR_VALUE, // imm is a value of the IR (argument, load, loop counter)
+  JIT_EXPR_ADD,
+  JIT_EXPR_SUB,
+  JIT_EXPR_MUL,
+  JIT_EXPR_SHL, // a << imm
+  JIT_EXPR_FADD,
+  JIT_EXPR_FSUB,
+  JIT_EXPR_FMUL,
+  JIT_EXPR_FDIV,
+  JIT_EXPR_INT_TO_FLOAT,
+  JIT_EXPR_FLOAT_TO_INT
+} JitExprOp;
+
+typedef struct
+{
+  JitExprOp op;
+  JitIrType type;
+  int a, b; // operand nodes, -1 if unused
+  int64_t imm;
+  int value; // IR value once lowered, -1 before
+} JitExprNode;
+
+typedef struct
+{
+  JitIr* ir;
+
+  JitExprNode* nodes;
+  size_t num_nodes;
+  size_t node_capacity;
+
+  int* table; // open addressing over nodes, -1 for empty buckets
+  size_t table_capacity;
+
+  size_t folded;  // nodes replaced by a constant or an operand
+  size_t reused;  // nodes found in the table instead of built again
+  size_t reduced; // multiplies turned into shifts
+} JitExpr;
+
+JitExpr*
+jit_expr_init(JitIr* ir);
+
+void
+jit_expr_cleanup(JitExpr* expr);
+
+int
+jit_expr_const_int(JitExpr* expr, int64_t value);
+
+int
+jit_expr_const_float(JitExpr* expr, float value);
+
+int
+jit_expr_value(JitExpr* expr, int value);
+
+int
+jit_expr_add(JitExpr* expr, int a, int b);
+
+int
+jit_expr_sub(JitExpr* expr, int a, int b);
+
+int
+jit_expr_mul(JitExpr* expr, int a, int b);
+
+int
+jit_expr_shl(JitExpr* expr, int a, int shift);
+
+int
+jit_expr_float_add(JitExpr* expr, int a, int b);
+
+int
+jit_expr_float_sub(JitExpr* expr, int a, int b);
+
+int
+jit_expr_float_mul(JitExpr* expr, int a, int b);
+
+int
+jit_expr_float_div(JitExpr* expr, int a, int b);
+
+int
+jit_expr_int_to_float(JitExpr* expr, int a);
+
+int
+jit_expr_float_to_int(JitExpr* expr, int a);
+
+int
+jit_expr_lower(JitExpr* expr, int node);
+
+void
+jit_expr_forget(JitExpr* expr);
+
+// GEMM microkernels specialized for one shape. C = A * B with A m x k, B
+// k x n and C m x n, all row major single precision with row strides lda,
+// ldb and ldc in elements. C is tiled in 4 x 16 blocks held in v16-v31 and
+// updated with FMLA by element, everything is unrolled for small shapes.
+// larger ones loop over K and the row blocks and first pack B into
+// zero-padded panels in the data section, so a packing kernel must not
+// run on two threads at once.
+typedef void (*JitGemmKernel)(const float* a, const float* b, float* c);
+
+typedef struct
+{
+  int m, n, k;
+  int lda, ldb, ldc;
+} JitGemmShape;
+
+typedef struct
+{
+  JitGemmShape shape;
+  JitGemmKernel kernel; // NULL for empty buckets
+  size_t func;          // function of the cache's compiler
+  bool packed;
+} JitGemmEntry;
+
+// kernels by shape, all in one compiler
+typedef struct
+{
+  JITCompiler* jit;
+  JitGemmEntry* entries; // open addressing, power of two
+  size_t num_entries;
+  size_t capacity;
+  size_t hits, misses;
+} JitGemmCache;
+
+size_t
+jit_gemm_emit(JITCompiler* jit, const JitGemmShape* shape);
+
+JitGemmCache*
+jit_gemm_init();
+
+JitGemmKernel
+jit_gemm_kernel(JitGemmCache* cache,
+                int m,
+                int n,
+                int k,
+                int lda,
+                int ldb,
+                int ldc);
+
+void
+jit_gemm_cleanup(JitGemmCache* cache);
+
+// Reductions over arrays of 32-bit floats or ints compiled into a loop of
+// several independent NEON accumulators, a vector of four elements each,
+// with a scalar tail. Float sums and dot products are added up in a
+// different order than a sequential loop, min/max propagate NaN. Int sums
+// and dot products are exact in 64 bits.
+typedef enum
+{
+  JIT_REDUCE_SUM,
+  JIT_REDUCE_MIN, // INT32_MAX / +inf for no elements
+  JIT_REDUCE_MAX, // INT32_MIN / -inf for no elements
+  JIT_REDUCE_DOT,
+  JIT_REDUCE_COUNT_IF, // elements e with e <cond> threshold
+} JitReduceOp;
+
+typedef struct
+{
+  JitReduceOp op;
+  bool is_float;         // float elements, int32_t otherwise
+  int cond;              // COUNT_IF, EQ NE GT GE LT LE, HI CS CC LS for ints
+  float threshold;       // COUNT_IF over floats
+  int32_t threshold_int; // COUNT_IF over ints
+  int accumulators;      // 1, 2, 4 or 8 vectors, 0 picks 4
+  size_t prefetch;       // bytes ahead of the loads to prefetch, 0 for none
+} JitReduction;
+
+// signatures of the compiled functions, by op and element type
+typedef float (*JitReduceFloat)(const float* data, size_t len);
+typedef int64_t (*JitReduceInt)(const int32_t* data, size_t len);
+typedef float (*JitDotFloat)(const float* a, const float* b, size_t len);
+typedef int64_t (*JitDotInt)(const int32_t* a, const int32_t* b, size_t len);
+typedef size_t (*JitCountIf)(const void* data, size_t len);
+
+size_t
+jit_compile_reduction(JITCompiler* jit, const JitReduction* reduction);
+
+// Predicates over columns of int32 or float values, compiled into a
+// branchless filter. Four rows are compared at a time into NEON masks,
+// AND/OR/NOT combine the masks, and the rows that pass are written out
+// with stores whose post-increment is the mask, so no row takes a branch.
+// Nodes are built bottom up, -1 from a builder is an error and makes
+// every node built on it -1 too.
+typedef enum
+{
+  JIT_PRED_COLUMN, // imm is the index into the columns argument
+  JIT_PRED_CONST,  // bits of the int or float
+  JIT_PRED_ADD,
+  JIT_PRED_SUB,
+  JIT_PRED_MUL,
+  JIT_PRED_COMPARE, // imm is the condition
+  JIT_PRED_AND,
+  JIT_PRED_OR,
+  JIT_PRED_NOT,
+} JitPredOp;
+
+typedef enum
+{
+  JIT_PRED_INT,
+  JIT_PRED_FLOAT,
+  JIT_PRED_BOOL,
+} JitPredType;
+
+typedef struct
+{
+  JitPredOp op;
+  JitPredType type;
+  int a, b;
+  int imm;
+  uint32_t bits;
+} JitPredNode;
+
+typedef struct
+{
+  JitPredNode* nodes;
+  size_t num_nodes;
+  size_t node_capacity;
+} JitPredicate;
+
+typedef enum
+{
+  JIT_PRED_SELECTION, // uint32_t indices of the rows that pass, len entries
+  JIT_PRED_BITMAP,    // bit i % 64 of uint64_t word i / 64 set if row i passes
+} JitPredOutput;
+
+// returns how many rows pass
+typedef size_t (*JitFilter)(const void* const* columns, size_t len, void* out);
+
+JitPredicate*
+jit_pred_init();
+
+void
+jit_pred_cleanup(JitPredicate* pred);
+
+int
+jit_pred_column(JitPredicate* pred, int column, bool is_float);
+
+int
+jit_pred_int(JitPredicate* pred, int32_t value);
+
+int
+jit_pred_float(JitPredicate* pred, float value);
+
+int
+jit_pred_add(JitPredicate* pred, int a, int b);
+
+int
+jit_pred_sub(JitPredicate* pred, int a, int b);
+
+int
+jit_pred_mul(JitPredicate* pred, int a, int b);
+
+int
+jit_pred_compare(JitPredicate* pred, int cond, int a, int b);
+
+int
+jit_pred_and(JitPredicate* pred, int a, int b);
+
+int
+jit_pred_or(JitPredicate* pred, int a, int b);
+
+int
+jit_pred_not(JitPredicate* pred, int a);
+
+size_t
+jit_compile_predicate(JITCompiler* jit,
+                      JitPredicate* pred,
+                      int root,
+                      JitPredOutput output);
+
+// Decoders for fixed layout binary records. The generated loop walks count
+// records of record_size bytes and writes each field into its own output
+// column, four records per iteration. Ints are loaded zero or sign
+// extended and stored with out_width bytes, so a field can be widened or
+// truncated on the way. Floats are copied as they are.
+typedef struct
+{
+  uint32_t offset;   // bytes from the start of the record, any alignment
+  uint8_t width;     // 1, 2, 4 or 8, 4 or 8 for floats
+  bool is_signed;    // sign extend when widening
+  bool is_float;     // float or double
+  uint8_t out_width; // bytes per element of the column, 0 for width
+} JitField;
+
+typedef void (*JitDecoder)(const void* records,
+                           size_t count,
+                           void* const* columns);
+
+size_t
+jit_compile_decoder(JITCompiler* jit,
+                    size_t record_size,
+                    const JitField* fields,
+                    size_t num_fields);
+
+#if defined(TINY_JIT_IMPLEMENTATION)
+static bool
+jit_fits_signed(int64_t value, int bits)
+{
+  return value >= -((int64_t)1 << (bits - 1)) &&
+         value < ((int64_t)1 << (bits - 1));
+}
+
+uint32_t
+arm64_mov(int rd, int rs)
+{
+  return 0xAA0003E0 | (rs << 16) | rd;
+}
+
+uint32_t
+arm64_movz(int reg, uint16_t value)
+{
+  return 0xd2800000 | ((uint32_t)value << 5) | reg;
+}
+
+// shift is in bits (0, 16, 32 or 48)
+uint32_t
+arm64_movk(int reg, uint16_t value, int shift)
+{
+  return 0xf2800000 | ((uint32_t)value << 5) | ((shift / 16) << 21) | reg;
+}
+
+uint32_t
+arm64_movz_shift(int reg, uint16_t value, int shift)
+{
+  return 0xd2800000 | ((uint32_t)value << 5) | ((shift / 16) << 21) | reg;
+}
+
+// MOVN writes ~(value << shift)
+uint32_t
+arm64_movn(int reg, uint16_t value, int shift)
+{
+  return 0x92800000 | ((uint32_t)value << 5) | ((shift / 16) << 21) | reg;
+}
+
+// encodes a 64-bit bitmask immediate (a rotated run of ones, replicated in
+// 2, 4, 8, 16, 32 or 64 bit elements) as N:immr:imms.
+bool
+arm64_logical_imm(uint64_t value, uint32_t* encoded)
+{
+  if (value == 0 || value == ~(uint64_t)0)
+    return false;
+
+  // smallest element size the value is a replication of
+  int size = 64;
+  while (size > 2) {
+    int half = size / 2;
+    uint64_t mask = ((uint64_t)1 << half) - 1;
+    if ((value & mask) != ((value >> half) & mask))
+      break;
+    size = half;
+  }
+
+  uint64_t mask = size == 64 ? ~(uint64_t)0 : ((uint64_t)1 << size) - 1;
+  uint64_t element = value & mask;
+  int ones = __builtin_popcountll(element);
+  uint64_t run = ((uint64_t)1 << ones) - 1;
+
+  // find the rotation that turns the run of ones into the element
+  for (int rotation = 0; rotation < size; rotation++) {
+    uint64_t rotated =
+      rotation ? ((run >> rotation) | (run << (size - rotation))) & mask : run;
+    if (rotated != element)
+      continue;
+
+    uint32_t n = size == 64;
+    uint32_t imms = ((~(uint32_t)(size - 1) << 1) | (ones - 1)) & 0x3f;
+    *encoded = (n << 12) | ((uint32_t)rotation << 6) | imms;
+    return true;
+  }
+  return false;
+}
+
+uint32_t
+arm64_orr_imm(int rd, int rn, uint32_t encoded)
+{
+  return 0xb2000000 | (encoded << 10) | (rn << 5) | rd;
+}
+
+// shortest of MOVZ/MOVN + MOVK chains, a single ORR bitmask immediate and
+// ORR + MOVK. writes up to 4 instructions, returns how many.
+int
+arm64_imm64_sequence(int reg, uint64_t value, uint32_t* instructions)
+{
+  int zero_halves = 0, ones_halves = 0;
+  for (int i = 0; i < 4; i++) {
+    uint16_t half = (value >> (i * 16)) & 0xffff;
+    zero_halves += half == 0;
+    ones_halves += half == 0xffff;
+  }
+
+  uint32_t encoded;
+  int count = 0;
+  bool inverted = ones_halves > zero_halves;
+  int chain = 4 - (inverted ? ones_halves : zero_halves);
+
+  if (chain > 1 && arm64_logical_imm(value, &encoded)) {
+    instructions[count++] = arm64_orr_imm(reg, 31, encoded);
+    return count;
+  }
+
+  // a bitmask immediate with one halfword patched up by MOVK
+  if (chain > 2) {
+    for (int i = 0; i < 4; i++) {
+      uint64_t clear = ~((uint64_t)0xffff << (i * 16));
+      uint64_t neighbour = (value >> (((i + 1) % 4) * 16)) & 0xffff;
+      uint64_t candidates[3] = { 0, 0xffff, neighbour };
+      for (int j = 0; j < 3; j++) {
+        uint64_t pattern = (value & clear) | (candidates[j] << (i * 16));
+        if (!arm64_logical_imm(pattern, &encoded))
+          continue;
+        instructions[count++] = arm64_orr_imm(reg, 31, encoded);
+        instructions[count++] =
+          arm64_movk(reg, (value >> (i * 16)) & 0xffff, i * 16);
+        return count;
+      }
+    }
+  }
+
+  // MOVZ (or MOVN when most halfwords are 0xffff) then MOVK the rest
+  uint16_t skip = inverted ? 0xffff : 0;
+  for (int i = 0; i < 4; i++) {
+    uint16_t half = (value >> (i * 16)) & 0xffff;
+    if (half == skip)
+      continue;
+
+    if (count == 0) {
+      instructions[count++] = inverted
+                                ? arm64_movn(reg, ~half & 0xffff, i * 16)
+                                : arm64_movz_shift(reg, half, i * 16);
+    } else {
+      instructions[count++] = arm64_movk(reg, half, i * 16);
+    }
+  }
+
+  // 0 or ~0
+  if (count == 0)
+    instructions[count++] =
+      inverted ? arm64_movn(reg, 0, 0) : arm64_movz(reg, 0);
+  return count;
+}
+
+// offset is in bytes, +-1MB
+uint32_t
+arm64_adr(int rd, int32_t offset)
+{
+  uint32_t immlo = offset & 0x3;
+  uint32_t immhi = (offset >> 2) & 0x7ffff;
+  return 0x10000000 | (immlo << 29) | (immhi << 5) | rd;
+}
+
+uint32_t
+arm64_add(int rd, int rn, int rm)
+{
+  return 0x8b000000 | (rm << 16) | (rn << 5) | rd;
+}
+
+uint32_t
+arm64_sub(int rd, int rn, int rm)
+{
+  return 0xcb000000 | (rm << 16) | (rn << 5) | rd;
+}
+
+uint32_t
+arm64_mul(int rd, int rn, int rm)
+{
+  return 0x9b007c00 | (rm << 16) | (rn << 5) | rd;
+}
+
+// UBFM rd, rn, #(-shift % 64), #(63 - shift)
+uint32_t
+arm64_lsl_imm(int rd, int rn, int shift)
+{
+  return 0xd3400000 | (((64 - shift) & 63) << 16) | ((63 - shift) << 10) |
+         (rn << 5) | rd;
+}
+
+// UBFM rd, rn, #shift, #63
+uint32_t
+arm64_lsr_imm(int rd, int rn, int shift)
+{
+  return 0xd340fc00 | (shift << 16) | (rn << 5) | rd;
+}
+
+uint32_t
+arm64_lslv(int rd, int rn, int rm)
+{
+  return 0x9ac02000 | (rm << 16) | (rn << 5) | rd;
+}
+
+uint32_t
+arm64_orr_lsl(int rd, int rn, int rm, int shift)
+{
+  return 0xaa000000 | (rm << 16) | (shift << 10) | (rn << 5) | rd;
+}
+
+// SUBS xzr, rn, rm
+uint32_t
+arm64_cmp(int rn, int rm)
+{
+  return 0xeb00001f | (rm << 16) | (rn << 5);
+}
+
+uint32_t
+arm64_cmp_imm(int rn, uint16_t imm)
+{
+  return 0xf100001f | ((imm & 0xfff) << 10) | (rn << 5);
+}
+
+uint32_t
+arm64_csel(int rd, int rn, int rm, int cond)
+{
+  return 0x9a800000 | (rm << 16) | ((cond & 0xf) << 12) | (rn << 5) | rd;
+}
+
+uint32_t
+arm64_csinc(int rd, int rn, int rm, int cond)
+{
+  return 0x9a800400 | (rm << 16) | ((cond & 0xf) << 12) | (rn << 5) | rd;
+}
+
+uint32_t
+arm64_csinv(int rd, int rn, int rm, int cond)
+{
+  return 0xda800000 | (rm << 16) | ((cond & 0xf) << 12) | (rn << 5) | rd;
+}
+
+uint32_t
+arm64_csneg(int rd, int rn, int rm, int cond)
+{
+  return 0xda800400 | (rm << 16) | ((cond & 0xf) << 12) | (rn << 5) | rd;
+}
+
+// CSINC rd, xzr, xzr, !cond
+uint32_t
+arm64_cset(int rd, int cond)
+{
+  return arm64_csinc(rd, 31, 31, cond ^ 1);
+}
+
+// CSINV rd, xzr, xzr, !cond
+uint32_t
+arm64_csetm(int rd, int cond)
+{
+  return arm64_csinv(rd, 31, 31, cond ^ 1);
+}
+
+uint32_t
+arm64_ccmp(int rn, int rm, int nzcv, int cond)
+{
+  return 0xfa400000 | (rm << 16) | ((cond & 0xf) << 12) | (rn << 5) |
+         (nzcv & 0xf);
+}
+
+uint32_t
+arm64_ccmp_imm(int rn, int imm, int nzcv, int cond)
+{
+  return 0xfa400800 | ((imm & 31) << 16) | ((cond & 0xf) << 12) | (rn << 5) |
+         (nzcv & 0xf);
+}
+
+uint32_t
+arm64_b(int32_t offset)
+{
+  return 0x14000000 | (offset & 0x3ffffff);
+}
+
+uint32_t
+arm64_b_cond(int32_t offset, int cond)
+{
+  uint32_t imm19 = offset & 0x7ffff;
   return 0x54000000 | (imm19 << 5) | cond;
 }
 
+// FMOV (immediate) encodes +-n/16 * 2^r with 16 <= n <= 31, -3 <= r <= 4.
+// the same 256 values are representable in single and double precision.
+bool
+jit_fp_imm8(double value, uint8_t* imm8)
+{
+  for (int i = 0; i < 256; i++) {
+    int exp = ((i >> 4) & 0x7) ^ 0x4; // NOT(b):c:d, biased by 4
+    double decoded = (16 + (i & 0xf)) / 16.0;
+    for (int e = exp - 3; e > 0; e--)
+      decoded *= 2;
+    for (int e = exp - 3; e < 0; e++)
+      decoded /= 2;
+    if (i & 0x80)
+      decoded = -decoded;
+
+    if (decoded == value) {
+      *imm8 = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+// value must be representable, see jit_fp_imm8
+uint32_t
+arm64_fmov_s(int rd, float value)
+{
+  uint8_t imm8 = 0;
+  jit_fp_imm8(value, &imm8);
+  return 0x1E201000 | ((uint32_t)imm8 << 13) | rd;
+}
+
+uint32_t
+arm64_fmov_d(int rd, double value)
+{
+  uint8_t imm8 = 0;
+  jit_fp_imm8(value, &imm8);
+  return 0x1E601000 | ((uint32_t)imm8 << 13) | rd;
+}
+
+// FMOV Sd, WZR (+0.0 has no imm8 encoding)
+uint32_t
+arm64_fmov_s_zero(int rd)
+{
+  return 0x1E2703E0 | rd;
+}
+
+// LDR (literal) single precision, offset in instructions from the LDR
+uint32_t
+arm64_ldr_lit_s(int rt, int32_t offset)
+{
+  return 0x1C000000 | ((offset & 0x7ffff) << 5) | rt;
+}
+
+// LDR (literal) double precision
+uint32_t
+arm64_ldr_lit_d(int rt, int32_t offset)
+{
+  return 0x5C000000 | ((offset & 0x7ffff) << 5) | rt;
+}
+
+// LDR (literal) 64-bit general purpose register
+uint32_t
+arm64_ldr_lit(int rt, int32_t offset)
+{
+  return 0x58000000 | ((offset & 0x7ffff) << 5) | rt;
+}
+
+uint32_t
+arm64_br(int rn)
+{
+  return 0xD61F0000 | (rn << 5);
+}
+
+void
+jit_load_float(JITCompiler* jit, int reg, float value)
+{
+  union
+  {
+    float f;
+    uint32_t i;
+  } conv = { .f = value };
+
+  uint8_t imm8;
+  if (conv.i == 0) {
+    jit_emit(jit, arm64_fmov_s_zero(reg));
+  } else if (jit_fp_imm8(value, &imm8)) {
+    jit_emit(jit, arm64_fmov_s(reg, value));
+  } else {
+    size_t offset = jit_add_constant(jit, &conv.i, sizeof(conv.i));
+    jit_load_constant(jit, reg, offset, sizeof(conv.i));
+  }
+}
+
+void
+jit_load_double(JITCompiler* jit, int reg, double value)
+{
+  union
+  {
+    double d;
+    uint64_t i;
+  } conv = { .d = value };
+
+  uint8_t imm8;
+  if (conv.i == 0) {
+    jit_emit(jit, arm64_fmov_s_zero(reg)); // also clears the upper half
+  } else if (jit_fp_imm8(value, &imm8)) {
+    jit_emit(jit, arm64_fmov_d(reg, value));
+  } else {
+    size_t offset = jit_add_constant(jit, &conv.i, sizeof(conv.i));
+    jit_load_constant(jit, reg, offset, sizeof(conv.i));
+  }
+}
+
+uint32_t
+arm64_fadd_s(int rd, int rn, int rm)
+{
+  return 0x1E202800 | (rm << 16) | (rn << 5) | rd;
+}
+
+uint32_t
+arm64_fsub_s(int rd, int rn, int rm)
+{
+  return 0x1E203800 | (rm << 16) | (rn << 5) | rd;
+}
+
+uint32_t
+arm64_fmul_s(int rd, int rn, int rm)
+{
+  return 0x1E200800 | (rm << 16) | (rn << 5) | rd;
+}
+
+uint32_t
+arm64_fdiv_s(int rd, int rn, int rm)
+{
+  return 0x1E201800 | (rm << 16) | (rn << 5) | rd;
+}
+
+// LDR (immediate) with 12-bit unsigned immediate offset, scaled by 8
+uint32_t
+arm64_ldr(int rt, int rn, uint16_t imm12)
+{
+  return 0xF9400000 | ((imm12 & 0xFFF) << 10) | (rn << 5) | rt;
+}
+
+// LDR (immediate) 32-bit word, offset scaled by 4
+uint32_t
+arm64_ldrw(int rt, int rn, uint16_t imm12)
+{
+  return 0xB9400000 | ((imm12 & 0xFFF) << 10) | (rn << 5) | rt;
+}
+
+// STR (immediate) 64-bit, offset scaled by 8
+uint32_t
+arm64_str(int rt, int rn, uint16_t imm12)
+{
+  return 0xF9000000 | ((imm12 & 0xFFF) << 10) | (rn << 5) | rt;
+}
+
+// STR (floating point) single precision, offset scaled by 4
+uint32_t
+arm64_strs(int rt, int rn, uint16_t imm12)
+{
+  return 0xBD000000 | ((imm12 & 0xFFF) << 10) | (rn << 5) | rt;
+}
+
+// STR (floating point) double precision, offset scaled by 8
+uint32_t
+arm64_strd(int rt, int rn, uint16_t imm12)
+{
+  return 0xFD000000 | ((imm12 & 0xFFF) << 10) | (rn << 5) | rt;
+}
+
+// LDR (floating point) single precision
+uint32_t
+arm64_ldrs(int rt, int rn, uint16_t imm12)
+{
+  return 0xBD400000 | ((imm12 & 0xFFF) << 10) | (rn << 5) | rt;
+}
+
+// LDR (floating point) double precision
+uint32_t
+arm64_ldrd(int rt, int rn, uint16_t imm12)
+{
+  return 0xFD400000 | ((imm12 & 0xFFF) << 10) | (rn << 5) | rt;
+}
+
+uint32_t
+arm64_ldrb(int rt, int rn, uint16_t imm12)
+{
+  return 0x39400000 | ((imm12 & 0xFFF) << 10) | (rn << 5) | rt;
+}
+
+uint32_t
+arm64_ldrh(int rt, int rn, uint16_t imm12)
+{
+  return 0x79400000 | ((imm12 & 0xFFF) << 10) | (rn << 5) | rt;
+}
+
+uint32_t
+arm64_ldrsb(int rt, int rn, uint16_t imm12)
+{
+  return 0x39800000 | ((imm12 & 0xFFF) << 10) | (rn << 5) | rt;
+}
+
+uint32_t
+arm64_ldrsh(int rt, int rn, uint16_t imm12)
+{
+  return 0x79800000 | ((imm12 & 0xFFF) << 10) | (rn << 5) | rt;
+}
+
+uint32_t
+arm64_ldrsw(int rt, int rn, uint16_t imm12)
+{
+  return 0xB9800000 | ((imm12 & 0xFFF) << 10) | (rn << 5) | rt;
+}
+
+uint32_t
+arm64_strb(int rt, int rn, uint16_t imm12)
+{
+  return 0x39000000 | ((imm12 & 0xFFF) << 10) | (rn << 5) | rt;
+}
+
+uint32_t
+arm64_strh(int rt, int rn, uint16_t imm12)
+{
+  return 0x79000000 | ((imm12 & 0xFFF) << 10) | (rn << 5) | rt;
+}
+
+uint32_t
+arm64_strw(int rt, int rn, uint16_t imm12)
+{
+  return 0xB9000000 | ((imm12 & 0xFFF) << 10) | (rn << 5) | rt;
+}
+
+// load/store register with a signed 9-bit byte offset, mode 1 is post-index
+// and 3 is pre-index
+static uint32_t
+arm64_ldst_index(uint32_t op, int rt, int rn, int imm, int mode)
+{
+  return op | ((imm & 0x1ff) << 12) | (mode << 10) | (rn << 5) | rt;
+}
+
+// load/store register with an LSL register offset, scaled when shift != 0
+static uint32_t
+arm64_ldst_reg(uint32_t op, int rt, int rn, int rm, int shift)
+{
+  return op | 0x00206800 | (rm << 16) | ((shift != 0) << 12) | (rn << 5) | rt;
+}
+
+uint32_t
+arm64_ldr_pre(int rt, int rn, int imm)
+{
+  return arm64_ldst_index(0xf8400000, rt, rn, imm, 3);
+}
+
+uint32_t
+arm64_ldr_post(int rt, int rn, int imm)
+{
+  return arm64_ldst_index(0xf8400000, rt, rn, imm, 1);
+}
+
+uint32_t
+arm64_ldr_reg(int rt, int rn, int rm, int shift)
+{
+  return arm64_ldst_reg(0xf8400000, rt, rn, rm, shift);
+}
+
+uint32_t
+arm64_ldrw_pre(int rt, int rn, int imm)
+{
+  return arm64_ldst_index(0xb8400000, rt, rn, imm, 3);
+}
+
+uint32_t
+arm64_ldrw_post(int rt, int rn, int imm)
+{
+  return arm64_ldst_index(0xb8400000, rt, rn, imm, 1);
+}
+
+uint32_t
+arm64_ldrw_reg(int rt, int rn, int rm, int shift)
+{
+  return arm64_ldst_reg(0xb8400000, rt, rn, rm, shift);
+}
+
+uint32_t
+arm64_ldrh_pre(int rt, int rn, int imm)
+{
+  return arm64_ldst_index(0x78400000, rt, rn, imm, 3);
+}
+
+uint32_t
+arm64_ldrh_post(int rt, int rn, int imm)
+{
+  return arm64_ldst_index(0x78400000, rt, rn, imm, 1);
+}
+
+uint32_t
+arm64_ldrh_reg(int rt, int rn, int rm, int shift)
+{
+  return arm64_ldst_reg(0x78400000, rt, rn, rm, shift);
+}
+
+uint32_t
+arm64_ldrb_pre(int rt, int rn, int imm)
+{
+  return arm64_ldst_index(0x38400000, rt, rn, imm, 3);
+}
+
+uint32_t
+arm64_ldrb_post(int rt, int rn, int imm)
+{
+  return arm64_ldst_index(0x38400000, rt, rn, imm, 1);
+}
+
+uint32_t
+arm64_ldrb_reg(int rt, int rn, int rm, int shift)
+{
+  return arm64_ldst_reg(0x38400000, rt, rn, rm, shift);
+}
+
+uint32_t
+arm64_ldrsw_pre(int rt, int rn, int imm)
+{
+  return arm64_ldst_index(0xb8800000, rt, rn, imm, 3);
+}
+
+uint32_t
+arm64_ldrsw_post(int rt, int rn, int imm)
+{
+  return arm64_ldst_index(0xb8800000, rt, rn, imm, 1);
+}
+
+uint32_t
+arm64_ldrsw_reg(int rt, int rn, int rm, int shift)
+{
+  return arm64_ldst_reg(0xb8800000, rt, rn, rm, shift);
+}
+
+uint32_t
+arm64_ldrsh_pre(int rt, int rn, int imm)
+{
+  return arm64_ldst_index(0x78800000, rt, rn, imm, 3);
+}
+
+uint32_t
+arm64_ldrsh_post(int rt, int rn, int imm)
+{
+  return arm64_ldst_index(0x78800000, rt, rn, imm, 1);
+}
+
+uint32_t
+arm64_ldrsh_reg(int rt, int rn, int rm, int shift)
+{
+  return arm64_ldst_reg(0x78800000, rt, rn, rm, shift);
+}
+
+uint32_t
+arm64_ldrsb_pre(int rt, int rn, int imm)
+{
+  return arm64_ldst_index(0x38800000, rt, rn, imm, 3);
+}
+
+uint32_t
+arm64_ldrsb_post(int rt, int rn, int imm)
+{
+  return arm64_ldst_index(0x38800000, rt, rn, imm, 1);
+}
+
+uint32_t
+arm64_ldrsb_reg(int rt, int rn, int rm, int shift)
+{
+  return arm64_ldst_reg(0x38800000, rt, rn, rm, shift);
+}
+
+uint32_t
+arm64_str_pre(int rt, int rn, int imm)
+{
+  return arm64_ldst_index(0xf8000000, rt, rn, imm, 3);
+}
+
+uint32_t
+arm64_str_post(int rt, int rn, int imm)
+{
+  return arm64_ldst_index(0xf8000000, rt, rn, imm, 1);
+}
+
+uint32_t
+arm64_str_reg(int rt, int rn, int rm, int shift)
+{
+  return arm64_ldst_reg(0xf8000000, rt, rn, rm, shift);
+}
+
+uint32_t
+arm64_strw_pre(int rt, int rn, int imm)
+{
+  return arm64_ldst_index(0xb8000000, rt, rn, imm, 3);
+}
+
+uint32_t
+arm64_strw_post(int rt, int rn, int imm)
+{
+  return arm64_ldst_index(0xb8000000, rt, rn, imm, 1);
+}
+
+uint32_t
+arm64_strw_reg(int rt, int rn, int rm, int shift)
+{
+  return arm64_ldst_reg(0xb8000000, rt, rn, rm, shift);
+}
+
+uint32_t
+arm64_strh_pre(int rt, int rn, int imm)
+{
+  return arm64_ldst_index(0x78000000, rt, rn, imm, 3);
+}
+
+uint32_t
+arm64_strh_post(int rt, int rn, int imm)
+{
+  return arm64_ldst_index(0x78000000, rt, rn, imm, 1);
+}
+
+uint32_t
+arm64_strh_reg(int rt, int rn, int rm, int shift)
+{
+  return arm64_ldst_reg(0x78000000, rt, rn, rm, shift);
+}
+
+uint32_t
+arm64_strb_pre(int rt, int rn, int imm)
+{
+  return arm64_ldst_index(0x38000000, rt, rn, imm, 3);
+}
+
+uint32_t
+arm64_strb_post(int rt, int rn, int imm)
+{
+  return arm64_ldst_index(0x38000000, rt, rn, imm, 1);
+}
+
+uint32_t
+arm64_strb_reg(int rt, int rn, int rm, int shift)
+{
+  return arm64_ldst_reg(0x38000000, rt, rn, rm, shift);
+}
+
+uint32_t
+arm64_prfm(int rn, uint16_t offset)
+{
+  return arm64_prfm_op(PRFM_PLDL1KEEP, rn, offset);
+}
+
+uint32_t
+arm64_prfm_op(int op, int rn, uint16_t offset)
+{
+  return 0xf9800000 | (((offset / 8) & 0xfff) << 10) | (rn << 5) | (op & 31);
+}
+
+uint32_t
+arm64_prfum(int op, int rn, int imm)
+{
+  return 0xf8800000 | ((imm & 0x1ff) << 12) | (rn << 5) | (op & 31);
+}
+
+uint32_t
+arm64_fmov_reg_s(int rd, int rn)
+{
+  return 0x1E204000 | (rn << 5) | rd;
+}
+
+// {vt.T - vt+count-1.T}, the opcode field encodes the register count
+static uint32_t
+arm64_ld1_st1(uint32_t base, int rt, int count, int arrangement, int rn)
+{
+  static const uint32_t opcodes[] = { 0x7, 0xa, 0x6, 0x2 };
+  uint32_t opcode = opcodes[(count - 1) & 3];
+  return base | (opcode << 12) | (arrangement << 10) | (rn << 5) | rt;
+}
+
+uint32_t
+arm64_ld1(int rt, int count, int arrangement, int rn)
+{
+  return arm64_ld1_st1(0x4c400000, rt, count, arrangement, rn);
+}
+
+// post-increment by the register list size (rm = 31)
+uint32_t
+arm64_ld1_post(int rt, int count, int arrangement, int rn)
+{
+  return arm64_ld1_st1(0x4cdf0000, rt, count, arrangement, rn);
+}
+
+uint32_t
+arm64_st1(int rt, int count, int arrangement, int rn)
+{
+  return arm64_ld1_st1(0x4c000000, rt, count, arrangement, rn);
+}
+
+uint32_t
+arm64_st1_post(int rt, int count, int arrangement, int rn)
+{
+  return arm64_ld1_st1(0x4c9f0000, rt, count, arrangement, rn);
+}
+
+uint32_t
+arm64_ld1_lane_post(int rt, int index, int rn)
+{
+  return 0x0ddf8000 | ((index >> 1) << 30) | ((index & 1) << 12) | (rn << 5) |
+         rt;
+}
+
+uint32_t
+arm64_st1_lane_post(int rt, int index, int rn)
+{
+  return 0x0d9f8000 | ((index >> 1) << 30) | ((index & 1) << 12) | (rn << 5) |
+         rt;
+}
+
+uint32_t
+arm64_st1_lane_post_reg(int rt, int index, int rn, int rm)
+{
+  return 0x0d808000 | ((index >> 1) << 30) | (rm << 16) | ((index & 1) << 12) |
+         (rn << 5) | rt;
+}
+
+// imm is scaled by 16
+uint32_t
+arm64_ldp_q(int rt1, int rt2, int rn, int imm)
+{
+  return 0xad400000 | ((imm & 0x7f) << 15) | (rt2 << 10) | (rn << 5) | rt1;
+}
+
+uint32_t
+arm64_stp_q(int rt1, int rt2, int rn, int imm)
+{
+  return 0xad000000 | ((imm & 0x7f) << 15) | (rt2 << 10) | (rn << 5) | rt1;
+}
+
+uint32_t
+arm64_ldp_q_post(int rt1, int rt2, int rn, int imm)
+{
+  return 0xacc00000 | ((imm & 0x7f) << 15) | (rt2 << 10) | (rn << 5) | rt1;
+}
+
+uint32_t
+arm64_stp_q_post(int rt1, int rt2, int rn, int imm)
+{
+  return 0xac800000 | ((imm & 0x7f) << 15) | (rt2 << 10) | (rn << 5) | rt1;
+}
+
+uint32_t
+arm64_ldnp_q(int rt1, int rt2, int rn, int imm)
+{
+  return 0xac400000 | ((imm & 0x7f) << 15) | (rt2 << 10) | (rn << 5) | rt1;
+}
+
+uint32_t
+arm64_stnp_q(int rt1, int rt2, int rn, int imm)
+{
+  return 0xac000000 | ((imm & 0x7f) << 15) | (rt2 << 10) | (rn << 5) | rt1;
+}
+
+uint32_t
+arm64_ldnp(int rt1, int rt2, int rn, int imm)
+{
+  return 0xa8400000 | ((imm & 0x7f) << 15) | (rt2 << 10) | (rn << 5) | rt1;
+}
+
+uint32_t
+arm64_stnp(int rt1, int rt2, int rn, int imm)
+{
+  return 0xa8000000 | ((imm & 0x7f) << 15) | (rt2 << 10) | (rn << 5) | rt1;
+}
+
+// three registers of the same arrangement. floating point only has 4S
+// and 2D, told apart by the sz bit.
+static uint32_t
+arm64_vec_float(uint32_t base, int rd, int rn, int rm, int arrangement)
+{
+  uint32_t sz = arrangement == VEC_2D ? 1 : 0;
+  return base | (sz << 22) | (rm << 16) | (rn << 5) | rd;
+}
+
+static uint32_t
+arm64_vec_int(uint32_t base, int rd, int rn, int rm, int arrangement)
+{
+  return base | (arrangement << 22) | (rm << 16) | (rn << 5) | rd;
+}
+
+uint32_t
+arm64_fadd_v(int rd, int rn, int rm, int arrangement)
+{
+  return arm64_vec_float(0x4e20d400, rd, rn, rm, arrangement);
+}
+
+uint32_t
+arm64_fsub_v(int rd, int rn, int rm, int arrangement)
+{
+  return arm64_vec_float(0x4ea0d400, rd, rn, rm, arrangement);
+}
+
+uint32_t
+arm64_fmul_v(int rd, int rn, int rm, int arrangement)
+{
+  return arm64_vec_float(0x6e20dc00, rd, rn, rm, arrangement);
+}
+
+uint32_t
+arm64_fdiv_v(int rd, int rn, int rm, int arrangement)
+{
+  return arm64_vec_float(0x6e20fc00, rd, rn, rm, arrangement);
+}
+
+// rd += rn * rm, fused
+uint32_t
+arm64_fmla_v(int rd, int rn, int rm, int arrangement)
+{
+  return arm64_vec_float(0x4e20cc00, rd, rn, rm, arrangement);
+}
+
+uint32_t
+arm64_fmax_v(int rd, int rn, int rm, int arrangement)
+{
+  return arm64_vec_float(0x4e20f400, rd, rn, rm, arrangement);
+}
+
+uint32_t
+arm64_fmin_v(int rd, int rn, int rm, int arrangement)
+{
+  return arm64_vec_float(0x4ea0f400, rd, rn, rm, arrangement);
+}
+
+// pairwise, rd = { rn[0] + rn[1], rn[2] + rn[3], rm[0] + rm[1], ... }
+uint32_t
+arm64_faddp_v(int rd, int rn, int rm, int arrangement)
+{
+  return arm64_vec_float(0x6e20d400, rd, rn, rm, arrangement);
+}
+
+// sd = vn.s[0] + vn.s[1] for VEC_4S, dd = vn.d[0] + vn.d[1] for VEC_2D
+uint32_t
+arm64_faddp_scalar(int rd, int rn, int arrangement)
+{
+  return arm64_vec_float(0x7e30d800, rd, rn, 0, arrangement);
+}
+
+uint32_t
+arm64_add_v(int rd, int rn, int rm, int arrangement)
+{
+  return arm64_vec_int(0x4e208400, rd, rn, rm, arrangement);
+}
+
+uint32_t
+arm64_sub_v(int rd, int rn, int rm, int arrangement)
+{
+  return arm64_vec_int(0x6e208400, rd, rn, rm, arrangement);
+}
+
+// no 2D form
+uint32_t
+arm64_mul_v(int rd, int rn, int rm, int arrangement)
+{
+  return arm64_vec_int(0x4e209c00, rd, rn, rm, arrangement);
+}
+
+// compares set every bit of a lane when they hold and clear it otherwise
+uint32_t
+arm64_cmeq_v(int rd, int rn, int rm, int arrangement)
+{
+  return arm64_vec_int(0x6e208c00, rd, rn, rm, arrangement);
+}
+
+uint32_t
+arm64_cmgt_v(int rd, int rn, int rm, int arrangement)
+{
+  return arm64_vec_int(0x4e203400, rd, rn, rm, arrangement);
+}
+
+uint32_t
+arm64_cmge_v(int rd, int rn, int rm, int arrangement)
+{
+  return arm64_vec_int(0x4e203c00, rd, rn, rm, arrangement);
+}
+
+uint32_t
+arm64_cmhi_v(int rd, int rn, int rm, int arrangement)
+{
+  return arm64_vec_int(0x6e203400, rd, rn, rm, arrangement);
+}
+
+uint32_t
+arm64_cmhs_v(int rd, int rn, int rm, int arrangement)
+{
+  return arm64_vec_int(0x6e203c00, rd, rn, rm, arrangement);
+}
+
+// sum of all lanes into the lowest one, no 2D form (see arm64_addp_scalar)
+uint32_t
+arm64_addv(int rd, int rn, int arrangement)
+{
+  return arm64_vec_int(0x4e31b800, rd, rn, 0, arrangement);
+}
+
+// dd = vn.d[0] + vn.d[1]
+uint32_t
+arm64_addp_scalar(int rd, int rn)
+{
+  return 0x5ef1b800 | (rn << 5) | rd;
+}
+
+// every lane = the low bits of general purpose register rn
+uint32_t
+arm64_dup_v(int rd, int rn, int arrangement)
+{
+  uint32_t imm5 = 1 << arrangement;
+  return 0x4e000c00 | (imm5 << 16) | (rn << 5) | rd;
+}
+
+// every lane = vn[index]
+uint32_t
+arm64_dup_lane(int rd, int rn, int index, int arrangement)
+{
+  uint32_t imm5 = ((index << 1) | 1) << arrangement;
+  return 0x4e000400 | ((imm5 & 0x1f) << 16) | (rn << 5) | rd;
+}
+
+// ORR vd.16B, vn.16B, vn.16B
+uint32_t
+arm64_mov_v(int rd, int rn)
+{
+  return 0x4ea01c00 | (rn << 16) | (rn << 5) | rd;
+}
+
+// MOVI vd.2D, #0
+uint32_t
+arm64_movi_zero(int rd)
+{
+  return 0x6f00e400 | rd;
+}
+
+uint32_t
+arm64_fmla_lane(int rd, int rn, int rm, int index)
+{
+  return 0x4f801000 | ((index >> 1) << 11) | ((index & 1) << 21) | (rm << 16) |
+         (rn << 5) | rd;
+}
+
+uint32_t
+arm64_and_v(int rd, int rn, int rm)
+{
+  return 0x4e201c00 | (rm << 16) | (rn << 5) | rd;
+}
+
+uint32_t
+arm64_orr_v(int rd, int rn, int rm)
+{
+  return 0x4ea01c00 | (rm << 16) | (rn << 5) | rd;
+}
+
+uint32_t
+arm64_not_v(int rd, int rn)
+{
+  return 0x6e205800 | (rn << 5) | rd;
+}
+
+uint32_t
+arm64_smax_v(int rd, int rn, int rm, int arrangement)
+{
+  return arm64_vec_int(0x4e206400, rd, rn, rm, arrangement);
+}
+
+uint32_t
+arm64_smin_v(int rd, int rn, int rm, int arrangement)
+{
+  return arm64_vec_int(0x4e206c00, rd, rn, rm, arrangement);
+}
+
+uint32_t
+arm64_fcmeq_v(int rd, int rn, int rm, int arrangement)
+{
+  return arm64_vec_float(0x4e20e400, rd, rn, rm, arrangement);
+}
+
+uint32_t
+arm64_fcmgt_v(int rd, int rn, int rm, int arrangement)
+{
+  return arm64_vec_float(0x6ea0e400, rd, rn, rm, arrangement);
+}
+
+uint32_t
+arm64_fcmge_v(int rd, int rn, int rm, int arrangement)
+{
+  return arm64_vec_float(0x6e20e400, rd, rn, rm, arrangement);
+}
+
+uint32_t
+arm64_fmaxv(int rd, int rn)
+{
+  return 0x6e30f800 | (rn << 5) | rd;
+}
+
+uint32_t
+arm64_fminv(int rd, int rn)
+{
+  return 0x6eb0f800 | (rn << 5) | rd;
+}
+
+uint32_t
+arm64_smaxv(int rd, int rn)
+{
+  return 0x4eb0a800 | (rn << 5) | rd;
+}
+
+uint32_t
+arm64_sminv(int rd, int rn)
+{
+  return 0x4eb1a800 | (rn << 5) | rd;
+}
+
+uint32_t
+arm64_uaddlv(int rd, int rn)
+{
+  return 0x6eb03800 | (rn << 5) | rd;
+}
+
+uint32_t
+arm64_sadalp(int rd, int rn)
+{
+  return 0x4ea06800 | (rn << 5) | rd;
+}
+
+uint32_t
+arm64_smlal(int rd, int rn, int rm)
+{
+  return 0x0ea08000 | (rm << 16) | (rn << 5) | rd;
+}
+
+uint32_t
+arm64_smlal2(int rd, int rn, int rm)
+{
+  return 0x4ea08000 | (rm << 16) | (rn << 5) | rd;
+}
+
+// imm5 is the lane index above a one bit marking the lane size
+static uint32_t
+arm64_lane_imm5(int index, int arrangement)
+{
+  return ((index << (arrangement + 1)) | (1 << arrangement)) << 16;
+}
+
+// the 2D form is the 64-bit MOV xd, vn.d[index]
+uint32_t
+arm64_umov(int rd, int rn, int index, int arrangement)
+{
+  uint32_t q = arrangement == VEC_2D ? 1 << 30 : 0;
+  return 0x0e003c00 | q | arm64_lane_imm5(index, arrangement) | (rn << 5) | rd;
+}
+
+// into a 64-bit register, no 2D form
+uint32_t
+arm64_smov(int rd, int rn, int index, int arrangement)
+{
+  return 0x4e002c00 | arm64_lane_imm5(index, arrangement) | (rn << 5) | rd;
+}
+
+uint32_t
+arm64_fcmp_s(int rn, int rm)
+{
+  return 0x1E202000 | (rm << 16) | (rn << 5);
+}
+
+uint32_t
+arm64_fcsel_s(int rd, int rn, int rm, int cond)
+{
+  return 0x1E200C00 | (rm << 16) | ((cond & 0xf) << 12) | (rn << 5) | rd;
+}
+
+uint32_t
+arm64_fccmp_s(int rn, int rm, int nzcv, int cond)
+{
+  return 0x1E200400 | (rm << 16) | ((cond & 0xf) << 12) | (rn << 5) |
+         (nzcv & 0xf);
+}
+
+// converts signed integer to single precision float
+uint32_t
+arm64_scvtf_s(int rd, int rn)
+{
+  return 0x1E220000 | (rn << 5) | rd;
+}
+
+// converts single precision float to signed integer
+uint32_t
+arm64_fcvtzs_s(int rd, int rn)
+{
+  return 0x1E380000 | (rn << 5) | rd;
+}
+
+void
+jit_load_mem(JITCompiler* jit, int rt, int rn, uint16_t offset)
+{
+  jit_emit(jit, arm64_ldr(rt, rn, offset));
+}
+
+void
+jit_load_mem_word(JITCompiler* jit, int rt, int rn, uint16_t offset)
+{
+  jit_emit(jit, arm64_ldrw(rt, rn, offset));
+}
+
+void
+jit_load_mem_half(JITCompiler* jit, int rt, int rn, uint16_t offset)
+{
+  jit_emit(jit, arm64_ldrh(rt, rn, offset));
+}
+
+void
+jit_load_mem_byte(JITCompiler* jit, int rt, int rn, uint16_t offset)
+{
+  jit_emit(jit, arm64_ldrb(rt, rn, offset));
+}
+
+void
+jit_load_float_mem(JITCompiler* jit, int rt, int rn, uint16_t offset)
+{
+  jit_emit(jit, arm64_ldrs(rt, rn, offset));
+}
+
+void
+jit_store_mem(JITCompiler* jit, int rt, int rn, uint16_t offset)
+{
+  jit_emit(jit, arm64_str(rt, rn, offset));
+}
+
+void
+jit_store_mem_word(JITCompiler* jit, int rt, int rn, uint16_t offset)
+{
+  jit_emit(jit, arm64_strw(rt, rn, offset));
+}
+
+void
+jit_store_mem_half(JITCompiler* jit, int rt, int rn, uint16_t offset)
+{
+  jit_emit(jit, arm64_strh(rt, rn, offset));
+}
+
+void
+jit_store_mem_byte(JITCompiler* jit, int rt, int rn, uint16_t offset)
+{
+  jit_emit(jit, arm64_strb(rt, rn, offset));
+}
+
+void
+jit_store_float_mem(JITCompiler* jit, int rt, int rn, uint16_t offset)
+{
+  jit_emit(jit, arm64_strs(rt, rn, offset));
+}
+
+void
+jit_load_mem_index(JITCompiler* jit, int rt, int rn, int rm)
+{
+  jit_emit(jit, arm64_ldr_reg(rt, rn, rm, 3));
+}
+
+void
+jit_store_mem_index(JITCompiler* jit, int rt, int rn, int rm)
+{
+  jit_emit(jit, arm64_str_reg(rt, rn, rm, 3));
+}
+
+void
+jit_load_mem_post(JITCompiler* jit, int rt, int rn, int step)
+{
+  jit_emit(jit, arm64_ldr_post(rt, rn, step));
+}
+
+void
+jit_store_mem_post(JITCompiler* jit, int rt, int rn, int step)
+{
+  jit_emit(jit, arm64_str_post(rt, rn, step));
+}
+
+void
+jit_load_pair_nt(JITCompiler* jit, int rt1, int rt2, int rn, int imm)
+{
+  jit_emit(jit, arm64_ldnp(rt1, rt2, rn, imm));
+}
+
+void
+jit_store_pair_nt(JITCompiler* jit, int rt1, int rt2, int rn, int imm)
+{
+  jit_emit(jit, arm64_stnp(rt1, rt2, rn, imm));
+}
+
+bool
+jit_prefetch(JITCompiler* jit, int op, int rn, int offset)
+{
+  if (offset >= 0 && offset <= 32760 && offset % 8 == 0) {
+    jit_emit(jit, arm64_prfm_op(op, rn, (uint16_t)offset));
+    return true;
+  }
+  if (offset >= -256 && offset <= 255) {
+    jit_emit(jit, arm64_prfum(op, rn, offset));
+    return true;
+  }
+  fprintf(stderr, "JIT prefetch: offset %d out of range\n", offset);
+  return false;
+}
+
+void
+jit_float_add(JITCompiler* jit, int rd, int rn, int rm)
+{
+  jit_emit(jit, arm64_fadd_s(rd, rn, rm));
+}
+
+void
+jit_float_sub(JITCompiler* jit, int rd, int rn, int rm)
+{
+  jit_emit(jit, arm64_fsub_s(rd, rn, rm));
+}
+
+void
+jit_float_mul(JITCompiler* jit, int rd, int rn, int rm)
+{
+  jit_emit(jit, arm64_fmul_s(rd, rn, rm));
+}
+
+void
+jit_float_div(JITCompiler* jit, int rd, int rn, int rm)
+{
+  jit_emit(jit, arm64_fdiv_s(rd, rn, rm));
+}
+
+void
+jit_float_compare(JITCompiler* jit, int rn, int rm)
+{
+  jit_emit(jit, arm64_fcmp_s(rn, rm));
+}
+
+void
+jit_float_compare_if(JITCompiler* jit, int rn, int rm, int nzcv, int cond)
+{
+  jit_emit(jit, arm64_fccmp_s(rn, rm, nzcv, cond));
+}
+
+void
+jit_float_select(JITCompiler* jit, int rd, int rn, int rm, int cond)
+{
+  jit_emit(jit, arm64_fcsel_s(rd, rn, rm, cond));
+}
+
+// unordered compares fall to rm, so a NaN in rn is dropped
+void
+jit_float_min(JITCompiler* jit, int rd, int rn, int rm)
+{
+  jit_emit(jit, arm64_fcmp_s(rn, rm));
+  jit_emit(jit, arm64_fcsel_s(rd, rn, rm, COND_MI));
+}
+
+void
+jit_float_max(JITCompiler* jit, int rd, int rn, int rm)
+{
+  jit_emit(jit, arm64_fcmp_s(rn, rm));
+  jit_emit(jit, arm64_fcsel_s(rd, rn, rm, COND_GT));
+}
+
+void
+jit_int_to_float(JITCompiler* jit, int rd, int rn)
+{
+  jit_emit(jit, arm64_scvtf_s(rd, rn));
+}
+
+void
+jit_float_to_int(JITCompiler* jit, int rd, int rn)
+{
+  jit_emit(jit, arm64_fcvtzs_s(rd, rn));
+}
+
+void
+jit_vec_load(JITCompiler* jit, int rt, int count, int arrangement, int rn)
+{
+  jit_emit(jit, arm64_ld1(rt, count, arrangement, rn));
+}
+
+void
+jit_vec_load_post(JITCompiler* jit, int rt, int count, int arrangement, int rn)
+{
+  jit_emit(jit, arm64_ld1_post(rt, count, arrangement, rn));
+}
+
+void
+jit_vec_store(JITCompiler* jit, int rt, int count, int arrangement, int rn)
+{
+  jit_emit(jit, arm64_st1(rt, count, arrangement, rn));
+}
+
+void
+jit_vec_store_post(JITCompiler* jit, int rt, int count, int arrangement, int rn)
+{
+  jit_emit(jit, arm64_st1_post(rt, count, arrangement, rn));
+}
+
+void
+jit_vec_load_pair_nt(JITCompiler* jit, int rt1, int rt2, int rn, int imm)
+{
+  jit_emit(jit, arm64_ldnp_q(rt1, rt2, rn, imm));
+}
+
+void
+jit_vec_store_pair_nt(JITCompiler* jit, int rt1, int rt2, int rn, int imm)
+{
+  jit_emit(jit, arm64_stnp_q(rt1, rt2, rn, imm));
+}
+
+void
+jit_vec_float_add(JITCompiler* jit, int rd, int rn, int rm, int arrangement)
+{
+  jit_emit(jit, arm64_fadd_v(rd, rn, rm, arrangement));
+}
+
+void
+jit_vec_float_sub(JITCompiler* jit, int rd, int rn, int rm, int arrangement)
+{
+  jit_emit(jit, arm64_fsub_v(rd, rn, rm, arrangement));
+}
+
+void
+jit_vec_float_mul(JITCompiler* jit, int rd, int rn, int rm, int arrangement)
+{
+  jit_emit(jit, arm64_fmul_v(rd, rn, rm, arrangement));
+}
+
+// rd += rn * rm
+void
+jit_vec_float_fma(JITCompiler* jit, int rd, int rn, int rm, int arrangement)
+{
+  jit_emit(jit, arm64_fmla_v(rd, rn, rm, arrangement));
+}
+
+void
+jit_vec_float_max(JITCompiler* jit, int rd, int rn, int rm, int arrangement)
+{
+  jit_emit(jit, arm64_fmax_v(rd, rn, rm, arrangement));
+}
+
+void
+jit_vec_float_min(JITCompiler* jit, int rd, int rn, int rm, int arrangement)
+{
+  jit_emit(jit, arm64_fmin_v(rd, rn, rm, arrangement));
+}
+
+// sum of the lanes of rn into scalar rd (s or d register), rn is clobbered
+// for VEC_4S
+void
+jit_vec_float_sum(JITCompiler* jit, int rd, int rn, int arrangement)
+{
+  if (arrangement == VEC_4S)
+    jit_emit(jit, arm64_faddp_v(rn, rn, rn, VEC_4S));
+  jit_emit(jit, arm64_faddp_scalar(rd, rn, arrangement));
+}
+
+void
+jit_vec_add(JITCompiler* jit, int rd, int rn, int rm, int arrangement)
+{
+  jit_emit(jit, arm64_add_v(rd, rn, rm, arrangement));
+}
+
+void
+jit_vec_sub(JITCompiler* jit, int rd, int rn, int rm, int arrangement)
+{
+  jit_emit(jit, arm64_sub_v(rd, rn, rm, arrangement));
+}
+
+void
+jit_vec_mul(JITCompiler* jit, int rd, int rn, int rm, int arrangement)
+{
+  if (arrangement == VEC_2D) {
+    fprintf(stderr, "JIT: no 64-bit lane vector multiply\n");
+    return;
+  }
+  jit_emit(jit, arm64_mul_v(rd, rn, rm, arrangement));
+}
+
+// lane masks for rn <cond> rm. LT, LE, CC and LS swap the operands of GT,
+// GE, HI and CS, NE is not available.
+void
+jit_vec_compare(JITCompiler* jit,
+                int rd,
+                int rn,
+                int rm,
+                int arrangement,
+                int cond)
+{
+  switch (cond) {
+    case COND_EQ: jit_emit(jit, arm64_cmeq_v(rd, rn, rm, arrangement)); break;
+    case COND_GT: jit_emit(jit, arm64_cmgt_v(rd, rn, rm, arrangement)); break;
+    case COND_GE: jit_emit(jit, arm64_cmge_v(rd, rn, rm, arrangement)); break;
+    case COND_HI: jit_emit(jit, arm64_cmhi_v(rd, rn, rm, arrangement)); break;
+    case COND_CS: jit_emit(jit, arm64_cmhs_v(rd, rn, rm, arrangement)); break;
+    case COND_LT: jit_emit(jit, arm64_cmgt_v(rd, rm, rn, arrangement)); break;
+    case COND_LE: jit_emit(jit, arm64_cmge_v(rd, rm, rn, arrangement)); break;
+    case COND_CC: jit_emit(jit, arm64_cmhi_v(rd, rm, rn, arrangement)); break;
+    case COND_LS: jit_emit(jit, arm64_cmhs_v(rd, rm, rn, arrangement)); break;
+    default:
+      fprintf(stderr, "JIT: no vector compare for condition %d\n", cond);
+      break;
+  }
+}
+
+// all ones in the lanes where rn <cond> rm holds, false for NaN
+void
+jit_vec_float_compare(JITCompiler* jit,
+                      int rd,
+                      int rn,
+                      int rm,
+                      int arrangement,
+                      int cond)
+{
+  switch (cond) {
+    case COND_EQ: jit_emit(jit, arm64_fcmeq_v(rd, rn, rm, arrangement)); break;
+    case COND_GT: jit_emit(jit, arm64_fcmgt_v(rd, rn, rm, arrangement)); break;
+    case COND_GE: jit_emit(jit, arm64_fcmge_v(rd, rn, rm, arrangement)); break;
+    case COND_LT: jit_emit(jit, arm64_fcmgt_v(rd, rm, rn, arrangement)); break;
+    case COND_LE: jit_emit(jit, arm64_fcmge_v(rd, rm, rn, arrangement)); break;
+    default:
+      fprintf(stderr, "JIT: no float vector compare for condition %d\n", cond);
+      break;
+  }
+}
+
+// sum of the integer lanes of rn into the lowest lane of rd
+void
+jit_vec_sum(JITCompiler* jit, int rd, int rn, int arrangement)
+{
+  if (arrangement == VEC_2D)
+    jit_emit(jit, arm64_addp_scalar(rd, rn));
+  else
+    jit_emit(jit, arm64_addv(rd, rn, arrangement));
+}
+
+void
+jit_vec_dup(JITCompiler* jit, int rd, int rn, int arrangement)
+{
+  jit_emit(jit, arm64_dup_v(rd, rn, arrangement));
+}
+
+void
+jit_vec_zero(JITCompiler* jit, int rd)
+{
+  jit_emit(jit, arm64_movi_zero(rd));
+}
+
+uint32_t
+arm64_bl(int32_t offset)
+{
+  return 0x94000000 | ((offset & 0x3ffffff) << 0);
+}
+
+uint32_t
+arm64_ret()
+{
+  return 0xd65f03c0;
+}
+
+uint32_t
+arm64_stp(int rt1, int rt2, int rn, int imm)
+{
+  return 0xa9000000 | ((imm & 0x7f) << 15) | (rt2 << 10) | (rn << 5) | rt1;
+}
+
+uint32_t
+arm64_ldp(int rt1, int rt2, int rn, int imm)
+{
+  return 0xa9400000 | ((imm & 0x7f) << 15) | (rt2 << 10) | (rn << 5) | rt1;
+}
+
+// STP with pre-index writeback, imm is in units of 8 bytes
+uint32_t
+arm64_stp_pre(int rt1, int rt2, int rn, int imm)
+{
+  return 0xa9800000 | ((imm & 0x7f) << 15) | (rt2 << 10) | (rn << 5) | rt1;
+}
+
+// LDP with post-index writeback
+uint32_t
+arm64_ldp_post(int rt1, int rt2, int rn, int imm)
+{
+  return 0xa8c00000 | ((imm & 0x7f) << 15) | (rt2 << 10) | (rn << 5) | rt1;
+}
+
+uint32_t
+arm64_adrp(int rd, int64_t imm)
+{
+  uint32_t immlo = (imm >> 12) & 0x3;
+  uint32_t immhi = (imm >> 14) & 0x7FFFF;
+  return 0x90000000 | (immlo << 29) | (immhi << 5) | rd;
+}
+
+uint32_t
+arm64_add_imm(int rd, int rn, uint16_t imm12)
+{
+  return 0x91000000 | ((uint32_t)imm12 << 10) | (rn << 5) | rd;
+}
+
+uint32_t
+arm64_sub_imm(int rd, int rn, uint16_t imm12)
+{
+  return 0xd1000000 | ((uint32_t)imm12 << 10) | (rn << 5) | rd;
+}
+
+// process-wide code heap. code chunks are carved out of large PROT_NONE
+// regions in power of two size classes. a chunk is a reservation, its pages
+// are committed on demand so a compiler can grow without moving its code.
+// freed chunks stay committed on a per-class free list until jit_heap_trim.
+//
+// on linux regions are memfd backed and mapped twice, a RW view for the
+// emitter and a RX view for execution, so no page is ever writable and
+// executable at the same time. without memfd the views are the same RWX
+// mapping, on Apple the same MAP_JIT mapping.
+
+typedef struct JitHeapRegion
+{
+  uint8_t* rw;
+  uint8_t* rx;
+  size_t size;
+  size_t used; // bump offset of the next chunk
+  bool huge_pages;
+  struct JitHeapRegion* next;
+} JitHeapRegion;
+
+typedef struct JitHeapBlock
+{
+  JitCodeChunk chunk;
+  struct JitHeapBlock* next;
+} JitHeapBlock;
+
+typedef struct
+{
+  pthread_mutex_t lock;
+  JitHeapRegion* regions;
+  JitHeapBlock* free_lists[JIT_HEAP_NUM_CLASSES];
+  JitHeapBlock* spare_blocks; // recycled free list nodes
+  bool huge_pages;
+  JitHeapStats stats;
+} JitCodeHeap;
+
+static JitCodeHeap jit_code_heap = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+#if defined(__linux__) && defined(SYS_memfd_create)
+#define JIT_HEAP_DUAL_MAPPING 1
+#endif
+
+#ifdef __APPLE__
+#define JIT_HEAP_MAP_FLAGS (MAP_PRIVATE | MAP_ANONYMOUS | MAP_JIT)
+#define JIT_HEAP_CODE_PROT (PROT_READ | PROT_WRITE)
+#else
+#define JIT_HEAP_MAP_FLAGS (MAP_PRIVATE | MAP_ANONYMOUS)
+#define JIT_HEAP_CODE_PROT (PROT_READ | PROT_WRITE | PROT_EXEC)
+#endif
+
+static size_t
+jit_page_align(size_t size)
+{
+  return (size + JIT_HEAP_MIN_CHUNK_SIZE - 1) &
+         ~(size_t)(JIT_HEAP_MIN_CHUNK_SIZE - 1);
+}
+
+static int
+jit_heap_class(size_t size)
+{
+  size_t chunk = JIT_HEAP_MIN_CHUNK_SIZE;
+  for (int i = 0; i < JIT_HEAP_NUM_CLASSES; i++, chunk <<= 1) {
+    if (size <= chunk)
+      return i;
+  }
+  return -1;
+}
+
+static size_t
+jit_heap_class_size(int size_class)
+{
+  return (size_t)JIT_HEAP_MIN_CHUNK_SIZE << size_class;
+}
+
+static size_t
+jit_heap_chunk_size(size_t size)
+{
+  int size_class = jit_heap_class(size);
+  return size_class < 0 ? jit_page_align(size)
+                        : jit_heap_class_size(size_class);
+}
+
+// reserves size bytes of address space in both views, nothing is accessible
+// until jit_heap_map_pages. with alignment the views are aligned to it.
+static bool
+jit_heap_reserve(size_t size, size_t alignment, uint8_t** rw, uint8_t** rx)
+{
+  size_t reserve = size + alignment;
+#ifdef __APPLE__
+  int prot = JIT_HEAP_CODE_PROT; // MAP_JIT can't be reserved PROT_NONE
+#else
+  int prot = PROT_NONE;
+#endif
+
+#ifdef JIT_HEAP_DUAL_MAPPING
+  int fd = (int)syscall(SYS_memfd_create, "tiny_jit", 1U /* MFD_CLOEXEC */);
+  if (fd >= 0) {
+    if (ftruncate(fd, size) == 0) {
+      uint8_t* views[2];
+      int mapped = 0;
+      for (; mapped < 2; mapped++) {
+        // reserve anonymous first so the shared view can be aligned
+        uint8_t* base = mmap(NULL, reserve, PROT_NONE, JIT_HEAP_MAP_FLAGS, -1, 0);
+        if (base == MAP_FAILED)
+          break;
+        uint8_t* aligned =
+          alignment ? (uint8_t*)(((uintptr_t)base + alignment - 1) &
+                                 ~(uintptr_t)(alignment - 1))
+                    : base;
+        views[mapped] =
+          mmap(aligned, size, PROT_NONE, MAP_SHARED | MAP_FIXED, fd, 0);
+        if (aligned > base)
+          munmap(base, aligned - base);
+        if (aligned + size < base + reserve)
+          munmap(aligned + size, (base + reserve) - (aligned + size));
+        if (views[mapped] == MAP_FAILED) {
+          munmap(aligned, size);
+          break;
+        }
+      }
+      close(fd);
+
+      if (mapped == 2) {
+        *rw = views[0];
+        *rx = views[1];
+        return true;
+      }
+      if (mapped == 1)
+        munmap(views[0], size);
+    } else {
+      close(fd);
+    }
+  }
+#endif
+
+  // single view fallback
+  uint8_t* base = mmap(NULL, reserve, prot, JIT_HEAP_MAP_FLAGS, -1, 0);
+  if (base == MAP_FAILED)
+    return false;
+
+  uint8_t* aligned =
+    alignment ? (uint8_t*)(((uintptr_t)base + alignment - 1) &
+                           ~(uintptr_t)(alignment - 1))
+              : base;
+  if (aligned > base)
+    munmap(base, aligned - base);
+  if (aligned + size < base + reserve)
+    munmap(aligned + size, (base + reserve) - (aligned + size));
+
+  *rw = aligned;
+  *rx = aligned;
+  return true;
+}
+
+static void
+jit_heap_release(uint8_t* rw, uint8_t* rx, size_t size)
+{
+  munmap(rw, size);
+  if (rx != rw)
+    munmap(rx, size);
+}
+
+static bool
+jit_heap_map_pages(uint8_t* rw, uint8_t* rx, size_t size)
+{
+#ifdef __APPLE__
+  // MAP_JIT memory is mapped up front
+  (void)rw;
+  (void)rx;
+  (void)size;
+  return true;
+#else
+  if (rx == rw)
+    return mprotect(rw, size, JIT_HEAP_CODE_PROT) == 0;
+  return mprotect(rw, size, PROT_READ | PROT_WRITE) == 0 &&
+         mprotect(rx, size, PROT_READ | PROT_EXEC) == 0;
+#endif
+}
+
+static void
+jit_heap_unmap_pages(uint8_t* rw, uint8_t* rx, size_t size)
+{
+#if defined(JIT_HEAP_DUAL_MAPPING) && defined(MADV_REMOVE)
+  // drop the pages from the shared file, not just from this view
+  if (rx != rw)
+    madvise(rw, size, MADV_REMOVE);
+#endif
+  madvise(rw, size, MADV_DONTNEED);
+#ifndef __APPLE__
+  mprotect(rw, size, PROT_NONE);
+  if (rx != rw)
+    mprotect(rx, size, PROT_NONE);
+#endif
+}
+
+// regions that can't be committed page by page: huge page regions (per-chunk
+// mprotect would split the huge pages) and MAP_JIT regions on Apple.
+static bool
+jit_heap_region_pinned(JitHeapRegion* region)
+{
+#ifdef __APPLE__
+  (void)region;
+  return true;
+#else
+  return region->huge_pages;
+#endif
+}
+
+static JitHeapRegion*
+jit_heap_add_region(JitCodeHeap* heap)
+{
+  JitHeapRegion* region = malloc(sizeof(JitHeapRegion));
+  if (!region)
+    return NULL;
+
+  size_t size = JIT_HEAP_REGION_SIZE;
+  size_t alignment = heap->huge_pages ? JIT_HUGE_PAGE_SIZE : 0;
+  if (!jit_heap_reserve(size, alignment, &region->rw, &region->rx)) {
+    free(region);
+    return NULL;
+  }
+
+  if (heap->huge_pages) {
+    jit_heap_map_pages(region->rw, region->rx, size);
+#ifdef MADV_HUGEPAGE
+    madvise(region->rw, size, MADV_HUGEPAGE);
+    if (region->rx != region->rw)
+      madvise(region->rx, size, MADV_HUGEPAGE);
+#endif
+  }
+  region->size = size;
+  region->used = 0;
+  region->huge_pages = heap->huge_pages;
+  if (jit_heap_region_pinned(region))
+    heap->stats.committed += size;
+
+  region->next = heap->regions;
+  heap->regions = region;
+
+  heap->stats.reserved += size;
+  heap->stats.num_regions++;
+  return region;
+}
+
+// commits up to size bytes of a chunk, called with the heap lock held
+static bool
+jit_heap_commit_locked(JitCodeHeap* heap, JitCodeChunk* chunk, size_t size)
+{
+  size = jit_page_align(size);
+  if (size <= chunk->committed)
+    return true;
+  if (size > chunk->size - chunk->committed_top)
+    return false;
+
+  size_t from = chunk->committed;
+  if (!jit_heap_map_pages(chunk->rw + from, chunk->rx + from, size - from))
+    return false;
+
+  heap->stats.committed += size - from;
+  chunk->committed = size;
+  return true;
+}
+
+bool
+jit_heap_alloc(JitCodeChunk* chunk, size_t size, size_t commit)
+{
+  JitCodeHeap* heap = &jit_code_heap;
+  memset(chunk, 0, sizeof(JitCodeChunk));
+  chunk->size = jit_heap_chunk_size(size);
+
+  int size_class = jit_heap_class(size);
+  if (size_class < 0) {
+    // too large for a size class, gets its own reservation
+    if (!jit_heap_reserve(chunk->size, 0, &chunk->rw, &chunk->rx))
+      return false;
+
+    pthread_mutex_lock(&heap->lock);
+#ifdef __APPLE__
+    chunk->pinned = true;
+    chunk->committed = chunk->size;
+    heap->stats.committed += chunk->size;
+#endif
+    heap->stats.reserved += chunk->size;
+  } else {
+    pthread_mutex_lock(&heap->lock);
+
+    JitHeapBlock* block = heap->free_lists[size_class];
+    if (block) {
+      heap->free_lists[size_class] = block->next;
+      *chunk = block->chunk;
+      heap->stats.fragmented -= chunk->committed + chunk->committed_top;
+
+      block->next = heap->spare_blocks;
+      heap->spare_blocks = block;
+    } else {
+      JitHeapRegion* region = heap->regions;
+      while (region && (region->used + chunk->size > region->size ||
+                        region->huge_pages != heap->huge_pages))
+        region = region->next;
+      if (!region)
+        region = jit_heap_add_region(heap);
+
+      if (region) {
+        chunk->rw = region->rw + region->used;
+        chunk->rx = region->rx + region->used;
+        region->used += chunk->size;
+        chunk->pinned = jit_heap_region_pinned(region);
+        if (chunk->pinned)
+          chunk->committed = chunk->size;
+      }
+    }
+  }
+
+  if (chunk->rw) {
+    heap->stats.in_use += chunk->size;
+    heap->stats.num_chunks++;
+  }
+  bool ok = chunk->rw && jit_heap_commit_locked(
+                           heap, chunk, commit < chunk->size ? commit : chunk->size);
+  pthread_mutex_unlock(&heap->lock);
+
+  if (chunk->rw && !ok) {
+    jit_heap_free(chunk);
+    return false;
+  }
+  return ok;
+}
+
+bool
+jit_heap_commit(JitCodeChunk* chunk, size_t commit)
+{
+  pthread_mutex_lock(&jit_code_heap.lock);
+  bool ok = jit_heap_commit_locked(&jit_code_heap, chunk, commit);
+  pthread_mutex_unlock(&jit_code_heap.lock);
+  return ok;
+}
+
+// commits the last size bytes of a chunk, kept apart from the committed
+// prefix so both ends can grow towards each other
+bool
+jit_heap_commit_top(JitCodeChunk* chunk, size_t size)
+{
+  JitCodeHeap* heap = &jit_code_heap;
+  size = jit_page_align(size);
+  if (chunk->pinned || size <= chunk->committed_top)
+    return true;
+  if (size > chunk->size - chunk->committed)
+    return false;
+
+  size_t from = chunk->size - size;
+  size_t length = size - chunk->committed_top;
+  if (!jit_heap_map_pages(chunk->rw + from, chunk->rx + from, length))
+    return false;
+
+  pthread_mutex_lock(&heap->lock);
+  heap->stats.committed += length;
+  chunk->committed_top = size;
+  pthread_mutex_unlock(&heap->lock);
+  return true;
+}
+
+void
+jit_heap_free(JitCodeChunk* chunk)
+{
+  JitCodeHeap* heap = &jit_code_heap;
+  if (!chunk->rw)
+    return;
+
+  int size_class = jit_heap_class(chunk->size);
+  if (size_class < 0) {
+    jit_heap_release(chunk->rw, chunk->rx, chunk->size);
+
+    pthread_mutex_lock(&heap->lock);
+    heap->stats.reserved -= chunk->size;
+    heap->stats.committed -= chunk->committed + chunk->committed_top;
+    heap->stats.in_use -= chunk->size;
+    heap->stats.num_chunks--;
+    pthread_mutex_unlock(&heap->lock);
+    memset(chunk, 0, sizeof(JitCodeChunk));
+    return;
+  }
+
+  pthread_mutex_lock(&heap->lock);
+
+  JitHeapBlock* block = heap->spare_blocks;
+  if (block)
+    heap->spare_blocks = block->next;
+  else
+    block = malloc(sizeof(JitHeapBlock));
+
+  if (block) {
+    block->chunk = *chunk;
+    block->next = heap->free_lists[size_class];
+    heap->free_lists[size_class] = block;
+    heap->stats.fragmented += chunk->committed + chunk->committed_top;
+  }
+  // without a node the chunk is leaked, but stays reserved by its region
+
+  heap->stats.in_use -= chunk->size;
+  heap->stats.num_chunks--;
+  pthread_mutex_unlock(&heap->lock);
+  memset(chunk, 0, sizeof(JitCodeChunk));
+}
+
+void
+jit_heap_set_huge_pages(bool enabled)
+{
+  // only affects regions reserved from now on
+  pthread_mutex_lock(&jit_code_heap.lock);
+  jit_code_heap.huge_pages = enabled;
+  pthread_mutex_unlock(&jit_code_heap.lock);
+}
+
+void
+jit_heap_trim()
+{
+  JitCodeHeap* heap = &jit_code_heap;
+  pthread_mutex_lock(&heap->lock);
+
+  // hand the pages of idle chunks back to the kernel, pinned chunks are
+  // kept so huge page regions aren't split
+  for (int i = 0; i < JIT_HEAP_NUM_CLASSES; i++) {
+    for (JitHeapBlock* block = heap->free_lists[i]; block;
+         block = block->next) {
+      JitCodeChunk* chunk = &block->chunk;
+      if (chunk->pinned)
+        continue;
+      if (chunk->committed_top) {
+        size_t from = chunk->size - chunk->committed_top;
+        jit_heap_unmap_pages(
+          chunk->rw + from, chunk->rx + from, chunk->committed_top);
+      }
+      if (chunk->committed)
+        jit_heap_unmap_pages(chunk->rw, chunk->rx, chunk->committed);
+      heap->stats.committed -= chunk->committed + chunk->committed_top;
+      heap->stats.fragmented -= chunk->committed + chunk->committed_top;
+      chunk->committed = 0;
+      chunk->committed_top = 0;
+    }
+  }
+
+  pthread_mutex_unlock(&heap->lock);
+}
+
+JitHeapStats
+jit_heap_stats()
+{
+  pthread_mutex_lock(&jit_code_heap.lock);
+  JitHeapStats stats = jit_code_heap.stats;
+  pthread_mutex_unlock(&jit_code_heap.lock);
+  return stats;
+}
+
+JITCompiler*
+jit_init()
+{
+  return jit_init_reserved(JIT_CODE_RESERVE_SIZE, JIT_DATA_RESERVE_SIZE);
+}
+
+JITCompiler*
+jit_init_reserved(size_t code_reserve, size_t data_reserve)
+{
+  JITCompiler* jit = malloc(sizeof(JITCompiler));
+  if (!jit)
+    return NULL;
+
+  // reserve the whole range now so the code never moves when it grows
+  if (!jit_heap_alloc(&jit->code_chunk, code_reserve, MAX_CODE_MEMORY_SIZE)) {
+    free(jit);
+    return NULL;
+  }
+  jit->code = (uint32_t*)jit->code_chunk.rw;
+  jit->exec = (uint32_t*)jit->code_chunk.rx;
+  jit->capacity = jit->code_chunk.committed;
+  jit->code_size = 0;
+  jit->finalized = true; // nothing emitted yet, so nothing to flush
+  jit->failed = false;
+
+  // the data section is reserved by the first allocation in it
+  jit->data = NULL;
+  jit->data_capacity = 0;
+  jit->data_size = 0;
+  jit->data_reserve = data_reserve;
+
+  jit->label_capacity = MAX_LABEL_CAPACITY;
+  jit->label_positions = malloc(sizeof(uint32_t*) * jit->label_capacity);
+  jit->label_offsets = malloc(sizeof(size_t) * jit->label_capacity);
+  jit->num_labels = 0;
+
+  jit->fixup_capacity = MAX_FIXUP_CAPACITY;
+  jit->fixups = malloc(sizeof(JitFixup) * jit->fixup_capacity);
+  jit->pending_fixups = malloc(sizeof(size_t) * jit->fixup_capacity);
+  jit->num_fixups = 0;
+  jit->num_pending_fixups = 0;
+
+  jit->function_capacity = MAX_FUNCTION_CAPACITY;
+  jit->functions = malloc(sizeof(JitFunction) * jit->function_capacity);
+  jit->num_functions = 0;
+  jit->current_function = (size_t)-1;
+
+  jit->constant_capacity = MAX_CONSTANT_CAPACITY;
+  jit->constants = malloc(sizeof(JitConstant) * jit->constant_capacity);
+  jit->num_constants = 0;
+
+  jit->stub_capacity = MAX_STUB_CAPACITY;
+  jit->stubs = malloc(sizeof(uint64_t) * jit->stub_capacity);
+  jit->num_stubs = 0;
+  jit->stub_area = 0;
+
+  jit->library_calls = NULL;
+  jit->num_library_calls = 0;
+  jit->library_call_capacity = 0;
+  jit->num_registered_calls = 0;
+
+  if (!jit->label_positions || !jit->label_offsets || !jit->fixups ||
+      !jit->pending_fixups || !jit->functions || !jit->constants ||
+      !jit->stubs) {
+    if (jit->label_positions)
+      free(jit->label_positions);
+    if (jit->label_offsets)
+      free(jit->label_offsets);
+    if (jit->fixups)
+      free(jit->fixups);
+    if (jit->pending_fixups)
+      free(jit->pending_fixups);
+    if (jit->functions)
+      free(jit->functions);
+    if (jit->constants)
+      free(jit->constants);
+    if (jit->stubs)
+      free(jit->stubs);
+    jit_heap_free(&jit->code_chunk);
+    free(jit);
+    return NULL;
+  }
+
+  return jit;
+}
+
+size_t
+jit_alloc_data(JITCompiler* jit, size_t size, size_t alignment)
+{
+  if (!jit->data) {
+    void* data = mmap(NULL,
+                      jit->data_reserve,
+                      PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS,
+                      -1,
+                      0);
+    if (data == MAP_FAILED)
+      return (size_t)-1;
+
+    jit->data = data;
+    jit->data_capacity = 0;
+  }
+
+  size_t offset = (jit->data_size + alignment - 1) & ~(alignment - 1);
+  if (offset + size > jit->data_reserve)
+    return (size_t)-1;
+
+  // commit more of the reservation, the data never moves so addresses
+  // already baked into the code stay valid
+  if (offset + size > jit->data_capacity) {
+    size_t new_capacity =
+      jit->data_capacity ? jit->data_capacity * 2 : MAX_DATA_MEMORY_SIZE;
+    while (new_capacity < offset + size)
+      new_capacity *= 2;
+    if (new_capacity > jit->data_reserve)
+      new_capacity = jit->data_reserve;
+
+    if (mprotect(jit->data + jit->data_capacity,
+                 new_capacity - jit->data_capacity,
+                 PROT_READ | PROT_WRITE) == -1)
+      return (size_t)-1;
+    jit->data_capacity = new_capacity;
+  }
+
+  jit->data_size = offset + size;
+  return offset;
+}
+
+size_t
+jit_add_string(JITCompiler* jit, const char* str)
+{
+  size_t len = strlen(str) + 1;
+  size_t aligned_size = (len + 7) & ~7; // 8-byte alignment
+
+  size_t offset = jit_alloc_data(jit, aligned_size, 8);
+  if (offset == (size_t)-1)
+    return (size_t)-1;
+
+  memcpy(jit->data + offset, str, len);
+  memset(jit->data + offset + len, 0, aligned_size - len); // zeoro padding
+
+  return offset;
+}
+
+size_t
+jit_add_constant(JITCompiler* jit, const void* value, size_t size)
+{
+  uint64_t bits = 0;
+  memcpy(&bits, value, size < sizeof(bits) ? size : sizeof(bits));
+
+  // the pool of the current function is small, a linear scan is enough
+  for (size_t i = 0; i < jit->num_constants; i++) {
+    JitConstant* constant = &jit->constants[i];
+    if (constant->size == size && constant->bits == bits &&
+        !memcmp(jit->data + constant->offset, value, size))
+      return constant->offset;
+  }
+
+  if (jit->num_constants >= jit->constant_capacity) {
+    size_t capacity = jit->constant_capacity * 2;
+    JitConstant* constants =
+      realloc(jit->constants, sizeof(JitConstant) * capacity);
+    if (!constants) {
+      fprintf(stderr, "JIT constant pool exhausted\n");
+      return (size_t)-1;
+    }
+    jit->constants = constants;
+    jit->constant_capacity = capacity;
+  }
+
+  size_t offset = jit_alloc_data(jit, size, size < 8 ? size : 8);
+  if (offset == (size_t)-1)
+    return (size_t)-1;
+  memcpy(jit->data + offset, value, size);
+
+  JitConstant* constant = &jit->constants[jit->num_constants++];
+  constant->bits = bits;
+  constant->size = size;
+  constant->offset = offset;
+  return offset;
+}
+
+// loads a 4 or 8 byte pool entry into s<reg>/d<reg>. a single LDR (literal)
+// when the entry is within +-1MB of the code, otherwise ADRP x16 + LDR, x16
+// being the intra-procedure scratch register.
+bool
+jit_load_constant(JITCompiler* jit, int reg, size_t offset, size_t size)
+{
+  if (offset == (size_t)-1) {
+    jit->failed = true;
+    return false;
+  }
+
+  bool is_double = size == 8;
+  uint64_t addr = (uint64_t)(jit->data + offset);
+  int64_t disp =
+    (int64_t)addr - (int64_t)jit_code_address(jit, jit->code_size);
+
+  // keep some slack for branch relaxation moving the LDR later on
+  if (jit_fits_signed(disp / 4, 18)) {
+    jit_add_fixup(jit, JIT_FIXUP_LDR_DATA, offset);
+    jit_emit(jit,
+             is_double ? arm64_ldr_lit_d(reg, disp / 4)
+                       : arm64_ldr_lit_s(reg, disp / 4));
+    return true;
+  }
+
+  jit_load_string_addr(jit, rx16, offset & ~(uint64_t)0xFFF);
+  uint16_t page_offset = addr & 0xFFF;
+  jit_emit(jit,
+           is_double ? arm64_ldrd(reg, rx16, page_offset / 8)
+                     : arm64_ldrs(reg, rx16, page_offset / 4));
+  return true;
+}
+
+void
+jit_load_string_addr(JITCompiler* jit, int reg, size_t offset)
+{
+  uint64_t addr = (uint64_t)(jit->data + offset);
+
+  // address and offset within page
+  uint64_t page = addr & ~0xFFF;
+  uint64_t page_offset = addr & 0xFFF;
+
+  // relative page offset from PC, re-encoded by the fixup if the code moves
+  int64_t pc = (int64_t)jit_code_address(jit, jit->code_size);
+  int64_t rel_page = page - (pc & ~0xFFF);
+
+  jit_add_fixup(jit, JIT_FIXUP_ADRP_DATA, offset);
+  jit_emit(jit, arm64_adrp(reg, rel_page));
+  if (page_offset) {
+    jit_emit(jit, arm64_add_imm(reg, reg, page_offset));
+  }
+}
+
+const char*
+jit_get_string(JITCompiler* jit, size_t offset)
+{
+  if (offset >= jit->data_size)
+    return NULL;
+  return (const char*)(jit->data + offset);
+}
+
+// every open library, so the call sites in code that goes away can be
+// found and unregistered
+typedef struct
+{
+  pthread_mutex_t lock; // the list and the sites of every library on it
+  ExternalLibrary* libraries;
+} ExtLibRegistry;
+
+static ExtLibRegistry ext_lib_registry = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// hands the call sites of owner over to new_owner, or drops them when
+// new_owner is NULL
+static void
+ext_lib_move_sites(const void* owner, const void* new_owner)
+{
+  pthread_mutex_lock(&ext_lib_registry.lock);
+  for (ExternalLibrary* lib = ext_lib_registry.libraries; lib;
+       lib = lib->next) {
+    size_t kept = 0;
+    for (size_t i = 0; i < lib->num_sites; i++) {
+      JitCallSite* site = &lib->sites[i];
+      if (site->owner == owner) {
+        if (!new_owner)
+          continue;
+        site->owner = new_owner;
+      }
+      lib->sites[kept++] = *site;
+    }
+    lib->num_sites = kept;
+  }
+  pthread_mutex_unlock(&ext_lib_registry.lock);
+}
+
+// the target of the private stub of call, RW view
+static uint64_t*
+jit_call_slot(JITCompiler* jit, const JitLibraryCall* call)
+{
+  uint64_t offset = call->stub + JIT_CALL_STUB_SLOT - (uint64_t)jit->code_chunk.rx;
+  return (uint64_t*)(jit->code_chunk.rw + offset);
+}
+
+// points the registered sites of the compiler at their BL again after the
+// code moved, the caller holds the registry lock
+static void
+jit_move_sites(JITCompiler* jit)
+{
+  for (ExternalLibrary* lib = ext_lib_registry.libraries; lib;
+       lib = lib->next) {
+    for (size_t i = 0; i < lib->num_sites; i++) {
+      JitCallSite* site = &lib->sites[i];
+      if (site->owner != jit)
+        continue;
+      size_t offset = jit->fixups[jit->library_calls[site->call].fixup].offset;
+      site->code = &jit->code[offset];
+      site->pc = jit_code_address(jit, offset);
+    }
+  }
+}
+
+// hands the patchable calls to their libraries. relaxation and the
+// peephole may still move the code afterwards, the sites follow it then.
+static void
+jit_register_calls(JITCompiler* jit)
+{
+  if (jit->num_registered_calls == jit->num_library_calls)
+    return;
+  pthread_mutex_lock(&ext_lib_registry.lock);
+  for (size_t i = jit->num_registered_calls; i < jit->num_library_calls; i++) {
+    JitLibraryCall* call = &jit->library_calls[i];
+    ExternalLibrary* lib = call->lib;
+    if (lib->num_sites >= lib->site_capacity) {
+      size_t capacity =
+        lib->site_capacity ? lib->site_capacity * 2 : MAX_CALL_SITE_CAPACITY;
+      JitCallSite* sites = realloc(lib->sites, sizeof(JitCallSite) * capacity);
+      if (!sites) {
+        fprintf(stderr, "JIT call site of function %d not registered\n",
+                call->function);
+        continue;
+      }
+      lib->sites = sites;
+      lib->site_capacity = capacity;
+    }
+
+    size_t offset = jit->fixups[call->fixup].offset;
+    JitCallSite* site = &lib->sites[lib->num_sites++];
+    site->code = &jit->code[offset];
+    site->pc = jit_code_address(jit, offset);
+    site->stub = call->stub;
+    site->slot = jit_call_slot(jit, call);
+    site->function = call->function;
+    site->owner = jit;
+    site->call = i;
+  }
+  pthread_mutex_unlock(&ext_lib_registry.lock);
+  jit->num_registered_calls = jit->num_library_calls;
+}
+
+// makes the emitted code visible to instruction fetch through the RX view.
+// execution through exec is then a plain call, no syscalls involved.
+bool
+jit_finalize(JITCompiler* jit)
+{
+  if (!jit)
+    return false;
+  if (jit->failed) {
+    fprintf(stderr, "JIT code incomplete, not finalized\n");
+    return false;
+  }
+  if (jit->finalized)
+    return true;
+
+  jit_register_calls(jit);
+
+  char* begin = (char*)jit->exec;
+  char* end = (char*)&jit->exec[jit->code_size];
+  char* stubs_end = (char*)jit->code_chunk.rx + jit->code_chunk.size;
+  char* stubs_begin = stubs_end - jit->num_stubs * JIT_STUB_SIZE;
+#ifdef __APPLE__
+  pthread_jit_write_protect_np(1);
+  sys_icache_invalidate(begin, end - begin);
+  sys_icache_invalidate(stubs_begin, stubs_end - stubs_begin);
+#else
+  __builtin___clear_cache(begin, end);
+  __builtin___clear_cache(stubs_begin, stubs_end);
+#endif
+  jit->finalized = true;
+  return true;
+}
+
+// called before anything writes to the code after jit_finalize
+static void
+jit_begin_write(JITCompiler* jit)
+{
+#ifdef __APPLE__
+  // MAP_JIT pages are writable per thread, only while we emit
+  if (jit->finalized)
+    pthread_jit_write_protect_np(0);
+#endif
+  jit->finalized = false;
+}
+
+void
+jit_cleanup(JITCompiler* jit)
+{
+  if (!jit)
+    return;
+  ext_lib_move_sites(jit, NULL);
+  if (jit->code)
+    jit_heap_free(&jit->code_chunk);
+  if (jit->data)
+    munmap(jit->data, jit->data_reserve);
+  if (jit->label_positions)
+    free(jit->label_positions);
+  if (jit->label_offsets)
+    free(jit->label_offsets);
+  if (jit->fixups)
+    free(jit->fixups);
+  if (jit->pending_fixups)
+    free(jit->pending_fixups);
+  if (jit->functions)
+    free(jit->functions);
+  if (jit->constants)
+    free(jit->constants);
+  if (jit->stubs)
+    free(jit->stubs);
+  free(jit->library_calls);
+  free(jit);
+}
+
+// forgets labels, fixups, functions, stubs and the literal pool
+static void
+jit_reset_state(JITCompiler* jit)
+{
+  memset(jit->label_positions, 0, jit->label_capacity * sizeof(uint32_t*));
+  memset(jit->label_offsets, 0, jit->label_capacity * sizeof(size_t));
+  jit->num_labels = 0;
+  jit->num_fixups = 0;
+  jit->num_pending_fixups = 0;
+  jit->num_functions = 0;
+  jit->current_function = (size_t)-1;
+  jit->num_constants = 0;
+  jit->num_stubs = 0;
+  jit->stub_area = 0;
+  jit->num_library_calls = 0;
+  jit->num_registered_calls = 0;
+  jit->failed = false;
+}
+
+void
+jit_reset(JITCompiler* jit)
+{
+  if (!jit)
+    return;
+  ext_lib_move_sites(jit, NULL);
+  jit_begin_write(jit);
+  memset(jit->code, 0, jit->capacity);
+  jit->code_size = 0;
+  jit_reset_state(jit);
+}
+
+// re-encodes every resolved fixup after instructions were inserted. returns
+// the index of the first fixup that no longer fits its immediate, or -1.
+static long
+jit_patch_fixups(JITCompiler* jit)
+{
+  for (size_t i = 0; i < jit->num_labels; i++) {
+    if (jit->label_positions[i])
+      jit->label_positions[i] = &jit->code[jit->label_offsets[i]];
+  }
+
+  // a library call keeps the target its stub has now, jit_patch_call or a
+  // reload may have moved it away from the one it was emitted with. the
+  // lock keeps ext_lib_reload out until the sites are where the BLs are.
+  bool calls = jit->num_library_calls > 0;
+  if (calls) {
+    pthread_mutex_lock(&ext_lib_registry.lock);
+    for (size_t i = 0; i < jit->num_library_calls; i++) {
+      JitLibraryCall* call = &jit->library_calls[i];
+      jit->fixups[call->fixup].target =
+        __atomic_load_n(jit_call_slot(jit, call), __ATOMIC_ACQUIRE);
+    }
+  }
+
+  long failed = -1;
+  for (size_t i = 0; i < jit->num_fixups && failed < 0; i++) {
+    if (!jit_apply_fixup(jit, &jit->fixups[i]))
+      failed = (long)i;
+  }
+
+  if (calls) {
+    jit_move_sites(jit);
+    pthread_mutex_unlock(&ext_lib_registry.lock);
+  }
+  return failed;
+}
+
+void
+jit_emit(JITCompiler* jit, uint32_t instruction)
+{
+  if (!jit || !jit->code) {
+    fprintf(stderr, "Invalid JIT compiler state\n");
+    return;
+  }
+
+  // commit more of the reserved range, the buffer never moves
+  if (jit->code_size >= jit->capacity / sizeof(uint32_t)) {
+    // pages committed for stubs before a reset stay stub pages
+    size_t top = jit->code_chunk.committed_top > jit->stub_area
+                   ? jit->code_chunk.committed_top
+                   : jit->stub_area;
+    size_t limit = jit->code_chunk.size - top;
+    size_t commit = jit->capacity * 2;
+    if (commit > limit)
+      commit = limit;
+
+    if (commit <= jit->capacity || !jit_heap_commit(&jit->code_chunk, commit)) {
+      fprintf(stderr, "JIT code reservation exhausted\n");
+      jit->failed = true;
+      return;
+    }
+    jit->capacity =
+      jit->code_chunk.committed < limit ? jit->code_chunk.committed : limit;
+  }
+
+  jit_begin_write(jit);
+  jit->code[jit->code_size++] = instruction;
+}
+
+size_t
+jit_create_label(JITCompiler* jit)
+{
+  if (jit->num_labels >= jit->label_capacity) {
+    size_t capacity = jit->label_capacity * 2;
+    uint32_t** positions =
+      realloc(jit->label_positions, sizeof(uint32_t*) * capacity);
+    if (positions)
+      jit->label_positions = positions;
+    size_t* offsets = realloc(jit->label_offsets, sizeof(size_t) * capacity);
+    if (offsets)
+      jit->label_offsets = offsets;
+    if (!positions || !offsets) {
+      fprintf(stderr, "JIT label table exhausted\n");
+      jit->failed = true;
+      return (size_t)-1;
+    }
+    jit->label_capacity = capacity;
+  }
+
+  jit->label_positions[jit->num_labels] = NULL;
+  return jit->num_labels++;
+}
+
+static bool
+jit_is_label_fixup(JitFixupKind kind)
+{
+  return kind == JIT_FIXUP_B || kind == JIT_FIXUP_B_COND ||
+         kind == JIT_FIXUP_B_COND_FAR || kind == JIT_FIXUP_BL ||
+         kind == JIT_FIXUP_CB || kind == JIT_FIXUP_TB;
+}
+
+// the address an instruction executes at, PC-relative encodings use this
+uint64_t
+jit_code_address(JITCompiler* jit, size_t offset)
+{
+  return (uint64_t)&jit->exec[offset];
+}
+
+bool
+jit_add_fixup(JITCompiler* jit, JitFixupKind kind, uint64_t target)
+{
+  if (jit->num_fixups >= jit->fixup_capacity) {
+    size_t capacity = jit->fixup_capacity * 2;
+    JitFixup* fixups = realloc(jit->fixups, sizeof(JitFixup) * capacity);
+    if (fixups)
+      jit->fixups = fixups;
+    size_t* pending = realloc(jit->pending_fixups, sizeof(size_t) * capacity);
+    if (pending)
+      jit->pending_fixups = pending;
+    if (!fixups || !pending) {
+      fprintf(stderr, "JIT fixup table exhausted\n");
+      jit->failed = true;
+      return false;
+    }
+    jit->fixup_capacity = capacity;
+  }
+
+  JitFixup* fixup = &jit->fixups[jit->num_fixups];
+  fixup->offset = jit->code_size;
+  fixup->target = target;
+  fixup->kind = kind;
+
+  if (jit_is_label_fixup(kind) &&
+      (target >= jit->num_labels || !jit->label_positions[target])) {
+    jit->pending_fixups[jit->num_pending_fixups++] = jit->num_fixups;
+  }
+  jit->num_fixups++;
+  return true;
+}
+
+// the address a call stub executes at, stub 0 is the topmost one
+static uint64_t
+jit_stub_address(JITCompiler* jit, size_t stub)
+{
+  return (uint64_t)(jit->code_chunk.rx + jit->code_chunk.size -
+                    (stub + 1) * JIT_STUB_SIZE);
+}
+
+// emits a stub that jumps to target. a shared stub is found again by
+// jit_call_stub, a private one belongs to a single patchable call site.
+// 0 when the reservation is full.
+//
+// a private stub takes two slots and waits while its target is 0, that is
+// where ext_lib_reload parks the callers while the library is not mapped:
+//   ldr x16, #24; cbz x16, #8; br x16; yield; b #-16; nop; .quad target
+static uint64_t
+jit_new_stub(JITCompiler* jit, uint64_t target, bool shared)
+{
+  size_t count = shared ? 1 : JIT_CALL_STUB_SIZE / JIT_STUB_SIZE;
+  size_t top = (jit->num_stubs + count) * JIT_STUB_SIZE;
+  if (top > jit->stub_area) {
+    // take the next page from the top, unless the code already uses it
+    size_t area = jit_page_align(top);
+    size_t limit = jit->code_chunk.size - area;
+    if (jit->code_size * sizeof(uint32_t) > limit ||
+        !jit_heap_commit_top(&jit->code_chunk, area)) {
+      fprintf(stderr, "JIT code reservation exhausted\n");
+      return 0;
+    }
+    jit->stub_area = area;
+    if (jit->capacity > limit)
+      jit->capacity = limit;
+  }
+
+  if (jit->num_stubs + count > jit->stub_capacity) {
+    size_t capacity = jit->stub_capacity * 2;
+    uint64_t* stubs = realloc(jit->stubs, sizeof(uint64_t) * capacity);
+    if (!stubs) {
+      fprintf(stderr, "JIT stub table exhausted\n");
+      return 0;
+    }
+    jit->stubs = stubs;
+    jit->stub_capacity = capacity;
+  }
+
+  uint32_t* stub =
+    (uint32_t*)(jit->code_chunk.rw + jit->code_chunk.size - top);
+  jit_begin_write(jit);
+  if (shared) {
+    stub[0] = arm64_ldr_lit(16, 2); // ldr x16, #8
+    stub[1] = arm64_br(16);         // br x16
+    memcpy(&stub[2], &target, sizeof(uint64_t));
+  } else {
+    stub[0] = arm64_ldr_lit(16, JIT_CALL_STUB_SLOT / 4); // ldr x16, #24
+    stub[1] = 0xb4000050;                               // cbz x16, #8
+    stub[2] = arm64_br(16);                             // br x16
+    stub[3] = 0xd503203f;                               // yield
+    stub[4] = arm64_b(-4);                              // b #-16
+    stub[5] = 0xd503201f;                               // nop
+    memcpy(&stub[JIT_CALL_STUB_SLOT / 4], &target, sizeof(uint64_t));
+  }
+
+  // 0 is never looked up, so private stubs are not shared
+  for (size_t i = 0; i < count; i++)
+    jit->stubs[jit->num_stubs++] = shared ? target : 0;
+  return jit_stub_address(jit, jit->num_stubs - 1);
+}
+
+// returns the stub that jumps to target, emitting it on first use so every
+// call site of the same target shares it
+static uint64_t
+jit_call_stub(JITCompiler* jit, uint64_t target)
+{
+  for (size_t i = 0; i < jit->num_stubs; i++) {
+    if (jit->stubs[i] == target)
+      return jit_stub_address(jit, i);
+  }
+  return jit_new_stub(jit, target, true);
+}
+
+bool
+jit_apply_fixup(JITCompiler* jit, const JitFixup* fixup)
+{
+  uint32_t* site = &jit->code[fixup->offset];
+  jit_begin_write(jit);
+
+  switch (fixup->kind) {
+    case JIT_FIXUP_B:
+    case JIT_FIXUP_B_COND:
+    case JIT_FIXUP_B_COND_FAR:
+    case JIT_FIXUP_BL:
+    case JIT_FIXUP_CB:
+    case JIT_FIXUP_TB: {
+      // unbound labels are patched by jit_bind_label
+      if (fixup->target >= jit->num_labels ||
+          !jit->label_positions[fixup->target])
+        return true;
+
+      int64_t disp =
+        (int64_t)jit->label_offsets[fixup->target] - (int64_t)fixup->offset;
+      int cond = *site & 0xf;
+
+      if (fixup->kind == JIT_FIXUP_B) {
+        if (!jit_fits_signed(disp, 26))
+          return false;
+        *site = arm64_b(disp);
+      } else if (fixup->kind == JIT_FIXUP_BL) {
+        if (!jit_fits_signed(disp, 26))
+          return false;
+        *site = arm64_bl(disp);
+      } else if (fixup->kind == JIT_FIXUP_B_COND) {
+        if (!jit_fits_signed(disp, 19))
+          return false;
+        *site = arm64_b_cond(disp, cond);
+      } else if (fixup->kind == JIT_FIXUP_CB) {
+        if (!jit_fits_signed(disp, 19))
+          return false;
+        *site = (*site & 0xff00001f) | ((uint32_t)(disp & 0x7ffff) << 5);
+      } else if (fixup->kind == JIT_FIXUP_TB) {
+        if (!jit_fits_signed(disp, 14))
+          return false;
+        *site = (*site & 0xfff8001f) | ((uint32_t)(disp & 0x3fff) << 5);
+      } else {
+        // the inverted branch in site[0] skips over the unconditional one
+        if (!jit_fits_signed(disp - 1, 26))
+          return false;
+        site[1] = arm64_b(disp - 1);
+      }
+      return true;
+    }
+    case JIT_FIXUP_ADR_ABS: {
+      int64_t disp =
+        (int64_t)fixup->target - (int64_t)jit_code_address(jit, fixup->offset);
+      if (!jit_fits_signed(disp, 21))
+        return false;
+      *site = arm64_adr(*site & 0x1f, disp);
+      return true;
+    }
+    case JIT_FIXUP_ADRP_DATA:
+    case JIT_FIXUP_ADRP_ABS: {
+      uint64_t addr = fixup->kind == JIT_FIXUP_ADRP_ABS
+                        ? fixup->target
+                        : (uint64_t)(jit->data + fixup->target);
+      int64_t pc = (int64_t)jit_code_address(jit, fixup->offset);
+      int64_t rel_page = (int64_t)(addr & ~0xFFF) - (pc & ~0xFFF);
+      if (!jit_fits_signed(rel_page >> 12, 21))
+        return false;
+      *site = arm64_adrp(*site & 0x1f, rel_page);
+      return true;
+    }
+    case JIT_FIXUP_LDR_DATA: {
+      int64_t disp = (int64_t)(uint64_t)(jit->data + fixup->target) -
+                     (int64_t)jit_code_address(jit, fixup->offset);
+      if (!jit_fits_signed(disp / 4, 19))
+        return false;
+      *site = (*site & 0xff00001f) | ((uint32_t)((disp / 4) & 0x7ffff) << 5);
+      return true;
+    }
+    case JIT_FIXUP_CALL: {
+      uint64_t pc = jit_code_address(jit, fixup->offset);
+      int64_t disp = (int64_t)fixup->target - (int64_t)pc;
+      if (!jit_fits_signed(disp / 4, 26)) {
+        // too far for a direct BL, go through the stub of the target
+        uint64_t stub = jit_call_stub(jit, fixup->target);
+        if (!stub)
+          return false;
+        disp = (int64_t)stub - (int64_t)pc;
+      }
+      *site = arm64_bl(disp / 4);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool
+jit_insert_instruction(JITCompiler* jit, size_t offset, uint32_t instruction)
+{
+  if (offset > jit->code_size)
+    return false;
+
+  // make room at the end first, this may commit more of the buffer
+  size_t tail = jit->code_size - offset;
+  jit_emit(jit, 0);
+  if (jit->code_size != offset + tail + 1)
+    return false;
+
+  // registered call sites move along, a reload can't patch in between
+  bool calls = jit->num_library_calls > 0;
+  if (calls)
+    pthread_mutex_lock(&ext_lib_registry.lock);
+  memmove(&jit->code[offset + 1], &jit->code[offset], tail * sizeof(uint32_t));
+  jit->code[offset] = instruction;
+
+  for (size_t i = 0; i < jit->num_labels; i++) {
+    if (jit->label_positions[i] && jit->label_offsets[i] >= offset)
+      jit->label_offsets[i]++;
+  }
+  for (size_t i = 0; i < jit->num_fixups; i++) {
+    if (jit->fixups[i].offset >= offset)
+      jit->fixups[i].offset++;
+  }
+  if (calls) {
+    jit_move_sites(jit);
+    pthread_mutex_unlock(&ext_lib_registry.lock);
+  }
+  return true;
+}
+
+// turns an out of range B.cond into B.!cond #8; B <label> (CBZ and TBZ the
+// same way) and keeps re-encoding until every fixup fits, since each
+// insertion moves code.
+static void
+jit_relax_branches(JITCompiler* jit, long index)
+{
+  while (index >= 0) {
+    JitFixup* fixup = &jit->fixups[index];
+    size_t offset = fixup->offset;
+    uint32_t site = jit->code[offset];
+    uint32_t inverted;
+
+    if (fixup->kind == JIT_FIXUP_B_COND) {
+      inverted = arm64_b_cond(2, (site & 0xf) ^ 1);
+    } else if (fixup->kind == JIT_FIXUP_CB) {
+      // flipping bit 24 turns CBZ into CBNZ and back
+      inverted = ((site ^ 0x01000000) & 0xff00001f) | (2 << 5);
+    } else if (fixup->kind == JIT_FIXUP_TB) {
+      inverted = ((site ^ 0x01000000) & 0xfff8001f) | (2 << 5);
+    } else {
+      fprintf(stderr, "JIT fixup %ld out of range\n", index);
+      jit->failed = true;
+      return;
+    }
+
+    // the site is only rewritten once there is room for the B
+    if (!jit_insert_instruction(jit, offset + 1, arm64_b(0))) {
+      fprintf(stderr, "JIT fixup %ld can't be relaxed\n", index);
+      jit->failed = true;
+      return;
+    }
+    jit->code[offset] = inverted;
+    fixup->kind = JIT_FIXUP_B_COND_FAR;
+
+    index = jit_patch_fixups(jit);
+  }
+}
+
+void
+jit_bind_label(JITCompiler* jit, size_t label)
+{
+  if (label >= jit->num_labels)
+    return;
+  jit->label_positions[label] = &jit->code[jit->code_size];
+  jit->label_offsets[label] = jit->code_size;
+
+  // resolve forward branches to this label
+  long failed = -1;
+  size_t i = 0;
+  while (i < jit->num_pending_fixups) {
+    size_t index = jit->pending_fixups[i];
+    if (jit->fixups[index].target != label) {
+      i++;
+      continue;
+    }
+
+    if (!jit_apply_fixup(jit, &jit->fixups[index]) && failed < 0)
+      failed = (long)index;
+    jit->pending_fixups[i] =
+      jit->pending_fixups[--jit->num_pending_fixups];
+  }
+
+  if (failed >= 0)
+    jit_relax_branches(jit, failed);
+}
+
+int32_t
+jit_branch_offset(JITCompiler* jit, size_t label)
+{
+  if (label >= jit->num_labels || !jit->label_positions[label])
+    return 0;
+  int32_t current = jit->code_size;
+  int32_t target = jit->label_offsets[label];
+  return target - current;
+}
+
+void
+jit_load_int(JITCompiler* jit, int reg, int32_t value)
+{
+  // sign extended, so negative values are correct in the full register
+  jit_load_imm64(jit, reg, (uint64_t)(int64_t)value);
+}
+
+void
+jit_load_imm64(JITCompiler* jit, int reg, uint64_t value)
+{
+  uint32_t instructions[4];
+  int count = arm64_imm64_sequence(reg, value, instructions);
+  for (int i = 0; i < count; i++)
+    jit_emit(jit, instructions[i]);
+}
+
+// pointers near the code are cheaper PC-relative, ADR reaches +-1MB and
+// ADRP (+ ADD) +-4GB. both are fixups, so they follow the code if it moves.
+void
+jit_load_addr(JITCompiler* jit, int reg, const void* ptr)
+{
+  uint64_t addr = (uint64_t)ptr;
+  int64_t pc = (int64_t)jit_code_address(jit, jit->code_size);
+  int64_t disp = (int64_t)addr - pc;
+
+  uint32_t instructions[4];
+  int count = arm64_imm64_sequence(reg, addr, instructions);
+
+  // keep some slack for branch relaxation moving the ADR later on
+  if (count > 1 && jit_fits_signed(disp, 20)) {
+    jit_add_fixup(jit, JIT_FIXUP_ADR_ABS, addr);
+    jit_emit(jit, arm64_adr(reg, disp));
+    return;
+  }
+
+  int64_t rel_page = (int64_t)(addr & ~0xFFF) - (pc & ~0xFFF);
+  int adrp_count = (addr & 0xFFF) ? 2 : 1;
+  if (count > adrp_count && jit_fits_signed(rel_page >> 12, 21)) {
+    jit_add_fixup(jit, JIT_FIXUP_ADRP_ABS, addr);
+    jit_emit(jit, arm64_adrp(reg, rel_page));
+    if (addr & 0xFFF)
+      jit_emit(jit, arm64_add_imm(reg, reg, addr & 0xFFF));
+    return;
+  }
+
+  for (int i = 0; i < count; i++)
+    jit_emit(jit, instructions[i]);
+}
+
+void
+jit_compare(JITCompiler* jit, int reg1, int reg2)
+{
+  jit_emit(jit, arm64_cmp(reg1, reg2));
+}
+
+void
+jit_jump(JITCompiler* jit, size_t label)
+{
+  int32_t offset = jit_branch_offset(jit, label);
+  jit_add_fixup(jit, JIT_FIXUP_B, label);
+  jit_emit(jit, arm64_b(offset));
+}
+
+void
+jit_jump_if(JITCompiler* jit, size_t label, int cond)
+{
+  int32_t offset = jit_branch_offset(jit, label);
+
+  // backward branches are known now, forward ones get relaxed when bound
+  if (!jit_fits_signed(offset, 19)) {
+    jit_add_fixup(jit, JIT_FIXUP_B_COND_FAR, label);
+    jit_emit(jit, arm64_b_cond(2, cond ^ 1));
+    jit_emit(jit, arm64_b(offset - 1));
+    return;
+  }
+
+  jit_add_fixup(jit, JIT_FIXUP_B_COND, label);
+  jit_emit(jit, arm64_b_cond(offset, cond));
+}
+
+void
+jit_jump_if_equal(JITCompiler* jit, size_t label)
+{
+  jit_jump_if(jit, label, COND_EQ);
+}
+
+void
+jit_jump_if_not_equal(JITCompiler* jit, size_t label)
+{
+  jit_jump_if(jit, label, COND_NE);
+}
+
+void
+jit_jump_if_less(JITCompiler* jit, size_t label)
+{
+  jit_jump_if(jit, label, COND_LT);
+}
+
+void
+jit_jump_if_greater(JITCompiler* jit, size_t label)
+{
+  jit_jump_if(jit, label, COND_GT);
+}
+
+void
+jit_jump_if_less_equal(JITCompiler* jit, size_t label)
+{
+  jit_jump_if(jit, label, COND_LE);
+}
+
+void
+jit_jump_if_greater_equal(JITCompiler* jit, size_t label)
+{
+  jit_jump_if(jit, label, COND_GE);
+}
+
+void
+jit_jump_if_below(JITCompiler* jit, size_t label)
+{
+  jit_jump_if(jit, label, COND_CC);
+}
+
+void
+jit_jump_if_below_equal(JITCompiler* jit, size_t label)
+{
+  jit_jump_if(jit, label, COND_LS);
+}
+
+void
+jit_jump_if_above(JITCompiler* jit, size_t label)
+{
+  jit_jump_if(jit, label, COND_HI);
+}
+
+void
+jit_jump_if_above_equal(JITCompiler* jit, size_t label)
+{
+  jit_jump_if(jit, label, COND_CS);
+}
+
+void
+jit_select(JITCompiler* jit, int rd, int rn, int rm, int cond)
+{
+  jit_emit(jit, arm64_csel(rd, rn, rm, cond));
+}
+
+void
+jit_select_increment(JITCompiler* jit, int rd, int rn, int rm, int cond)
+{
+  jit_emit(jit, arm64_csinc(rd, rn, rm, cond));
+}
+
+void
+jit_select_negate(JITCompiler* jit, int rd, int rn, int rm, int cond)
+{
+  jit_emit(jit, arm64_csneg(rd, rn, rm, cond));
+}
+
+void
+jit_set_if(JITCompiler* jit, int rd, int cond)
+{
+  jit_emit(jit, arm64_cset(rd, cond));
+}
+
+void
+jit_set_mask_if(JITCompiler* jit, int rd, int cond)
+{
+  jit_emit(jit, arm64_csetm(rd, cond));
+}
+
+void
+jit_compare_if(JITCompiler* jit, int rn, int rm, int nzcv, int cond)
+{
+  jit_emit(jit, arm64_ccmp(rn, rm, nzcv, cond));
+}
+
+void
+jit_min(JITCompiler* jit, int rd, int rn, int rm)
+{
+  jit_emit(jit, arm64_cmp(rn, rm));
+  jit_emit(jit, arm64_csel(rd, rn, rm, COND_LT));
+}
+
+void
+jit_max(JITCompiler* jit, int rd, int rn, int rm)
+{
+  jit_emit(jit, arm64_cmp(rn, rm));
+  jit_emit(jit, arm64_csel(rd, rn, rm, COND_GT));
+}
+
+void
+jit_clamp(JITCompiler* jit, int rd, int rn, int lo, int hi)
+{
+  jit_max(jit, rd, rn, lo);
+  jit_min(jit, rd, rd, hi);
+}
+
+bool
+jit_loop_begin(JITCompiler* jit, JitLoop* loop)
+{
+  int level = loop->prefetch_level ? loop->prefetch_level : 1;
+  if (level > 3 || loop->prefetch < 0) {
+    fprintf(stderr, "JIT loop: bad prefetch level or distance\n");
+    return false;
+  }
+
+  loop->top = jit_create_label(jit);
+  loop->done = jit_create_label(jit);
+  jit_compare(jit, loop->counter, 31);
+  jit_jump_if_equal(jit, loop->done);
+  jit_bind_label(jit, loop->top);
+
+  if (!loop->prefetch)
+    return true;
+
+  int hint = (level - 1) * 2 + (loop->prefetch_keep ? 0 : 1);
+  if (loop->load >= 0 &&
+      !jit_prefetch(jit, PRFM_PLDL1KEEP | hint, loop->load, loop->prefetch))
+    return false;
+  if (loop->store >= 0 &&
+      !jit_prefetch(jit, PRFM_PSTL1KEEP | hint, loop->store, loop->prefetch))
+    return false;
+  return true;
+}
+
+void
+jit_loop_end(JITCompiler* jit, JitLoop* loop)
+{
+  jit_emit(jit, arm64_sub_imm(loop->counter, loop->counter, 1));
+  jit_compare(jit, loop->counter, 31);
+  jit_jump_if_not_equal(jit, loop->top);
+  jit_bind_label(jit, loop->done);
+}
+
+// BL to an absolute address, direct when it is in range and through the
+// shared stub of the target otherwise. false when the call couldn't be
+// emitted or can't reach its target.
+static bool
+jit_emit_call(JITCompiler* jit, void* func_ptr)
+{
+  if (!jit_add_fixup(jit, JIT_FIXUP_CALL, (uint64_t)func_ptr))
+    return false;
+  size_t offset = jit->code_size;
+  jit_emit(jit, arm64_bl(0));
+  if (jit->code_size == offset)
+    return false;
+  if (!jit_apply_fixup(jit, &jit->fixups[jit->num_fixups - 1])) {
+    fprintf(stderr, "JIT call to %p out of range\n", func_ptr);
+    jit->failed = true;
+    return false;
+  }
+  return true;
+}
+
+void
+jit_call(JITCompiler* jit, void* func_ptr)
+{
+  jit_emit(jit, arm64_stp_pre(29, 30, 31, -2)); // stp x29, x30, [sp, #-16]!
+  jit_emit_call(jit, func_ptr);                 // bl <func_ptr or its stub>
+  jit_emit(jit, arm64_ldp_post(29, 30, 31, 2)); // ldp x29, x30, [sp], #16
+}
+
+size_t
+jit_declare_function(JITCompiler* jit)
+{
+  if (jit->num_functions >= jit->function_capacity) {
+    size_t capacity = jit->function_capacity * 2;
+    JitFunction* functions =
+      realloc(jit->functions, sizeof(JitFunction) * capacity);
+    if (!functions) {
+      fprintf(stderr, "JIT function table exhausted\n");
+      return (size_t)-1;
+    }
+    jit->functions = functions;
+    jit->function_capacity = capacity;
+  }
+
+  JitFunction* function = &jit->functions[jit->num_functions];
+  function->label = jit_create_label(jit);
+  function->size = 0;
+  return jit->num_functions++;
+}
+
+void
+jit_bind_function(JITCompiler* jit, size_t func)
+{
+  if (func >= jit->num_functions)
+    return;
+  if (jit->current_function != (size_t)-1)
+    jit_end_function(jit);
+
+  // keep entries aligned so hot functions start on a fetch boundary
+  while ((jit->code_size * sizeof(uint32_t)) % JIT_FUNCTION_ALIGNMENT)
+    jit_emit(jit, 0xd503201f); // nop
+
+  jit_bind_label(jit, jit->functions[func].label);
+  jit->current_function = func;
+  jit->num_constants = 0;
+}
+
+size_t
+jit_begin_function(JITCompiler* jit)
+{
+  size_t func = jit_declare_function(jit);
+  jit_bind_function(jit, func);
+  return func;
+}
+
+void
+jit_end_function(JITCompiler* jit)
+{
+  if (jit->current_function == (size_t)-1)
+    return;
+
+  JitFunction* function = &jit->functions[jit->current_function];
+  function->size = jit->code_size - jit->label_offsets[function->label];
+  jit->current_function = (size_t)-1;
+}
+
+void*
+jit_function_entry(JITCompiler* jit, size_t func)
+{
+  if (func >= jit->num_functions)
+    return NULL;
+
+  size_t label = jit->functions[func].label;
+  if (!jit->label_positions[label])
+    return NULL;
+  return (void*)jit_code_address(jit, jit->label_offsets[label]);
+}
+
+void
+jit_call_function(JITCompiler* jit, size_t func)
+{
+  if (func >= jit->num_functions)
+    return;
+
+  jit_emit(jit, arm64_stp_pre(29, 30, 31, -2)); // stp x29, x30, [sp, #-16]!
+
+  size_t label = jit->functions[func].label;
+  jit_add_fixup(jit, JIT_FIXUP_BL, label);
+  jit_emit(jit, arm64_bl(jit_branch_offset(jit, label))); // bl <func>
+
+  jit_emit(jit, arm64_ldp_post(29, 30, 31, 2)); // ldp x29, x30, [sp], #16
+}
+
+static JitValue
+jit_execute_entry(JITCompiler* jit, void* entry, JitReturnType return_type)
+{
+  JitValue result = { 0 };
+  if (!jit->finalized) {
+    fprintf(stderr, "JIT code executed before jit_finalize\n");
+    return result;
+  }
+
+  switch (return_type) {
+    case JIT_TYPE_INT: {
+      JitFunctionInt func = (JitFunctionInt)entry;
+      result.i = func();
+      break;
+    }
+    case JIT_TYPE_FLOAT: {
+      JitFunctionFloat func = (JitFunctionFloat)entry;
+      result.f = func();
+      break;
+    }
+    case JIT_TYPE_DOUBLE: {
+      JitFunctionDouble func = (JitFunctionDouble)entry;
+      result.d = func();
+      break;
+    }
+    case JIT_TYPE_INT64:
+    case JIT_TYPE_POINTER: {
+      JitFunctionInt64 func = (JitFunctionInt64)entry;
+      result.l = func();
+      break;
+    }
+    case JIT_TYPE_VOID: {
+      JitFunctionVoid func = (JitFunctionVoid)entry;
+      func();
+      break;
+    }
+  }
+
+  return result;
+}
+
+JitValue
+jit_execute_typed(JITCompiler* jit, JitReturnType return_type)
+{
+  return jit_execute_entry(
+    jit, (void*)jit_code_address(jit, 0), return_type);
+}
+
+JitValue
+jit_execute_function(JITCompiler* jit, size_t func, JitReturnType return_type)
+{
+  JitValue result = { 0 };
+
+  void* entry = jit_function_entry(jit, func);
+  if (!entry) {
+    fprintf(stderr, "JIT function %zu is not defined\n", func);
+    return result;
+  }
+  return jit_execute_entry(jit, entry, return_type);
+}
+
+void
+jit_dump_code(JITCompiler* jit)
+{
+  if (!jit || !jit->code || jit->code_size == 0) {
+    fprintf(stderr,
+            "JIT dump failed: Invalid JIT compiler or empty code section.\n");
+    return;
+  }
+  printf("\n\n\t\tTinyJIT Dump\n\n");
+  printf("INSTRUCTIONS: %zu/%zu bytes\n", jit->code_size, jit->capacity);
+  printf("---------------------------------------------------------\n");
+  uint8_t* code = (uint8_t*)jit->code;
+  for (size_t i = 0; i < jit->code_size; i++) {
+    if (i % 16 == 0) {
+      if (i > 0)
+        printf("\n");
+      printf("%08zx: ", i);
+    }
+    printf("%02x ", code[i]);
+  }
+  printf("\n");
+
+  if (jit->num_functions > 0) {
+    printf("\nFUNCTIONS: %zu\n", jit->num_functions);
+    printf("---------------------------------------------------------\n");
+    for (size_t i = 0; i < jit->num_functions; i++) {
+      size_t label = jit->functions[i].label;
+      if (!jit->label_positions[label]) {
+        printf("%4zu: <undefined>\n", i);
+        continue;
+      }
+      printf("%4zu: %08zx (%zu instructions)\n",
+             i,
+             jit->label_offsets[label] * sizeof(uint32_t),
+             jit->functions[i].size);
+    }
+  }
+
+  if (jit->num_stubs > 0) {
+    printf("\nCALL STUBS: %zu\n", jit->num_stubs);
+    printf("---------------------------------------------------------\n");
+    for (size_t i = 0; i < jit->num_stubs; i++) {
+      printf("%4zu: %016llx -> %016llx\n",
+             i,
+             (unsigned long long)jit_stub_address(jit, i),
+             (unsigned long long)jit->stubs[i]);
+    }
+  }
+
+  if (jit->data && jit->data_size > 0) {
+    printf("\nSTATIC MEMORY: %zu/%zu bytes\n", jit->data_size, jit->data_capacity);
+    printf("---------------------------------------------------------\n");
+    uint8_t* data = (uint8_t*)jit->data;
+    for (size_t i = 0; i < jit->data_size; i++) {
+      if (i % 16 == 0) {
+        if (i > 0)
+          printf("\n");
+        printf("%08zx: ", i);
+      }
+      printf("%02x ", data[i]);
+    }
+    printf("\n");
+  } else {
+    printf("\nNo data section found.\n");
+  }
+}
+
+int
+jit_execute_int(JITCompiler* jit)
+{
+  return jit_execute_typed(jit, JIT_TYPE_INT).i;
+}
+
+float
+jit_execute_float(JITCompiler* jit)
+{
+  return jit_execute_typed(jit, JIT_TYPE_FLOAT).f;
+}
+
+double
+jit_execute_double(JITCompiler* jit)
+{
+  return jit_execute_typed(jit, JIT_TYPE_DOUBLE).d;
+}
+
+// the invoker keeps args, results and count in x19-x21 across the calls:
+//   loop: load the tuple into x0-x7 / v0-v7, bl func, store x0 / v0,
+//         advance args by num_args values and results by one
+bool
+jit_function_handle(JITCompiler* jit,
+                    size_t func,
+                    const JitSignature* signature,
+                    JitHandle* handle)
+{
+  if (func >= jit->num_functions || signature->num_args < 0 ||
+      signature->num_args > JIT_MAX_ARGS) {
+    fprintf(stderr, "JIT handle: bad function or signature\n");
+    return false;
+  }
+  for (int i = 0; i < signature->num_args; i++) {
+    if (signature->args[i] == JIT_TYPE_VOID) {
+      fprintf(stderr, "JIT handle: void argument %d\n", i);
+      return false;
+    }
+  }
+
+  size_t invoker = jit_begin_function(jit);
+  size_t loop = jit_create_label(jit);
+  size_t done = jit_create_label(jit);
+  jit_emit(jit, arm64_stp_pre(29, 30, 31, -6)); // stp x29, x30, [sp, #-48]!
+  jit_emit(jit, 0x910003fd);                    // mov x29, sp
+  jit_emit(jit, arm64_stp(19, 20, 31, 2));      // stp x19, x20, [sp, #16]
+  jit_emit(jit, arm64_stp(21, 22, 31, 4));      // stp x21, x22, [sp, #32]
+  jit_emit(jit, arm64_add(19, 0, 31));
+  jit_emit(jit, arm64_add(20, 1, 31));
+  jit_emit(jit, arm64_add(21, 2, 31));
+
+  jit_bind_label(jit, loop);
+  jit_compare(jit, 21, 31);
+  jit_jump_if_equal(jit, done);
+
+  int gp = 0, fp = 0;
+  for (int i = 0; i < signature->num_args; i++) {
+    switch (signature->args[i]) {
+      case JIT_TYPE_FLOAT:
+        jit_emit(jit, arm64_ldrs(fp++, 19, (uint16_t)(i * 2)));
+        break;
+      case JIT_TYPE_DOUBLE:
+        jit_emit(jit, arm64_ldrd(fp++, 19, (uint16_t)i));
+        break;
+      default:
+        jit_emit(jit, arm64_ldr(gp++, 19, (uint16_t)i));
+        break;
+    }
+  }
+
+  size_t label = jit->functions[func].label;
+  jit_add_fixup(jit, JIT_FIXUP_BL, label);
+  jit_emit(jit, arm64_bl(jit_branch_offset(jit, label)));
+
+  switch (signature->ret) {
+    case JIT_TYPE_INT: jit_emit(jit, arm64_strw(0, 20, 0)); break;
+    case JIT_TYPE_FLOAT: jit_emit(jit, arm64_strs(0, 20, 0)); break;
+    case JIT_TYPE_DOUBLE: jit_emit(jit, arm64_strd(0, 20, 0)); break;
+    case JIT_TYPE_INT64:
+    case JIT_TYPE_POINTER: jit_emit(jit, arm64_str(0, 20, 0)); break;
+    case JIT_TYPE_VOID: break;
+  }
+  if (signature->num_args)
+    jit_emit(jit, arm64_add_imm(19, 19, signature->num_args * sizeof(JitValue)));
+  if (signature->ret != JIT_TYPE_VOID)
+    jit_emit(jit, arm64_add_imm(20, 20, sizeof(JitValue)));
+  jit_emit(jit, arm64_sub_imm(21, 21, 1));
+  jit_jump(jit, loop);
+
+  jit_bind_label(jit, done);
+  jit_emit(jit, arm64_ldp(21, 22, 31, 4));      // ldp x21, x22, [sp, #32]
+  jit_emit(jit, arm64_ldp(19, 20, 31, 2));      // ldp x19, x20, [sp, #16]
+  jit_emit(jit, arm64_ldp_post(29, 30, 31, 6)); // ldp x29, x30, [sp], #48
+  jit_emit(jit, arm64_ret());
+  jit_end_function(jit);
+  if (!jit_finalize(jit))
+    return false;
+
+  handle->entry = jit_function_entry(jit, func);
+  handle->invoke = (JitInvoker)jit_function_entry(jit, invoker);
+  handle->signature = *signature;
+  return handle->entry && handle->invoke;
+}
+
+JitValue
+jit_invoke(const JitHandle* handle, const JitValue* args)
+{
+  JitValue result = { 0 };
+  handle->invoke(args, &result, 1);
+  return result;
+}
+
+void
+jit_invoke_batch(const JitHandle* handle,
+                 const JitValue* args,
+                 JitValue* results,
+                 size_t count)
+{
+  handle->invoke(args, results, count);
+}
+
+JitSealed*
+jit_seal(JITCompiler* jit)
+{
+  if (jit->current_function != (size_t)-1) {
+    fprintf(stderr, "JIT seal: function %zu is still open\n", jit->current_function);
+    return NULL;
+  }
+  if (!jit_finalize(jit))
+    return NULL;
+
+  JitSealed* sealed = malloc(sizeof(JitSealed));
+  if (!sealed)
+    return NULL;
+  sealed->num_functions = jit->num_functions;
+  sealed->entries = malloc(sizeof(void*) * (jit->num_functions + 1));
+  if (!sealed->entries) {
+    free(sealed);
+    return NULL;
+  }
+
+  // the compiler moves to a new chunk of the same reservation size
+  JitCodeChunk chunk;
+  if (!jit_heap_alloc(&chunk, jit->code_chunk.size, MAX_CODE_MEMORY_SIZE)) {
+    free(sealed->entries);
+    free(sealed);
+    return NULL;
+  }
+
+  ext_lib_move_sites(jit, sealed);
+  for (size_t i = 0; i < jit->num_functions; i++)
+    sealed->entries[i] = jit_function_entry(jit, i);
+  sealed->code_chunk = jit->code_chunk;
+  sealed->data = jit->data;
+  sealed->data_reserve = jit->data_reserve;
+
+  jit->code_chunk = chunk;
+  jit->code = (uint32_t*)chunk.rw;
+  jit->exec = (uint32_t*)chunk.rx;
+  jit->capacity = chunk.committed;
+  jit->code_size = 0;
+  jit->finalized = true;
+  jit->data = NULL;
+  jit->data_size = 0;
+  jit->data_capacity = 0;
+  jit_reset_state(jit);
+  return sealed;
+}
+
+void*
+jit_sealed_entry(const JitSealed* sealed, size_t func)
+{
+  return func < sealed->num_functions ? sealed->entries[func] : NULL;
+}
+
+void
+jit_sealed_free(JitSealed* sealed)
+{
+  if (!sealed)
+    return;
+  ext_lib_move_sites(sealed, NULL);
+  jit_heap_free(&sealed->code_chunk);
+  if (sealed->data)
+    munmap(sealed->data, sealed->data_reserve);
+  free(sealed->entries);
+  free(sealed);
+}
+
+JitSealed*
+jit_sealed_exchange(JitSealed** slot, JitSealed* sealed)
+{
+  return __atomic_exchange_n(slot, sealed, __ATOMIC_ACQ_REL);
+}
+
+JitSealed*
+jit_sealed_load(JitSealed* const* slot)
+{
+  return __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+}
+
+JitEpoch*
+jit_epoch_init()
+{
+  JitEpoch* epoch = malloc(sizeof(JitEpoch));
+  if (!epoch)
+    return NULL;
+
+  memset(epoch, 0, sizeof(JitEpoch));
+  pthread_mutex_init(&epoch->lock, NULL);
+  return epoch;
+}
+
+void
+jit_epoch_cleanup(JitEpoch* epoch)
+{
+  if (!epoch)
+    return;
+
+  while (epoch->retired) {
+    JitRetired* retired = epoch->retired;
+    epoch->retired = retired->next;
+    jit_sealed_free(retired->sealed);
+    free(retired);
+  }
+  while (epoch->threads) {
+    JitEpochThread* thread = epoch->threads;
+    epoch->threads = thread->next;
+    free(thread);
+  }
+  pthread_mutex_destroy(&epoch->lock);
+  free(epoch);
+}
+
+JitEpochThread*
+jit_epoch_register(JitEpoch* epoch)
+{
+  JitEpochThread* thread = malloc(sizeof(JitEpochThread));
+  if (!thread)
+    return NULL;
+
+  thread->state = 0;
+  pthread_mutex_lock(&epoch->lock);
+  thread->next = epoch->threads;
+  epoch->threads = thread;
+  pthread_mutex_unlock(&epoch->lock);
+  return thread;
+}
+
+void
+jit_epoch_unregister(JitEpoch* epoch, JitEpochThread* thread)
+{
+  pthread_mutex_lock(&epoch->lock);
+  for (JitEpochThread** link = &epoch->threads; *link; link = &(*link)->next) {
+    if (*link == thread) {
+      *link = thread->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&epoch->lock);
+  free(thread);
+}
+
+void
+jit_epoch_enter(JitEpoch* epoch, JitEpochThread* thread)
+{
+  uint64_t current = __atomic_load_n(&epoch->epoch, __ATOMIC_ACQUIRE);
+  __atomic_store_n(&thread->state, current << 1 | 1, __ATOMIC_SEQ_CST);
+  // the announcement has to be visible before any module pointer is read
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void
+jit_epoch_exit(JitEpochThread* thread)
+{
+  __atomic_store_n(&thread->state, 0, __ATOMIC_RELEASE);
+}
+
+void
+jit_epoch_retire(JitEpoch* epoch, JitSealed* sealed)
+{
+  if (!sealed)
+    return;
+
+  JitRetired* retired = malloc(sizeof(JitRetired));
+  pthread_mutex_lock(&epoch->lock);
+  if (retired) {
+    retired->sealed = sealed;
+    retired->epoch = __atomic_load_n(&epoch->epoch, __ATOMIC_SEQ_CST);
+    retired->next = epoch->retired;
+    epoch->retired = retired;
+    epoch->num_retired++;
+  }
+  pthread_mutex_unlock(&epoch->lock);
+  // without a node the module is leaked rather than freed under a reader
+}
+
+size_t
+jit_epoch_reclaim(JitEpoch* epoch)
+{
+  size_t freed = 0;
+  pthread_mutex_lock(&epoch->lock);
+
+  uint64_t current = __atomic_load_n(&epoch->epoch, __ATOMIC_SEQ_CST);
+  bool advance = true;
+  for (JitEpochThread* thread = epoch->threads; thread && advance;
+       thread = thread->next) {
+    uint64_t state = __atomic_load_n(&thread->state, __ATOMIC_SEQ_CST);
+    advance = !(state & 1) || state >> 1 == current;
+  }
+  if (advance)
+    __atomic_store_n(&epoch->epoch, ++current, __ATOMIC_SEQ_CST);
+
+  for (JitRetired** link = &epoch->retired; *link;) {
+    JitRetired* retired = *link;
+    if (retired->epoch + 2 > current) {
+      link = &retired->next;
+      continue;
+    }
+    *link = retired->next;
+    jit_sealed_free(retired->sealed);
+    free(retired);
+    epoch->num_retired--;
+    epoch->num_reclaimed++;
+    freed++;
+  }
+
+  pthread_mutex_unlock(&epoch->lock);
+  return freed;
+}
+
+static uint64_t
+jit_now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+ExternalLibrary*
+ext_lib_init(const char* library_path)
+{
+  return ext_lib_init_flags(library_path, 0);
+}
+
+ExternalLibrary*
+ext_lib_init_flags(const char* library_path, int flags)
+{
+  ExternalLibrary* lib = malloc(sizeof(ExternalLibrary));
+  if (!lib)
+    return NULL;
+
+  uint64_t start = jit_now_ns();
+  lib->handle =
+    dlopen(library_path, (flags & EXT_LIB_BIND_NOW) ? RTLD_NOW : RTLD_LAZY);
+  if (!lib->handle) {
+    fprintf(stderr, "Error loading library: %s\n", dlerror());
+    free(lib);
+    return NULL;
+  }
+  lib->resolve_ns = jit_now_ns() - start;
+
+  lib->func_capacity = MAX_EXT_FUNCTION_CAPACITY;
+  lib->functions = malloc(sizeof(void*) * lib->func_capacity);
+  lib->func_count = 0;
+
+  lib->symbol_capacity = MAX_EXT_SYMBOL_CAPACITY;
+  lib->symbols = calloc(lib->symbol_capacity, sizeof(ExtLibSymbol));
+  lib->path = strdup(library_path);
+  lib->flags = flags;
+
+  lib->sites = NULL;
+  lib->num_sites = 0;
+  lib->site_capacity = 0;
+
+  lib->next = NULL;
+
+  if (!lib->functions || !lib->symbols || !lib->path) {
+    ext_lib_cleanup(lib);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&ext_lib_registry.lock);
+  lib->next = ext_lib_registry.libraries;
+  ext_lib_registry.libraries = lib;
+  pthread_mutex_unlock(&ext_lib_registry.lock);
+  return lib;
+}
+
+// FNV-1a
+static uint64_t
+ext_lib_hash(const char* name)
+{
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (; *name; name++) {
+    hash ^= (uint8_t)*name;
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+// the slot holding name, or the free slot it would go into
+static ExtLibSymbol*
+ext_lib_find_symbol(ExternalLibrary* lib, const char* name, uint64_t hash)
+{
+  size_t mask = lib->symbol_capacity - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    ExtLibSymbol* symbol = &lib->symbols[i];
+    if (!symbol->name ||
+        (symbol->hash == hash && strcmp(symbol->name, name) == 0))
+      return symbol;
+  }
+}
+
+static bool
+ext_lib_grow_symbols(ExternalLibrary* lib)
+{
+  ExtLibSymbol* old_symbols = lib->symbols;
+  size_t old_capacity = lib->symbol_capacity;
+
+  ExtLibSymbol* symbols = calloc(old_capacity * 2, sizeof(ExtLibSymbol));
+  if (!symbols)
+    return false;
+  lib->symbols = symbols;
+  lib->symbol_capacity = old_capacity * 2;
+
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (old_symbols[i].name)
+      *ext_lib_find_symbol(lib, old_symbols[i].name, old_symbols[i].hash) =
+        old_symbols[i];
+  }
+  free(old_symbols);
+  return true;
+}
+
+// dlsym and cache one symbol, the caller adds the time to resolve_ns
+static int
+ext_lib_resolve(ExternalLibrary* lib, const char* func_name)
+{
+  uint64_t hash = ext_lib_hash(func_name);
+  ExtLibSymbol* symbol = ext_lib_find_symbol(lib, func_name, hash);
+  if (symbol->name)
+    return symbol->index;
+
+  void* func = dlsym(lib->handle, func_name);
+  if (!func) {
+    fprintf(stderr, "Error loading function %s: %s\n", func_name, dlerror());
+    return -1;
+  }
+
+  if (lib->func_count >= lib->func_capacity) {
+    void** functions =
+      realloc(lib->functions, sizeof(void*) * lib->func_capacity * 2);
+    if (!functions) {
+      fprintf(stderr, "Too many functions loaded\n");
+      return -1;
+    }
+    lib->functions = functions;
+    lib->func_capacity *= 2;
+  }
+
+  if ((size_t)(lib->func_count + 1) * 2 > lib->symbol_capacity) {
+    if (!ext_lib_grow_symbols(lib)) {
+      fprintf(stderr, "Too many functions loaded\n");
+      return -1;
+    }
+    symbol = ext_lib_find_symbol(lib, func_name, hash);
+  }
+
+  symbol->name = strdup(func_name);
+  if (!symbol->name)
+    return -1;
+  symbol->hash = hash;
+  symbol->index = lib->func_count;
+
+  lib->functions[lib->func_count] = func;
+  return lib->func_count++;
+}
+
+int
+ext_lib_load_function(ExternalLibrary* lib, const char* func_name)
+{
+  uint64_t start = jit_now_ns();
+  int index = ext_lib_resolve(lib, func_name);
+  lib->resolve_ns += jit_now_ns() - start;
+  return index;
+}
+
+// resolves a list of symbols, indices[i] is the function index of
+// func_names[i] or -1. returns the number of symbols that failed.
+int
+ext_lib_load_functions(ExternalLibrary* lib,
+                       const char** func_names,
+                       int count,
+                       int* indices)
+{
+  uint64_t start = jit_now_ns();
+
+  // size the tables once for the whole list
+  while (lib->func_capacity < lib->func_count + count) {
+    void** functions =
+      realloc(lib->functions, sizeof(void*) * lib->func_capacity * 2);
+    if (!functions)
+      break;
+    lib->functions = functions;
+    lib->func_capacity *= 2;
+  }
+  while ((size_t)(lib->func_count + count) * 2 > lib->symbol_capacity) {
+    if (!ext_lib_grow_symbols(lib))
+      break;
+  }
+
+  int failed = 0;
+  for (int i = 0; i < count; i++) {
+    indices[i] = ext_lib_resolve(lib, func_names[i]);
+    if (indices[i] < 0)
+      failed++;
+  }
+
+  lib->resolve_ns += jit_now_ns() - start;
+  return failed;
+}
+
+// where a call site lands when its symbol is gone after a reload
+static void
+ext_lib_unresolved(void)
+{
+  fprintf(stderr, "JIT call into a function missing from its reloaded library\n");
+  abort();
+}
+
+// retargets every site of lib at its function, or at ext_lib_unresolved
+static void
+ext_lib_patch_sites(ExternalLibrary* lib)
+{
+  for (size_t i = 0; i < lib->num_sites; i++) {
+    void* func = lib->functions[lib->sites[i].function];
+    jit_patch_call(&lib->sites[i], func ? func : (void*)ext_lib_unresolved);
+  }
+}
+
+int
+ext_lib_reload(ExternalLibrary* lib)
+{
+  uint64_t start = jit_now_ns();
+
+  // the lock keeps the owners from freeing the code while it is patched
+  pthread_mutex_lock(&ext_lib_registry.lock);
+
+  // calls that start from here on wait for the new image, the ones already
+  // on their way are the caller's to stop
+  for (size_t i = 0; i < lib->num_sites; i++)
+    jit_patch_call(&lib->sites[i], NULL);
+
+  // dlopen of the same path hands back the loaded image until it is closed
+  if (lib->handle)
+    dlclose(lib->handle);
+  lib->handle = dlopen(lib->path,
+                       (lib->flags & EXT_LIB_BIND_NOW) ? RTLD_NOW : RTLD_LAZY);
+  if (!lib->handle) {
+    fprintf(stderr, "Error reloading library: %s\n", dlerror());
+    for (int i = 0; i < lib->func_count; i++)
+      lib->functions[i] = NULL;
+    ext_lib_patch_sites(lib);
+    pthread_mutex_unlock(&ext_lib_registry.lock);
+    return -1;
+  }
+
+  int failed = 0;
+  for (size_t i = 0; i < lib->symbol_capacity; i++) {
+    ExtLibSymbol* symbol = &lib->symbols[i];
+    if (!symbol->name)
+      continue;
+    void* func = dlsym(lib->handle, symbol->name);
+    if (!func) {
+      fprintf(stderr,
+              "Error reloading function %s: %s\n",
+              symbol->name,
+              dlerror());
+      failed++;
+    }
+    lib->functions[symbol->index] = func;
+  }
+
+  ext_lib_patch_sites(lib);
+  pthread_mutex_unlock(&ext_lib_registry.lock);
+
+  lib->resolve_ns += jit_now_ns() - start;
+  return failed;
+}
+
+void
+ext_lib_dump(ExternalLibrary* lib)
+{
+  if (!lib)
+    return;
+  printf("\nLIBRARY: %s\n", lib->path);
+  printf("---------------------------------------------------------\n");
+  printf("functions: %d, call sites: %zu, resolve time: %.3f ms\n",
+         lib->func_count,
+         lib->num_sites,
+         lib->resolve_ns / 1e6);
+  for (int index = 0; index < lib->func_count; index++) {
+    for (size_t i = 0; i < lib->symbol_capacity; i++) {
+      ExtLibSymbol* symbol = &lib->symbols[i];
+      if (symbol->name && symbol->index == index)
+        printf("%4d: %p %s\n", index, lib->functions[index], symbol->name);
+    }
+  }
+}
+
+void
+ext_lib_cleanup(ExternalLibrary* lib)
+{
+  if (lib) {
+    pthread_mutex_lock(&ext_lib_registry.lock);
+    ExternalLibrary** link = &ext_lib_registry.libraries;
+    while (*link && *link != lib)
+      link = &(*link)->next;
+    if (*link)
+      *link = lib->next;
+    pthread_mutex_unlock(&ext_lib_registry.lock);
+
+    if (lib->handle) {
+      dlclose(lib->handle);
+    }
+    if (lib->symbols) {
+      for (size_t i = 0; i < lib->symbol_capacity; i++)
+        free(lib->symbols[i].name);
+      free(lib->symbols);
+    }
+    free(lib->functions);
+    free(lib->sites);
+    free(lib->path);
+    free(lib);
+  }
+}
+
+void
+jit_begin_frame(JITCompiler* jit)
+{
+  // save the frame pointer and link register
+  jit_emit(jit, arm64_stp_pre(29, 30, 31, -2)); // stp x29, x30, [sp, #-16]!
+  jit_emit(jit, 0x910003fd);                    // mov x29, sp
+}
+
+void
+jit_end_frame(JITCompiler* jit)
+{
+  // restore frame pointer and link register
+  jit_emit(jit, arm64_ldp_post(29, 30, 31, 2)); // ldp x29, x30, [sp], #16
+  jit_emit(jit, arm64_ret());                   // ret
+}
+
+void
+jit_call_external(JITCompiler* jit, void* func_ptr)
+{
+  // set up stack for external call
+  jit_emit(jit, 0xd10043ff);               // sub sp, sp, #16
+  jit_emit(jit, arm64_stp(29, 30, 31, 0)); // stp x29, x30, [sp]
+
+  // the call
+  jit_emit_call(jit, func_ptr);
+
+  // restore stack after call
+  jit_emit(jit, arm64_ldp(29, 30, 31, 0)); // ldp x29, x30, [sp]
+  jit_emit(jit, 0x910043ff);               // add sp, sp, #16
+}
+
+// records the BL of fixup as a patchable call of function index of lib
+static bool
+jit_add_library_call(JITCompiler* jit,
+                     size_t fixup,
+                     ExternalLibrary* lib,
+                     int index)
+{
+  if (jit->num_library_calls >= jit->library_call_capacity) {
+    size_t capacity = jit->library_call_capacity
+                        ? jit->library_call_capacity * 2
+                        : MAX_CALL_SITE_CAPACITY;
+    JitLibraryCall* calls =
+      realloc(jit->library_calls, sizeof(JitLibraryCall) * capacity);
+    if (!calls)
+      return false;
+    jit->library_calls = calls;
+    jit->library_call_capacity = capacity;
+  }
+
+  // every site gets its own stub, so a reload can move the target anywhere
+  uint64_t stub = jit_new_stub(jit, (uint64_t)lib->functions[index], false);
+  if (!stub)
+    return false;
+
+  JitLibraryCall* call = &jit->library_calls[jit->num_library_calls++];
+  call->fixup = fixup;
+  call->stub = stub;
+  call->lib = lib;
+  call->function = index;
+  return true;
+}
+
+bool
+jit_call_library(JITCompiler* jit, ExternalLibrary* lib, int index)
+{
+  if (!lib || index < 0 || index >= lib->func_count) {
+    fprintf(stderr, "JIT call: no function %d in library\n", index);
+    return false;
+  }
+  void* func_ptr = lib->functions[index];
+
+  jit_emit(jit, 0xd10043ff);               // sub sp, sp, #16
+  jit_emit(jit, arm64_stp(29, 30, 31, 0)); // stp x29, x30, [sp]
+  if (!jit_emit_call(jit, func_ptr))       // bl <func_ptr or shared stub>
+    return false;
+  // the site is the fixup the call just added
+  if (!jit_add_library_call(jit, jit->num_fixups - 1, lib, index))
+    return false;
+  jit_emit(jit, arm64_ldp(29, 30, 31, 0)); // ldp x29, x30, [sp]
+  jit_emit(jit, 0x910043ff);               // add sp, sp, #16
+  return true;
+}
+
+// BL is one of the instructions the architecture allows to be modified
+// while another core executes it, that core sees either the old or the new
+// one. the stub slot is written first, so a thread on its way through the
+// stub already lands on the new target.
+void
+jit_patch_call(const JitCallSite* site, void* target)
+{
+  int64_t disp = (int64_t)(uint64_t)target - (int64_t)site->pc;
+  if (!target || !jit_fits_signed(disp / 4, 26))
+    disp = (int64_t)site->stub - (int64_t)site->pc;
+  uint32_t bl = arm64_bl(disp / 4);
+
+#ifdef __APPLE__
+  pthread_jit_write_protect_np(0);
+#endif
+  __atomic_store_n(site->slot, (uint64_t)target, __ATOMIC_RELEASE);
+  __atomic_store_n(site->code, bl, __ATOMIC_RELEASE);
+#ifdef __APPLE__
+  pthread_jit_write_protect_np(1);
+  sys_icache_invalidate((void*)site->pc, sizeof(uint32_t));
+#else
+  __builtin___clear_cache((char*)site->pc, (char*)site->pc + sizeof(uint32_t));
+#endif
+}
+
+// peephole pass. the code buffer is split into basic blocks at labels and
+// branches, register and flag liveness is solved over the blocks and then
+// the rewrites below run until nothing changes. deleted instructions are
+// squeezed out and labels, fixups and function sizes are remapped.
+
+#define JIT_PEEP_SP ((uint64_t)1 << 31)
+#define JIT_PEEP_FLAGS ((uint64_t)1 << 32)
+#define JIT_PEEP_ALL (((uint64_t)1 << 33) - 1)
+
+typedef enum
+{
+  JIT_PEEP_NEXT,     // falls through
+  JIT_PEEP_JUMP,     // B, only the target
+  JIT_PEEP_COND,     // B.cond, CBZ, TBZ: target and fall through
+  JIT_PEEP_EXIT,     // RET, nothing after it is reachable from here
+  JIT_PEEP_INDIRECT, // BR, anything may be live
+} JitPeepFlow;
+
+typedef struct
+{
+  uint64_t use, def;
+  bool pure;   // no side effects, can go when nothing reads what it defines
+  bool opaque; // not decoded, may have written any register
+  JitPeepFlow flow;
+  int64_t target; // branch target, instruction index
+} JitPeepInfo;
+
+static uint64_t
+jit_peep_reg(int reg)
+{
+  return reg == 31 ? 0 : (uint64_t)1 << reg; // 31 is xzr here
+}
+
+static uint64_t
+jit_peep_reg_sp(int reg)
+{
+  return (uint64_t)1 << reg; // 31 is sp here
+}
+
+static void
+jit_peep_decode(uint32_t w, size_t offset, JitPeepInfo* info)
+{
+  int rd = w & 31, rn = (w >> 5) & 31, rm = (w >> 16) & 31;
+  bool set_flags = (w >> 29) & 1;
+
+  memset(info, 0, sizeof(JitPeepInfo));
+  info->flow = JIT_PEEP_NEXT;
+
+  if (w == 0xd503201f) { // nop
+  } else if ((w & 0x1f800000) == 0x12800000) { // movn/movz/movk
+    bool movk = ((w >> 29) & 3) == 3;
+    info->def = jit_peep_reg(rd);
+    info->use = movk ? jit_peep_reg(rd) : 0;
+    info->pure = true;
+  } else if ((w & 0x1f800000) == 0x12000000) { // logical immediate
+    bool ands = ((w >> 29) & 3) == 3;
+    info->use = jit_peep_reg(rn);
+    info->def = ands ? jit_peep_reg(rd) | JIT_PEEP_FLAGS : jit_peep_reg_sp(rd);
+    info->pure = ands || rd != 31;
+  } else if ((w & 0x1f000000) == 0x0a000000) { // logical shifted register
+    bool ands = ((w >> 29) & 3) == 3;
+    info->use = jit_peep_reg(rn) | jit_peep_reg(rm);
+    info->def = jit_peep_reg(rd) | (ands ? JIT_PEEP_FLAGS : 0);
+    info->pure = true;
+  } else if ((w & 0x1f000000) == 0x11000000) { // add/sub immediate
+    info->use = jit_peep_reg_sp(rn);
+    info->def = set_flags ? jit_peep_reg(rd) | JIT_PEEP_FLAGS : jit_peep_reg_sp(rd);
+    info->pure = set_flags || rd != 31;
+  } else if ((w & 0x1f200000) == 0x0b000000) { // add/sub shifted register
+    info->use = jit_peep_reg(rn) | jit_peep_reg(rm);
+    info->def = jit_peep_reg(rd) | (set_flags ? JIT_PEEP_FLAGS : 0);
+    info->pure = true;
+  } else if ((w & 0x7f000000) == 0x1b000000) { // madd/msub/smulh/umulh
+    info->use = jit_peep_reg(rn) | jit_peep_reg(rm) | jit_peep_reg((w >> 10) & 31);
+    info->def = jit_peep_reg(rd);
+    info->pure = true;
+  } else if ((w & 0x7fe00000) == 0x1ac00000) { // udiv/sdiv/lslv/lsrv/asrv
+    info->use = jit_peep_reg(rn) | jit_peep_reg(rm);
+    info->def = jit_peep_reg(rd);
+    info->pure = true;
+  } else if ((w & 0x1f000000) == 0x10000000) { // adr/adrp
+    info->def = jit_peep_reg(rd);
+    info->pure = true;
+  } else if ((w & 0x1f800000) == 0x13000000) { // bitfield move
+    info->use = jit_peep_reg(rn) | (((w >> 29) & 3) == 1 ? jit_peep_reg(rd) : 0);
+    info->def = jit_peep_reg(rd);
+    info->pure = true;
+  } else if ((w & 0x1fe00000) == 0x1a800000) { // csel/csinc/csinv/csneg
+    info->use = jit_peep_reg(rn) | jit_peep_reg(rm) | JIT_PEEP_FLAGS;
+    info->def = jit_peep_reg(rd);
+    info->pure = true;
+  } else if ((w & 0x3fe00410) == 0x3a400000) { // ccmp/ccmn
+    bool imm = (w >> 11) & 1;
+    info->use = jit_peep_reg(rn) | (imm ? 0 : jit_peep_reg(rm)) | JIT_PEEP_FLAGS;
+    info->def = JIT_PEEP_FLAGS;
+    info->pure = true;
+  } else if ((w & 0xfc000000) == 0x14000000) { // b
+    info->flow = JIT_PEEP_JUMP;
+    info->target = (int64_t)offset + (((int32_t)(w << 6)) >> 6);
+  } else if ((w & 0x7c000000) == 0x14000000) { // bl
+    info->use = 0x1ff;                        // x0-x8
+    info->def = 0x7ffff | ((uint64_t)1 << 30) | JIT_PEEP_FLAGS;
+  } else if ((w & 0xff000010) == 0x54000000) { // b.cond
+    info->use = JIT_PEEP_FLAGS;
+    info->flow = JIT_PEEP_COND;
+    info->target = (int64_t)offset + (((int32_t)(w << 8)) >> 13);
+  } else if ((w & 0x7e000000) == 0x34000000) { // cbz/cbnz
+    info->use = jit_peep_reg(rd);
+    info->flow = JIT_PEEP_COND;
+    info->target = (int64_t)offset + (((int32_t)(w << 8)) >> 13);
+  } else if ((w & 0x7e000000) == 0x36000000) { // tbz/tbnz
+    info->use = jit_peep_reg(rd);
+    info->flow = JIT_PEEP_COND;
+    info->target = (int64_t)offset + (((int32_t)(w << 13)) >> 18);
+  } else if ((w & 0xfffffc1f) == 0xd65f0000) { // ret
+    // the return value and everything the caller expects preserved
+    info->use = 0x3 | 0x7ff80000 | JIT_PEEP_SP | jit_peep_reg(rn);
+    info->flow = JIT_PEEP_EXIT;
+  } else if ((w & 0xfffffc1f) == 0xd63f0000) { // blr
+    info->use = 0x1ff | jit_peep_reg(rn);
+    info->def = 0x7ffff | ((uint64_t)1 << 30) | JIT_PEEP_FLAGS;
+  } else if ((w & 0x3b000000) == 0x39000000 || (w & 0x3b200000) == 0x38000000) {
+    // load/store register, immediate forms
+    bool simd = (w >> 26) & 1;
+    bool prfm = (w >> 30) == 3 && ((w >> 22) & 3) == 2;
+    bool load = ((w >> 22) & 3) != 0 && !prfm;
+    bool writeback = (w & 0x3b000000) == 0x38000000 && (w & 0x400);
+    info->use =
+      jit_peep_reg_sp(rn) | (!simd && !load && !prfm ? jit_peep_reg(rd) : 0);
+    info->def = (!simd && load ? jit_peep_reg(rd) : 0) |
+                (writeback ? jit_peep_reg_sp(rn) : 0);
+  } else if ((w & 0x3b200c00) == 0x38200800) {
+    // load/store register, register offset
+    bool simd = (w >> 26) & 1;
+    bool prfm = (w >> 30) == 3 && ((w >> 22) & 3) == 2;
+    bool load = ((w >> 22) & 3) != 0 && !prfm;
+    info->use = jit_peep_reg_sp(rn) | jit_peep_reg(rm) |
+                (!simd && !load && !prfm ? jit_peep_reg(rd) : 0);
+    info->def = !simd && load ? jit_peep_reg(rd) : 0;
+  } else if ((w & 0x3a000000) == 0x28000000) { // load/store pair
+    bool simd = (w >> 26) & 1;
+    bool load = (w >> 22) & 1;
+    bool writeback = ((w >> 23) & 3) == 1 || ((w >> 23) & 3) == 3;
+    uint64_t regs = simd ? 0 : jit_peep_reg(rd) | jit_peep_reg((w >> 10) & 31);
+    info->use = jit_peep_reg_sp(rn) | (load ? 0 : regs);
+    info->def = (load ? regs : 0) | (writeback ? jit_peep_reg_sp(rn) : 0);
+  } else if ((w & 0x3b000000) == 0x18000000) { // ldr literal
+    info->def = (w >> 26) & 1 ? 0 : jit_peep_reg(rd);
+  } else if ((w & 0x5f20fc00) == 0x1e200000) {
+    // conversions between general purpose and fp registers
+    int opcode = (w >> 16) & 7;
+    if (opcode == 2 || opcode == 3 || opcode == 7)
+      info->use = jit_peep_reg(rn); // scvtf/ucvtf/fmov from xn
+    else
+      info->def = jit_peep_reg(rd); // fcvt*/fmov to xd
+  } else if ((w & 0x5f000000) == 0x1e000000) {
+    // scalar fp only touches v registers, fcsel/fccmp read the flags
+    info->use = JIT_PEEP_FLAGS;
+  } else {
+    // anything else may read and write anything
+    info->use = JIT_PEEP_ALL;
+    info->opaque = true;
+    info->flow = (w & 0xfe000000) == 0xd6000000 ? JIT_PEEP_INDIRECT
+                                                : JIT_PEEP_NEXT;
+  }
+}
+
+typedef struct
+{
+  JITCompiler* jit;
+  size_t count;
+  JitPeepInfo* info;
+  bool* leader;  // a basic block starts here
+  bool* fixup;   // a fixup patches this instruction
+  uint64_t* out; // registers live after each instruction
+  bool* deleted;
+  bool compact; // every pc-relative instruction has a fixup
+} JitPeephole;
+
+static uint64_t
+jit_peep_live_at(JitPeephole* p, int64_t index)
+{
+  // code outside the buffer (unresolved labels, other functions) may read
+  // anything
+  if (index < 0 || (size_t)index >= p->count)
+    return JIT_PEEP_ALL;
+  JitPeepInfo* info = &p->info[index];
+  return info->use | (p->out[index] & ~info->def);
+}
+
+static void
+jit_peep_liveness(JitPeephole* p)
+{
+  for (size_t i = 0; i < p->count; i++)
+    p->out[i] = 0;
+
+  // backward dataflow until the live sets settle
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t i = p->count; i-- > 0;) {
+      JitPeepInfo* info = &p->info[i];
+      uint64_t out = 0;
+      switch (info->flow) {
+        case JIT_PEEP_NEXT:
+          out = jit_peep_live_at(p, (int64_t)i + 1);
+          break;
+        case JIT_PEEP_JUMP:
+          out = jit_peep_live_at(p, info->target);
+          break;
+        case JIT_PEEP_COND:
+          out = jit_peep_live_at(p, info->target) |
+                jit_peep_live_at(p, (int64_t)i + 1);
+          break;
+        case JIT_PEEP_EXIT:
+          out = 0;
+          break;
+        case JIT_PEEP_INDIRECT:
+          out = JIT_PEEP_ALL;
+          break;
+      }
+      if (out != p->out[i]) {
+        p->out[i] = out;
+        changed = true;
+      }
+    }
+  }
+}
+
+static void
+jit_peep_analyze(JitPeephole* p)
+{
+  JITCompiler* jit = p->jit;
+  p->count = jit->code_size;
+  memset(p->leader, 0, p->count + 1);
+  memset(p->fixup, 0, p->count + 1);
+  memset(p->deleted, 0, p->count + 1);
+
+  for (size_t i = 0; i < jit->num_labels; i++) {
+    if (jit->label_positions[i] && jit->label_offsets[i] < p->count)
+      p->leader[jit->label_offsets[i]] = true;
+  }
+  for (size_t i = 0; i < p->count; i++)
+    jit_peep_decode(jit->code[i], i, &p->info[i]);
+
+  for (size_t i = 0; i < jit->num_fixups; i++) {
+    JitFixup* fixup = &jit->fixups[i];
+    size_t sites = fixup->kind == JIT_FIXUP_B_COND_FAR ? 2 : 1;
+    bool unbound = jit_is_label_fixup(fixup->kind) &&
+                   (fixup->target >= jit->num_labels ||
+                    !jit->label_positions[fixup->target]);
+    for (size_t j = 0; j < sites; j++) {
+      p->fixup[fixup->offset + j] = true;
+      if (unbound)
+        p->info[fixup->offset + j].target = -1; // somewhere not emitted yet
+    }
+  }
+
+  p->compact = true;
+  for (size_t i = 0; i < p->count; i++) {
+    uint32_t w = jit->code[i];
+    JitPeepInfo* info = &p->info[i];
+    if (info->flow != JIT_PEEP_NEXT)
+      p->leader[i + 1] = true;
+    if ((info->flow == JIT_PEEP_JUMP || info->flow == JIT_PEEP_COND) &&
+        info->target >= 0 && (size_t)info->target < p->count)
+      p->leader[info->target] = true;
+
+    // moving code would break a pc-relative instruction nobody patches
+    bool pc_relative = (w & 0x7c000000) == 0x14000000 ||
+                       (w & 0xff000010) == 0x54000000 ||
+                       (w & 0x7c000000) == 0x34000000 ||
+                       (w & 0x1f000000) == 0x10000000 ||
+                       (w & 0x3b000000) == 0x18000000;
+    if (pc_relative && !p->fixup[i])
+      p->compact = false;
+  }
+
+  jit_peep_liveness(p);
+}
+
+// the instruction before index in the same basic block, or -1
+static long
+jit_peep_prev(JitPeephole* p, size_t index)
+{
+  if (p->leader[index])
+    return -1;
+  for (size_t i = index; i-- > 0;) {
+    if (!p->deleted[i])
+      return (long)i;
+    if (p->leader[i])
+      return -1;
+  }
+  return -1;
+}
+
+// value of a register set by a MOVZ earlier in the same block, -1 if unknown
+static int64_t
+jit_peep_known(JitPeephole* p, size_t index, int reg)
+{
+  if (reg == 31)
+    return 0; // xzr
+  for (long i = jit_peep_prev(p, index); i >= 0; i = jit_peep_prev(p, i)) {
+    uint32_t w = p->jit->code[i];
+    if (p->info[i].opaque)
+      return -1;
+    if (!(p->info[i].def & jit_peep_reg(reg)))
+      continue;
+    // movz xd/wd, #imm
+    if ((w & 0x7fe00000) == 0x52800000 && (int)(w & 31) == reg)
+      return (w >> 5) & 0xffff;
+    return -1;
+  }
+  return -1;
+}
+
+static void
+jit_peep_delete(JitPeephole* p, size_t index)
+{
+  p->deleted[index] = true;
+  jit_peep_decode(0xd503201f, index, &p->info[index]);
+}
+
+static JitFixup*
+jit_peep_fixup_at(JitPeephole* p, size_t index)
+{
+  for (size_t i = 0; i < p->jit->num_fixups; i++) {
+    if (p->jit->fixups[i].offset == index)
+      return &p->jit->fixups[i];
+  }
+  return NULL;
+}
+
+// ADD/SUB rd, rn, #imm keeping the width and flag setting of w
+static uint32_t
+jit_peep_addsub_imm(uint32_t w, int rd, int rn, uint32_t imm12)
+{
+  return (w & 0xe0000000) | 0x11000000 | (imm12 << 10) | (rn << 5) | rd;
+}
+
+static void
+jit_peep_rewrite(JitPeephole* p, size_t i, JitPeepholeStats* stats)
+{
+  JITCompiler* jit = p->jit;
+  uint32_t w = jit->code[i];
+  JitPeepInfo* info = &p->info[i];
+  int rd = w & 31, rn = (w >> 5) & 31, rm = (w >> 16) & 31;
+
+  // mov xd, xd
+  bool orr_mov = (w & 0x7fe0ffe0) == 0x2a0003e0;
+  bool add_mov = (w & 0x7f20fc00) == 0x0b000000 && (rn == 31 || rm == 31);
+  if (orr_mov || add_mov) {
+    int src = orr_mov ? rm : (rn == 31 ? rm : rn);
+    if (src == rd && (w >> 31)) {
+      jit_peep_delete(p, i);
+      stats->moves++;
+      return;
+    }
+    // add xd, xn, xzr is the move the examples write, use the real one
+    if (add_mov && rd != 31) {
+      jit->code[i] = (w >> 31) ? arm64_mov(rd, src)
+                               : (uint32_t)(0x2a0003e0 | (src << 16) | rd);
+      jit_peep_decode(jit->code[i], i, info);
+      stats->moves++;
+      return;
+    }
+  }
+
+  // add/sub rd, rn, rm with a small constant in rm becomes an immediate
+  bool set_flags = (w >> 29) & 1;
+  if ((w & 0x1f20fc00) == 0x0b000000 && (set_flags || rd != 31)) {
+    bool sub = (w >> 30) & 1;
+    int reg = rm, other = rn;
+    int64_t value = jit_peep_known(p, i, rm);
+    if (value < 0 && !sub) {
+      value = jit_peep_known(p, i, rn);
+      reg = rn;
+      other = rm;
+    }
+    if (value >= 0 && value <= 0xfff && reg != 31 && other != 31) {
+      jit->code[i] = jit_peep_addsub_imm(w, rd, other, (uint32_t)value);
+      jit_peep_decode(jit->code[i], i, info);
+      stats->folds++;
+      return;
+    }
+  }
+
+  // cmp xn, #0 (or a zero register); b.eq/b.ne -> cbz/cbnz
+  // tst xn, #(1 << bit); b.eq/b.ne -> tbz/tbnz
+  if ((w & 0xff000010) == 0x54000000 && (w & 0xe) == 0) {
+    long prev = jit_peep_prev(p, i);
+    JitFixup* fixup = jit_peep_fixup_at(p, i);
+    if (prev < 0 || !fixup || fixup->kind != JIT_FIXUP_B_COND ||
+        (p->out[i] & JIT_PEEP_FLAGS) || p->fixup[prev])
+      return;
+
+    uint32_t c = jit->code[prev];
+    int cn = (c >> 5) & 31, cm = (c >> 16) & 31;
+    bool ne = w & 1;
+    int64_t target = info->target;
+    int64_t disp = target - (int64_t)i;
+    int reg = -1;
+
+    if ((c & 0x7fc0001f) == 0x7100001f && !((c >> 10) & 0xfff) && cn != 31)
+      reg = cn; // subs xzr, xn, #0
+    else if ((c & 0x7f20fc1f) == 0x6b00001f && jit_peep_known(p, prev, cm) == 0)
+      reg = cn; // subs xzr, xn, xm with xm == 0
+    if (reg >= 0 && reg != 31) {
+      jit->code[i] =
+        (c & 0x80000000) | (ne ? 0x35000000 : 0x34000000) |
+        ((uint32_t)(disp & 0x7ffff) << 5) | reg;
+      fixup->kind = JIT_FIXUP_CB;
+      jit_peep_decode(jit->code[i], i, info);
+      info->target = target;
+      jit_peep_delete(p, prev);
+      stats->branches++;
+      return;
+    }
+
+    // ands xzr, xn, #imm with a single bit set
+    if ((c & 0x7f80001f) == 0x7200001f && cn != 31 && info->target >= 0 &&
+        jit_fits_signed(disp, 14)) {
+      uint32_t n = (c >> 22) & 1, immr = (c >> 16) & 0x3f, imms = (c >> 10) & 0x3f;
+      bool wide = (c >> 31) & 1;
+      int size = n ? 64 : (wide ? 0 : 32);
+      if (size && imms == 0) {
+        // one bit, rotated right by immr
+        int bit = (size - immr) % size;
+        jit->code[i] = ((uint32_t)(bit >> 5) << 31) |
+                       (ne ? 0x37000000 : 0x36000000) |
+                       ((uint32_t)(bit & 31) << 19) |
+                       ((uint32_t)(disp & 0x3fff) << 5) | cn;
+        fixup->kind = JIT_FIXUP_TB;
+        jit_peep_decode(jit->code[i], i, info);
+        info->target = target;
+        jit_peep_delete(p, prev);
+        stats->branches++;
+      }
+    }
+  }
+}
+
+// deletes the marked instructions and remaps labels, fixups and functions
+static void
+jit_peep_compact(JitPeephole* p)
+{
+  JITCompiler* jit = p->jit;
+  size_t* remap = malloc(sizeof(size_t) * (p->count + 1));
+  if (!remap)
+    return;
+
+  size_t out = 0;
+  for (size_t i = 0; i <= p->count; i++) {
+    remap[i] = out;
+    if (i < p->count && !p->deleted[i])
+      jit->code[out++] = jit->code[i];
+  }
+
+  for (size_t i = 0; i < jit->num_functions; i++) {
+    JitFunction* function = &jit->functions[i];
+    size_t label = function->label;
+    if (!jit->label_positions[label] || i == jit->current_function)
+      continue;
+    size_t entry = jit->label_offsets[label];
+    function->size = remap[entry + function->size] - remap[entry];
+  }
+  for (size_t i = 0; i < jit->num_labels; i++) {
+    if (jit->label_positions[i])
+      jit->label_offsets[i] = remap[jit->label_offsets[i]];
+  }
+  for (size_t i = 0; i < jit->num_fixups; i++)
+    jit->fixups[i].offset = remap[jit->fixups[i].offset];
+
+  memset(&jit->code[out], 0, (p->count - out) * sizeof(uint32_t));
+  jit->code_size = out;
+  free(remap);
+}
+
+// function entries lost their alignment when code before them went away
+static void
+jit_peep_align_functions(JITCompiler* jit)
+{
+  for (size_t i = 0; i < jit->num_functions; i++) {
+    size_t label = jit->functions[i].label;
+    if (!jit->label_positions[label])
+      continue;
+    while ((jit->label_offsets[label] * sizeof(uint32_t)) %
+           JIT_FUNCTION_ALIGNMENT) {
+      if (!jit_insert_instruction(jit, jit->label_offsets[label], 0xd503201f))
+        return;
+    }
+  }
+}
+
+JitPeepholeStats
+jit_peephole(JITCompiler* jit)
+{
+  JitPeepholeStats stats = { 0 };
+  stats.before = jit->code_size;
+  stats.after = jit->code_size;
+
+  JitPeephole p = { 0 };
+  p.jit = jit;
+  size_t n = jit->code_size + 1;
+  p.info = malloc(sizeof(JitPeepInfo) * n);
+  p.leader = malloc(n);
+  p.fixup = malloc(n);
+  p.out = malloc(sizeof(uint64_t) * n);
+  p.deleted = malloc(n);
+  if (!p.info || !p.leader || !p.fixup || !p.out || !p.deleted)
+    goto done;
+
+  jit_begin_write(jit);
+  for (int round = 0; round < 8; round++) {
+    jit_peep_analyze(&p);
+    size_t changes = stats.moves + stats.folds + stats.branches + stats.dead;
+
+    for (size_t i = 0; i < p.count; i++) {
+      if (!p.deleted[i])
+        jit_peep_rewrite(&p, i, &stats);
+    }
+
+    // definitions nobody reads. padding in front of function entries is
+    // dropped too and put back by jit_peep_align_functions.
+    if (p.compact) {
+      jit_peep_liveness(&p);
+      for (size_t i = 0; i < p.count; i++) {
+        JitPeepInfo* info = &p.info[i];
+        if (p.deleted[i] || p.fixup[i])
+          continue;
+        bool dead = info->pure && !(info->def & p.out[i]);
+        bool padding = jit->code[i] == 0xd503201f && i + 1 < p.count &&
+                       (p.leader[i + 1] || jit->code[i + 1] == 0xd503201f);
+        if (dead || padding) {
+          jit_peep_delete(&p, i);
+          stats.dead += dead;
+        }
+      }
+      jit_peep_compact(&p);
+      long failed = jit_patch_fixups(jit);
+      if (failed >= 0)
+        jit_relax_branches(jit, failed);
+    } else {
+      // without compaction deleted instructions turn into nops
+      for (size_t i = 0; i < p.count; i++) {
+        if (p.deleted[i])
+          jit->code[i] = 0xd503201f;
+      }
+    }
+
+    if (stats.moves + stats.folds + stats.branches + stats.dead == changes)
+      break;
+  }
+
+  if (p.compact) {
+    jit_peep_align_functions(jit);
+    long failed = jit_patch_fixups(jit);
+    if (failed >= 0)
+      jit_relax_branches(jit, failed);
+  }
+  stats.after = jit->code_size;
+
+done:
+  free(p.info);
+  free(p.leader);
+  free(p.fixup);
+  free(p.out);
+  free(p.deleted);
+  return stats;
+}
+
+// registers the allocator hands out, in order of preference. x0-x7 and
+// v0-v7 are left for arguments and return values, x16/x17 and v30/v31 are
+// scratch registers for spilled values, x18 is the platform register.
+static const int jit_ir_int_caller_saved[] = { 9, 10, 11, 12, 13, 14, 15 };
+static const int jit_ir_int_callee_saved[] = { 19, 20, 21, 22, 23,
+                                               24, 25, 26, 27, 28 };
+static const int jit_ir_float_caller_saved[] = { 16, 17, 18, 19, 20, 21, 22,
+                                                 23, 24, 25, 26, 27, 28, 29 };
+static const int jit_ir_float_callee_saved[] = { 8,  9,  10, 11,
+                                                 12, 13, 14, 15 };
+
+JitIr*
+jit_ir_init(JITCompiler* jit)
+{
+  JitIr* ir = malloc(sizeof(JitIr));
+  if (!ir)
+    return NULL;
+  memset(ir, 0, sizeof(JitIr));
+  ir->jit = jit;
+
+  ir->inst_capacity = MAX_IR_INST_CAPACITY;
+  ir->insts = malloc(sizeof(JitIrInst) * ir->inst_capacity);
+  ir->value_capacity = MAX_IR_VALUE_CAPACITY;
+  ir->values = malloc(sizeof(JitIrValue) * ir->value_capacity);
+  ir->call_arg_capacity = MAX_IR_VALUE_CAPACITY;
+  ir->call_args = malloc(sizeof(int) * ir->call_arg_capacity);
+
+  if (!ir->insts || !ir->values || !ir->call_args) {
+    jit_ir_cleanup(ir);
+    return NULL;
+  }
+  return ir;
+}
+
+void
+jit_ir_cleanup(JitIr* ir)
+{
+  if (!ir)
+    return;
+  if (ir->insts)
+    free(ir->insts);
+  if (ir->values)
+    free(ir->values);
+  if (ir->call_args)
+    free(ir->call_args);
+  free(ir);
+}
+
+// -1 when the value table can't grow
+static int
+jit_ir_new_value(JitIr* ir, JitIrType type)
+{
+  if (ir->num_values >= ir->value_capacity) {
+    size_t capacity = ir->value_capacity * 2;
+    JitIrValue* values = realloc(ir->values, sizeof(JitIrValue) * capacity);
+    if (!values) {
+      fprintf(stderr, "JIT IR: value table exhausted\n");
+      ir->failed = true;
+      return -1;
+    }
+    ir->values = values;
+    ir->value_capacity = capacity;
+  }
+
+  JitIrValue* value = &ir->values[ir->num_values];
+  memset(value, 0, sizeof(JitIrValue));
+  value->type = type;
+  value->reg = -1;
+  value->slot = -1;
+  return (int)ir->num_values++;
+}
+
+// NULL when the instruction table can't grow
+static JitIrInst*
+jit_ir_add_inst(JitIr* ir, JitIrOp op, int dst, int a, int b)
+{
+  if (ir->num_insts >= ir->inst_capacity) {
+    size_t capacity = ir->inst_capacity * 2;
+    JitIrInst* insts = realloc(ir->insts, sizeof(JitIrInst) * capacity);
+    if (!insts) {
+      fprintf(stderr, "JIT IR: instruction table exhausted\n");
+      ir->failed = true;
+      return NULL;
+    }
+    ir->insts = insts;
+    ir->inst_capacity = capacity;
+  }
+
+  JitIrInst* inst = &ir->insts[ir->num_insts++];
+  memset(inst, 0, sizeof(JitIrInst));
+  inst->op = op;
+  inst->dst = dst;
+  inst->a = a;
+  inst->b = b;
+  return inst;
+}
+
+// an instruction defining a new value of type, NULL when it can't be added
+static JitIrInst*
+jit_ir_define(JitIr* ir, JitIrOp op, JitIrType type, int a, int b)
+{
+  int dst = jit_ir_new_value(ir, type);
+  if (dst < 0)
+    return NULL;
+  return jit_ir_add_inst(ir, op, dst, a, b);
+}
+
+static bool
+jit_ir_check(JitIr* ir, int value, JitIrType type)
+{
+  if (value < 0 || (size_t)value >= ir->num_values ||
+      ir->values[value].type != type) {
+    fprintf(stderr, "JIT IR: invalid %s value %d\n",
+            type == JIT_IR_INT ? "int" : "float",
+            value);
+    return false;
+  }
+  return true;
+}
+
+static int
+jit_ir_binary(JitIr* ir, JitIrOp op, JitIrType type, int a, int b)
+{
+  if (!jit_ir_check(ir, a, type) || !jit_ir_check(ir, b, type))
+    return -1;
+  JitIrInst* inst = jit_ir_define(ir, op, type, a, b);
+  return inst ? inst->dst : -1;
+}
+
+int
+jit_ir_arg(JitIr* ir, JitIrType type, int index)
+{
+  if (index < 0 || index > 7) {
+    fprintf(stderr, "JIT IR: argument %d not passed in a register\n", index);
+    return -1;
+  }
+  JitIrInst* inst = jit_ir_define(ir, JIT_IR_ARG, type, -1, -1);
+  if (!inst)
+    return -1;
+  inst->imm = index;
+  return inst->dst;
+}
+
+int
+jit_ir_const_int(JitIr* ir, int64_t value)
+{
+  JitIrInst* inst = jit_ir_define(ir, JIT_IR_CONST, JIT_IR_INT, -1, -1);
+  if (!inst)
+    return -1;
+  inst->imm = value;
+  return inst->dst;
+}
+
+int
+jit_ir_const_float(JitIr* ir, float value)
+{
+  union
+  {
+    float f;
+    uint32_t i;
+  } conv = { .f = value };
+
+  JitIrInst* inst = jit_ir_define(ir, JIT_IR_CONST, JIT_IR_FLOAT, -1, -1);
+  if (!inst)
+    return -1;
+  inst->imm = conv.i;
+  return inst->dst;
+}
+
+void
+jit_ir_mov(JitIr* ir, int dst, int src)
+{
+  if (dst < 0 || (size_t)dst >= ir->num_values ||
+      !jit_ir_check(ir, src, ir->values[dst].type))
+    return;
+  jit_ir_add_inst(ir, JIT_IR_MOV, dst, src, -1);
+}
+
+int
+jit_ir_add(JitIr* ir, int a, int b)
+{
+  return jit_ir_binary(ir, JIT_IR_ADD, JIT_IR_INT, a, b);
+}
+
+int
+jit_ir_sub(JitIr* ir, int a, int b)
+{
+  return jit_ir_binary(ir, JIT_IR_SUB, JIT_IR_INT, a, b);
+}
+
+int
+jit_ir_mul(JitIr* ir, int a, int b)
+{
+  return jit_ir_binary(ir, JIT_IR_MUL, JIT_IR_INT, a, b);
+}
+
+int
+jit_ir_shl(JitIr* ir, int a, int shift)
+{
+  if (!jit_ir_check(ir, a, JIT_IR_INT) || shift < 0 || shift > 63)
+    return -1;
+  JitIrInst* inst = jit_ir_define(ir, JIT_IR_SHL, JIT_IR_INT, a, -1);
+  if (!inst)
+    return -1;
+  inst->imm = shift;
+  return inst->dst;
+}
+
+int
+jit_ir_float_add(JitIr* ir, int a, int b)
+{
+  return jit_ir_binary(ir, JIT_IR_FADD, JIT_IR_FLOAT, a, b);
+}
+
+int
+jit_ir_float_sub(JitIr* ir, int a, int b)
+{
+  return jit_ir_binary(ir, JIT_IR_FSUB, JIT_IR_FLOAT, a, b);
+}
+
+int
+jit_ir_float_mul(JitIr* ir, int a, int b)
+{
+  return jit_ir_binary(ir, JIT_IR_FMUL, JIT_IR_FLOAT, a, b);
+}
+
+int
+jit_ir_float_div(JitIr* ir, int a, int b)
+{
+  return jit_ir_binary(ir, JIT_IR_FDIV, JIT_IR_FLOAT, a, b);
+}
+
+int
+jit_ir_int_to_float(JitIr* ir, int a)
+{
+  if (!jit_ir_check(ir, a, JIT_IR_INT))
+    return -1;
+  JitIrInst* inst = jit_ir_define(ir, JIT_IR_INT_TO_FLOAT, JIT_IR_FLOAT, a, -1);
+  return inst ? inst->dst : -1;
+}
+
+int
+jit_ir_float_to_int(JitIr* ir, int a)
+{
+  if (!jit_ir_check(ir, a, JIT_IR_FLOAT))
+    return -1;
+  JitIrInst* inst = jit_ir_define(ir, JIT_IR_FLOAT_TO_INT, JIT_IR_INT, a, -1);
+  return inst ? inst->dst : -1;
+}
+
+int
+jit_ir_load(JitIr* ir, int base, int32_t offset)
+{
+  if (!jit_ir_check(ir, base, JIT_IR_INT))
+    return -1;
+  JitIrInst* inst = jit_ir_define(ir, JIT_IR_LOAD, JIT_IR_INT, base, -1);
+  if (!inst)
+    return -1;
+  inst->imm = offset;
+  return inst->dst;
+}
+
+int
+jit_ir_load_float(JitIr* ir, int base, int32_t offset)
+{
+  if (!jit_ir_check(ir, base, JIT_IR_INT))
+    return -1;
+  JitIrInst* inst = jit_ir_define(ir, JIT_IR_LOAD_FLOAT, JIT_IR_FLOAT, base, -1);
+  if (!inst)
+    return -1;
+  inst->imm = offset;
+  return inst->dst;
+}
+
+int
+jit_ir_call(JitIr* ir,
+            void* func,
+            JitIrType return_type,
+            const int* args,
+            int num_args)
+{
+  int num_int = 0, num_float = 0;
+  for (int i = 0; i < num_args; i++) {
+    if (args[i] < 0 || (size_t)args[i] >= ir->num_values) {
+      fprintf(stderr, "JIT IR: invalid call argument %d\n", args[i]);
+      return -1;
+    }
+    if (ir->values[args[i]].type == JIT_IR_INT)
+      num_int++;
+    else
+      num_float++;
+  }
+  if (num_int > 8 || num_float > 8) {
+    fprintf(stderr, "JIT IR: stack arguments are not supported\n");
+    return -1;
+  }
+
+  size_t capacity = ir->call_arg_capacity;
+  while (ir->num_call_args + num_args > capacity)
+    capacity *= 2;
+  if (capacity != ir->call_arg_capacity) {
+    int* call_args = realloc(ir->call_args, sizeof(int) * capacity);
+    if (!call_args) {
+      fprintf(stderr, "JIT IR: call argument table exhausted\n");
+      ir->failed = true;
+      return -1;
+    }
+    ir->call_args = call_args;
+    ir->call_arg_capacity = capacity;
+  }
+
+  JitIrInst* inst = jit_ir_define(ir, JIT_IR_CALL, return_type, -1, -1);
+  if (!inst)
+    return -1;
+  inst->func = func;
+  inst->first_arg = ir->num_call_args;
+  inst->num_args = num_args;
+  memcpy(&ir->call_args[ir->num_call_args], args, sizeof(int) * num_args);
+  ir->num_call_args += num_args;
+  return inst->dst;
+}
+
+size_t
+jit_ir_create_label(JitIr* ir)
+{
+  return jit_create_label(ir->jit);
+}
+
+void
+jit_ir_bind_label(JitIr* ir, size_t label)
+{
+  JitIrInst* inst = jit_ir_add_inst(ir, JIT_IR_LABEL, -1, -1, -1);
+  if (inst)
+    inst->imm = (int64_t)label;
+}
+
+void
+jit_ir_jump(JitIr* ir, size_t label)
+{
+  JitIrInst* inst = jit_ir_add_inst(ir, JIT_IR_JUMP, -1, -1, -1);
+  if (inst)
+    inst->imm = (int64_t)label;
+}
+
+void
+jit_ir_branch(JitIr* ir, int cond, int a, int b, size_t label)
+{
+  if (a < 0 || (size_t)a >= ir->num_values ||
+      !jit_ir_check(ir, b, ir->values[a].type))
+    return;
+  JitIrInst* inst = jit_ir_add_inst(ir, JIT_IR_BRANCH, -1, a, b);
+  if (!inst)
+    return;
+  inst->imm = (int64_t)label;
+  inst->cond = cond;
+}
+
+void
+jit_ir_ret(JitIr* ir, int value)
+{
+  if (value >= 0 && (size_t)value >= ir->num_values)
+    return;
+  jit_ir_add_inst(ir, JIT_IR_RET, -1, value, -1);
+}
+
+// interval positions, an instruction reads its operands at 2i + 1 and
+// writes its result at 2i + 2 so a value that dies at an instruction can
+// share its register with the result. arguments are defined at 0.
+static size_t
+jit_ir_use(size_t inst)
+{
+  return 2 * inst + 1;
+}
+
+static size_t
+jit_ir_def(size_t inst)
+{
+  return 2 * inst + 2;
+}
+
+static void
+jit_ir_touch(JitIr* ir, int value, size_t pos)
+{
+  JitIrValue* v = &ir->values[value];
+  if (pos < v->start)
+    v->start = pos;
+  if (pos > v->end)
+    v->end = pos;
+}
+
+static bool
+jit_ir_liveness(JitIr* ir)
+{
+  for (size_t i = 0; i < ir->num_values; i++) {
+    ir->values[i].start = (size_t)-1;
+    ir->values[i].end = 0;
+    ir->values[i].crosses_call = false;
+  }
+
+  for (size_t i = 0; i < ir->num_insts; i++) {
+    JitIrInst* inst = &ir->insts[i];
+    if (inst->a >= 0)
+      jit_ir_touch(ir, inst->a, jit_ir_use(i));
+    if (inst->b >= 0)
+      jit_ir_touch(ir, inst->b, jit_ir_use(i));
+    for (int j = 0; j < inst->num_args; j++)
+      jit_ir_touch(ir, ir->call_args[inst->first_arg + j], jit_ir_use(i));
+    if (inst->dst >= 0)
+      jit_ir_touch(ir, inst->dst, inst->op == JIT_IR_ARG ? 0 : jit_ir_def(i));
+  }
+
+  for (size_t i = 0; i < ir->num_values; i++) {
+    JitIrValue* v = &ir->values[i];
+    if (v->start != (size_t)-1 && v->start > v->end) {
+      fprintf(stderr, "JIT IR: value %zu is used before it is defined\n", i);
+      return false;
+    }
+  }
+
+  // a value live at the head of a loop stays live until the back edge
+  size_t* label_pos = malloc(sizeof(size_t) * (ir->jit->num_labels + 1));
+  if (!label_pos)
+    return false;
+  for (size_t i = 0; i < ir->jit->num_labels; i++)
+    label_pos[i] = (size_t)-1;
+  for (size_t i = 0; i < ir->num_insts; i++) {
+    if (ir->insts[i].op == JIT_IR_LABEL)
+      label_pos[ir->insts[i].imm] = jit_ir_use(i);
+  }
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t i = 0; i < ir->num_insts; i++) {
+      JitIrInst* inst = &ir->insts[i];
+      if (inst->op != JIT_IR_JUMP && inst->op != JIT_IR_BRANCH)
+        continue;
+      size_t head = label_pos[inst->imm];
+      size_t tail = jit_ir_use(i);
+      if (head == (size_t)-1 || head > tail)
+        continue;
+      for (size_t j = 0; j < ir->num_values; j++) {
+        JitIrValue* v = &ir->values[j];
+        if (v->start < head && v->end >= head && v->end < tail) {
+          v->end = tail;
+          changed = true;
+        }
+      }
+    }
+  }
+  free(label_pos);
+
+  // values live across a call must not be in caller saved registers
+  for (size_t i = 0; i < ir->num_insts; i++) {
+    if (ir->insts[i].op != JIT_IR_CALL)
+      continue;
+    size_t pos = jit_ir_use(i);
+    for (size_t j = 0; j < ir->num_values; j++) {
+      JitIrValue* v = &ir->values[j];
+      if (v->start < pos && v->end > pos)
+        v->crosses_call = true;
+    }
+  }
+  return true;
+}
+
+static bool
+jit_ir_is_callee_saved(JitIrType type, int reg)
+{
+  return type == JIT_IR_INT ? (reg >= 19 && reg <= 28) : (reg >= 8 && reg <= 15);
+}
+
+static int
+jit_ir_pick_reg(JitIrValue* v, const bool* busy)
+{
+  bool is_int = v->type == JIT_IR_INT;
+  const int* caller = is_int ? jit_ir_int_caller_saved : jit_ir_float_caller_saved;
+  const int* callee = is_int ? jit_ir_int_callee_saved : jit_ir_float_callee_saved;
+  size_t num_caller = is_int ? sizeof(jit_ir_int_caller_saved) / sizeof(int)
+                             : sizeof(jit_ir_float_caller_saved) / sizeof(int);
+  size_t num_callee = is_int ? sizeof(jit_ir_int_callee_saved) / sizeof(int)
+                             : sizeof(jit_ir_float_callee_saved) / sizeof(int);
+
+  // caller saved registers are free to use unless a call clobbers them
+  if (!v->crosses_call) {
+    for (size_t i = 0; i < num_caller; i++) {
+      if (!busy[caller[i]])
+        return caller[i];
+    }
+  }
+  for (size_t i = 0; i < num_callee; i++) {
+    if (!busy[callee[i]])
+      return callee[i];
+  }
+  return -1;
+}
+
+// linear scan (Poletto & Sarkar). intervals are visited by start, when no
+// register is free the interval that ends last is spilled to the stack.
+// false when the work arrays can't be allocated.
+static bool
+jit_ir_allocate(JitIr* ir, size_t* num_slots)
+{
+  size_t count = 0;
+  int* order = malloc(sizeof(int) * (ir->num_values + 1));
+  int* active = malloc(sizeof(int) * (ir->num_values + 1));
+  if (!order || !active) {
+    fprintf(stderr, "JIT IR: out of memory allocating registers\n");
+    free(order);
+    free(active);
+    return false;
+  }
+  for (size_t i = 0; i < ir->num_values; i++) {
+    ir->values[i].reg = -1;
+    ir->values[i].slot = -1;
+    if (ir->values[i].start == (size_t)-1)
+      continue;
+
+    // insertion sort by start, values are mostly created in order
+    size_t j = count++;
+    while (j > 0 && ir->values[order[j - 1]].start > ir->values[i].start) {
+      order[j] = order[j - 1];
+      j--;
+    }
+    order[j] = (int)i;
+  }
+
+  bool busy[2][32];
+  memset(busy, 0, sizeof(busy));
+  size_t num_active = 0;
+  *num_slots = 0;
+  ir->num_spills = 0;
+  ir->saved_int = 0;
+  ir->saved_float = 0;
+
+  for (size_t i = 0; i < count; i++) {
+    JitIrValue* v = &ir->values[order[i]];
+    bool* class_busy = busy[v->type];
+
+    // expire intervals that ended before this one starts
+    for (size_t j = 0; j < num_active;) {
+      JitIrValue* w = &ir->values[active[j]];
+      if (w->end < v->start) {
+        busy[w->type][w->reg] = false;
+        active[j] = active[--num_active];
+      } else {
+        j++;
+      }
+    }
+
+    v->reg = jit_ir_pick_reg(v, class_busy);
+    if (v->reg < 0) {
+      // steal the register of the active interval that ends last, if it
+      // ends after this one and may hold this value across its calls
+      long victim = -1;
+      for (size_t j = 0; j < num_active; j++) {
+        JitIrValue* w = &ir->values[active[j]];
+        if (w->type != v->type ||
+            (v->crosses_call && !jit_ir_is_callee_saved(w->type, w->reg)))
+          continue;
+        if (victim < 0 || w->end > ir->values[active[victim]].end)
+          victim = (long)j;
+      }
+
+      JitIrValue* spilled = v;
+      if (victim >= 0 && ir->values[active[victim]].end > v->end) {
+        spilled = &ir->values[active[victim]];
+        v->reg = spilled->reg;
+        spilled->reg = -1;
+        active[victim] = active[--num_active];
+      }
+      spilled->slot = (int)(*num_slots)++;
+      ir->num_spills++;
+    }
+
+    if (v->reg >= 0) {
+      class_busy[v->reg] = true;
+      active[num_active++] = order[i];
+      if (jit_ir_is_callee_saved(v->type, v->reg)) {
+        if (v->type == JIT_IR_INT)
+          ir->saved_int |= 1u << v->reg;
+        else
+          ir->saved_float |= 1u << v->reg;
+      }
+    }
+  }
+
+  free(order);
+  free(active);
+  return true;
+}
+
+typedef struct
+{
+  JitIr* ir;
+  size_t spill_base; // byte offset of the first spill slot from sp
+} JitIrEmitter;
+
+static uint32_t
+jit_ir_slot_offset(JitIrEmitter* e, JitIrValue* v)
+{
+  return (uint32_t)(e->spill_base + (size_t)v->slot * 8);
+}
+
+// the register holding a value, spilled values are reloaded into scratch
+static int
+jit_ir_read(JitIrEmitter* e, int value, int scratch)
+{
+  JITCompiler* jit = e->ir->jit;
+  JitIrValue* v = &e->ir->values[value];
+  if (v->reg >= 0)
+    return v->reg;
+
+  uint32_t offset = jit_ir_slot_offset(e, v);
+  if (v->type == JIT_IR_INT)
+    jit_emit(jit, arm64_ldr(scratch, 31, offset / 8));
+  else
+    jit_emit(jit, arm64_ldrs(scratch, 31, offset / 4));
+  return scratch;
+}
+
+static int
+jit_ir_dest(JitIrEmitter* e, int value, int scratch)
+{
+  JitIrValue* v = &e->ir->values[value];
+  return v->reg >= 0 ? v->reg : scratch;
+}
+
+// stores the result of a spilled value written through jit_ir_dest
+static void
+jit_ir_write(JitIrEmitter* e, int value, int reg)
+{
+  JITCompiler* jit = e->ir->jit;
+  JitIrValue* v = &e->ir->values[value];
+  if (v->reg >= 0)
+    return;
+
+  uint32_t offset = jit_ir_slot_offset(e, v);
+  if (v->type == JIT_IR_INT)
+    jit_emit(jit, arm64_str(reg, 31, offset / 8));
+  else
+    jit_emit(jit, arm64_strs(reg, 31, offset / 4));
+}
+
+// moves a value into a fixed register, for arguments and return values
+static void
+jit_ir_move_to(JitIrEmitter* e, int value, int reg)
+{
+  JITCompiler* jit = e->ir->jit;
+  JitIrValue* v = &e->ir->values[value];
+  int src = jit_ir_read(e, value, reg);
+  if (src == reg)
+    return;
+  jit_emit(jit, v->type == JIT_IR_INT ? arm64_mov(reg, src)
+                                      : arm64_fmov_reg_s(reg, src));
+}
+
+// moves a fixed register into a value
+static void
+jit_ir_move_from(JitIrEmitter* e, int value, int reg)
+{
+  JITCompiler* jit = e->ir->jit;
+  JitIrValue* v = &e->ir->values[value];
+  if (v->reg < 0) {
+    jit_ir_write(e, value, reg);
+    return;
+  }
+  if (v->reg != reg)
+    jit_emit(jit, v->type == JIT_IR_INT ? arm64_mov(v->reg, reg)
+                                        : arm64_fmov_reg_s(v->reg, reg));
+}
+
+// saves (or restores) the callee saved registers the allocation used
+static void
+jit_ir_save_regs(JitIr* ir, bool restore)
+{
+  uint32_t offset = 0;
+  for (int reg = 19; reg <= 28; reg++) {
+    if (!(ir->saved_int & (1u << reg)))
+      continue;
+    jit_emit(ir->jit, restore ? arm64_ldr(reg, 31, offset / 8)
+                              : arm64_str(reg, 31, offset / 8));
+    offset += 8;
+  }
+  for (int reg = 8; reg <= 15; reg++) {
+    if (!(ir->saved_float & (1u << reg)))
+      continue;
+    // only the low 64 bits of v8-v15 are callee saved
+    jit_emit(ir->jit, restore ? arm64_ldrd(reg, 31, offset / 8)
+                              : arm64_strd(reg, 31, offset / 8));
+    offset += 8;
+  }
+}
+
+static void
+jit_ir_emit_inst(JitIrEmitter* e, JitIrInst* inst, size_t epilogue, bool last)
+{
+  JitIr* ir = e->ir;
+  JITCompiler* jit = ir->jit;
+  bool is_int = inst->dst >= 0 && ir->values[inst->dst].type == JIT_IR_INT;
+  int scratch_a = is_int ? 16 : 30;
+  int scratch_b = is_int ? 17 : 31;
+
+  switch (inst->op) {
+    case JIT_IR_ARG:
+      break; // moved in by the prologue
+    case JIT_IR_CONST: {
+      int rd = jit_ir_dest(e, inst->dst, scratch_a);
+      if (is_int) {
+        jit_load_imm64(jit, rd, (uint64_t)inst->imm);
+      } else {
+        union
+        {
+          uint32_t i;
+          float f;
+        } conv = { .i = (uint32_t)inst->imm };
+        jit_load_float(jit, rd, conv.f);
+      }
+      jit_ir_write(e, inst->dst, rd);
+      break;
+    }
+    case JIT_IR_MOV: {
+      int rn = jit_ir_read(e, inst->a, scratch_a);
+      jit_ir_move_from(e, inst->dst, rn);
+      break;
+    }
+    case JIT_IR_ADD:
+    case JIT_IR_SUB:
+    case JIT_IR_MUL:
+    case JIT_IR_FADD:
+    case JIT_IR_FSUB:
+    case JIT_IR_FMUL:
+    case JIT_IR_FDIV: {
+      int rn = jit_ir_read(e, inst->a, scratch_a);
+      int rm = jit_ir_read(e, inst->b, scratch_b);
+      int rd = jit_ir_dest(e, inst->dst, scratch_a);
+      switch (inst->op) {
+        case JIT_IR_ADD: jit_emit(jit, arm64_add(rd, rn, rm)); break;
+        case JIT_IR_SUB: jit_emit(jit, arm64_sub(rd, rn, rm)); break;
+        case JIT_IR_MUL: jit_emit(jit, arm64_mul(rd, rn, rm)); break;
+        case JIT_IR_FADD: jit_float_add(jit, rd, rn, rm); break;
+        case JIT_IR_FSUB: jit_float_sub(jit, rd, rn, rm); break;
+        case JIT_IR_FMUL: jit_float_mul(jit, rd, rn, rm); break;
+        default: jit_float_div(jit, rd, rn, rm); break;
+      }
+      jit_ir_write(e, inst->dst, rd);
+      break;
+    }
+    case JIT_IR_SHL: {
+      int rn = jit_ir_read(e, inst->a, scratch_a);
+      int rd = jit_ir_dest(e, inst->dst, scratch_a);
+      jit_emit(jit, arm64_lsl_imm(rd, rn, (int)inst->imm));
+      jit_ir_write(e, inst->dst, rd);
+      break;
+    }
+    case JIT_IR_INT_TO_FLOAT: {
+      int rn = jit_ir_read(e, inst->a, 16);
+      int rd = jit_ir_dest(e, inst->dst, 30);
+      jit_emit(jit, arm64_scvtf_s(rd, rn) | (1u << 31)); // from x register
+      jit_ir_write(e, inst->dst, rd);
+      break;
+    }
+    case JIT_IR_FLOAT_TO_INT: {
+      int rn = jit_ir_read(e, inst->a, 30);
+      int rd = jit_ir_dest(e, inst->dst, 16);
+      jit_emit(jit, arm64_fcvtzs_s(rd, rn) | (1u << 31)); // to x register
+      jit_ir_write(e, inst->dst, rd);
+      break;
+    }
+    case JIT_IR_LOAD:
+    case JIT_IR_LOAD_FLOAT: {
+      int size = inst->op == JIT_IR_LOAD ? 8 : 4;
+      int rn = jit_ir_read(e, inst->a, 16);
+      int rd = jit_ir_dest(e, inst->dst, is_int ? 16 : 30);
+      int64_t offset = inst->imm;
+      if (offset < 0 || offset % size || offset / size > 0xfff) {
+        jit_load_imm64(jit, 17, (uint64_t)offset);
+        jit_emit(jit, arm64_add(17, rn, 17));
+        rn = 17;
+        offset = 0;
+      }
+      jit_emit(jit, size == 8 ? arm64_ldr(rd, rn, offset / 8)
+                              : arm64_ldrs(rd, rn, offset / 4));
+      jit_ir_write(e, inst->dst, rd);
+      break;
+    }
+    case JIT_IR_CALL: {
+      // nothing lives in x0-x7/v0-v7, so the arguments can go straight in
+      int num_int = 0, num_float = 0;
+      for (int i = 0; i < inst->num_args; i++) {
+        int arg = ir->call_args[inst->first_arg + i];
+        if (ir->values[arg].type == JIT_IR_INT)
+          jit_ir_move_to(e, arg, num_int++);
+        else
+          jit_ir_move_to(e, arg, num_float++);
+      }
+      jit_emit_call(jit, inst->func);
+      jit_ir_move_from(e, inst->dst, 0);
+      break;
+    }
+    case JIT_IR_LABEL:
+      jit_bind_label(jit, (size_t)inst->imm);
+      break;
+    case JIT_IR_JUMP:
+      jit_jump(jit, (size_t)inst->imm);
+      break;
+    case JIT_IR_BRANCH: {
+      bool int_cmp = ir->values[inst->a].type == JIT_IR_INT;
+      int rn = jit_ir_read(e, inst->a, int_cmp ? 16 : 30);
+      int rm = jit_ir_read(e, inst->b, int_cmp ? 17 : 31);
+      jit_emit(jit, int_cmp ? arm64_cmp(rn, rm) : arm64_fcmp_s(rn, rm));
+      jit_jump_if(jit, (size_t)inst->imm, inst->cond);
+      break;
+    }
+    case JIT_IR_RET:
+      if (inst->a >= 0)
+        jit_ir_move_to(e, inst->a, 0);
+      if (!last)
+        jit_jump(jit, epilogue);
+      break;
+  }
+}
+
+bool
+jit_ir_compile(JitIr* ir)
+{
+  JITCompiler* jit = ir->jit;
+  if (ir->failed) {
+    fprintf(stderr, "JIT IR: incomplete after a failed allocation\n");
+    return false;
+  }
+  if (!jit_ir_liveness(ir))
+    return false;
+
+  size_t num_slots;
+  if (!jit_ir_allocate(ir, &num_slots))
+    return false;
+
+  size_t num_saved = __builtin_popcount(ir->saved_int) +
+                     __builtin_popcount(ir->saved_float);
+  ir->frame_size = ((num_saved + num_slots) * 8 + 15) & ~(size_t)15;
+  if (ir->frame_size > MAX_IR_FRAME_SIZE) {
+    fprintf(stderr, "JIT IR: stack frame of %zu bytes is too large\n",
+            ir->frame_size);
+    return false;
+  }
+
+  JitIrEmitter e = { ir, num_saved * 8 };
+
+  // prologue
+  jit_emit(jit, arm64_stp_pre(29, 30, 31, -2)); // stp x29, x30, [sp, #-16]!
+  jit_emit(jit, arm64_add_imm(29, 31, 0));      // mov x29, sp
+  if (ir->frame_size)
+    jit_emit(jit, arm64_sub_imm(31, 31, ir->frame_size));
+  jit_ir_save_regs(ir, false);
+
+  // incoming arguments never share registers with values
+  for (size_t i = 0; i < ir->num_insts; i++) {
+    JitIrInst* inst = &ir->insts[i];
+    if (inst->op == JIT_IR_ARG &&
+        ir->values[inst->dst].start != (size_t)-1)
+      jit_ir_move_from(&e, inst->dst, (int)inst->imm);
+  }
+
+  size_t epilogue = jit_create_label(jit);
+  for (size_t i = 0; i < ir->num_insts; i++)
+    jit_ir_emit_inst(&e, &ir->insts[i], epilogue, i + 1 == ir->num_insts);
+
+  // epilogue
+  jit_bind_label(jit, epilogue);
+  jit_ir_save_regs(ir, true);
+  if (ir->frame_size)
+    jit_emit(jit, arm64_add_imm(31, 31, ir->frame_size));
+  jit_emit(jit, arm64_ldp_post(29, 30, 31, 2)); // ldp x29, x30, [sp], #16
+  jit_emit(jit, arm64_ret());
+  return true;
+}
+
 void
-jit_load_float(JITCompiler* jit, int reg, float value)
+jit_ir_dump(JitIr* ir)
+{
+  static const char* names[] = {
+    "arg",  "const", "mov",  "add",   "sub",    "mul", "shl",
+    "fadd", "fsub",  "fmul", "fdiv",  "itof",   "ftoi", "load",
+    "loadf", "call", "label", "jump", "branch", "ret",
+  };
+
+  printf("\nIR: %zu instructions, %zu values, %zu spilled, frame %zu bytes\n",
+         ir->num_insts,
+         ir->num_values,
+         ir->num_spills,
+         ir->frame_size);
+  printf("---------------------------------------------------------\n");
+  for (size_t i = 0; i < ir->num_insts; i++) {
+    JitIrInst* inst = &ir->insts[i];
+    printf("%4zu: %-6s", i, names[inst->op]);
+    if (inst->dst >= 0)
+      printf(" v%d", inst->dst);
+    if (inst->a >= 0)
+      printf(" v%d", inst->a);
+    if (inst->b >= 0)
+      printf(" v%d", inst->b);
+    for (int j = 0; j < inst->num_args; j++)
+      printf(" v%d", ir->call_args[inst->first_arg + j]);
+    if (inst->op == JIT_IR_ARG || inst->op == JIT_IR_CONST ||
+        inst->op == JIT_IR_SHL ||
+        inst->op == JIT_IR_LOAD || inst->op == JIT_IR_LOAD_FLOAT ||
+        inst->op == JIT_IR_LABEL || inst->op == JIT_IR_JUMP ||
+        inst->op == JIT_IR_BRANCH)
+      printf(" #%lld", (long long)inst->imm);
+    printf("\n");
+  }
+
+  printf("\nVALUES\n");
+  printf("---------------------------------------------------------\n");
+  for (size_t i = 0; i < ir->num_values; i++) {
+    JitIrValue* v = &ir->values[i];
+    if (v->start == (size_t)-1)
+      continue;
+    printf("%4zu: [%zu, %zu]%s ", i, v->start, v->end, v->crosses_call ? " call" : "");
+    if (v->reg >= 0)
+      printf("%c%d\n", v->type == JIT_IR_INT ? 'x' : 's', v->reg);
+    else
+      printf("slot %d\n", v->slot);
+  }
+}
+
+JitExpr*
+jit_expr_init(JitIr* ir)
+{
+  JitExpr* expr = malloc(sizeof(JitExpr));
+  if (!expr)
+    return NULL;
+
+  memset(expr, 0, sizeof(JitExpr));
+  expr->ir = ir;
+  expr->node_capacity = MAX_EXPR_NODE_CAPACITY;
+  expr->table_capacity = MAX_EXPR_NODE_CAPACITY * 2;
+  expr->nodes = malloc(sizeof(JitExprNode) * expr->node_capacity);
+  expr->table = malloc(sizeof(int) * expr->table_capacity);
+  if (!expr->nodes || !expr->table) {
+    jit_expr_cleanup(expr);
+    return NULL;
+  }
+  memset(expr->table, 0xff, sizeof(int) * expr->table_capacity);
+  return expr;
+}
+
+void
+jit_expr_cleanup(JitExpr* expr)
+{
+  if (!expr)
+    return;
+  if (expr->nodes)
+    free(expr->nodes);
+  if (expr->table)
+    free(expr->table);
+  free(expr);
+}
+
+static uint64_t
+jit_expr_hash(JitExprOp op, JitIrType type, int a, int b, int64_t imm)
+{
+  uint64_t words[] = { op, type, (uint64_t)a, (uint64_t)b, (uint64_t)imm };
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+    hash ^= words[i];
+    hash *= 0x100000001b3ull;
+    hash ^= hash >> 29;
+  }
+  return hash;
+}
+
+static bool
+jit_expr_grow_table(JitExpr* expr)
+{
+  size_t capacity = expr->table_capacity * 2;
+  int* table = malloc(sizeof(int) * capacity);
+  if (!table)
+    return false;
+  memset(table, 0xff, sizeof(int) * capacity);
+
+  for (size_t i = 0; i < expr->num_nodes; i++) {
+    JitExprNode* n = &expr->nodes[i];
+    uint64_t hash = jit_expr_hash(n->op, n->type, n->a, n->b, n->imm);
+    size_t j = hash & (capacity - 1);
+    while (table[j] >= 0)
+      j = (j + 1) & (capacity - 1);
+    table[j] = (int)i;
+  }
+
+  free(expr->table);
+  expr->table = table;
+  expr->table_capacity = capacity;
+  return true;
+}
+
+// the node for op on a and b, built only if the table doesn't have it yet
+static int
+jit_expr_node(JitExpr* expr,
+              JitExprOp op,
+              JitIrType type,
+              int a,
+              int b,
+              int64_t imm)
+{
+  if (expr->num_nodes * 2 >= expr->table_capacity &&
+      !jit_expr_grow_table(expr)) {
+    fprintf(stderr, "JIT expr: hash table exhausted\n");
+    return -1;
+  }
+
+  uint64_t hash = jit_expr_hash(op, type, a, b, imm);
+  size_t mask = expr->table_capacity - 1;
+  size_t i = hash & mask;
+  for (; expr->table[i] >= 0; i = (i + 1) & mask) {
+    JitExprNode* n = &expr->nodes[expr->table[i]];
+    if (n->op == op && n->type == type && n->a == a && n->b == b &&
+        n->imm == imm) {
+      expr->reused++;
+      return expr->table[i];
+    }
+  }
+
+  if (expr->num_nodes >= expr->node_capacity) {
+    size_t capacity = expr->node_capacity * 2;
+    JitExprNode* nodes = realloc(expr->nodes, sizeof(JitExprNode) * capacity);
+    if (!nodes) {
+      fprintf(stderr, "JIT expr: node table exhausted\n");
+      return -1;
+    }
+    expr->nodes = nodes;
+    expr->node_capacity = capacity;
+  }
+
+  JitExprNode* n = &expr->nodes[expr->num_nodes];
+  n->op = op;
+  n->type = type;
+  n->a = a;
+  n->b = b;
+  n->imm = imm;
+  n->value = -1;
+  expr->table[i] = (int)expr->num_nodes;
+  return (int)expr->num_nodes++;
+}
+
+static bool
+jit_expr_check(JitExpr* expr, int node, JitIrType type)
+{
+  if (node < 0 || (size_t)node >= expr->num_nodes ||
+      expr->nodes[node].type != type) {
+    fprintf(stderr, "JIT expr: invalid %s node %d\n",
+            type == JIT_IR_INT ? "int" : "float",
+            node);
+    return false;
+  }
+  return true;
+}
+
+static bool
+jit_expr_is_const(JitExpr* expr, int node, int64_t* value)
+{
+  if (expr->nodes[node].op != JIT_EXPR_CONST)
+    return false;
+  *value = expr->nodes[node].imm;
+  return true;
+}
+
+static float
+jit_expr_float(int64_t bits)
+{
+  union
+  {
+    uint32_t i;
+    float f;
+  } conv = { .i = (uint32_t)bits };
+  return conv.f;
+}
+
+// operands of commutative operations: a constant goes to the right,
+// otherwise they are sorted by node so a + b and b + a hash the same
+static void
+jit_expr_order(JitExpr* expr, int* a, int* b)
+{
+  int64_t x, y;
+  bool const_a = jit_expr_is_const(expr, *a, &x);
+  bool const_b = jit_expr_is_const(expr, *b, &y);
+  if ((const_a && !const_b) || (const_a == const_b && *a > *b)) {
+    int t = *a;
+    *a = *b;
+    *b = t;
+  }
+}
+
+static int
+jit_expr_folded(JitExpr* expr, int node)
+{
+  if (node >= 0)
+    expr->folded++;
+  return node;
+}
+
+int
+jit_expr_const_int(JitExpr* expr, int64_t value)
+{
+  return jit_expr_node(expr, JIT_EXPR_CONST, JIT_IR_INT, -1, -1, value);
+}
+
+int
+jit_expr_const_float(JitExpr* expr, float value)
 {
   union
   {
     float f;
     uint32_t i;
   } conv = { .f = value };
+  return jit_expr_node(expr, JIT_EXPR_CONST, JIT_IR_FLOAT, -1, -1, conv.i);
+}
+
+int
+jit_expr_value(JitExpr* expr, int value)
+{
+  JitIr* ir = expr->ir;
+  if (value < 0 || (size_t)value >= ir->num_values) {
+    fprintf(stderr, "JIT expr: invalid IR value %d\n", value);
+    return -1;
+  }
+  int node = jit_expr_node(
+    expr, JIT_EXPR_VALUE, ir->values[value].type, -1, -1, value);
+  if (node >= 0)
+    expr->nodes[node].value = value;
+  return node;
+}
+
+// integer operations wrap like the instructions do
+static int
+jit_expr_int_binary(JitExpr* expr, JitExprOp op, int a, int b)
+{
+  if (!jit_expr_check(expr, a, JIT_IR_INT) ||
+      !jit_expr_check(expr, b, JIT_IR_INT))
+    return -1;
+
+  int64_t x, y;
+  if (op != JIT_EXPR_SUB)
+    jit_expr_order(expr, &a, &b);
+
+  bool const_a = jit_expr_is_const(expr, a, &x);
+  bool const_b = jit_expr_is_const(expr, b, &y);
+  if (const_a && const_b) {
+    uint64_t ux = (uint64_t)x, uy = (uint64_t)y;
+    uint64_t r = op == JIT_EXPR_ADD ? ux + uy
+               : op == JIT_EXPR_SUB ? ux - uy
+                                    : ux * uy;
+    return jit_expr_folded(expr, jit_expr_const_int(expr, (int64_t)r));
+  }
+
+  if (const_b) {
+    if ((op == JIT_EXPR_ADD || op == JIT_EXPR_SUB) && y == 0)
+      return jit_expr_folded(expr, a);
+    if (op == JIT_EXPR_MUL && y == 1)
+      return jit_expr_folded(expr, a);
+    if (op == JIT_EXPR_MUL && y == 0)
+      return jit_expr_folded(expr, b);
+    if (op == JIT_EXPR_MUL && y > 0 && (y & (y - 1)) == 0) {
+      expr->reduced++;
+      return jit_expr_shl(expr, a, __builtin_ctzll((uint64_t)y));
+    }
+  }
+  if (op == JIT_EXPR_SUB && a == b)
+    return jit_expr_folded(expr, jit_expr_const_int(expr, 0));
+
+  return jit_expr_node(expr, op, JIT_IR_INT, a, b, 0);
+}
+
+// only folds that hold for every input, NaN, infinities and -0 included
+static int
+jit_expr_float_binary(JitExpr* expr, JitExprOp op, int a, int b)
+{
+  if (!jit_expr_check(expr, a, JIT_IR_FLOAT) ||
+      !jit_expr_check(expr, b, JIT_IR_FLOAT))
+    return -1;
+
+  int64_t x, y;
+  if (op == JIT_EXPR_FADD || op == JIT_EXPR_FMUL)
+    jit_expr_order(expr, &a, &b);
+
+  bool const_a = jit_expr_is_const(expr, a, &x);
+  bool const_b = jit_expr_is_const(expr, b, &y);
+  if (const_a && const_b) {
+    float fx = jit_expr_float(x), fy = jit_expr_float(y);
+    float r = op == JIT_EXPR_FADD ? fx + fy
+            : op == JIT_EXPR_FSUB ? fx - fy
+            : op == JIT_EXPR_FMUL ? fx * fy
+                                  : fx / fy;
+    return jit_expr_folded(expr, jit_expr_const_float(expr, r));
+  }
+
+  if (const_b) {
+    float fy = jit_expr_float(y);
+    if (op == JIT_EXPR_FSUB && y == 0)
+      return jit_expr_folded(expr, a); // x - 0.0 == x, even for -0
+    if ((op == JIT_EXPR_FMUL || op == JIT_EXPR_FDIV) && fy == 1.0f)
+      return jit_expr_folded(expr, a);
+  }
+
+  return jit_expr_node(expr, op, JIT_IR_FLOAT, a, b, 0);
+}
+
+int
+jit_expr_add(JitExpr* expr, int a, int b)
+{
+  return jit_expr_int_binary(expr, JIT_EXPR_ADD, a, b);
+}
+
+int
+jit_expr_sub(JitExpr* expr, int a, int b)
+{
+  return jit_expr_int_binary(expr, JIT_EXPR_SUB, a, b);
+}
+
+int
+jit_expr_mul(JitExpr* expr, int a, int b)
+{
+  return jit_expr_int_binary(expr, JIT_EXPR_MUL, a, b);
+}
+
+int
+jit_expr_shl(JitExpr* expr, int a, int shift)
+{
+  if (!jit_expr_check(expr, a, JIT_IR_INT) || shift < 0 || shift > 63)
+    return -1;
+
+  int64_t x;
+  if (jit_expr_is_const(expr, a, &x))
+    return jit_expr_folded(
+      expr, jit_expr_const_int(expr, (int64_t)((uint64_t)x << shift)));
+  if (shift == 0)
+    return jit_expr_folded(expr, a);
+
+  // (a << n) << m is a << (n + m)
+  JitExprNode* n = &expr->nodes[a];
+  if (n->op == JIT_EXPR_SHL && n->imm + shift < 64) {
+    expr->folded++;
+    return jit_expr_shl(expr, n->a, (int)n->imm + shift);
+  }
+  return jit_expr_node(expr, JIT_EXPR_SHL, JIT_IR_INT, a, -1, shift);
+}
+
+int
+jit_expr_float_add(JitExpr* expr, int a, int b)
+{
+  return jit_expr_float_binary(expr, JIT_EXPR_FADD, a, b);
+}
+
+int
+jit_expr_float_sub(JitExpr* expr, int a, int b)
+{
+  return jit_expr_float_binary(expr, JIT_EXPR_FSUB, a, b);
+}
+
+int
+jit_expr_float_mul(JitExpr* expr, int a, int b)
+{
+  return jit_expr_float_binary(expr, JIT_EXPR_FMUL, a, b);
+}
+
+int
+jit_expr_float_div(JitExpr* expr, int a, int b)
+{
+  return jit_expr_float_binary(expr, JIT_EXPR_FDIV, a, b);
+}
+
+int
+jit_expr_int_to_float(JitExpr* expr, int a)
+{
+  if (!jit_expr_check(expr, a, JIT_IR_INT))
+    return -1;
+
+  int64_t x;
+  if (jit_expr_is_const(expr, a, &x))
+    return jit_expr_folded(expr, jit_expr_const_float(expr, (float)x));
+  return jit_expr_node(expr, JIT_EXPR_INT_TO_FLOAT, JIT_IR_FLOAT, a, -1, 0);
+}
+
+int
+jit_expr_float_to_int(JitExpr* expr, int a)
+{
+  if (!jit_expr_check(expr, a, JIT_IR_FLOAT))
+    return -1;
+
+  int64_t x;
+  if (jit_expr_is_const(expr, a, &x)) {
+    // fcvtzs saturates and turns NaN into 0
+    float f = jit_expr_float(x);
+    int64_t r = f != f                ? 0
+              : f >= 9223372036854775807.0f ? INT64_MAX
+              : f <= -9223372036854775808.0f ? INT64_MIN
+                                            : (int64_t)f;
+    return jit_expr_folded(expr, jit_expr_const_int(expr, r));
+  }
+  return jit_expr_node(expr, JIT_EXPR_FLOAT_TO_INT, JIT_IR_INT, a, -1, 0);
+}
+
+int
+jit_expr_lower(JitExpr* expr, int node)
+{
+  if (node < 0 || (size_t)node >= expr->num_nodes)
+    return -1;
+
+  JitExprNode* n = &expr->nodes[node];
+  if (n->value >= 0)
+    return n->value;
+
+  JitIr* ir = expr->ir;
+  int a = n->a >= 0 ? jit_expr_lower(expr, n->a) : -1;
+  int b = n->b >= 0 ? jit_expr_lower(expr, n->b) : -1;
+  int value = -1;
+  if ((n->a >= 0 && a < 0) || (n->b >= 0 && b < 0))
+    return -1;
+
+  // the recursion may have grown the node array
+  n = &expr->nodes[node];
+  switch (n->op) {
+    case JIT_EXPR_CONST:
+      value = n->type == JIT_IR_INT
+                ? jit_ir_const_int(ir, n->imm)
+                : jit_ir_const_float(ir, jit_expr_float(n->imm));
+      break;
+    case JIT_EXPR_VALUE: value = (int)n->imm; break;
+    case JIT_EXPR_ADD: value = jit_ir_add(ir, a, b); break;
+    case JIT_EXPR_SUB: value = jit_ir_sub(ir, a, b); break;
+    case JIT_EXPR_MUL: value = jit_ir_mul(ir, a, b); break;
+    case JIT_EXPR_SHL: value = jit_ir_shl(ir, a, (int)n->imm); break;
+    case JIT_EXPR_FADD: value = jit_ir_float_add(ir, a, b); break;
+    case JIT_EXPR_FSUB: value = jit_ir_float_sub(ir, a, b); break;
+    case JIT_EXPR_FMUL: value = jit_ir_float_mul(ir, a, b); break;
+    case JIT_EXPR_FDIV: value = jit_ir_float_div(ir, a, b); break;
+    case JIT_EXPR_INT_TO_FLOAT: value = jit_ir_int_to_float(ir, a); break;
+    case JIT_EXPR_FLOAT_TO_INT: value = jit_ir_float_to_int(ir, a); break;
+  }
+
+  n->value = value;
+  return value;
+}
+
+void
+jit_expr_forget(JitExpr* expr)
+{
+  for (size_t i = 0; i < expr->num_nodes; i++) {
+    JitExprNode* n = &expr->nodes[i];
+    if (n->op != JIT_EXPR_VALUE)
+      n->value = -1;
+  }
+}
+
+#define JIT_GEMM_MR 4 // rows of a C block
+#define JIT_GEMM_NR 16 // columns of a C block, four vectors
+#define JIT_GEMM_B 0   // v0-v3, a row of B
+#define JIT_GEMM_A 4   // v4-v7, four elements of a row of A each
+#define JIT_GEMM_C 16  // v16-v31, the C block
+
+typedef struct
+{
+  JITCompiler* jit;
+  const JitGemmShape* shape;
+  bool loop_k; // K in a loop of 4 steps instead of unrolled
+  bool packed; // B read from the panels at x3
+  int a, c;    // registers with the rows of A and C of the current blocks
+  uint64_t row; // byte offset of those rows in A, scaled by ldc / lda for C
+} JitGemmEmitter;
+
+// rd = rn + offset in bytes, through x16 once it needs more than 12 bits
+static void
+jit_add_offset(JITCompiler* jit, int rd, int rn, uint64_t offset)
+{
+  if (offset < 4096) {
+    if (offset || rd != rn)
+      jit_emit(jit, arm64_add_imm(rd, rn, (uint16_t)offset));
+    return;
+  }
+  jit_load_imm64(jit, 16, offset);
+  jit_emit(jit, arm64_add(rd, rn, 16));
+}
+
+static void
+jit_gemm_count_down(JITCompiler* jit, int reg, size_t label)
+{
+  jit_emit(jit, arm64_sub_imm(reg, reg, 1));
+  jit_compare(jit, reg, 31);
+  jit_jump_if_not_equal(jit, label);
+}
+
+// a row of cols elements of B from x13 into v0.., the lanes past cols are
+// left as they are
+static void
+jit_gemm_load_row(JitGemmEmitter* e, int cols)
+{
+  JITCompiler* jit = e->jit;
+  int full = cols / 4, rest = cols % 4;
+
+  if (e->packed) {
+    int vectors = full + (rest > 0);
+    jit_emit(jit, arm64_ld1_post(JIT_GEMM_B, vectors, VEC_4S, 13));
+    return;
+  }
+
+  if (full)
+    jit_emit(jit, arm64_ld1_post(JIT_GEMM_B, full, VEC_4S, 13));
+  for (int lane = 0; lane < rest; lane++)
+    jit_emit(jit, arm64_ld1_lane_post(JIT_GEMM_B + full, lane, 13));
+  jit_add_offset(jit, 13, 13, (uint64_t)(e->shape->ldb - cols) * 4);
+}
+
+// depth (1 or 4) steps of K for a rows x cols block
+static void
+jit_gemm_step(JitGemmEmitter* e, int rows, int cols, int depth)
+{
+  JITCompiler* jit = e->jit;
+  int vectors = (cols + 3) / 4;
+
+  for (int r = 0; r < rows; r++) {
+    if (depth == 4)
+      jit_emit(jit, arm64_ld1_post(JIT_GEMM_A + r, 1, VEC_4S, 9 + r));
+    else
+      jit_emit(jit, arm64_ld1_lane_post(JIT_GEMM_A + r, 0, 9 + r));
+  }
+
+  for (int q = 0; q < depth; q++) {
+    jit_gemm_load_row(e, cols);
+    for (int r = 0; r < rows; r++) {
+      for (int c = 0; c < vectors; c++)
+        jit_emit(jit, arm64_fmla_lane(JIT_GEMM_C + r * 4 + c,
+                                      JIT_GEMM_B + c,
+                                      JIT_GEMM_A + r,
+                                      q));
+    }
+  }
+}
+
+// the block of rows x cols at the current rows and column col
+static void
+jit_gemm_block(JitGemmEmitter* e, int rows, int col, int cols)
+{
+  JITCompiler* jit = e->jit;
+  const JitGemmShape* s = e->shape;
+  int full = cols / 4, rest = cols % 4, vectors = full + (rest > 0);
+
+  for (int r = 0; r < rows; r++)
+    jit_add_offset(jit, 9 + r, e->a, (e->row + r) * s->lda * 4);
+  if (e->packed)
+    jit_add_offset(jit, 13, 3, (uint64_t)(col / JIT_GEMM_NR) * s->k * 64);
+  else
+    jit_add_offset(jit, 13, 1, (uint64_t)col * 4);
+
+  for (int r = 0; r < rows; r++) {
+    for (int c = 0; c < vectors; c++)
+      jit_emit(jit, arm64_movi_zero(JIT_GEMM_C + r * 4 + c));
+  }
+
+  int single = s->k;
+  if (e->loop_k && s->k >= 8) {
+    size_t loop = jit_create_label(jit);
+    jit_load_int(jit, 7, s->k / 4);
+    jit_bind_label(jit, loop);
+    jit_gemm_step(e, rows, cols, 4);
+    jit_gemm_count_down(jit, 7, loop);
+    single = s->k % 4;
+  } else {
+    for (int i = 0; i < s->k / 4; i++)
+      jit_gemm_step(e, rows, cols, 4);
+    single = s->k % 4;
+  }
+  for (int i = 0; i < single; i++)
+    jit_gemm_step(e, rows, cols, 1);
+
+  for (int r = 0; r < rows; r++) {
+    int acc = JIT_GEMM_C + r * 4;
+    jit_add_offset(jit, 15, e->c, ((e->row + r) * s->ldc + col) * 4);
+    if (full)
+      jit_emit(jit, arm64_st1_post(acc, full, VEC_4S, 15));
+    for (int lane = 0; lane < rest; lane++)
+      jit_emit(jit, arm64_st1_lane_post(acc + full, lane, 15));
+  }
+}
+
+// copies B into panels of JIT_GEMM_NR columns, k rows each, the last one
+// padded with zeros to whole vectors
+static void
+jit_gemm_pack(JitGemmEmitter* e)
+{
+  JITCompiler* jit = e->jit;
+  const JitGemmShape* s = e->shape;
+
+  for (int col = 0; col < s->n; col += JIT_GEMM_NR) {
+    int cols = s->n - col < JIT_GEMM_NR ? s->n - col : JIT_GEMM_NR;
+    int full = cols / 4, rest = cols % 4, vectors = full + (rest > 0);
+    size_t loop = jit_create_label(jit);
+
+    jit_add_offset(jit, 13, 1, (uint64_t)col * 4);
+    jit_add_offset(jit, 15, 3, (uint64_t)(col / JIT_GEMM_NR) * s->k * 64);
+    jit_load_int(jit, 7, s->k);
+    jit_bind_label(jit, loop);
+    if (rest)
+      jit_emit(jit, arm64_movi_zero(JIT_GEMM_B + full));
+    e->packed = false;
+    jit_gemm_load_row(e, cols);
+    e->packed = true;
+    jit_emit(jit, arm64_st1_post(JIT_GEMM_B, vectors, VEC_4S, 15));
+    jit_gemm_count_down(jit, 7, loop);
+  }
+}
+
+static void
+jit_gemm_row_blocks(JitGemmEmitter* e, int rows)
+{
+  const JitGemmShape* s = e->shape;
+  for (int col = 0; col < s->n; col += JIT_GEMM_NR) {
+    int cols = s->n - col < JIT_GEMM_NR ? s->n - col : JIT_GEMM_NR;
+    jit_gemm_block(e, rows, col, cols);
+  }
+}
+
+// emits a kernel for shape as a function of jit, returns the function or
+// (size_t)-1 for shapes that don't make sense
+size_t
+jit_gemm_emit(JITCompiler* jit, const JitGemmShape* shape)
+{
+  const JitGemmShape* s = shape;
+  if (s->m <= 0 || s->n <= 0 || s->k <= 0 || s->lda < s->k ||
+      s->ldb < s->n || s->ldc < s->n) {
+    fprintf(stderr, "JIT gemm: invalid shape %dx%dx%d\n", s->m, s->n, s->k);
+    return (size_t)-1;
+  }
+
+  JitGemmEmitter e = { jit, shape, false, false, 0, 2, 0 };
+  size_t blocks = (size_t)(s->m + JIT_GEMM_MR - 1) / JIT_GEMM_MR;
+  size_t fmlas = blocks * JIT_GEMM_MR * ((s->n + 3) / 4) * s->k;
+  e.loop_k = fmlas > JIT_GEMM_MAX_UNROLL;
+  bool loop_m = e.loop_k && s->m >= 2 * JIT_GEMM_MR;
+
+  // B is reused by every row block, worth a copy with unit stride
+  size_t panels = 0;
+  bool pack = loop_m;
+  if (pack) {
+    size_t bytes = (size_t)((s->n + JIT_GEMM_NR - 1) / JIT_GEMM_NR) * s->k * 64;
+    panels = jit_alloc_data(jit, bytes, 16);
+    if (panels == (size_t)-1)
+      pack = false;
+  }
 
-  uint16_t lower = conv.i & 0xFFFF;
-  uint16_t upper = (conv.i >> 16) & 0xFFFF;
+  size_t func = jit_begin_function(jit);
+  if (pack) {
+    jit_load_addr(jit, 3, jit->data + panels);
+    e.packed = true;
+    jit_gemm_pack(&e);
+  }
 
-  // load into x0 using MOVZ/MOVK
-  jit_emit(jit, 0xD2800000 | (lower << 5)); // MOVZ x0, #lower16
-  jit_emit(jit, 0xF2A00000 | (upper << 5)); // MOVK x0, #upper16, LSL #16
+  if (loop_m) {
+    size_t loop = jit_create_label(jit);
+    e.a = 4;
+    e.c = 5;
+    jit_emit(jit, arm64_mov(4, 0));
+    jit_emit(jit, arm64_mov(5, 2));
+    jit_load_int(jit, 6, s->m / JIT_GEMM_MR);
+    jit_bind_label(jit, loop);
+    jit_gemm_row_blocks(&e, JIT_GEMM_MR);
+    jit_add_offset(jit, 4, 4, (uint64_t)JIT_GEMM_MR * s->lda * 4);
+    jit_add_offset(jit, 5, 5, (uint64_t)JIT_GEMM_MR * s->ldc * 4);
+    jit_gemm_count_down(jit, 6, loop);
+    if (s->m % JIT_GEMM_MR)
+      jit_gemm_row_blocks(&e, s->m % JIT_GEMM_MR);
+  } else {
+    for (int row = 0; row < s->m; row += JIT_GEMM_MR) {
+      int rows = s->m - row < JIT_GEMM_MR ? s->m - row : JIT_GEMM_MR;
+      e.row = row;
+      jit_gemm_row_blocks(&e, rows);
+    }
+  }
 
-  jit_emit(jit, 0x9E670000 | reg); // FMOV sN, w0
+  jit_emit(jit, arm64_ret());
+  jit_end_function(jit);
+  return func;
 }
 
-uint32_t
-arm64_fadd_s(int rd, int rn, int rm)
+JitGemmCache*
+jit_gemm_init()
 {
-  return 0x1E202800 | (rm << 16) | (rn << 5) | rd;
+  JitGemmCache* cache = malloc(sizeof(JitGemmCache));
+  if (!cache)
+    return NULL;
+
+  memset(cache, 0, sizeof(JitGemmCache));
+  cache->capacity = MAX_GEMM_CACHE_CAPACITY;
+  cache->entries = calloc(cache->capacity, sizeof(JitGemmEntry));
+  cache->jit = jit_init();
+  if (!cache->entries || !cache->jit) {
+    jit_gemm_cleanup(cache);
+    return NULL;
+  }
+  return cache;
 }
 
-uint32_t
-arm64_fsub_s(int rd, int rn, int rm)
+static uint64_t
+jit_gemm_hash(const JitGemmShape* shape)
 {
-  return 0x1E203800 | (rm << 16) | (rn << 5) | rd;
+  int fields[] = { shape->m,   shape->n,   shape->k,
+                   shape->lda, shape->ldb, shape->ldc };
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+    hash ^= (uint32_t)fields[i];
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
 }
 
-uint32_t
-arm64_fmul_s(int rd, int rn, int rm)
+static JitGemmEntry*
+jit_gemm_find(JitGemmEntry* entries, size_t capacity, const JitGemmShape* shape)
 {
-  return 0x1E200800 | (rm << 16) | (rn << 5) | rd;
+  size_t mask = capacity - 1;
+  for (size_t i = jit_gemm_hash(shape) & mask;; i = (i + 1) & mask) {
+    JitGemmEntry* entry = &entries[i];
+    if (!entry->kernel ||
+        memcmp(&entry->shape, shape, sizeof(JitGemmShape)) == 0)
+      return entry;
+  }
 }
 
-uint32_t
-arm64_fdiv_s(int rd, int rn, int rm)
+static bool
+jit_gemm_grow(JitGemmCache* cache)
 {
-  return 0x1E201800 | (rm << 16) | (rn << 5) | rd;
+  size_t capacity = cache->capacity * 2;
+  JitGemmEntry* entries = calloc(capacity, sizeof(JitGemmEntry));
+  if (!entries)
+    return false;
+
+  for (size_t i = 0; i < cache->capacity; i++) {
+    JitGemmEntry* entry = &cache->entries[i];
+    if (entry->kernel)
+      *jit_gemm_find(entries, capacity, &entry->shape) = *entry;
+  }
+  free(cache->entries);
+  cache->entries = entries;
+  cache->capacity = capacity;
+  return true;
 }
 
-// LDR (immediate) with 12-bit unsigned immediate offset
-uint32_t
-arm64_ldr(int rt, int rn, uint16_t imm12)
+JitGemmKernel
+jit_gemm_kernel(JitGemmCache* cache,
+                int m,
+                int n,
+                int k,
+                int lda,
+                int ldb,
+                int ldc)
 {
-  return 0xF8400000 | ((imm12 & 0xFFF) << 10) | (rn << 5) | rt;
+  JitGemmShape shape = { m, n, k, lda, ldb, ldc };
+  JitGemmEntry* entry = jit_gemm_find(cache->entries, cache->capacity, &shape);
+  if (entry->kernel) {
+    cache->hits++;
+    return entry->kernel;
+  }
+
+  cache->misses++;
+  if ((cache->num_entries + 1) * 2 > cache->capacity) {
+    if (!jit_gemm_grow(cache))
+      return NULL;
+    entry = jit_gemm_find(cache->entries, cache->capacity, &shape);
+  }
+
+  size_t data_size = cache->jit->data_size;
+  size_t func = jit_gemm_emit(cache->jit, &shape);
+  if (func == (size_t)-1 || !jit_finalize(cache->jit))
+    return NULL;
+
+  entry->shape = shape;
+  entry->kernel = (JitGemmKernel)jit_function_entry(cache->jit, func);
+  entry->func = func;
+  entry->packed = cache->jit->data_size != data_size;
+  cache->num_entries++;
+  return entry->kernel;
 }
 
-// LDR (immediate) 32-bit word
-uint32_t
-arm64_ldrw(int rt, int rn, uint16_t imm12)
+void
+jit_gemm_cleanup(JitGemmCache* cache)
 {
-  return 0xB8400000 | ((imm12 & 0xFFF) << 10) | (rn << 5) | rt;
+  if (!cache)
+    return;
+  if (cache->entries)
+    free(cache->entries);
+  if (cache->jit)
+    jit_cleanup(cache->jit);
+  free(cache);
 }
 
-// LDR (floating point) single precision
-uint32_t
-arm64_ldrs(int rt, int rn, uint16_t imm12)
+#define JIT_REDUCE_A 0   // v0-v7, elements
+#define JIT_REDUCE_B 24  // v24-v31, elements of b for dot products
+#define JIT_REDUCE_ACC 16 // v16-v23
+#define JIT_REDUCE_THRESHOLD 24
+#define JIT_REDUCE_MASK 1 // count mask in the tail
+
+// folds the elements in va (and vb) into acc
+static void
+jit_reduce_step(JITCompiler* jit,
+                const JitReduction* r,
+                int acc,
+                int va,
+                int vb,
+                int mask)
 {
-  return 0xBC400000 | ((imm12 & 0xFFF) << 10) | (rn << 5) | rt;
+  switch (r->op) {
+    case JIT_REDUCE_SUM:
+      if (r->is_float)
+        jit_vec_float_add(jit, acc, acc, va, VEC_4S);
+      else
+        jit_emit(jit, arm64_sadalp(acc, va));
+      break;
+    case JIT_REDUCE_MIN:
+      if (r->is_float)
+        jit_vec_float_min(jit, acc, acc, va, VEC_4S);
+      else
+        jit_emit(jit, arm64_smin_v(acc, acc, va, VEC_4S));
+      break;
+    case JIT_REDUCE_MAX:
+      if (r->is_float)
+        jit_vec_float_max(jit, acc, acc, va, VEC_4S);
+      else
+        jit_emit(jit, arm64_smax_v(acc, acc, va, VEC_4S));
+      break;
+    case JIT_REDUCE_DOT:
+      if (r->is_float) {
+        jit_vec_float_fma(jit, acc, va, vb, VEC_4S);
+      } else {
+        jit_emit(jit, arm64_smlal(acc, va, vb));
+        jit_emit(jit, arm64_smlal2(acc, va, vb));
+      }
+      break;
+    case JIT_REDUCE_COUNT_IF: {
+      // NE counts the equal elements and subtracts them from len at the end
+      int cond = r->cond == COND_NE ? COND_EQ : r->cond;
+      if (r->is_float)
+        jit_vec_float_compare(jit, mask, va, JIT_REDUCE_THRESHOLD, VEC_4S, cond);
+      else
+        jit_vec_compare(jit, mask, va, JIT_REDUCE_THRESHOLD, VEC_4S, cond);
+      // true lanes are -1. the tail compares into a separate mask and
+      // counts lane 0 itself
+      if (mask == va)
+        jit_emit(jit, arm64_sub_v(acc, acc, mask, VEC_4S));
+      break;
+    }
+  }
 }
 
-// LDR with register offset
-uint32_t
-arm64_ldr_reg(int rt, int rn, int rm, int shift)
+// acc = acc + other, both accumulators
+static void
+jit_reduce_combine(JITCompiler* jit, const JitReduction* r, int acc, int other)
 {
-  return 0xF8600000 | (rm << 16) | ((shift & 0x7) << 12) | (rn << 5) | rt;
+  switch (r->op) {
+    case JIT_REDUCE_SUM:
+    case JIT_REDUCE_DOT:
+      if (r->is_float)
+        jit_vec_float_add(jit, acc, acc, other, VEC_4S);
+      else
+        jit_emit(jit, arm64_add_v(acc, acc, other, VEC_2D));
+      break;
+    case JIT_REDUCE_MIN:
+      if (r->is_float)
+        jit_vec_float_min(jit, acc, acc, other, VEC_4S);
+      else
+        jit_emit(jit, arm64_smin_v(acc, acc, other, VEC_4S));
+      break;
+    case JIT_REDUCE_MAX:
+      if (r->is_float)
+        jit_vec_float_max(jit, acc, acc, other, VEC_4S);
+      else
+        jit_emit(jit, arm64_smax_v(acc, acc, other, VEC_4S));
+      break;
+    case JIT_REDUCE_COUNT_IF:
+      jit_emit(jit, arm64_add_v(acc, acc, other, VEC_4S));
+      break;
+  }
 }
 
-uint32_t
-arm64_fcmp_s(int rn, int rm)
+// fills rd with the value that leaves the accumulators unchanged
+static void
+jit_reduce_identity(JITCompiler* jit, const JitReduction* r, int rd)
 {
-  return 0x1E202000 | (rm << 16) | (rn << 5);
+  uint32_t bits;
+  if (r->op == JIT_REDUCE_MIN)
+    bits = r->is_float ? 0x7f800000 : 0x7fffffff;
+  else if (r->op == JIT_REDUCE_MAX)
+    bits = r->is_float ? 0xff800000 : 0x80000000;
+  else {
+    jit_emit(jit, arm64_movi_zero(rd));
+    return;
+  }
+  jit_load_int(jit, 12, (int32_t)bits);
+  jit_vec_dup(jit, rd, 12, VEC_4S);
 }
 
-// converts signed integer to single precision float
-uint32_t
-arm64_scvtf_s(int rd, int rn)
+static bool
+jit_reduce_valid(const JitReduction* r, int accumulators)
 {
-  return 0x1E220000 | (rn << 5) | rd;
+  if (accumulators != 1 && accumulators != 2 && accumulators != 4 &&
+      accumulators != 8) {
+    fprintf(stderr, "JIT reduction: %d accumulators\n", accumulators);
+    return false;
+  }
+  if (r->prefetch % 8 || r->prefetch > 32760) {
+    fprintf(stderr, "JIT reduction: bad prefetch distance %zu\n", r->prefetch);
+    return false;
+  }
+  if (r->op != JIT_REDUCE_COUNT_IF)
+    return true;
+
+  switch (r->cond) {
+    case COND_EQ:
+    case COND_NE:
+    case COND_GT:
+    case COND_GE:
+    case COND_LT:
+    case COND_LE: return true;
+    case COND_HI:
+    case COND_CS:
+    case COND_CC:
+    case COND_LS:
+      if (!r->is_float)
+        return true;
+      break;
+  }
+  fprintf(stderr, "JIT reduction: no count for condition %d\n", r->cond);
+  return false;
 }
 
-// converts single precision float to signed integer
-uint32_t
-arm64_fcvtzs_s(int rd, int rn)
+// emits the reduction as a function of jit, see the JitReduce* typedefs
+// for how to call it. returns the function or (size_t)-1
+size_t
+jit_compile_reduction(JITCompiler* jit, const JitReduction* reduction)
 {
-  return 0x1E380000 | (rn << 5) | rd;
+  const JitReduction* r = reduction;
+  int accumulators = r->accumulators ? r->accumulators : 4;
+  if (!jit_reduce_valid(r, accumulators))
+    return (size_t)-1;
+
+  bool dot = r->op == JIT_REDUCE_DOT;
+  bool count = r->op == JIT_REDUCE_COUNT_IF;
+  int len = dot ? 2 : 1;
+  int shift = 2;
+  while ((1 << shift) < accumulators * 4)
+    shift++;
+
+  size_t func = jit_begin_function(jit);
+  size_t reduce = jit_create_label(jit);
+  size_t loop = jit_create_label(jit);
+  size_t tail = jit_create_label(jit);
+  size_t done = jit_create_label(jit);
+
+  for (int i = 0; i < accumulators; i++)
+    jit_reduce_identity(jit, r, JIT_REDUCE_ACC + i);
+  if (count) {
+    uint32_t bits = (uint32_t)r->threshold_int;
+    if (r->is_float)
+      memcpy(&bits, &r->threshold, sizeof(bits));
+    jit_load_int(jit, 12, (int32_t)bits);
+    jit_vec_dup(jit, JIT_REDUCE_THRESHOLD, 12, VEC_4S);
+    jit_load_int(jit, 11, 0);
+  }
+
+  // x10 blocks of accumulators * 4 elements, then x9 single ones
+  jit_emit(jit, arm64_lsr_imm(10, len, shift));
+  jit_emit(jit, arm64_lsl_imm(12, 10, shift));
+  jit_emit(jit, arm64_sub(9, len, 12));
+  jit_compare(jit, 10, 31);
+  jit_jump_if_equal(jit, reduce);
+
+  jit_bind_label(jit, loop);
+  if (r->prefetch) {
+    jit_emit(jit, arm64_prfm(0, (uint16_t)r->prefetch));
+    if (dot)
+      jit_emit(jit, arm64_prfm(1, (uint16_t)r->prefetch));
+  }
+  for (int i = 0; i < accumulators; i += 4) {
+    int vectors = accumulators - i < 4 ? accumulators - i : 4;
+    jit_emit(jit, arm64_ld1_post(JIT_REDUCE_A + i, vectors, VEC_4S, 0));
+    if (dot)
+      jit_emit(jit, arm64_ld1_post(JIT_REDUCE_B + i, vectors, VEC_4S, 1));
+  }
+  for (int i = 0; i < accumulators; i++)
+    jit_reduce_step(jit,
+                    r,
+                    JIT_REDUCE_ACC + i,
+                    JIT_REDUCE_A + i,
+                    JIT_REDUCE_B + i,
+                    JIT_REDUCE_A + i);
+  jit_emit(jit, arm64_sub_imm(10, 10, 1));
+  jit_compare(jit, 10, 31);
+  jit_jump_if_not_equal(jit, loop);
+
+  jit_bind_label(jit, reduce);
+  for (int half = accumulators / 2; half; half /= 2) {
+    for (int i = 0; i < half; i++)
+      jit_reduce_combine(jit, r, JIT_REDUCE_ACC + i, JIT_REDUCE_ACC + i + half);
+  }
+
+  // the tail loads one element into lane 0 of a vector that holds the
+  // identity in the other lanes and folds it like the loop does
+  jit_compare(jit, 9, 31);
+  jit_jump_if_equal(jit, done);
+  jit_reduce_identity(jit, r, JIT_REDUCE_A);
+  if (dot)
+    jit_emit(jit, arm64_movi_zero(JIT_REDUCE_B));
+  jit_bind_label(jit, tail);
+  jit_emit(jit, arm64_ld1_lane_post(JIT_REDUCE_A, 0, 0));
+  if (dot)
+    jit_emit(jit, arm64_ld1_lane_post(JIT_REDUCE_B, 0, 1));
+  if (count) {
+    // only lane 0 counts, x11 -= mask
+    jit_reduce_step(
+      jit, r, JIT_REDUCE_ACC, JIT_REDUCE_A, JIT_REDUCE_B, JIT_REDUCE_MASK);
+    jit_emit(jit, arm64_smov(12, JIT_REDUCE_MASK, 0, VEC_4S));
+    jit_emit(jit, arm64_sub(11, 11, 12));
+  } else {
+    jit_reduce_step(
+      jit, r, JIT_REDUCE_ACC, JIT_REDUCE_A, JIT_REDUCE_B, JIT_REDUCE_A);
+  }
+  jit_emit(jit, arm64_sub_imm(9, 9, 1));
+  jit_compare(jit, 9, 31);
+  jit_jump_if_not_equal(jit, tail);
+
+  jit_bind_label(jit, done);
+  switch (r->op) {
+    case JIT_REDUCE_SUM:
+    case JIT_REDUCE_DOT:
+      if (r->is_float) {
+        jit_vec_float_sum(jit, 0, JIT_REDUCE_ACC, VEC_4S);
+      } else {
+        jit_emit(jit, arm64_addp_scalar(0, JIT_REDUCE_ACC));
+        jit_emit(jit, arm64_umov(0, 0, 0, VEC_2D));
+      }
+      break;
+    case JIT_REDUCE_MIN:
+    case JIT_REDUCE_MAX: {
+      bool min = r->op == JIT_REDUCE_MIN;
+      if (r->is_float) {
+        jit_emit(jit, min ? arm64_fminv(0, JIT_REDUCE_ACC)
+                          : arm64_fmaxv(0, JIT_REDUCE_ACC));
+      } else {
+        jit_emit(jit, min ? arm64_sminv(0, JIT_REDUCE_ACC)
+                          : arm64_smaxv(0, JIT_REDUCE_ACC));
+        jit_emit(jit, arm64_smov(0, 0, 0, VEC_4S));
+      }
+      break;
+    }
+    case JIT_REDUCE_COUNT_IF:
+      jit_emit(jit, arm64_uaddlv(0, JIT_REDUCE_ACC));
+      jit_emit(jit, arm64_umov(0, 0, 0, VEC_2D));
+      jit_emit(jit, arm64_add(0, 0, 11));
+      if (r->cond == COND_NE)
+        jit_emit(jit, arm64_sub(0, len, 0));
+      break;
+  }
+  jit_emit(jit, arm64_ret());
+  jit_end_function(jit);
+  return func;
 }
 
-void
-jit_load_mem(JITCompiler* jit, int rt, int rn, uint16_t offset)
+JitPredicate*
+jit_pred_init()
 {
-  jit_emit(jit, arm64_ldr(rt, rn, offset));
+  JitPredicate* pred = malloc(sizeof(JitPredicate));
+  if (!pred)
+    return NULL;
+
+  memset(pred, 0, sizeof(JitPredicate));
+  pred->node_capacity = MAX_PRED_NODE_CAPACITY;
+  pred->nodes = malloc(sizeof(JitPredNode) * pred->node_capacity);
+  if (!pred->nodes) {
+    free(pred);
+    return NULL;
+  }
+  return pred;
 }
 
 void
-jit_load_mem_word(JITCompiler* jit, int rt, int rn, uint16_t offset)
+jit_pred_cleanup(JitPredicate* pred)
 {
-  jit_emit(jit, arm64_ldrw(rt, rn, offset));
+  if (!pred)
+    return;
+  if (pred->nodes)
+    free(pred->nodes);
+  free(pred);
 }
 
-void
-jit_load_float_mem(JITCompiler* jit, int rt, int rn, uint16_t offset)
+static int
+jit_pred_node(JitPredicate* pred,
+              JitPredOp op,
+              JitPredType type,
+              int a,
+              int b,
+              int imm,
+              uint32_t bits)
 {
-  jit_emit(jit, arm64_ldrs(rt, rn, offset));
+  if (pred->num_nodes >= pred->node_capacity) {
+    size_t capacity = pred->node_capacity * 2;
+    JitPredNode* nodes = realloc(pred->nodes, sizeof(JitPredNode) * capacity);
+    if (!nodes)
+      return -1;
+    pred->nodes = nodes;
+    pred->node_capacity = capacity;
+  }
+
+  JitPredNode* n = &pred->nodes[pred->num_nodes];
+  n->op = op;
+  n->type = type;
+  n->a = a;
+  n->b = b;
+  n->imm = imm;
+  n->bits = bits;
+  return (int)pred->num_nodes++;
 }
 
-void
-jit_float_add(JITCompiler* jit, int rd, int rn, int rm)
+static bool
+jit_pred_typed(JitPredicate* pred, int a, int b, JitPredType type)
 {
-  jit_emit(jit, arm64_fadd_s(rd, rn, rm));
+  if (a < 0 || b < 0)
+    return false;
+  if (pred->nodes[a].type == type && pred->nodes[b].type == type)
+    return true;
+  fprintf(stderr, "JIT predicate: operand types don't match\n");
+  return false;
 }
 
-void
-jit_float_sub(JITCompiler* jit, int rd, int rn, int rm)
+// a column node per column, loaded once per row
+int
+jit_pred_column(JitPredicate* pred, int column, bool is_float)
 {
-  jit_emit(jit, arm64_fsub_s(rd, rn, rm));
+  JitPredType type = is_float ? JIT_PRED_FLOAT : JIT_PRED_INT;
+  if (column < 0 || column >= JIT_PRED_MAX_COLUMNS) {
+    fprintf(stderr, "JIT predicate: column %d out of range\n", column);
+    return -1;
+  }
+
+  for (size_t i = 0; i < pred->num_nodes; i++) {
+    JitPredNode* n = &pred->nodes[i];
+    if (n->op == JIT_PRED_COLUMN && n->imm == column) {
+      if (n->type == type)
+        return (int)i;
+      fprintf(stderr, "JIT predicate: column %d has two types\n", column);
+      return -1;
+    }
+  }
+  return jit_pred_node(pred, JIT_PRED_COLUMN, type, -1, -1, column, 0);
 }
 
-void
-jit_float_mul(JITCompiler* jit, int rd, int rn, int rm)
+int
+jit_pred_int(JitPredicate* pred, int32_t value)
 {
-  jit_emit(jit, arm64_fmul_s(rd, rn, rm));
+  return jit_pred_node(
+    pred, JIT_PRED_CONST, JIT_PRED_INT, -1, -1, 0, (uint32_t)value);
 }
 
-void
-jit_float_div(JITCompiler* jit, int rd, int rn, int rm)
+int
+jit_pred_float(JitPredicate* pred, float value)
 {
-  jit_emit(jit, arm64_fdiv_s(rd, rn, rm));
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return jit_pred_node(pred, JIT_PRED_CONST, JIT_PRED_FLOAT, -1, -1, 0, bits);
 }
 
-void
-jit_float_compare(JITCompiler* jit, int rn, int rm)
+static int
+jit_pred_arith(JitPredicate* pred, JitPredOp op, int a, int b)
 {
-  jit_emit(jit, arm64_fcmp_s(rn, rm));
+  if (a < 0 || b < 0)
+    return -1;
+  JitPredType type = pred->nodes[a].type;
+  if (type == JIT_PRED_BOOL || !jit_pred_typed(pred, a, b, type))
+    return -1;
+  return jit_pred_node(pred, op, type, a, b, 0, 0);
 }
 
-void
-jit_int_to_float(JITCompiler* jit, int rd, int rn)
+int
+jit_pred_add(JitPredicate* pred, int a, int b)
 {
-  jit_emit(jit, arm64_scvtf_s(rd, rn));
+  return jit_pred_arith(pred, JIT_PRED_ADD, a, b);
 }
 
-void
-jit_float_to_int(JITCompiler* jit, int rd, int rn)
+int
+jit_pred_sub(JitPredicate* pred, int a, int b)
 {
-  jit_emit(jit, arm64_fcvtzs_s(rd, rn));
+  return jit_pred_arith(pred, JIT_PRED_SUB, a, b);
 }
 
-uint32_t
-arm64_bl(int32_t offset)
+int
+jit_pred_mul(JitPredicate* pred, int a, int b)
 {
-  return 0x94000000 | ((offset & 0x3ffffff) << 0);
+  return jit_pred_arith(pred, JIT_PRED_MUL, a, b);
 }
 
-uint32_t
-arm64_ret()
+// a <cond> b, EQ NE GT GE LT LE, and the unsigned HI CS CC LS for ints
+int
+jit_pred_compare(JitPredicate* pred, int cond, int a, int b)
 {
-  return 0xd65f03c0;
+  if (a < 0 || b < 0)
+    return -1;
+  JitPredType type = pred->nodes[a].type;
+  if (type == JIT_PRED_BOOL || !jit_pred_typed(pred, a, b, type))
+    return -1;
+
+  switch (cond) {
+    case COND_EQ:
+    case COND_NE:
+    case COND_GT:
+    case COND_GE:
+    case COND_LT:
+    case COND_LE: break;
+    case COND_HI:
+    case COND_CS:
+    case COND_CC:
+    case COND_LS:
+      if (type == JIT_PRED_INT)
+        break;
+      // fall through
+    default:
+      fprintf(stderr, "JIT predicate: no compare for condition %d\n", cond);
+      return -1;
+  }
+  return jit_pred_node(pred, JIT_PRED_COMPARE, JIT_PRED_BOOL, a, b, cond, 0);
 }
 
-uint32_t
-arm64_stp(int rt1, int rt2, int rn, int imm)
+int
+jit_pred_and(JitPredicate* pred, int a, int b)
 {
-  return 0xa9000000 | ((imm & 0x7f) << 15) | (rt2 << 10) | (rn << 5) | rt1;
+  if (!jit_pred_typed(pred, a, b, JIT_PRED_BOOL))
+    return -1;
+  return jit_pred_node(pred, JIT_PRED_AND, JIT_PRED_BOOL, a, b, 0, 0);
 }
 
-uint32_t
-arm64_ldp(int rt1, int rt2, int rn, int imm)
+int
+jit_pred_or(JitPredicate* pred, int a, int b)
 {
-  return 0xa9400000 | ((imm & 0x7f) << 15) | (rt2 << 10) | (rn << 5) | rt1;
+  if (!jit_pred_typed(pred, a, b, JIT_PRED_BOOL))
+    return -1;
+  return jit_pred_node(pred, JIT_PRED_OR, JIT_PRED_BOOL, a, b, 0, 0);
 }
 
-uint32_t
-arm64_adrp(int rd, int64_t imm)
+int
+jit_pred_not(JitPredicate* pred, int a)
 {
-  uint32_t immlo = (imm >> 12) & 0x3;
-  uint32_t immhi = (imm >> 14) & 0x7FFFF;
-  return 0x90000000 | (immlo << 29) | (immhi << 5) | rd;
+  if (!jit_pred_typed(pred, a, a, JIT_PRED_BOOL))
+    return -1;
+  return jit_pred_node(pred, JIT_PRED_NOT, JIT_PRED_BOOL, a, -1, 0, 0);
 }
 
-uint32_t
-arm64_add_imm(int rd, int rn, uint16_t imm12)
+#define JIT_PRED_INDEX 31 // row indices, or the count for bitmaps
+#define JIT_PRED_STEP 30  // 4s for selections, 1 2 4 8 for bitmaps
+#define JIT_PRED_TEMP 29
+#define JIT_PRED_ONE 28 // 1s for selections
+
+typedef struct
 {
-  return 0x91000000 | ((uint32_t)imm12 << 10) | (rn << 5) | rd;
+  JITCompiler* jit;
+  JitPredicate* pred;
+  int root;
+  int* regs; // vector register of each node, -1 for unused nodes
+} JitPredCompiler;
+
+static bool
+jit_pred_take(JitPredCompiler* c, bool* free_regs, int node)
+{
+  for (int reg = 0; reg < 32; reg++) {
+    if (free_regs[reg]) {
+      free_regs[reg] = false;
+      c->regs[node] = reg;
+      return true;
+    }
+  }
+  fprintf(stderr, "JIT predicate: out of vector registers\n");
+  return false;
 }
 
-JITCompiler*
-jit_init()
+// nodes are built bottom up so the indices are already in evaluation
+// order, registers go back to the pool after the last use of a node
+static bool
+jit_pred_allocate(JitPredCompiler* c)
 {
-  JITCompiler* jit = malloc(sizeof(JITCompiler));
-  if (!jit)
-    return NULL;
-
-  jit->capacity = MAX_CODE_MEMORY_SIZE;
+  JitPredicate* pred = c->pred;
+  size_t count = pred->num_nodes;
+  int* last = malloc(sizeof(int) * count);
+  bool* used = calloc(count, sizeof(bool));
+  if (!last || !used) {
+    free(last);
+    free(used);
+    return false;
+  }
 
-#ifdef __APPLE__
-  jit->code = mmap(NULL,
-                   jit->capacity,
-                   PROT_READ | PROT_WRITE,
-                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_JIT,
-                   -1,
-                   0);
-#else
-  jit->code = mmap(NULL,
-                   jit->capacity,
-                   PROT_READ | PROT_WRITE | PROT_EXEC,
-                   MAP_PRIVATE | MAP_ANONYMOUS,
-                   -1,
-                   0);
-#endif
+  used[c->root] = true;
+  for (int i = c->root; i >= 0; i--) {
+    JitPredNode* n = &pred->nodes[i];
+    last[i] = i == c->root ? (int)count : -1;
+    if (!used[i])
+      continue;
+    if (n->a >= 0)
+      used[n->a] = true;
+    if (n->b >= 0)
+      used[n->b] = true;
+  }
+  for (int i = 0; i <= c->root; i++) {
+    JitPredNode* n = &pred->nodes[i];
+    c->regs[i] = -1;
+    if (!used[i])
+      continue;
+    // constants are loaded once before the loop and keep their registers
+    if (n->op == JIT_PRED_CONST)
+      last[i] = (int)count;
+    if (n->a >= 0 && last[n->a] < i)
+      last[n->a] = i;
+    if (n->b >= 0 && last[n->b] < i)
+      last[n->b] = i;
+  }
 
-  if (jit->code == MAP_FAILED) {
-    free(jit);
-    return NULL;
+  // v0-v7 and v16-v27, v8-v15 are callee saved
+  bool free_regs[32] = { false };
+  for (int r = 0; r < 8; r++)
+    free_regs[r] = true;
+  for (int r = 16; r < JIT_PRED_ONE; r++)
+    free_regs[r] = true;
+
+  // constants first, a register freed in the loop can't be one of them
+  bool ok = true;
+  for (int i = 0; i <= c->root && ok; i++) {
+    if (used[i] && pred->nodes[i].op == JIT_PRED_CONST)
+      ok = jit_pred_take(c, free_regs, i);
+  }
+  for (int i = 0; i <= c->root && ok; i++) {
+    JitPredNode* n = &pred->nodes[i];
+    if (!used[i] || n->op == JIT_PRED_CONST)
+      continue;
+    // operands whose last use is this node can give their register to it
+    if (n->a >= 0 && last[n->a] == i)
+      free_regs[c->regs[n->a]] = true;
+    if (n->b >= 0 && last[n->b] == i)
+      free_regs[c->regs[n->b]] = true;
+    ok = jit_pred_take(c, free_regs, i);
   }
-  jit->code_size = 0;
 
-  jit->data_capacity = MAX_DATA_MEMORY_SIZE;
-  jit->data = mmap(NULL,
-                   jit->data_capacity,
-                   PROT_READ | PROT_WRITE,
-                   MAP_PRIVATE | MAP_ANONYMOUS,
-                   -1,
-                   0);
+  free(last);
+  free(used);
+  return ok;
+}
 
-  if (jit->data == MAP_FAILED) {
-    munmap(jit->code, jit->capacity);
-    free(jit);
-    return NULL;
+// evaluates the predicate for four rows, or for the row in lane 0
+static void
+jit_pred_eval(JitPredCompiler* c, bool single)
+{
+  JITCompiler* jit = c->jit;
+  JitPredicate* pred = c->pred;
+
+  for (int i = 0; i <= c->root; i++) {
+    JitPredNode* n = &pred->nodes[i];
+    int rd = c->regs[i];
+    if (rd < 0 || n->op == JIT_PRED_CONST)
+      continue;
+
+    int ra = n->a >= 0 ? c->regs[n->a] : -1;
+    int rb = n->b >= 0 ? c->regs[n->b] : -1;
+    bool is_float = n->a >= 0 && pred->nodes[n->a].type == JIT_PRED_FLOAT;
+    switch (n->op) {
+      case JIT_PRED_COLUMN:
+        if (single)
+          jit_emit(jit, arm64_ld1_lane_post(rd, 0, 3 + n->imm));
+        else
+          jit_emit(jit, arm64_ld1_post(rd, 1, VEC_4S, 3 + n->imm));
+        break;
+      case JIT_PRED_ADD:
+        if (is_float)
+          jit_vec_float_add(jit, rd, ra, rb, VEC_4S);
+        else
+          jit_vec_add(jit, rd, ra, rb, VEC_4S);
+        break;
+      case JIT_PRED_SUB:
+        if (is_float)
+          jit_vec_float_sub(jit, rd, ra, rb, VEC_4S);
+        else
+          jit_vec_sub(jit, rd, ra, rb, VEC_4S);
+        break;
+      case JIT_PRED_MUL:
+        if (is_float)
+          jit_vec_float_mul(jit, rd, ra, rb, VEC_4S);
+        else
+          jit_vec_mul(jit, rd, ra, rb, VEC_4S);
+        break;
+      case JIT_PRED_COMPARE: {
+        int cond = n->imm == COND_NE ? COND_EQ : n->imm;
+        if (is_float)
+          jit_vec_float_compare(jit, rd, ra, rb, VEC_4S, cond);
+        else
+          jit_vec_compare(jit, rd, ra, rb, VEC_4S, cond);
+        if (n->imm == COND_NE)
+          jit_emit(jit, arm64_not_v(rd, rd));
+        break;
+      }
+      case JIT_PRED_AND: jit_emit(jit, arm64_and_v(rd, ra, rb)); break;
+      case JIT_PRED_OR: jit_emit(jit, arm64_orr_v(rd, ra, rb)); break;
+      case JIT_PRED_NOT: jit_emit(jit, arm64_not_v(rd, ra)); break;
+      case JIT_PRED_CONST: break;
+    }
   }
-  jit->data_size = 0;
-
-  jit->label_capacity = MAX_LABEL_CAPACITY;
-  jit->label_positions = malloc(sizeof(uint32_t*) * jit->label_capacity);
-  jit->label_offsets = malloc(sizeof(size_t) * jit->label_capacity);
-  jit->num_labels = 0;
+}
 
-  if (!jit->label_positions || !jit->label_offsets) {
-    if (jit->label_positions)
-      free(jit->label_positions);
-    if (jit->label_offsets)
-      free(jit->label_offsets);
-    munmap(jit->data, jit->data_capacity);
-    munmap(jit->code, jit->capacity);
-    free(jit);
-    return NULL;
+static void
+jit_pred_selection(JitPredCompiler* c)
+{
+  JITCompiler* jit = c->jit;
+  int root = c->regs[c->root];
+  size_t loop = jit_create_label(jit);
+  size_t tail = jit_create_label(jit);
+  size_t done = jit_create_label(jit);
+
+  // x11 groups of four rows, x12 rows left after them
+  jit_emit(jit, arm64_mov(14, 2));
+  jit_emit(jit, arm64_lsr_imm(11, 1, 2));
+  jit_emit(jit, arm64_lsl_imm(12, 11, 2));
+  jit_emit(jit, arm64_sub(12, 1, 12));
+  jit_compare(jit, 11, 31);
+  jit_jump_if_equal(jit, tail);
+
+  // every index is stored, x2 only moves past the ones that pass
+  jit_bind_label(jit, loop);
+  jit_pred_eval(c, false);
+  jit_emit(jit, arm64_and_v(JIT_PRED_TEMP, root, JIT_PRED_STEP));
+  for (int lane = 0; lane < 4; lane++) {
+    jit_emit(jit, arm64_umov(13, JIT_PRED_TEMP, lane, VEC_4S));
+    jit_emit(jit, arm64_st1_lane_post_reg(JIT_PRED_INDEX, lane, 2, 13));
   }
+  jit_vec_add(jit, JIT_PRED_INDEX, JIT_PRED_INDEX, JIT_PRED_STEP, VEC_4S);
+  jit_emit(jit, arm64_sub_imm(11, 11, 1));
+  jit_compare(jit, 11, 31);
+  jit_jump_if_not_equal(jit, loop);
+
+  size_t single = jit_create_label(jit);
+  jit_bind_label(jit, tail);
+  jit_compare(jit, 12, 31);
+  jit_jump_if_equal(jit, done);
+  jit_bind_label(jit, single);
+  jit_pred_eval(c, true);
+  jit_emit(jit, arm64_and_v(JIT_PRED_TEMP, root, JIT_PRED_STEP));
+  jit_emit(jit, arm64_umov(13, JIT_PRED_TEMP, 0, VEC_4S));
+  jit_emit(jit, arm64_st1_lane_post_reg(JIT_PRED_INDEX, 0, 2, 13));
+  jit_vec_add(jit, JIT_PRED_INDEX, JIT_PRED_INDEX, JIT_PRED_ONE, VEC_4S);
+  jit_emit(jit, arm64_sub_imm(12, 12, 1));
+  jit_compare(jit, 12, 31);
+  jit_jump_if_not_equal(jit, single);
+
+  jit_bind_label(jit, done);
+  jit_emit(jit, arm64_sub(0, 2, 14));
+  jit_emit(jit, arm64_lsr_imm(0, 0, 2));
+}
 
-  return jit;
+static void
+jit_pred_bitmap(JitPredCompiler* c)
+{
+  JITCompiler* jit = c->jit;
+  int root = c->regs[c->root];
+  size_t loop = jit_create_label(jit);
+  size_t tail = jit_create_label(jit);
+  size_t done = jit_create_label(jit);
+
+  // x11 words of 64 rows, x12 rows left after them, x17 passing tail rows
+  jit_emit(jit, arm64_movi_zero(JIT_PRED_INDEX));
+  jit_load_int(jit, 17, 0);
+  jit_emit(jit, arm64_lsr_imm(11, 1, 6));
+  jit_emit(jit, arm64_lsl_imm(12, 11, 6));
+  jit_emit(jit, arm64_sub(12, 1, 12));
+  jit_compare(jit, 11, 31);
+  jit_jump_if_equal(jit, tail);
+
+  // 16 groups of four rows, each a nibble of the word in x14
+  jit_bind_label(jit, loop);
+  jit_load_int(jit, 14, 0);
+  for (int group = 0; group < 16; group++) {
+    jit_pred_eval(c, false);
+    jit_vec_sub(jit, JIT_PRED_INDEX, JIT_PRED_INDEX, root, VEC_4S);
+    jit_emit(jit, arm64_and_v(JIT_PRED_TEMP, root, JIT_PRED_STEP));
+    jit_vec_sum(jit, JIT_PRED_TEMP, JIT_PRED_TEMP, VEC_4S);
+    jit_emit(jit, arm64_umov(13, JIT_PRED_TEMP, 0, VEC_4S));
+    jit_emit(jit, arm64_orr_lsl(14, 14, 13, group * 4));
+  }
+  jit_emit(jit, arm64_str(14, 2, 0));
+  jit_emit(jit, arm64_add_imm(2, 2, 8));
+  jit_emit(jit, arm64_sub_imm(11, 11, 1));
+  jit_compare(jit, 11, 31);
+  jit_jump_if_not_equal(jit, loop);
+
+  // the last word a row at a time, x15 is the bit
+  size_t single = jit_create_label(jit);
+  jit_bind_label(jit, tail);
+  jit_compare(jit, 12, 31);
+  jit_jump_if_equal(jit, done);
+  jit_load_int(jit, 14, 0);
+  jit_load_int(jit, 15, 0);
+  jit_bind_label(jit, single);
+  jit_pred_eval(c, true);
+  jit_emit(jit, arm64_and_v(JIT_PRED_TEMP, root, JIT_PRED_STEP));
+  jit_emit(jit, arm64_umov(13, JIT_PRED_TEMP, 0, VEC_4S));
+  jit_emit(jit, arm64_add(17, 17, 13));
+  jit_emit(jit, arm64_lslv(13, 13, 15));
+  jit_emit(jit, arm64_orr_lsl(14, 14, 13, 0));
+  jit_emit(jit, arm64_add_imm(15, 15, 1));
+  jit_emit(jit, arm64_sub_imm(12, 12, 1));
+  jit_compare(jit, 12, 31);
+  jit_jump_if_not_equal(jit, single);
+  jit_emit(jit, arm64_str(14, 2, 0));
+
+  jit_bind_label(jit, done);
+  jit_emit(jit, arm64_uaddlv(JIT_PRED_TEMP, JIT_PRED_INDEX));
+  jit_emit(jit, arm64_umov(0, JIT_PRED_TEMP, 0, VEC_2D));
+  jit_emit(jit, arm64_add(0, 0, 17));
 }
 
+// emits the filter for the predicate at root as a function of jit, called
+// as a JitFilter with the column pointers in columns. returns the function
+// or (size_t)-1
 size_t
-jit_add_string(JITCompiler* jit, const char* str)
+jit_compile_predicate(JITCompiler* jit,
+                      JitPredicate* pred,
+                      int root,
+                      JitPredOutput output)
 {
-  size_t len = strlen(str) + 1;
-  size_t aligned_size = (len + 7) & ~7; // 8-byte alignment
+  if (root < 0 || (size_t)root >= pred->num_nodes ||
+      pred->nodes[root].type != JIT_PRED_BOOL) {
+    fprintf(stderr, "JIT predicate: root %d is not a condition\n", root);
+    return (size_t)-1;
+  }
 
-  if (jit->data_size + aligned_size > jit->data_capacity) {
-    size_t new_capacity = jit->data_capacity * 2;
-    void* new_data = mmap(NULL,
-                          new_capacity,
-                          PROT_READ | PROT_WRITE,
-                          MAP_PRIVATE | MAP_ANONYMOUS,
-                          -1,
-                          0);
+  JitPredCompiler c = { jit, pred, root, malloc(sizeof(int) * (root + 1)) };
+  if (!c.regs)
+    return (size_t)-1;
+  if (!jit_pred_allocate(&c)) {
+    free(c.regs);
+    return (size_t)-1;
+  }
 
-    if (new_data == MAP_FAILED) {
-      return (size_t)-1;
+  // the first row indices, or the bit of each lane in a nibble
+  bool selection = output == JIT_PRED_SELECTION;
+  uint32_t lanes[2][4] = { { 1, 2, 4, 8 }, { 0, 1, 2, 3 } };
+  size_t lanes_offset = jit_alloc_data(jit, 16, 16);
+  if (lanes_offset == (size_t)-1) {
+    free(c.regs);
+    return (size_t)-1;
+  }
+  memcpy(jit->data + lanes_offset, lanes[selection], 16);
+
+  size_t func = jit_begin_function(jit);
+  for (int i = 0; i <= root; i++) {
+    JitPredNode* n = &pred->nodes[i];
+    if (c.regs[i] < 0)
+      continue;
+    if (n->op == JIT_PRED_COLUMN)
+      jit_emit(jit, arm64_ldr(3 + n->imm, 0, n->imm));
+    if (n->op == JIT_PRED_CONST) {
+      jit_load_int(jit, 13, (int32_t)n->bits);
+      jit_vec_dup(jit, c.regs[i], 13, VEC_4S);
     }
+  }
+
+  jit_load_addr(jit, 13, jit->data + lanes_offset);
+  if (selection) {
+    jit_emit(jit, arm64_ld1(JIT_PRED_INDEX, 1, VEC_4S, 13));
+    jit_load_int(jit, 13, 4);
+    jit_vec_dup(jit, JIT_PRED_STEP, 13, VEC_4S);
+    jit_load_int(jit, 13, 1);
+    jit_vec_dup(jit, JIT_PRED_ONE, 13, VEC_4S);
+    jit_pred_selection(&c);
+  } else {
+    jit_emit(jit, arm64_ld1(JIT_PRED_STEP, 1, VEC_4S, 13));
+    jit_pred_bitmap(&c);
+  }
+  jit_emit(jit, arm64_ret());
+  jit_end_function(jit);
 
-    memcpy(new_data, jit->data, jit->data_size);
-    munmap(jit->data, jit->data_capacity);
+  free(c.regs);
+  return func;
+}
 
-    jit->data = new_data;
-    jit->data_capacity = new_capacity;
+static bool
+jit_decode_valid(size_t record_size, const JitField* fields, size_t num_fields)
+{
+  if (!record_size || !num_fields || num_fields > JIT_DECODE_MAX_FIELDS) {
+    fprintf(stderr, "JIT decoder: %zu fields\n", num_fields);
+    return false;
   }
 
-  size_t offset = jit->data_size;
-  memcpy(jit->data + offset, str, len);
-  memset(jit->data + offset + len, 0, aligned_size - len); // zeoro padding
-  jit->data_size += aligned_size;
+  for (size_t i = 0; i < num_fields; i++) {
+    const JitField* f = &fields[i];
+    int out = f->out_width ? f->out_width : f->width;
+    bool sized = (f->width == 1 || f->width == 2 || f->width == 4 ||
+                  f->width == 8) &&
+                 (out == 1 || out == 2 || out == 4 || out == 8);
+    if (f->is_float)
+      sized = (f->width == 4 || f->width == 8) && out == f->width;
+    if (!sized || f->offset + f->width > record_size) {
+      fprintf(stderr, "JIT decoder: bad field %zu\n", i);
+      return false;
+    }
+  }
+  return true;
+}
 
-  return offset;
+// ints rotate through x11-x15 and floats through v0-v7, so neighbouring
+// fields don't wait on each other
+static int
+jit_decode_reg(const JitField* field, size_t index)
+{
+  return field->is_float ? (int)(index % 8) : 11 + (int)(index % 5);
 }
 
-void
-jit_load_string_addr(JITCompiler* jit, int reg, size_t offset)
+// rt = the field at offset bytes from x0
+static void
+jit_decode_load(JITCompiler* jit, const JitField* field, int rt, size_t offset)
 {
-  uint64_t addr = (uint64_t)(jit->data + offset);
+  int base = 0;
+  if (offset % field->width || offset / field->width > 0xfff) {
+    jit_add_offset(jit, 16, 0, offset);
+    base = 16;
+    offset = 0;
+  }
 
-  // address and offset within page
-  uint64_t page = addr & ~0xFFF;
-  uint64_t page_offset = addr & 0xFFF;
+  uint16_t imm = (uint16_t)(offset / field->width);
+  if (field->is_float) {
+    jit_emit(jit, field->width == 4 ? arm64_ldrs(rt, base, imm)
+                                    : arm64_ldrd(rt, base, imm));
+    return;
+  }
 
-  // relative page offset from PC
-  int64_t pc = (int64_t)&jit->code[jit->code_size];
-  int64_t rel_page = page - (pc & ~0xFFF);
+  switch (field->width) {
+    case 1:
+      jit_emit(jit, field->is_signed ? arm64_ldrsb(rt, base, imm)
+                                     : arm64_ldrb(rt, base, imm));
+      break;
+    case 2:
+      jit_emit(jit, field->is_signed ? arm64_ldrsh(rt, base, imm)
+                                     : arm64_ldrh(rt, base, imm));
+      break;
+    case 4:
+      jit_emit(jit, field->is_signed ? arm64_ldrsw(rt, base, imm)
+                                     : arm64_ldrw(rt, base, imm));
+      break;
+    default: jit_emit(jit, arm64_ldr(rt, base, imm)); break;
+  }
+}
 
-  jit_emit(jit, arm64_adrp(reg, rel_page));
-  if (page_offset) {
-    jit_emit(jit, arm64_add_imm(reg, reg, page_offset));
+// element index of the column at rn = rt
+static void
+jit_decode_store(JITCompiler* jit,
+                 const JitField* field,
+                 int rt,
+                 int rn,
+                 uint16_t index)
+{
+  int out = field->out_width ? field->out_width : field->width;
+  if (field->is_float) {
+    jit_emit(jit, out == 4 ? arm64_strs(rt, rn, index)
+                           : arm64_strd(rt, rn, index));
+    return;
   }
-}
 
-const char*
-jit_get_string(JITCompiler* jit, size_t offset)
-{
-  if (offset >= jit->data_size)
-    return NULL;
-  return (const char*)(jit->data + offset);
+  switch (out) {
+    case 1: jit_emit(jit, arm64_strb(rt, rn, index)); break;
+    case 2: jit_emit(jit, arm64_strh(rt, rn, index)); break;
+    case 4: jit_emit(jit, arm64_strw(rt, rn, index)); break;
+    default: jit_emit(jit, arm64_str(rt, rn, index)); break;
+  }
 }
 
-void
-jit_cleanup(JITCompiler* jit)
+// records at x0, the first column pointer in x3
+static void
+jit_decode_records(JITCompiler* jit,
+                   size_t record_size,
+                   const JitField* fields,
+                   size_t num_fields,
+                   int records)
 {
-  if (!jit)
-    return;
-  if (jit->code)
-    munmap(jit->code, jit->capacity);
-  if (jit->data)
-    munmap(jit->data, jit->data_capacity);
-  if (jit->label_positions)
-    free(jit->label_positions);
-  if (jit->label_offsets)
-    free(jit->label_offsets);
-  free(jit);
+  for (int r = 0; r < records; r++) {
+    for (size_t i = 0; i < num_fields; i++) {
+      const JitField* f = &fields[i];
+      int rt = jit_decode_reg(f, r * num_fields + i);
+      jit_decode_load(jit, f, rt, r * record_size + f->offset);
+      jit_decode_store(jit, f, rt, 3 + (int)i, (uint16_t)r);
+    }
+  }
+
+  jit_add_offset(jit, 0, 0, records * record_size);
+  for (size_t i = 0; i < num_fields; i++) {
+    const JitField* f = &fields[i];
+    int out = f->out_width ? f->out_width : f->width;
+    jit_emit(jit, arm64_add_imm(3 + (int)i, 3 + (int)i, records * out));
+  }
 }
 
-void
-jit_reset(JITCompiler* jit)
+// emits the decoder as a function of jit, called as a JitDecoder with a
+// column pointer per field. returns the function or (size_t)-1
+size_t
+jit_compile_decoder(JITCompiler* jit,
+                    size_t record_size,
+                    const JitField* fields,
+                    size_t num_fields)
 {
-  if (!jit)
-    return;
-  memset(jit->code, 0, jit->capacity);
-  jit->code_size = 0;
-  memset(jit->label_positions, 0, jit->label_capacity * sizeof(uint32_t*));
-  memset(jit->label_offsets, 0, jit->label_capacity * sizeof(size_t));
-  jit->num_labels = 0;
+  if (!jit_decode_valid(record_size, fields, num_fields))
+    return (size_t)-1;
+
+  size_t func = jit_begin_function(jit);
+  size_t loop = jit_create_label(jit);
+  size_t tail = jit_create_label(jit);
+  size_t single = jit_create_label(jit);
+  size_t done = jit_create_label(jit);
+
+  for (size_t i = 0; i < num_fields; i++)
+    jit_emit(jit, arm64_ldr(3 + (int)i, 2, (uint16_t)i));
+
+  // x17 blocks of JIT_DECODE_UNROLL records, x1 records after them
+  int shift = 0;
+  while ((1 << shift) < JIT_DECODE_UNROLL)
+    shift++;
+  jit_emit(jit, arm64_lsr_imm(17, 1, shift));
+  jit_emit(jit, arm64_lsl_imm(16, 17, shift));
+  jit_emit(jit, arm64_sub(1, 1, 16));
+  jit_compare(jit, 17, 31);
+  jit_jump_if_equal(jit, tail);
+
+  jit_bind_label(jit, loop);
+  jit_decode_records(jit, record_size, fields, num_fields, JIT_DECODE_UNROLL);
+  jit_emit(jit, arm64_sub_imm(17, 17, 1));
+  jit_compare(jit, 17, 31);
+  jit_jump_if_not_equal(jit, loop);
+
+  jit_bind_label(jit, tail);
+  jit_compare(jit, 1, 31);
+  jit_jump_if_equal(jit, done);
+  jit_bind_label(jit, single);
+  jit_decode_records(jit, record_size, fields, num_fields, 1);
+  jit_emit(jit, arm64_sub_imm(1, 1, 1));
+  jit_compare(jit, 1, 31);
+  jit_jump_if_not_equal(jit, single);
+
+  jit_bind_label(jit, done);
+  jit_emit(jit, arm64_ret());
+  jit_end_function(jit);
+  return func;
 }
 
-void
-jit_emit(JITCompiler* jit, uint32_t instruction)
+static void
+jit_compile_run(JitCompileService* service, JITCompiler* jit, JitCompileJob* job)
 {
-  if (!jit || !jit->code) {
-    fprintf(stderr, "Invalid JIT compiler state\n");
-    return;
+  uint64_t start = jit_now_ns();
+  size_t func = job->build(jit, job->arg);
+  size_t code_size = func < jit->num_functions ? jit->functions[func].size : 0;
+  JitSealed* sealed = func != (size_t)-1 ? jit_seal(jit) : NULL;
+  void* entry = sealed ? jit_sealed_entry(sealed, func) : NULL;
+  if (!sealed)
+    jit_reset(jit); // drop whatever a failed build left behind
+
+  pthread_mutex_lock(&service->lock);
+  JitCompileModule* module = NULL;
+  for (size_t i = 0; sealed && i < service->num_modules && !module; i++) {
+    if (service->modules[i].slot == job->slot)
+      module = &service->modules[i];
+  }
+  if (sealed && !module && service->num_modules >= service->module_capacity) {
+    size_t capacity = service->module_capacity * 2;
+    JitCompileModule* modules =
+      realloc(service->modules, sizeof(JitCompileModule) * capacity);
+    if (modules) {
+      service->modules = modules;
+      service->module_capacity = capacity;
+    }
+  }
+  if (sealed && !module && service->num_modules < service->module_capacity) {
+    module = &service->modules[service->num_modules++];
+    module->slot = job->slot;
+    module->sealed = NULL;
   }
 
-  // resize if we need to grow the buffer
-  if (jit->code_size >= (jit->capacity / sizeof(uint32_t)) - 16) {
-    size_t new_capacity = jit->capacity * 2;
-    uint32_t* new_code = mmap(NULL,
-                              new_capacity,
-                              PROT_READ | PROT_WRITE | PROT_EXEC,
-                              MAP_PRIVATE | MAP_ANONYMOUS,
-                              -1,
-                              0);
+  // published under the lock, so two builds of a slot can't leave it
+  // pointing into the module that was retired
+  JitSealed* replaced = NULL;
+  if (module) {
+    replaced = module->sealed;
+    module->sealed = sealed;
+    __atomic_store_n(job->slot, entry, __ATOMIC_RELEASE);
+  } else if (sealed) {
+    jit_sealed_free(sealed);
+    entry = NULL;
+  }
 
-    if (new_code == MAP_FAILED) {
-      fprintf(stderr, "Failed to allocate new code buffer\n");
-      return;
-    }
+  uint64_t end = jit_now_ns();
+  uint64_t queued_ns = start - job->submitted_ns;
+  uint64_t compile_ns = end - start;
+  JitCompileStats* stats = &service->stats;
+  if (entry)
+    stats->completed++;
+  else
+    stats->failed++;
+  stats->total_queued_ns += queued_ns;
+  stats->total_compile_ns += compile_ns;
+  if (compile_ns > stats->max_compile_ns)
+    stats->max_compile_ns = compile_ns;
+  pthread_mutex_unlock(&service->lock);
+
+  jit_epoch_retire(service->epoch, replaced);
+  jit_epoch_reclaim(service->epoch);
+
+  if (job->metrics) {
+    job->metrics->queued_ns = queued_ns;
+    job->metrics->compile_ns = compile_ns;
+    job->metrics->code_size = code_size;
+    job->metrics->ok = entry != NULL;
+  }
+  if (job->metrics)
+    __atomic_store_n(&job->metrics->done, true, __ATOMIC_RELEASE);
+}
 
-    memcpy(new_code, jit->code, jit->code_size * sizeof(uint32_t));
-    if (munmap(jit->code, jit->capacity) == -1) {
-      fprintf(stderr, "Failed to unmap old code buffer\n");
-      munmap(new_code, new_capacity);
-      return;
-    }
+static void*
+jit_compile_worker(void* arg)
+{
+  JitCompileService* service = arg;
+  JITCompiler* jit = jit_init();
+  if (!jit)
+    fprintf(stderr, "JIT compile: worker has no compiler\n");
+
+  pthread_mutex_lock(&service->lock);
+  for (;;) {
+    while (!service->count && !service->stopping)
+      pthread_cond_wait(&service->not_empty, &service->lock);
+    if (!service->count)
+      break;
 
-    printf(
-      "JIT buffer grown from %zu to %zu bytes\n", jit->capacity, new_capacity);
+    JitCompileJob job = service->jobs[service->head];
+    service->head = (service->head + 1) % service->capacity;
+    service->count--;
+    service->active++;
+    pthread_cond_signal(&service->not_full);
+    pthread_mutex_unlock(&service->lock);
+
+    if (jit) {
+      jit_compile_run(service, jit, &job);
+    } else if (job.metrics) {
+      __atomic_store_n(&job.metrics->done, true, __ATOMIC_RELEASE);
+    }
 
-    jit->code = new_code;
-    jit->capacity = new_capacity;
+    pthread_mutex_lock(&service->lock);
+    if (!jit)
+      service->stats.failed++;
+    service->active--;
+    if (!service->count && !service->active)
+      pthread_cond_broadcast(&service->idle);
   }
+  pthread_mutex_unlock(&service->lock);
 
-  jit->code[jit->code_size++] = instruction;
+  jit_cleanup(jit);
+  return NULL;
 }
 
-size_t
-jit_create_label(JITCompiler* jit)
+JitCompileService*
+jit_compile_init(int num_threads, size_t queue_capacity)
 {
-  if (jit->num_labels >= jit->label_capacity) {
-    jit->label_capacity *= 2;
-    jit->label_positions =
-      realloc(jit->label_positions, sizeof(uint32_t*) * jit->label_capacity);
-    jit->label_offsets =
-      realloc(jit->label_offsets, sizeof(size_t) * jit->label_capacity);
+  if (num_threads < 1 || !queue_capacity)
+    return NULL;
+
+  JitCompileService* service = malloc(sizeof(JitCompileService));
+  if (!service)
+    return NULL;
+
+  memset(service, 0, sizeof(JitCompileService));
+  pthread_mutex_init(&service->lock, NULL);
+  pthread_cond_init(&service->not_empty, NULL);
+  pthread_cond_init(&service->not_full, NULL);
+  pthread_cond_init(&service->idle, NULL);
+  service->capacity = queue_capacity;
+  service->jobs = malloc(sizeof(JitCompileJob) * queue_capacity);
+  service->module_capacity = MAX_FUNCTION_CAPACITY;
+  service->modules =
+    malloc(sizeof(JitCompileModule) * service->module_capacity);
+  service->threads = malloc(sizeof(pthread_t) * num_threads);
+  service->epoch = jit_epoch_init();
+  if (!service->jobs || !service->modules || !service->threads ||
+      !service->epoch) {
+    jit_compile_cleanup(service);
+    return NULL;
   }
 
-  jit->label_positions[jit->num_labels] = NULL;
-  return jit->num_labels++;
+  for (int i = 0; i < num_threads; i++) {
+    if (pthread_create(
+          &service->threads[i], NULL, jit_compile_worker, service) != 0)
+      break;
+    service->num_threads++;
+  }
+  if (!service->num_threads) {
+    jit_compile_cleanup(service);
+    return NULL;
+  }
+  return service;
 }
 
 void
-jit_bind_label(JITCompiler* jit, size_t label)
+jit_compile_cleanup(JitCompileService* service)
 {
-  if (label >= jit->num_labels)
+  if (!service)
     return;
-  jit->label_positions[label] = &jit->code[jit->code_size];
-  jit->label_offsets[label] = jit->code_size;
-}
 
-int32_t
-jit_branch_offset(JITCompiler* jit, size_t label)
-{
-  if (label >= jit->num_labels || !jit->label_positions[label])
-    return 0;
-  int32_t current = jit->code_size;
-  int32_t target = jit->label_offsets[label];
-  return (target - (current + 1));
+  pthread_mutex_lock(&service->lock);
+  service->stopping = true;
+  pthread_cond_broadcast(&service->not_empty);
+  pthread_mutex_unlock(&service->lock);
+  for (int i = 0; i < service->num_threads; i++)
+    pthread_join(service->threads[i], NULL);
+
+  for (size_t i = 0; i < service->num_modules; i++)
+    jit_sealed_free(service->modules[i].sealed);
+  free(service->modules);
+  jit_epoch_cleanup(service->epoch);
+  free(service->jobs);
+  free(service->threads);
+  pthread_cond_destroy(&service->idle);
+  pthread_cond_destroy(&service->not_full);
+  pthread_cond_destroy(&service->not_empty);
+  pthread_mutex_destroy(&service->lock);
+  free(service);
 }
 
-void
-jit_load_int(JITCompiler* jit, int reg, int32_t value)
+static bool
+jit_compile_enqueue(JitCompileService* service,
+                    JitBuildFn build,
+                    void* arg,
+                    void** slot,
+                    JitCompileMetrics* metrics,
+                    bool block)
 {
-  jit_emit(jit, arm64_movz(reg, value & 0xffff));
-  if (value > 0xffff) {
-    jit_emit(jit, arm64_movk(reg, (value >> 16) & 0xffff, 16));
+  if (metrics)
+    memset(metrics, 0, sizeof(JitCompileMetrics));
+
+  pthread_mutex_lock(&service->lock);
+  while (block && service->count == service->capacity && !service->stopping)
+    pthread_cond_wait(&service->not_full, &service->lock);
+  if (service->count == service->capacity || service->stopping) {
+    service->stats.rejected++;
+    pthread_mutex_unlock(&service->lock);
+    return false;
   }
+
+  JitCompileJob* job =
+    &service->jobs[(service->head + service->count) % service->capacity];
+  job->build = build;
+  job->arg = arg;
+  job->slot = slot;
+  job->metrics = metrics;
+  job->submitted_ns = jit_now_ns();
+  service->count++;
+  service->stats.submitted++;
+  if (service->count > service->stats.max_queued)
+    service->stats.max_queued = service->count;
+  pthread_cond_signal(&service->not_empty);
+  pthread_mutex_unlock(&service->lock);
+  return true;
 }
 
-void
-jit_compare(JITCompiler* jit, int reg1, int reg2)
+bool
+jit_compile_submit(JitCompileService* service,
+                   JitBuildFn build,
+                   void* arg,
+                   void** slot,
+                   JitCompileMetrics* metrics)
 {
-  jit_emit(jit, arm64_cmp(reg1, reg2));
+  return jit_compile_enqueue(service, build, arg, slot, metrics, true);
 }
 
-void
-jit_jump(JITCompiler* jit, size_t label)
+bool
+jit_compile_try_submit(JitCompileService* service,
+                       JitBuildFn build,
+                       void* arg,
+                       void** slot,
+                       JitCompileMetrics* metrics)
 {
-  int32_t offset = jit_branch_offset(jit, label);
-  jit_emit(jit, arm64_b(offset));
+  return jit_compile_enqueue(service, build, arg, slot, metrics, false);
 }
 
 void
-jit_jump_if_equal(JITCompiler* jit, size_t label)
+jit_compile_wait(JitCompileService* service)
 {
-  int32_t offset = jit_branch_offset(jit, label);
-  jit_emit(jit, arm64_b_cond(offset, COND_EQ));
+  pthread_mutex_lock(&service->lock);
+  while (service->count || service->active)
+    pthread_cond_wait(&service->idle, &service->lock);
+  pthread_mutex_unlock(&service->lock);
 }
 
-void
-jit_jump_if_not_equal(JITCompiler* jit, size_t label)
+void*
+jit_compile_entry(void* const* slot)
 {
-  int32_t offset = jit_branch_offset(jit, label);
-  jit_emit(jit, arm64_b_cond(offset, COND_NE));
+  return __atomic_load_n(slot, __ATOMIC_ACQUIRE);
 }
 
-void
-jit_jump_if_less(JITCompiler* jit, size_t label)
+JitCompileStats
+jit_compile_stats(JitCompileService* service)
 {
-  int32_t offset = jit_branch_offset(jit, label);
-  jit_emit(jit, arm64_b_cond(offset, COND_LT));
+  pthread_mutex_lock(&service->lock);
+  JitCompileStats stats = service->stats;
+  pthread_mutex_unlock(&service->lock);
+  return stats;
 }
 
-void
-jit_jump_if_greater(JITCompiler* jit, size_t label)
+uint64_t
+jit_cache_hash(const void* data, size_t size, uint64_t seed)
 {
-  int32_t offset = jit_branch_offset(jit, label);
-  jit_emit(jit, arm64_b_cond(offset, COND_GT));
+  const uint8_t* bytes = data;
+  uint64_t hash = seed ^ (size * 0x9e3779b97f4a7c15ull);
+  for (; size >= 8; size -= 8, bytes += 8) {
+    uint64_t word;
+    memcpy(&word, bytes, sizeof(word));
+    hash = (hash ^ word) * 0xff51afd7ed558ccdull;
+    hash ^= hash >> 32;
+  }
+  uint64_t tail = 0;
+  memcpy(&tail, bytes, size);
+  hash = (hash ^ tail) * 0xc4ceb9fe1a85ec53ull;
+  return hash ^ (hash >> 33);
 }
 
-void
-jit_call(JITCompiler* jit, void* func_ptr)
+static size_t
+jit_cache_pad(size_t size)
 {
-  jit_emit(jit, arm64_stp(29, 30, 31, -2)); // stp x29, x30, [sp, #-16]!
-
-  // note (david) probably we need tocheck if offset is valid.
-  int64_t offset = (int64_t)func_ptr - (int64_t)&jit->code[jit->code_size];
-
-  jit_emit(jit, arm64_bl(offset / 4));     // bl <offset>
-  jit_emit(jit, arm64_ldp(29, 30, 31, 2)); // ldp x29, x30, [sp], #16
+  return (size + 7) & ~(size_t)7;
 }
 
-JitValue
-jit_execute_typed(JITCompiler* jit, JitReturnType return_type)
+// the section sizes of a file, 0 if the counts can't be right for a file of
+// file_size bytes
+static size_t
+jit_cache_size(const JitCacheHeader* header, size_t file_size)
 {
-  JitValue result = { 0 };
+  uint64_t counts[] = { header->code_size,     header->data_size,
+                        header->num_labels,    header->num_functions,
+                        header->num_fixups,    header->num_symbols,
+                        header->strings_size };
+  for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+    if (counts[i] > file_size)
+      return 0;
+  }
+  return sizeof(JitCacheHeader) +
+         jit_cache_pad(header->code_size * sizeof(uint32_t)) +
+         jit_cache_pad(header->data_size) +
+         header->num_labels * sizeof(uint64_t) +
+         header->num_functions * 2 * sizeof(uint64_t) +
+         header->num_fixups * sizeof(JitCacheFixup) +
+         header->num_symbols * sizeof(JitCacheSymbol) +
+         jit_cache_pad(header->strings_size);
+}
 
-#ifdef __APPLE__
-  if (mprotect(jit->code, jit->capacity, PROT_READ | PROT_EXEC) == -1) {
-    perror("mprotect failed");
-    return result;
+// finds the library symbol at addr, appending it to symbols on first use.
+// -1 if none of the libraries loaded it.
+static long
+jit_cache_symbol(uint64_t addr,
+                 ExternalLibrary** libs,
+                 int num_libs,
+                 JitCacheSymbol* symbols,
+                 uint64_t* addrs,
+                 const char** names,
+                 size_t* num_symbols,
+                 size_t* strings_size)
+{
+  for (size_t i = 0; i < *num_symbols; i++) {
+    if (addrs[i] == addr)
+      return (long)i;
   }
-#endif
 
-  switch (return_type) {
-    case JIT_TYPE_INT: {
-      JitFunctionInt func = (JitFunctionInt)jit->code;
-      result.i = func();
-      break;
-    }
-    case JIT_TYPE_FLOAT: {
-      JitFunctionFloat func = (JitFunctionFloat)jit->code;
-      result.f = func();
-      break;
-    }
-    case JIT_TYPE_DOUBLE: {
-      JitFunctionDouble func = (JitFunctionDouble)jit->code;
-      result.d = func();
-      break;
+  for (int lib = 0; lib < num_libs; lib++) {
+    for (size_t i = 0; i < libs[lib]->symbol_capacity; i++) {
+      ExtLibSymbol* symbol = &libs[lib]->symbols[i];
+      if (!symbol->name || (uint64_t)libs[lib]->functions[symbol->index] != addr)
+        continue;
+
+      size_t len = strlen(symbol->name) + 1;
+      JitCacheSymbol* entry = &symbols[*num_symbols];
+      entry->lib = (uint32_t)lib;
+      entry->name = (uint32_t)*strings_size;
+      entry->page_offset = (uint32_t)(addr & 0xFFF);
+      entry->reserved = 0;
+      *strings_size += len;
+      addrs[*num_symbols] = addr;
+      names[*num_symbols] = symbol->name;
+      return (long)(*num_symbols)++;
     }
   }
+  return -1;
+}
 
-#ifdef __APPLE__
-  if (mprotect(jit->code, jit->capacity, PROT_READ | PROT_WRITE) == -1) {
-    perror("mprotect failed");
-    return result;
+bool
+jit_cache_save(JITCompiler* jit,
+               const char* path,
+               uint64_t key,
+               ExternalLibrary** libs,
+               int num_libs)
+{
+  if (jit->current_function != (size_t)-1 || jit->num_pending_fixups) {
+    fprintf(stderr, "JIT cache: module has open functions or labels\n");
+    return false;
   }
-#endif
 
-  return result;
-}
+  // every fixup references at most one symbol, so these bound the table
+  JitCacheFixup* fixups = malloc(sizeof(JitCacheFixup) * (jit->num_fixups + 1));
+  JitCacheSymbol* symbols =
+    malloc(sizeof(JitCacheSymbol) * (jit->num_fixups + 1));
+  uint64_t* addrs = malloc(sizeof(uint64_t) * (jit->num_fixups + 1));
+  const char** names = malloc(sizeof(char*) * (jit->num_fixups + 1));
+  if (!fixups || !symbols || !addrs || !names) {
+    free(fixups);
+    free(symbols);
+    free(addrs);
+    free(names);
+    return false;
+  }
 
-void
-jit_dump_code(JITCompiler* jit)
-{
-  if (!jit || !jit->code || jit->code_size == 0) {
-    fprintf(stderr,
-            "JIT dump failed: Invalid JIT compiler or empty code section.\n");
-    return;
+  // library calls are marked first. they are saved as the function the
+  // library has now, a reload or jit_patch_call may have moved them away
+  // from the fixup target.
+  for (size_t i = 0; i < jit->num_fixups; i++)
+    fixups[i].reloc = JIT_RELOC_NONE;
+  for (size_t i = 0; i < jit->num_library_calls; i++) {
+    const JitLibraryCall* call = &jit->library_calls[i];
+    fixups[call->fixup].reloc = JIT_RELOC_LIBRARY;
+    fixups[call->fixup].target = (uint64_t)call->lib->functions[call->function];
   }
-  printf("\n\n\t\tTinyJIT Dump\n\n");
-  printf("INSTRUCTIONS: %zu/%zu bytes\n", jit->code_size, jit->capacity);
-  printf("---------------------------------------------------------\n");
-  uint8_t* code = (uint8_t*)jit->code;
-  for (size_t i = 0; i < jit->code_size; i++) {
-    if (i % 16 == 0) {
-      if (i > 0)
-        printf("\n");
-      printf("%08zx: ", i);
+
+  uint64_t data_begin = (uint64_t)jit->data;
+  uint64_t code_begin = (uint64_t)jit->code_chunk.rx;
+  size_t num_symbols = 0;
+  size_t strings_size = 0;
+  bool ok = true;
+  for (size_t i = 0; i < jit->num_fixups && ok; i++) {
+    const JitFixup* fixup = &jit->fixups[i];
+    JitCacheFixup* out = &fixups[i];
+    bool library = out->reloc == JIT_RELOC_LIBRARY;
+    uint64_t addr = library ? out->target : fixup->target;
+    out->offset = fixup->offset;
+    out->target = fixup->target;
+    out->kind = fixup->kind;
+    out->reloc = JIT_RELOC_NONE;
+    if (fixup->kind != JIT_FIXUP_ADR_ABS && fixup->kind != JIT_FIXUP_ADRP_ABS &&
+        fixup->kind != JIT_FIXUP_CALL)
+      continue;
+
+    if (!library && jit->data && addr >= data_begin &&
+        addr < data_begin + jit->data_size) {
+      out->reloc = JIT_RELOC_DATA;
+      out->target = addr - data_begin;
+    } else if (!library && addr >= code_begin &&
+               addr < code_begin + jit->code_chunk.size) {
+      out->reloc = JIT_RELOC_CODE;
+      out->target = addr - code_begin;
+    } else {
+      long symbol = jit_cache_symbol(addr,
+                                     libs,
+                                     num_libs,
+                                     symbols,
+                                     addrs,
+                                     names,
+                                     &num_symbols,
+                                     &strings_size);
+      if (symbol < 0) {
+        fprintf(stderr, "JIT cache: %p is not in any library\n", (void*)addr);
+        ok = false;
+      }
+      out->reloc = library ? JIT_RELOC_LIBRARY : JIT_RELOC_SYMBOL;
+      out->target = (uint64_t)symbol;
     }
-    printf("%02x ", code[i]);
   }
-  printf("\n");
 
-  if (jit->data && jit->data_size > 0) {
-    printf("\nSTATIC MEMORY: %zu/%zu bytes\n", jit->data_size, jit->data_capacity);
-    printf("---------------------------------------------------------\n");
-    uint8_t* data = (uint8_t*)jit->data;
-    for (size_t i = 0; i < jit->data_size; i++) {
-      if (i % 16 == 0) {
-        if (i > 0)
-          printf("\n");
-        printf("%08zx: ", i);
-      }
-      printf("%02x ", data[i]);
+  JitCacheHeader header = { JIT_CACHE_MAGIC,
+                            JIT_CACHE_VERSION,
+                            sizeof(JitCacheHeader),
+                            key,
+                            0,
+                            jit->code_size,
+                            jit->data_size,
+                            jit->num_labels,
+                            jit->num_functions,
+                            jit->num_fixups,
+                            num_symbols,
+                            strings_size };
+  size_t size = jit_cache_size(&header, SIZE_MAX);
+  uint8_t* file = ok ? calloc(1, size) : NULL;
+  if (!file) {
+    free(fixups);
+    free(symbols);
+    free(addrs);
+    free(names);
+    return false;
+  }
+
+  uint8_t* p = file + sizeof(JitCacheHeader);
+  memcpy(p, jit->code, jit->code_size * sizeof(uint32_t));
+  p += jit_cache_pad(jit->code_size * sizeof(uint32_t));
+  if (jit->data_size)
+    memcpy(p, jit->data, jit->data_size);
+  p += jit_cache_pad(jit->data_size);
+
+  for (size_t i = 0; i < jit->num_labels; i++) {
+    uint64_t offset =
+      jit->label_positions[i] ? jit->label_offsets[i] : UINT64_MAX;
+    memcpy(p, &offset, sizeof(offset));
+    p += sizeof(offset);
+  }
+  for (size_t i = 0; i < jit->num_functions; i++) {
+    uint64_t function[2] = { jit->functions[i].label, jit->functions[i].size };
+    memcpy(p, function, sizeof(function));
+    p += sizeof(function);
+  }
+  memcpy(p, fixups, jit->num_fixups * sizeof(JitCacheFixup));
+  p += jit->num_fixups * sizeof(JitCacheFixup);
+  memcpy(p, symbols, num_symbols * sizeof(JitCacheSymbol));
+  p += num_symbols * sizeof(JitCacheSymbol);
+  for (size_t i = 0; i < num_symbols; i++)
+    memcpy(p + symbols[i].name, names[i], strlen(names[i]) + 1);
+
+  header.checksum = jit_cache_hash(file + sizeof(JitCacheHeader),
+                                   size - sizeof(JitCacheHeader),
+                                   JIT_CACHE_MAGIC);
+  memcpy(file, &header, sizeof(header));
+
+  // written next to path and renamed, readers never see half a file
+  size_t path_len = strlen(path);
+  char* tmp_path = malloc(path_len + 5);
+  if (tmp_path) {
+    memcpy(tmp_path, path, path_len);
+    memcpy(tmp_path + path_len, ".tmp", 5);
+    FILE* out = fopen(tmp_path, "wb");
+    ok = out && fwrite(file, 1, size, out) == size;
+    if (out && fclose(out) != 0)
+      ok = false;
+    if (ok && rename(tmp_path, path) != 0)
+      ok = false;
+    if (!ok) {
+      fprintf(stderr, "JIT cache: can't write %s\n", path);
+      remove(tmp_path);
     }
-    printf("\n");
   } else {
-    printf("\nNo data section found.\n");
+    ok = false;
   }
-}
 
-int
-jit_execute_int(JITCompiler* jit)
-{
-  return jit_execute_typed(jit, JIT_TYPE_INT).i;
+  free(tmp_path);
+  free(file);
+  free(fixups);
+  free(symbols);
+  free(addrs);
+  free(names);
+  return ok;
 }
 
-float
-jit_execute_float(JITCompiler* jit)
+// resolves the absolute target of a fixup read from a cache file, 0 if it
+// can't be had in this process
+static uint64_t
+jit_cache_target(JITCompiler* jit,
+                 const JitCacheFixup* fixup,
+                 const JitCacheSymbol* symbols,
+                 size_t num_symbols,
+                 const char* strings,
+                 size_t strings_size,
+                 ExternalLibrary** libs,
+                 int num_libs)
 {
-  return jit_execute_typed(jit, JIT_TYPE_FLOAT).f;
+  switch (fixup->reloc) {
+    case JIT_RELOC_DATA:
+      return fixup->target < jit->data_size
+               ? (uint64_t)(jit->data + fixup->target)
+               : 0;
+    case JIT_RELOC_CODE:
+      return fixup->target < jit->code_chunk.size
+               ? (uint64_t)(jit->code_chunk.rx + fixup->target)
+               : 0;
+    case JIT_RELOC_SYMBOL:
+    case JIT_RELOC_LIBRARY: {
+      if (fixup->target >= num_symbols)
+        return 0;
+      const JitCacheSymbol* symbol = &symbols[fixup->target];
+      if (symbol->lib >= (uint32_t)num_libs || symbol->name >= strings_size ||
+          !memchr(strings + symbol->name, 0, strings_size - symbol->name))
+        return 0;
+
+      ExternalLibrary* lib = libs[symbol->lib];
+      int index = ext_lib_load_function(lib, strings + symbol->name);
+      if (index < 0)
+        return 0;
+      uint64_t addr = (uint64_t)lib->functions[index];
+      // ADRP is followed by an ADD of the old page offset
+      if (fixup->kind == JIT_FIXUP_ADRP_ABS &&
+          (addr & 0xFFF) != symbol->page_offset)
+        return 0;
+      return addr;
+    }
+  }
+  return 0;
 }
 
-double
-jit_execute_double(JITCompiler* jit)
+bool
+jit_cache_load(JITCompiler* jit,
+               const char* path,
+               uint64_t key,
+               ExternalLibrary** libs,
+               int num_libs)
 {
-  return jit_execute_typed(jit, JIT_TYPE_DOUBLE).d;
-}
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    if (errno != ENOENT)
+      fprintf(stderr, "JIT cache: can't open %s\n", path);
+    return false;
+  }
+  struct stat st;
+  void* map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(JitCacheHeader))
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return false;
+
+  size_t file_size = st.st_size;
+  const uint8_t* file = map;
+  JitCacheHeader header;
+  memcpy(&header, file, sizeof(header));
+  if (header.magic != JIT_CACHE_MAGIC || header.version != JIT_CACHE_VERSION ||
+      header.header_size != sizeof(JitCacheHeader) || header.key != key) {
+    munmap(map, file_size);
+    return false;
+  }
+  if (jit_cache_size(&header, file_size) != file_size ||
+      jit_cache_hash(file + sizeof(header),
+                     file_size - sizeof(header),
+                     JIT_CACHE_MAGIC) != header.checksum) {
+    fprintf(stderr, "JIT cache: %s is damaged\n", path);
+    munmap(map, file_size);
+    return false;
+  }
 
-ExternalLibrary*
-ext_lib_init(const char* library_path)
-{
-  ExternalLibrary* lib = malloc(sizeof(ExternalLibrary));
-  lib->handle = dlopen(library_path, RTLD_LAZY);
-  if (!lib->handle) {
-    fprintf(stderr, "Error loading library: %s\n", dlerror());
-    free(lib);
-    return NULL;
+  const uint8_t* p = file + sizeof(header);
+  const uint32_t* code = (const uint32_t*)p;
+  p += jit_cache_pad(header.code_size * sizeof(uint32_t));
+  const uint8_t* data = p;
+  p += jit_cache_pad(header.data_size);
+  const uint64_t* labels = (const uint64_t*)p;
+  p += header.num_labels * sizeof(uint64_t);
+  const uint64_t* functions = (const uint64_t*)p;
+  p += header.num_functions * 2 * sizeof(uint64_t);
+  const JitCacheFixup* fixups = (const JitCacheFixup*)p;
+  p += header.num_fixups * sizeof(JitCacheFixup);
+  const JitCacheSymbol* symbols = (const JitCacheSymbol*)p;
+  p += header.num_symbols * sizeof(JitCacheSymbol);
+  const char* strings = (const char*)p;
+
+  jit_reset(jit);
+  bool ok = true;
+
+  // size the tables once
+  while (jit->label_capacity < header.num_labels && ok) {
+    jit->label_capacity *= 2;
+    uint32_t** positions =
+      realloc(jit->label_positions, sizeof(uint32_t*) * jit->label_capacity);
+    if (positions)
+      jit->label_positions = positions;
+    size_t* offsets =
+      realloc(jit->label_offsets, sizeof(size_t) * jit->label_capacity);
+    if (offsets)
+      jit->label_offsets = offsets;
+    ok = positions && offsets;
+  }
+  while (jit->fixup_capacity < header.num_fixups && ok) {
+    jit->fixup_capacity *= 2;
+    JitFixup* fixups_out =
+      realloc(jit->fixups, sizeof(JitFixup) * jit->fixup_capacity);
+    if (fixups_out)
+      jit->fixups = fixups_out;
+    size_t* pending =
+      realloc(jit->pending_fixups, sizeof(size_t) * jit->fixup_capacity);
+    if (pending)
+      jit->pending_fixups = pending;
+    ok = fixups_out && pending;
+  }
+  while (jit->function_capacity < header.num_functions && ok) {
+    jit->function_capacity *= 2;
+    JitFunction* functions_out =
+      realloc(jit->functions, sizeof(JitFunction) * jit->function_capacity);
+    if (functions_out)
+      jit->functions = functions_out;
+    ok = functions_out != NULL;
   }
-  lib->func_count = 0;
-  return lib;
-}
 
-int
-ext_lib_load_function(ExternalLibrary* lib, const char* func_name)
-{
-  if (lib->func_count >= 32) {
-    fprintf(stderr, "Too many functions loaded\n");
-    return -1;
+  // the data goes back to offset 0, page aligned like it was when saved
+  jit->data_size = 0;
+  if (ok && header.data_size) {
+    ok = jit_alloc_data(jit, header.data_size, 4096) == 0;
+    if (ok)
+      memcpy(jit->data, data, header.data_size);
   }
 
-  void* func = dlsym(lib->handle, func_name);
-  if (!func) {
-    fprintf(stderr, "Error loading function %s: %s\n", func_name, dlerror());
-    return -1;
+  for (size_t i = 0; i < header.code_size && ok; i++) {
+    jit_emit(jit, code[i]);
+    ok = jit->code_size == i + 1;
   }
 
-  lib->functions[lib->func_count] = func;
-  return lib->func_count++;
-}
+  for (size_t i = 0; i < header.num_labels && ok; i++) {
+    bool bound = labels[i] != UINT64_MAX;
+    ok = !bound || labels[i] < header.code_size;
+    jit->label_positions[i] = bound ? &jit->code[labels[i]] : NULL;
+    jit->label_offsets[i] = bound ? labels[i] : 0;
+  }
+  if (ok)
+    jit->num_labels = header.num_labels;
 
-void
-ext_lib_cleanup(ExternalLibrary* lib)
-{
-  if (lib) {
-    if (lib->handle) {
-      dlclose(lib->handle);
+  for (size_t i = 0; i < header.num_functions && ok; i++) {
+    ok = functions[i * 2] < header.num_labels;
+    jit->functions[i].label = functions[i * 2];
+    jit->functions[i].size = functions[i * 2 + 1];
+  }
+  if (ok)
+    jit->num_functions = header.num_functions;
+
+  for (size_t i = 0; i < header.num_fixups && ok; i++) {
+    const JitCacheFixup* fixup = &fixups[i];
+    JitFixup* out = &jit->fixups[i];
+    out->offset = fixup->offset;
+    out->target = fixup->target;
+    out->kind = (JitFixupKind)fixup->kind;
+    ok = fixup->offset < header.code_size && fixup->kind <= JIT_FIXUP_TB;
+    if (jit_is_label_fixup(out->kind))
+      ok = ok && fixup->target < header.num_labels &&
+           jit->label_positions[fixup->target];
+    if (ok && fixup->reloc != JIT_RELOC_NONE) {
+      out->target = jit_cache_target(jit,
+                                     fixup,
+                                     symbols,
+                                     header.num_symbols,
+                                     strings,
+                                     header.strings_size,
+                                     libs,
+                                     num_libs);
+      ok = out->target != 0;
+    }
+    if (ok && fixup->reloc == JIT_RELOC_LIBRARY) {
+      // a new private stub, jit_finalize registers the site with the library
+      const JitCacheSymbol* symbol = &symbols[fixup->target];
+      ExternalLibrary* lib = libs[symbol->lib];
+      ok = fixup->kind == JIT_FIXUP_CALL &&
+           jit_add_library_call(jit,
+                                i,
+                                lib,
+                                ext_lib_load_function(lib,
+                                                      strings + symbol->name));
     }
-    free(lib);
   }
-}
-
-void
-jit_begin_frame(JITCompiler* jit)
-{
-  // save the frame pointer and link register
-  jit_emit(jit, arm64_stp(29, 30, 31, -2)); // stp x29, x30, [sp, #-16]!
-  jit_emit(jit, 0x910003fd);                // mov x29, sp
-}
-
-void
-jit_end_frame(JITCompiler* jit)
-{
-  // restore frame pointer and link register
-  jit_emit(jit, arm64_ldp(29, 30, 31, 2)); // ldp x29, x30, [sp], #16
-  jit_emit(jit, arm64_ret());              // ret
-}
-
-void
-jit_call_external(JITCompiler* jit, void* func_ptr)
-{
-  // set up stack for external call
-  jit_emit(jit, 0xd10043ff);               // sub sp, sp, #16
-  jit_emit(jit, arm64_stp(29, 30, 31, 0)); // stp x29, x30, [sp]
+  munmap(map, file_size);
 
-  // the call
-  int64_t offset = (int64_t)func_ptr - (int64_t)&jit->code[jit->code_size];
-  jit_emit(jit, arm64_bl(offset / 4));
+  if (ok) {
+    jit->num_fixups = header.num_fixups;
+    ok = jit_patch_fixups(jit) < 0;
+  }
+  if (!ok) {
+    fprintf(stderr, "JIT cache: %s doesn't fit this process\n", path);
+    jit_reset(jit);
+    return false;
+  }
 
-  // restore stack after call
-  jit_emit(jit, arm64_ldp(29, 30, 31, 0)); // ldp x29, x30, [sp]
-  jit_emit(jit, 0x910043ff);               // add sp, sp, #16
+  return jit_finalize(jit);
 }
 
 #endif // TINY_JIT_IMPLEMENTATION